@@ -1,3 +1,7 @@
 #pragma once
 #include "Swarm.hpp"
-#include "Peer.hpp"
\ No newline at end of file
+#include "Peer.hpp"
+#include "BufferPool.hpp"
+#include "HashTree.hpp"
+#include "IoUring.hpp"
+#include "Compression.hpp"
@@ -0,0 +1,348 @@
+#include "ApplicationLayer.hpp"
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <ctime>
+#include <algorithm>
+#include <string>
+#include <utility>
+extern "C" {
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+}
+
+namespace ApplicationLayer
+{
+class PeerBenchmarks {
+	// CPU time consumed by the calling thread in seconds
+	static double thread_cpu_seconds(void)
+	{
+		timespec ts;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+		return ts.tv_sec + ts.tv_nsec / 1e9;
+	}
+
+	// Create a file of num_chunks full chunks to serve from.
+
+	// :return: false on failure
+	static bool create_bench_file(const std::string &path,
+				      const uint32_t num_chunks)
+	{
+		int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+		if (fd < 0) {
+			std::cerr << "Error. Unable to create benchmark file.\n";
+			return false;
+		}
+		std::vector<uint8_t> block(1000 * 1000);
+		for (size_t i = 0; i < block.size(); ++i) {
+			block[i] = (uint8_t)(i * 2654435761u >> 24);
+		}
+		for (size_t i = 0; i < num_chunks * CHUNK_SIZE / block.size();
+		     ++i) {
+			if (write(fd, block.data(), block.size()) <
+			    (ssize_t)block.size()) {
+				std::cerr
+					<< "Error. Unable to write benchmark file.\n";
+				close(fd);
+				return false;
+			}
+		}
+		close(fd);
+		return true;
+	}
+
+	// Connect a loopback TCP socket pair so that we measure the same path a
+	// real seeder takes.
+
+	// :return: false on failure
+	static bool tcp_pair(int &out_sender, int &out_receiver)
+	{
+		int listener = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in addr = { .sin_family = AF_INET, .sin_port = 0 };
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t addr_len = sizeof(sockaddr_in);
+		if (bind(listener, (sockaddr *)&addr, addr_len) < 0 ||
+		    listen(listener, 1) < 0 ||
+		    getsockname(listener, (sockaddr *)&addr, &addr_len) < 0) {
+			std::cerr << "Error. Unable to set up loopback listener.\n";
+			close(listener);
+			return false;
+		}
+		out_sender = socket(AF_INET, SOCK_STREAM, 0);
+		if (connect(out_sender, (sockaddr *)&addr, addr_len) < 0) {
+			std::cerr << "Error. Unable to connect over loopback.\n";
+			close(listener);
+			close(out_sender);
+			return false;
+		}
+		out_receiver = accept(listener, nullptr, nullptr);
+		close(listener);
+		return out_receiver >= 0;
+	}
+
+    public:
+	// Measure how much seeder CPU it takes to push each GB of chunk responses
+	// down a socket with and without the zero copy path.
+	static void bench_chunk_response(const uint32_t num_chunks,
+					 const int rounds)
+	{
+		static const std::string bench_file = "bench_chunks.p2p";
+		if (!create_bench_file(bench_file, num_chunks))
+			return;
+		const bool modes[] = { false, true };
+		for (const bool zero_copy : modes) {
+			int sender, receiver;
+			if (!tcp_pair(sender, receiver))
+				break;
+			// Drain and discard everything the seeder sends.
+			std::thread drain([receiver] {
+				std::vector<uint8_t> sink(1 << 20);
+				while (read(receiver, sink.data(), sink.size()) >
+				       0) {
+				}
+			});
+			double bytes_sent = 0;
+			const double cpu_begin = thread_cpu_seconds();
+			const auto wall_begin =
+				std::chrono::steady_clock::now();
+			for (int r = 0; r < rounds; ++r) {
+				for (uint32_t idx = 0; idx < num_chunks; ++idx) {
+					if (!Peer::write_message(
+						    sender,
+						    PeerMessageType::CHUNK_RESPONSE,
+						    "", 0, 0, 0, idx, bench_file,
+						    zero_copy)) {
+						std::cerr
+							<< "Error. Benchmark send failed.\n";
+						break;
+					}
+					bytes_sent += CHUNK_SIZE;
+				}
+			}
+			const double cpu =
+				thread_cpu_seconds() - cpu_begin;
+			const double wall =
+				std::chrono::duration<double>(
+					std::chrono::steady_clock::now() -
+					wall_begin)
+					.count();
+			shutdown(sender, SHUT_WR);
+			drain.join();
+			close(sender);
+			close(receiver);
+			const double gb = bytes_sent / 1e9;
+			std::cout << "chunk_response "
+				  << (zero_copy ? "zero_copy" : "buffered")
+				  << ": " << gb << " GB, seeder cpu "
+				  << cpu / gb << " s/GB, throughput "
+				  << gb / wall << " GB/s\n";
+		}
+		unlink(bench_file.c_str());
+	}
+
+	// Measure how fast chunk responses are received into their file, and at
+	// what receiver CPU per GB, with blocking I/O and with io_uring.
+	static void bench_receive(const uint32_t num_chunks, const int rounds)
+	{
+		static const std::string bench_file = "bench_send.p2p";
+		static const std::string received_file = "bench_received.p2p";
+		if (!create_bench_file(bench_file, num_chunks))
+			return;
+		int destination_fd = open(received_file.c_str(),
+					  O_CREAT | O_WRONLY | O_TRUNC, 0644);
+		if (destination_fd < 0) {
+			std::cerr << "Error. Unable to create benchmark file.\n";
+			unlink(bench_file.c_str());
+			return;
+		}
+		const IoBackend backends[] = { BLOCKING_IO, IO_URING };
+		for (const IoBackend backend : backends) {
+			if (!Peer::set_io_backend(backend)) {
+				std::cout << "receive io_uring: not built in\n";
+				continue;
+			}
+			int sender, receiver;
+			if (!tcp_pair(sender, receiver))
+				break;
+			std::thread seeder([sender, num_chunks, rounds] {
+				for (int r = 0; r < rounds; ++r) {
+					for (uint32_t idx = 0; idx < num_chunks;
+					     ++idx) {
+						if (!Peer::write_message(
+							    sender,
+							    PeerMessageType::
+								    CHUNK_RESPONSE,
+							    "", 0, 0, 0, idx,
+							    bench_file))
+							return;
+					}
+				}
+			});
+			double bytes_received = 0;
+			const double cpu_begin = thread_cpu_seconds();
+			const auto wall_begin =
+				std::chrono::steady_clock::now();
+			for (int i = 0; i < rounds * (int)num_chunks; ++i) {
+				PeerHeader header;
+				if (!Peer::read_message(receiver, header, false,
+							destination_fd)) {
+					std::cerr << "Error. Benchmark receive "
+						     "failed.\n";
+					break;
+				}
+				bytes_received += header.current_chunk_size;
+			}
+			const double cpu =
+				thread_cpu_seconds() - cpu_begin;
+			const double wall =
+				std::chrono::duration<double>(
+					std::chrono::steady_clock::now() -
+					wall_begin)
+					.count();
+			shutdown(receiver, SHUT_RDWR);
+			seeder.join();
+			close(sender);
+			close(receiver);
+			const double gb = bytes_received / 1e9;
+			std::cout << "receive "
+				  << (backend == IO_URING ? "io_uring" :
+							    "blocking")
+				  << ": " << gb << " GB, receiver cpu "
+				  << cpu / gb << " s/GB, throughput "
+				  << gb / wall << " GB/s\n";
+		}
+		Peer::set_io_backend(BLOCKING_IO);
+		close(destination_fd);
+		unlink(received_file.c_str());
+		unlink(bench_file.c_str());
+	}
+
+	// Measure how fast a file is hashed into its HashTree leaves on one
+	// thread and on every core, against the line rate it has to keep up
+	// with.
+	static void bench_hashing(const uint32_t num_chunks, const int rounds)
+	{
+		static const std::string bench_file = "bench_hashes.p2p";
+		if (!create_bench_file(bench_file, num_chunks))
+			return;
+		int fd = open(bench_file.c_str(), O_RDONLY);
+		if (fd < 0) {
+			std::cerr << "Error. Unable to open benchmark file.\n";
+			unlink(bench_file.c_str());
+			return;
+		}
+		const size_t thread_counts[] = {
+			1,
+			std::max<size_t>(1, std::thread::hardware_concurrency())
+		};
+		for (const size_t num_threads : thread_counts) {
+			std::vector<HashDigest> leaves;
+			double bytes_hashed = 0;
+			const auto wall_begin =
+				std::chrono::steady_clock::now();
+			for (int r = 0; r < rounds; ++r) {
+				if (!HashTree::hash_file(fd,
+							 (uint64_t)num_chunks *
+								 CHUNK_SIZE,
+							 leaves, num_threads)) {
+					break;
+				}
+				bytes_hashed += (double)num_chunks * CHUNK_SIZE;
+			}
+			const double wall =
+				std::chrono::duration<double>(
+					std::chrono::steady_clock::now() -
+					wall_begin)
+					.count();
+			const double gb = bytes_hashed / 1e9;
+			std::cout << "hash_file " << num_threads
+				  << " threads: " << gb << " GB, throughput "
+				  << gb / wall << " GB/s ("
+				  << 8 * gb / wall << " Gbit/s)\n";
+		}
+		close(fd);
+		unlink(bench_file.c_str());
+	}
+
+	// Measure how far blocks of CSV-like records and of noise compress, and
+	// how fast they compress and decompress, against the line rate it has to
+	// keep up with. Noise should be given up on quickly.
+	static void bench_compression(const size_t block_size, const int rounds)
+	{
+		std::string records;
+		for (uint32_t i = 0; records.size() < block_size; ++i) {
+			records += std::to_string(i) + "," +
+				   (i % 3 == 0 ? "alpha" : "beta") + "," +
+				   std::to_string((i * 7919) % 10000) + ".25,ok\n";
+		}
+		records.resize(block_size);
+		std::vector<uint8_t> noise(block_size);
+		uint32_t seed = 12345;
+		for (auto &byte : noise) {
+			seed = seed * 1103515245 + 12345;
+			byte = seed >> 24;
+		}
+		const std::pair<const char *, const uint8_t *> corpora[] = {
+			{ "records", (const uint8_t *)records.data() },
+			{ "noise", noise.data() }
+		};
+		std::vector<uint8_t> compressed(
+			Compression::worthwhile_size(block_size));
+		std::vector<uint8_t> restored(block_size);
+		for (const auto &corpus : corpora) {
+			size_t compressed_size = 0;
+			auto begin = std::chrono::steady_clock::now();
+			for (int r = 0; r < rounds; ++r) {
+				compressed_size = Compression::compress(
+					corpus.second, block_size,
+					compressed.data(), compressed.size());
+			}
+			const double compress_time =
+				std::chrono::duration<double>(
+					std::chrono::steady_clock::now() - begin)
+					.count();
+			double decompress_time = 0;
+			if (compressed_size != 0) {
+				begin = std::chrono::steady_clock::now();
+				for (int r = 0; r < rounds; ++r) {
+					Compression::decompress(
+						compressed.data(),
+						compressed_size,
+						restored.data(), block_size);
+				}
+				decompress_time =
+					std::chrono::duration<double>(
+						std::chrono::steady_clock::now() -
+						begin)
+						.count();
+			}
+			const double gb = (double)block_size * rounds / 1e9;
+			std::cout << "compression " << corpus.first << ": ratio "
+				  << (compressed_size == 0 ?
+					      1.0 :
+					      (double)block_size /
+						      compressed_size)
+				  << ", compress " << gb / compress_time
+				  << " GB/s";
+			if (compressed_size != 0)
+				std::cout << ", decompress "
+					  << gb / decompress_time << " GB/s";
+			std::cout << " (" << 8 * gb / compress_time
+				  << " Gbit/s to compress)\n";
+		}
+	}
+};
+} // namespace ApplicationLayer
+
+int main(void)
+{
+	ApplicationLayer::PeerBenchmarks::bench_chunk_response(4, 4);
+	ApplicationLayer::PeerBenchmarks::bench_receive(4, 4);
+	ApplicationLayer::PeerBenchmarks::bench_hashing(4, 4);
+	ApplicationLayer::PeerBenchmarks::bench_compression(1024 * 1024, 32);
+	return 0;
+}
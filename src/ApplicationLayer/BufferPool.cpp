@@ -0,0 +1,178 @@
+#include "BufferPool.hpp"
+#include <algorithm>
+#include <iostream>
+extern "C" {
+#include <sys/mman.h>
+}
+
+namespace ApplicationLayer
+{
+// Huge pages are 2MB on the platforms we run on
+static const size_t constexpr HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+PooledBuffer::PooledBuffer(BufferPool *pool, uint8_t *buff, size_t len)
+	: pool(pool), buff(buff), len(len)
+{
+}
+
+PooledBuffer::PooledBuffer(void) : pool(nullptr), buff(nullptr), len(0)
+{
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer &&other)
+	: pool(other.pool), buff(other.buff), len(other.len)
+{
+	other.pool = nullptr;
+	other.buff = nullptr;
+	other.len = 0;
+}
+
+PooledBuffer &PooledBuffer::operator=(PooledBuffer &&other)
+{
+	if (this != &other) {
+		if (pool != nullptr)
+			pool->release(buff, len);
+		pool = other.pool;
+		buff = other.buff;
+		len = other.len;
+		other.pool = nullptr;
+		other.buff = nullptr;
+		other.len = 0;
+	}
+	return *this;
+}
+
+// Give the buffer back to the pool it came from
+PooledBuffer::~PooledBuffer(void)
+{
+	if (pool != nullptr)
+		pool->release(buff, len);
+}
+
+BufferPool::BufferPool(const size_t budget, const bool huge_pages)
+	: budget(budget), huge_pages(huge_pages), in_flight(0), allocated(0),
+	  high_water(0), hits(0), misses(0)
+{
+}
+
+// Unmap every idle buffer. Borrowed buffers must all be back by now.
+BufferPool::~BufferPool(void)
+{
+	for (auto &size_class : idle) {
+		for (uint8_t *buff : size_class.second) {
+			deallocate(buff, size_class.first);
+		}
+	}
+}
+
+// The pool shared by every transfer in the process
+BufferPool &BufferPool::instance(void)
+{
+	static BufferPool pool;
+	return pool;
+}
+
+// Change the in-flight budget, and whether new buffers use huge pages.
+void BufferPool::configure(const size_t budget, const bool huge_pages)
+{
+	std::lock_guard<std::mutex> pool_guard(pool_lock);
+	this->budget = budget;
+	this->huge_pages = huge_pages;
+	buffer_returned.notify_all();
+}
+
+// Map a new buffer, backed by huge pages when they were asked for.
+
+// :return: nullptr on failure
+uint8_t *BufferPool::allocate(const size_t len)
+{
+	void *buff = MAP_FAILED;
+	if (huge_pages) {
+		// Try for explicit huge pages first, then fall back to asking for
+		// transparent ones.
+		size_t rounded = (len + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE *
+				 HUGE_PAGE_SIZE;
+		buff = mmap(nullptr, rounded, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (buff != MAP_FAILED)
+			return (uint8_t *)buff;
+	}
+	buff = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buff == MAP_FAILED) {
+		std::cerr << "Error. Unable to map a pool buffer.\n";
+		return nullptr;
+	}
+	if (huge_pages)
+		madvise(buff, len, MADV_HUGEPAGE);
+	return (uint8_t *)buff;
+}
+
+void BufferPool::deallocate(uint8_t *buff, const size_t len)
+{
+	// munmap rounds up to whole pages (huge ones included) on its own.
+	munmap(buff, len);
+}
+
+// Borrow a buffer of len bytes, waiting while the budget is used up. A single
+// buffer larger than the whole budget is still handed out once nothing else is
+// in flight.
+
+// :return: an empty buffer if memory could not be mapped
+PooledBuffer BufferPool::acquire(const size_t len)
+{
+	std::unique_lock<std::mutex> pool_guard(pool_lock);
+	buffer_returned.wait(pool_guard, [&] {
+		return in_flight == 0 || in_flight + len <= budget;
+	});
+	uint8_t *buff = nullptr;
+	auto size_class = idle.find(len);
+	if (size_class != idle.end() && !size_class->second.empty()) {
+		// Recycle one we already have
+		buff = size_class->second.back();
+		size_class->second.pop_back();
+		++hits;
+	} else {
+		++misses;
+		// Make room by dropping idle buffers of other sizes, so that the
+		// memory we hold stays within the budget.
+		for (auto &other : idle) {
+			while (allocated + len > budget && !other.second.empty()) {
+				deallocate(other.second.back(), other.first);
+				other.second.pop_back();
+				allocated -= other.first;
+			}
+		}
+		buff = allocate(len);
+		if (buff == nullptr)
+			return PooledBuffer();
+		allocated += len;
+	}
+	in_flight += len;
+	high_water = std::max(high_water, in_flight);
+	return PooledBuffer(this, buff, len);
+}
+
+// Hand a buffer back, and wake anyone waiting on the budget.
+void BufferPool::release(uint8_t *buff, const size_t len)
+{
+	{
+		std::lock_guard<std::mutex> pool_guard(pool_lock);
+		in_flight -= len;
+		idle[len].push_back(buff);
+	}
+	buffer_returned.notify_all();
+}
+
+// Print the hit rate, the high-water mark and current usage.
+void BufferPool::report(std::ostream &out)
+{
+	std::lock_guard<std::mutex> pool_guard(pool_lock);
+	uint64_t requests = hits + misses;
+	out << "Buffer pool: " << requests << " requests, hit rate "
+	    << (requests == 0 ? 0.0 : 100.0 * hits / requests)
+	    << "%, high-water mark " << high_water << " bytes, "
+	    << in_flight << " bytes in flight, " << allocated
+	    << " bytes held, budget " << budget << " bytes.\n";
+}
+} // namespace ApplicationLayer
@@ -0,0 +1,93 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <vector>
+#include <ostream>
+namespace ApplicationLayer
+{
+// Default cap on payload memory handed out by the pool at once
+static const size_t constexpr DEFAULT_BUFFER_BUDGET = 256 * 1000 * 1000;
+
+class BufferPool;
+
+// A buffer borrowed from a BufferPool. It goes back to the pool when it is
+// destroyed. It can be moved but not copied.
+class PooledBuffer {
+	friend class BufferPool;
+	BufferPool *pool;
+	uint8_t *buff;
+	size_t len;
+
+	PooledBuffer(BufferPool *pool, uint8_t *buff, size_t len);
+
+    public:
+	PooledBuffer(void);
+	PooledBuffer(PooledBuffer &&other);
+	PooledBuffer &operator=(PooledBuffer &&other);
+	PooledBuffer(PooledBuffer &other) = delete;
+	PooledBuffer &operator=(PooledBuffer &other) = delete;
+	~PooledBuffer(void);
+	uint8_t *data(void)
+	{
+		return buff;
+	}
+	size_t size(void) const
+	{
+		return len;
+	}
+};
+
+// Recycles payload buffers between transfers, and caps how much payload
+// memory may be in flight across every thread in the process. Once the budget
+// is used up, acquire() waits for a buffer to come back instead of allocating.
+class BufferPool {
+	friend class BufferPoolTests;
+	friend class PooledBuffer;
+	std::mutex pool_lock;
+	std::condition_variable buffer_returned;
+	size_t budget;
+	bool huge_pages;
+	// size: idle buffers of that size
+	std::unordered_map<size_t, std::vector<uint8_t *> > idle;
+	// Bytes currently handed out
+	size_t in_flight;
+	// Bytes handed out plus bytes sitting idle
+	size_t allocated;
+	size_t high_water;
+	uint64_t hits;
+	uint64_t misses;
+
+	// Map a new buffer, backed by huge pages when they were asked for.
+
+	// :return: nullptr on failure
+	uint8_t *allocate(const size_t len);
+	void deallocate(uint8_t *buff, const size_t len);
+	// Hand a buffer back, and wake anyone waiting on the budget.
+	void release(uint8_t *buff, const size_t len);
+
+    public:
+	BufferPool(const size_t budget = DEFAULT_BUFFER_BUDGET,
+		   const bool huge_pages = false);
+	~BufferPool(void);
+	// This cannot be moved, deleted, or reassigned
+	BufferPool(BufferPool &&pool) = delete;
+	BufferPool(BufferPool &pool) = delete;
+	BufferPool &operator=(BufferPool &pool) = delete;
+	BufferPool &operator=(BufferPool &&pool) = delete;
+	// The pool shared by every transfer in the process
+	static BufferPool &instance(void);
+	// Change the in-flight budget, and whether new buffers use huge pages.
+	void configure(const size_t budget, const bool huge_pages);
+	// Borrow a buffer of len bytes, waiting while the budget is used up. A
+	// single buffer larger than the whole budget is still handed out once
+	// nothing else is in flight.
+
+	// :return: an empty buffer if memory could not be mapped
+	PooledBuffer acquire(const size_t len);
+	// Print the hit rate, the high-water mark and current usage.
+	void report(std::ostream &out);
+};
+} // namespace ApplicationLayer
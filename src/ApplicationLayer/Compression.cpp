@@ -0,0 +1,222 @@
+#include "Compression.hpp"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace ApplicationLayer
+{
+// Shortest match the format can express
+static const size_t constexpr MIN_MATCH = 4;
+// The last match has to start this far before the end of the block, and the
+// block has to end in at least LAST_LITERALS literals.
+static const size_t constexpr MATCH_LIMIT = 12;
+static const size_t constexpr LAST_LITERALS = 5;
+// Furthest back a match can be
+static const size_t constexpr MAX_OFFSET = 65535;
+// Positions are remembered in a table of 2^HASH_BITS entries, by the hash of
+// the 4 bytes starting there.
+static const unsigned constexpr HASH_BITS = 14;
+// Each run of this many missed positions makes the search skip ahead one
+// byte further, so incompressible data goes by quickly.
+static const unsigned constexpr SKIP_TRIGGER = 6;
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static uint32_t hash_position(const uint8_t *p)
+{
+	return (read32(p) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// How many bytes from a and b on are the same, stopping at limit.
+static size_t common_length(const uint8_t *a, const uint8_t *b,
+			    const uint8_t *limit)
+{
+	const uint8_t *start = a;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while (a + sizeof(uint64_t) <= limit) {
+		uint64_t x, y;
+		memcpy(&x, a, sizeof(x));
+		memcpy(&y, b, sizeof(y));
+		if (x != y)
+			return a - start + (__builtin_ctzll(x ^ y) >> 3);
+		a += sizeof(uint64_t);
+		b += sizeof(uint64_t);
+	}
+#endif
+	while (a < limit && *a == *b) {
+		++a;
+		++b;
+	}
+	return a - start;
+}
+
+// Write a length that didn't fit in its half of the token as a run of 255s
+// and a last byte below 255.
+static uint8_t *put_length(size_t length, uint8_t *out)
+{
+	while (length >= 255) {
+		*out++ = 255;
+		length -= 255;
+	}
+	*out++ = (uint8_t)length;
+	return out;
+}
+
+// Compress len bytes of in into out, as long as it fits in capacity bytes.
+
+// :return: the compressed length, 0 if it didn't fit
+size_t Compression::compress(const uint8_t *in, const size_t len, uint8_t *out,
+			     const size_t capacity)
+{
+	std::vector<uint32_t> table(1 << HASH_BITS, 0);
+	const uint8_t *const end = in + len;
+	const uint8_t *anchor = in;
+	uint8_t *op = out;
+	uint8_t *const op_end = out + capacity;
+	// Write the literals from anchor to literal_end, followed by a match
+	// of match_length bytes offset back, if there is one.
+
+	// :return: false if it doesn't fit
+	auto put_sequence = [&](const uint8_t *literal_end, const size_t offset,
+				const size_t match_length) {
+		const size_t literals = literal_end - anchor;
+		if ((size_t)(op_end - op) <
+		    1 + literals / 255 + 1 + literals + 2 + match_length / 255 + 1)
+			return false;
+		uint8_t *token = op++;
+		*token = (uint8_t)(std::min<size_t>(literals, 15) << 4);
+		if (literals >= 15)
+			op = put_length(literals - 15, op);
+		memcpy(op, anchor, literals);
+		op += literals;
+		if (match_length == 0)
+			return true;
+		*op++ = (uint8_t)(offset & 0xFF);
+		*op++ = (uint8_t)(offset >> 8);
+		const size_t extra = match_length - MIN_MATCH;
+		*token |= (uint8_t)std::min<size_t>(extra, 15);
+		if (extra >= 15)
+			op = put_length(extra - 15, op);
+		return true;
+	};
+	if (len > MATCH_LIMIT) {
+		const uint8_t *const search_end = end - MATCH_LIMIT;
+		const uint8_t *const match_end = end - LAST_LITERALS;
+		const uint8_t *ip = in + 1;
+		unsigned misses = 1 << SKIP_TRIGGER;
+		while (ip < search_end) {
+			const uint32_t hash = hash_position(ip);
+			const uint8_t *ref = in + table[hash];
+			table[hash] = ip - in;
+			if (ref >= ip || (size_t)(ip - ref) > MAX_OFFSET ||
+			    read32(ref) != read32(ip)) {
+				ip += misses++ >> SKIP_TRIGGER;
+				continue;
+			}
+			misses = 1 << SKIP_TRIGGER;
+			// Take in whatever before the match matches too.
+			while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+				--ip;
+				--ref;
+			}
+			const size_t match_length =
+				MIN_MATCH + common_length(ip + MIN_MATCH,
+							  ref + MIN_MATCH,
+							  match_end);
+			if (!put_sequence(ip, ip - ref, match_length))
+				return 0;
+			ip += match_length;
+			anchor = ip;
+			// Remember a position inside the match, so the next
+			// repeat of it is found.
+			if (ip < search_end)
+				table[hash_position(ip - 2)] = ip - 2 - in;
+		}
+	}
+	if (!put_sequence(end, 0, 0))
+		return 0;
+	return op - out;
+}
+
+// Decompress in_len bytes of in into exactly out_len bytes of out.
+
+// :return: false if in is malformed, or doesn't decompress to out_len bytes
+bool Compression::decompress(const uint8_t *in, const size_t in_len,
+			     uint8_t *out, const size_t out_len)
+{
+	const uint8_t *ip = in;
+	const uint8_t *const in_end = in + in_len;
+	uint8_t *op = out;
+	uint8_t *const op_end = out + out_len;
+	// Read the rest of a length that didn't fit in its half of the token.
+
+	// :return: false if it runs past the end of in
+	auto get_length = [&](size_t &length) {
+		uint8_t byte;
+		do {
+			if (ip == in_end)
+				return false;
+			byte = *ip++;
+			length += byte;
+		} while (byte == 255);
+		return true;
+	};
+	while (ip < in_end) {
+		const uint8_t token = *ip++;
+		size_t literals = token >> 4;
+		if (literals == 15 && !get_length(literals))
+			return false;
+		if ((size_t)(in_end - ip) < literals ||
+		    (size_t)(op_end - op) < literals)
+			return false;
+		memcpy(op, ip, literals);
+		ip += literals;
+		op += literals;
+		// The block ends on literals.
+		if (ip == in_end)
+			break;
+		if (in_end - ip < 2)
+			return false;
+		const size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - out))
+			return false;
+		size_t match_length = token & 15;
+		if (match_length == 15 && !get_length(match_length))
+			return false;
+		match_length += MIN_MATCH;
+		if ((size_t)(op_end - op) < match_length)
+			return false;
+		const uint8_t *ref = op - offset;
+		if (offset >= match_length) {
+			memcpy(op, ref, match_length);
+			op += match_length;
+		} else {
+			// The match overlaps what it writes, repeating the
+			// last offset bytes.
+			for (size_t i = 0; i < match_length; ++i) {
+				*op++ = *ref++;
+			}
+		}
+	}
+	return op == op_end;
+}
+
+// Most a block of len bytes may compress to and still be worth sending
+// compressed: an eighth smaller.
+size_t Compression::worthwhile_size(const size_t len)
+{
+	return len - len / 8;
+}
+
+// Most a block of len bytes can compress to, however badly it goes.
+size_t Compression::bound(const size_t len)
+{
+	return len + len / 255 + 16;
+}
+} // namespace ApplicationLayer
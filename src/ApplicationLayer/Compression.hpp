@@ -0,0 +1,45 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+namespace ApplicationLayer
+{
+// Codecs a chunk payload may be compressed with. They are bits, so that a
+// CHUNK_REQUEST can offer several.
+enum CompressionCodec {
+	NO_COMPRESSION = 0,
+	// The LZ4 block format
+	LZ4_COMPRESSION = 1
+};
+// Every codec this build can decompress
+static const uint32_t constexpr SUPPORTED_COMPRESSION = LZ4_COMPRESSION;
+// Blocks shorter than this go out raw, they wouldn't save enough to matter
+static const size_t constexpr MIN_COMPRESSED_BLOCK = 4096;
+// Blocks longer than this go out raw, so that a leecher never has to hold
+// more than this of a block in memory to decompress it, and compressing one
+// never holds up a seeder's reactor for long
+static const size_t constexpr MAX_COMPRESSED_BLOCK = 1024 * 1024;
+
+// A fast LZ77 codec writing the LZ4 block format: runs of literals, each
+// followed by a match of at least 4 bytes up to 64KB back. It trades ratio
+// for speed, so that a seeder can compress blocks as fast as it sends them.
+class Compression {
+    public:
+	// Compress len bytes of in into out, as long as it fits in capacity
+	// bytes.
+
+	// :return: the compressed length, 0 if it didn't fit
+	static size_t compress(const uint8_t *in, const size_t len, uint8_t *out,
+			       const size_t capacity);
+	// Decompress in_len bytes of in into exactly out_len bytes of out.
+
+	// :return: false if in is malformed, or doesn't decompress to out_len
+	// bytes
+	static bool decompress(const uint8_t *in, const size_t in_len,
+			       uint8_t *out, const size_t out_len);
+	// Most a block of len bytes may compress to and still be worth sending
+	// compressed.
+	static size_t worthwhile_size(const size_t len);
+	// Most a block of len bytes can compress to, however badly it goes.
+	static size_t bound(const size_t len);
+};
+} // namespace ApplicationLayer
@@ -0,0 +1,209 @@
+#include "HashTree.hpp"
+#include <algorithm>
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <cerrno>
+extern "C" {
+#include <openssl/evp.h>
+#include <unistd.h>
+}
+namespace ApplicationLayer
+{
+// Most bytes read from a file at once while hashing it
+static const size_t constexpr HASH_READ_SIZE = 16 * HASH_LEAF_SIZE;
+
+// What each kind of hash in the tree is prefixed with
+static const uint8_t constexpr LEAF_PREFIX = 0x00;
+static const uint8_t constexpr NODE_PREFIX = 0x01;
+static const uint8_t constexpr ROOT_PREFIX = 0x02;
+
+// Hash the prefix byte followed by len bytes of data. OpenSSL picks the fastest
+// SHA-256 the CPU has, the SHA extensions or AVX2 where they exist.
+static HashDigest hash_prefixed(const uint8_t prefix, const uint8_t *data,
+				const size_t len)
+{
+	HashDigest digest;
+	unsigned int digest_length;
+	EVP_MD_CTX *context = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(context, EVP_sha256(), nullptr);
+	EVP_DigestUpdate(context, &prefix, 1);
+	EVP_DigestUpdate(context, data, len);
+	EVP_DigestFinal_ex(context, digest.data(), &digest_length);
+	EVP_MD_CTX_free(context);
+	return digest;
+}
+
+// The leaf hash of len bytes of data.
+HashDigest HashTree::hash_leaf(const uint8_t *data, const size_t len)
+{
+	return hash_prefixed(LEAF_PREFIX, data, len);
+}
+
+// The hash of a node from its two children.
+HashDigest HashTree::hash_pair(const HashDigest &left, const HashDigest &right)
+{
+	uint8_t children[2 * HASH_SIZE];
+	std::copy(left.begin(), left.end(), children);
+	std::copy(right.begin(), right.end(), children + HASH_SIZE);
+	return hash_prefixed(NODE_PREFIX, children, sizeof(children));
+}
+
+// Work the root of the tree out from its leaves: the hash of the number of
+// leaves, as 8 big-endian bytes, followed by the top node. The top node of no
+// leaves is all zeroes.
+HashDigest HashTree::root(const std::vector<HashDigest> &leaves)
+{
+	uint8_t committed[sizeof(uint64_t) + HASH_SIZE] = {};
+	for (size_t i = 0; i < sizeof(uint64_t); ++i) {
+		committed[i] = (uint8_t)((uint64_t)leaves.size() >>
+					 (8 * (sizeof(uint64_t) - 1 - i)));
+	}
+	if (leaves.empty())
+		return hash_prefixed(ROOT_PREFIX, committed, sizeof(committed));
+	std::vector<HashDigest> level(leaves);
+	while (level.size() > 1) {
+		size_t parents = 0;
+		for (size_t i = 0; i < level.size(); i += 2) {
+			level[parents++] = i + 1 < level.size() ?
+						   hash_pair(level[i], level[i + 1]) :
+						   level[i];
+		}
+		level.resize(parents);
+	}
+	std::copy(level[0].begin(), level[0].end(),
+		  committed + sizeof(uint64_t));
+	return hash_prefixed(ROOT_PREFIX, committed, sizeof(committed));
+}
+
+// The number of leaves a file of file_size bytes has.
+uint64_t HashTree::num_leaves(const uint64_t file_size)
+{
+	return (file_size + HASH_LEAF_SIZE - 1) / HASH_LEAF_SIZE;
+}
+
+// The most leaves a file of num_chunks chunks of chunk_size bytes has, when its
+// last chunk is whole.
+uint64_t HashTree::num_leaves(const uint64_t num_chunks,
+			      const uint32_t chunk_size)
+{
+	return num_leaves(num_chunks * chunk_size);
+}
+
+// Hash every leaf of the first file_size bytes of the open file, spread over
+// num_threads threads. Each thread takes an even share of the leaves.
+
+// :return: false if the file couldn't be read
+bool HashTree::hash_file(const int file_fd, const uint64_t file_size,
+			 std::vector<HashDigest> &out_leaves,
+			 const size_t num_threads)
+{
+	out_leaves.assign(num_leaves(file_size), HashDigest());
+	const size_t num_shares = std::max<size_t>(1, num_threads);
+	const size_t share = (out_leaves.size() + num_shares - 1) / num_shares;
+	std::vector<std::thread> threads;
+	std::atomic<bool> success(true);
+	for (size_t first = 0; first < out_leaves.size(); first += share) {
+		threads.push_back(std::thread([&, first] {
+			std::vector<uint8_t> buff(HASH_READ_SIZE);
+			const size_t last =
+				std::min(first + share, out_leaves.size());
+			size_t leaf = first;
+			while (leaf < last) {
+				// Read as many whole leaves as fit
+				const uint64_t offset = leaf * HASH_LEAF_SIZE;
+				const size_t len = std::min<uint64_t>(
+					std::min<uint64_t>(
+						buff.size(),
+						(last - leaf) * HASH_LEAF_SIZE),
+					file_size - offset);
+				size_t done = 0;
+				while (done < len) {
+					ssize_t bytes_read =
+						pread(file_fd, buff.data() + done,
+						      len - done, offset + done);
+					if (bytes_read < 0 && errno == EINTR)
+						continue;
+					if (bytes_read <= 0) {
+						success = false;
+						return;
+					}
+					done += bytes_read;
+				}
+				for (size_t leaf_offset = 0; leaf_offset < len;
+				     leaf_offset += HASH_LEAF_SIZE) {
+					out_leaves[leaf++] = hash_leaf(
+						buff.data() + leaf_offset,
+						std::min(HASH_LEAF_SIZE,
+							 len - leaf_offset));
+				}
+			}
+		}));
+	}
+	for (auto &t : threads) {
+		t.join();
+	}
+	if (!success) {
+		std::cerr << "Error. Unable to read file to hash it.\n";
+	}
+	return success;
+}
+
+// Check len bytes of data that start at offset in the file against the leaves.
+// offset is a multiple of HASH_LEAF_SIZE. The data should have been
+// expected_len long, and may only be shorter where the file ends.
+
+// :return: false if the data doesn't match, or stops short
+bool HashTree::verify(const std::vector<HashDigest> &leaves,
+		      const uint64_t offset, const uint8_t *data,
+		      const size_t len, const size_t expected_len)
+{
+	if (offset % HASH_LEAF_SIZE != 0)
+		return false;
+	// Data cut short has to run into the last leaf of the file.
+	if (len < expected_len &&
+	    (offset + len + HASH_LEAF_SIZE - 1) / HASH_LEAF_SIZE < leaves.size())
+		return false;
+	uint64_t leaf = offset / HASH_LEAF_SIZE;
+	for (size_t leaf_offset = 0; leaf_offset < len;
+	     leaf_offset += HASH_LEAF_SIZE, ++leaf) {
+		const size_t leaf_length =
+			std::min(HASH_LEAF_SIZE, len - leaf_offset);
+		// Only the last leaf of the file may be short.
+		if (leaf >= leaves.size() ||
+		    (leaf_length < HASH_LEAF_SIZE && leaf + 1 != leaves.size()) ||
+		    hash_leaf(data + leaf_offset, leaf_length) !=
+			    leaves[leaf]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Append the leaves to a HASH_RESPONSE payload.
+void HashTree::encode_leaves(const HashDigest *leaves, const size_t count,
+			     std::vector<uint8_t> &out_payload)
+{
+	for (size_t i = 0; i < count; ++i) {
+		out_payload.insert(out_payload.end(), leaves[i].begin(),
+				   leaves[i].end());
+	}
+}
+
+// Pull the leaves out of a HASH_RESPONSE payload, appending them to out_leaves.
+
+// :return: false if the payload is malformed
+bool HashTree::decode_leaves(const std::vector<uint8_t> &payload,
+			     std::vector<HashDigest> &out_leaves)
+{
+	if (payload.size() % HASH_SIZE != 0)
+		return false;
+	for (size_t offset = 0; offset < payload.size(); offset += HASH_SIZE) {
+		HashDigest leaf;
+		std::copy(payload.begin() + offset,
+			  payload.begin() + offset + HASH_SIZE, leaf.begin());
+		out_leaves.push_back(leaf);
+	}
+	return true;
+}
+} // namespace ApplicationLayer
@@ -0,0 +1,74 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <vector>
+namespace ApplicationLayer
+{
+// Every file is hashed in leaves of this many bytes, counted from the start of
+// the file. Chunk sizes and the blocks leechers ask for are whole numbers of
+// leaves, so every block can be checked on its own. Divides CHUNK_SIZE.
+static const size_t constexpr HASH_LEAF_SIZE = 256 * 1000;
+// Length of a SHA-256 digest
+static const size_t constexpr HASH_SIZE = 32;
+// Most leaf hashes sent in one HASH_RESPONSE
+static const size_t constexpr MAX_HASHES_PER_RESPONSE = 32 * 1024;
+
+using HashDigest = std::array<uint8_t, HASH_SIZE>;
+
+// The SHA-256 Merkle tree of a file. The leaves are the hashes of each
+// HASH_LEAF_SIZE piece of the file, and each node above them is the hash of
+// its two children. A node without a sibling moves up a level as it is. Leaves,
+// nodes and the root are hashed behind different prefix bytes, and the root
+// takes in the number of leaves, so no other list of leaves, such as a level of
+// nodes further up, adds up to the same root.
+class HashTree {
+	friend class HashTreeTests;
+
+    public:
+	// The leaf hash of len bytes of data.
+	static HashDigest hash_leaf(const uint8_t *data, const size_t len);
+
+	// The hash of a node from its two children.
+	static HashDigest hash_pair(const HashDigest &left,
+				    const HashDigest &right);
+
+	// Work the root of the tree out from its leaves.
+	static HashDigest root(const std::vector<HashDigest> &leaves);
+
+	// The number of leaves a file of file_size bytes has.
+	static uint64_t num_leaves(const uint64_t file_size);
+
+	// The most leaves a file of num_chunks chunks of chunk_size bytes has.
+	static uint64_t num_leaves(const uint64_t num_chunks,
+				   const uint32_t chunk_size);
+
+	// Hash every leaf of the first file_size bytes of the open file, spread
+	// over num_threads threads.
+
+	// :return: false if the file couldn't be read
+	static bool hash_file(const int file_fd, const uint64_t file_size,
+			      std::vector<HashDigest> &out_leaves,
+			      const size_t num_threads = 1);
+
+	// Check len bytes of data that start at offset in the file against the
+	// leaves. offset is a multiple of HASH_LEAF_SIZE. The data should have
+	// been expected_len long, and may only be shorter where the file ends.
+
+	// :return: false if the data doesn't match, or stops short
+	static bool verify(const std::vector<HashDigest> &leaves,
+			   const uint64_t offset, const uint8_t *data,
+			   const size_t len, const size_t expected_len);
+
+	// Append the leaves to a HASH_RESPONSE payload.
+	static void encode_leaves(const HashDigest *leaves, const size_t count,
+				  std::vector<uint8_t> &out_payload);
+
+	// Pull the leaves out of a HASH_RESPONSE payload, appending them to
+	// out_leaves.
+
+	// :return: false if the payload is malformed
+	static bool decode_leaves(const std::vector<uint8_t> &payload,
+				  std::vector<HashDigest> &out_leaves);
+};
+} // namespace ApplicationLayer
@@ -0,0 +1,462 @@
+#include "IoUring.hpp"
+#ifndef P2P_NO_IO_URING
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+extern "C" {
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+}
+
+// Older C libraries don't name the io_uring system calls yet.
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+
+namespace ApplicationLayer
+{
+IoUring::IoUring(const unsigned entries)
+	: ring_fd(-1), sq_ring(MAP_FAILED), sq_ring_size(0),
+	  cq_ring(MAP_FAILED), cq_ring_size(0), sqes((io_uring_sqe *)MAP_FAILED),
+	  sqes_size(0), sq_entries(0), sqe_tail(0)
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring_fd < 0)
+		return;
+	sq_ring_size =
+		params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_size = params.cq_off.cqes +
+		       params.cq_entries * sizeof(io_uring_cqe);
+	// Newer kernels put both rings in the one mapping.
+	const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap) {
+		sq_ring_size = cq_ring_size =
+			std::max(sq_ring_size, cq_ring_size);
+	}
+	sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	cq_ring = single_mmap ? sq_ring :
+				mmap(nullptr, cq_ring_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring_fd,
+				     IORING_OFF_CQ_RING);
+	sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	sqes = (io_uring_sqe *)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ring_fd,
+				    IORING_OFF_SQES);
+	if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED ||
+	    sqes == MAP_FAILED) {
+		std::cerr << "Error. Unable to map the io_uring.\n";
+		close(ring_fd);
+		ring_fd = -1;
+		return;
+	}
+	uint8_t *sq = (uint8_t *)sq_ring;
+	uint8_t *cq = (uint8_t *)cq_ring;
+	sq_entries = params.sq_entries;
+	sq_head = (unsigned *)(sq + params.sq_off.head);
+	sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	sq_array = (unsigned *)(sq + params.sq_off.array);
+	cq_head = (unsigned *)(cq + params.cq_off.head);
+	cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+	cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+	sqe_tail = *sq_tail;
+}
+
+// Tear the ring down. The kernel drops whatever it still has in flight.
+IoUring::~IoUring(void)
+{
+	if (sqes != MAP_FAILED)
+		munmap(sqes, sqes_size);
+	if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_size);
+	if (sq_ring != MAP_FAILED)
+		munmap(sq_ring, sq_ring_size);
+	if (ring_fd >= 0)
+		close(ring_fd);
+}
+
+bool IoUring::ready(void) const
+{
+	return ring_fd >= 0;
+}
+
+// Register buffers with the ring, so the kernel maps them once rather than on
+// every request. Requests then name them by index.
+
+// :return: false on failure
+bool IoUring::register_buffers(const std::vector<iovec> &buffers)
+{
+	return syscall(__NR_io_uring_register, ring_fd,
+		       IORING_REGISTER_BUFFERS, buffers.data(),
+		       buffers.size()) == 0;
+}
+
+// Make room for count registered files, all empty to begin with.
+
+// :return: false on failure
+bool IoUring::register_files(const unsigned count)
+{
+	std::vector<int> fds(count, -1);
+	return syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_FILES,
+		       fds.data(), count) == 0;
+}
+
+// Point registered files [first, first + fds.size()) at fds. -1 empties a
+// slot, dropping the ring's hold on the file.
+
+// :return: false on failure
+bool IoUring::update_files(const unsigned first, const std::vector<int> &fds)
+{
+	io_uring_files_update update;
+	memset(&update, 0, sizeof(update));
+	update.offset = first;
+	update.fds = (uint64_t)(uintptr_t)fds.data();
+	return syscall(__NR_io_uring_register, ring_fd,
+		       IORING_REGISTER_FILES_UPDATE, &update,
+		       fds.size()) == (long)fds.size();
+}
+
+// The next free submission queue entry, zeroed.
+
+// :return: nullptr if the queue is full
+io_uring_sqe *IoUring::get_sqe(void)
+{
+	if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >=
+	    sq_entries)
+		return nullptr;
+	const unsigned idx = sqe_tail & sq_mask;
+	sq_array[idx] = idx;
+	++sqe_tail;
+	memset(&sqes[idx], 0, sizeof(io_uring_sqe));
+	return &sqes[idx];
+}
+
+// Hand every queued request to the kernel, and wait until at least wait_for
+// requests have completed.
+
+// :return: false on failure
+bool IoUring::submit(const unsigned wait_for)
+{
+	__atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+	while (true) {
+		const unsigned to_submit =
+			sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+		// A wait cut short by a signal after the requests went in
+		// still counts as a success. The caller comes back for the
+		// completions.
+		if (syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_for,
+			    wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr,
+			    0) >= 0)
+			return true;
+		if (errno != EINTR) {
+			std::cerr << "Error. Unable to submit to the io_uring.\n";
+			return false;
+		}
+	}
+}
+
+// Take the next completion off the ring.
+
+// :return: false if there is none
+bool IoUring::next_completion(uint64_t &out_user_data, int32_t &out_result)
+{
+	const unsigned head = *cq_head;
+	if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+		return false;
+	const io_uring_cqe &cqe = cqes[head & cq_mask];
+	out_user_data = cqe.user_data;
+	out_result = cqe.res;
+	__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+// Registered files the descriptors of a copy go in
+static const unsigned constexpr SOURCE_FILE = 0;
+static const unsigned constexpr DESTINATION_FILE = 1;
+// Registering the descriptors costs two extra system calls per copy, which
+// only pays off over more requests than this.
+static const size_t constexpr MIN_FIXED_FILE_SLICES = 4;
+
+// What a request in flight is, packed into its user_data with its slice
+enum IoStreamOp { STREAM_READ = 1, STREAM_WRITE, STREAM_TIMEOUT, STREAM_CANCEL };
+
+// Where each slice is in its trip from source to destination
+enum SliceState { SLICE_FREE = 0, SLICE_READING, SLICE_FULL, SLICE_WRITING };
+
+IoStream::IoStream(const size_t slice_size)
+	: ring(IO_STREAM_RING_ENTRIES), fixed_buffers(false), fixed_files(false),
+	  broken(false)
+{
+	if (!ring.ready())
+		return;
+	slice_memory.resize(2 * slice_size);
+	std::vector<iovec> buffers;
+	for (size_t slice = 0; slice < 2; ++slice) {
+		buffers.push_back(
+			{ slice_memory.data() + slice * slice_size, slice_size });
+	}
+	// Both are optional, plain requests work without them.
+	fixed_buffers = ring.register_buffers(buffers);
+	fixed_files = ring.register_files(2);
+}
+
+// The calling thread's stream, with slices of slice_size.
+
+// :return: nullptr if io_uring can't be used here
+IoStream *IoStream::for_this_thread(const size_t slice_size)
+{
+	static thread_local std::unique_ptr<IoStream> stream;
+	// The slice size changed since, start over. A ring that couldn't be set
+	// up is kept, so that it isn't tried again on every receive.
+	if (stream && stream->ring.ready() && !stream->broken &&
+	    stream->slice_size() != slice_size)
+		stream.reset();
+	if (!stream)
+		stream.reset(new IoStream(slice_size));
+	if (!stream->ring.ready() || stream->slice_memory.empty() ||
+	    stream->broken)
+		return nullptr;
+	return stream.get();
+}
+
+size_t IoStream::slice_size(void)
+{
+	return slice_memory.size() / 2;
+}
+
+// How long the socket lets a send or receive block. A file has no limit.
+
+// :return: false if there is no limit
+static bool socket_timeout(const int fd, const int option,
+			   __kernel_timespec &out_timeout)
+{
+	timeval timeout;
+	socklen_t timeout_len = sizeof(timeout);
+	if (getsockopt(fd, SOL_SOCKET, option, &timeout, &timeout_len) < 0 ||
+	    (timeout.tv_sec == 0 && timeout.tv_usec == 0))
+		return false;
+	out_timeout.tv_sec = timeout.tv_sec;
+	out_timeout.tv_nsec = timeout.tv_usec * 1000;
+	return true;
+}
+
+// Copy len bytes from source, starting at source_offset, to destination,
+// starting at destination_offset. An offset of -1 reads or writes the
+// descriptor in order, as a socket must be. A socket's SO_RCVTIMEO and
+// SO_SNDTIMEO are honoured.
+// Only one read and one write are in flight at a time, each in its own slice,
+// so the bytes reach the destination in the order they left the source.
+
+// :return: false on failure
+bool IoStream::copy(const int source, const off_t source_offset,
+		    const int destination, const off_t destination_offset,
+		    size_t len)
+{
+	__kernel_timespec read_timeout, write_timeout;
+	const bool read_timed =
+		socket_timeout(source, SO_RCVTIMEO, read_timeout);
+	const bool write_timed =
+		socket_timeout(destination, SO_SNDTIMEO, write_timeout);
+	const bool use_fixed_files =
+		fixed_files && len > MIN_FIXED_FILE_SLICES * slice_size() &&
+		ring.update_files(SOURCE_FILE, { source, destination });
+	SliceState state[2] = { SLICE_FREE, SLICE_FREE };
+	// Where each slice's bytes sit in the stream, how many there are, and
+	// how many of them have been written out
+	uint64_t position[2] = { 0, 0 };
+	size_t filled[2] = { 0, 0 };
+	size_t written[2] = { 0, 0 };
+	uint64_t bytes_read = 0;
+	uint64_t bytes_written = 0;
+	unsigned in_flight = 0;
+	bool failed = false;
+	bool cancelled = false;
+
+	// Queue a request on the slice, followed by a timeout on it when there
+	// is one.
+	auto queue = [&](const IoStreamOp op, const size_t slice,
+			 const bool timed, const __kernel_timespec &timeout) {
+		const bool reading = op == STREAM_READ;
+		io_uring_sqe *sqe = ring.get_sqe();
+		if (fixed_buffers) {
+			sqe->opcode = reading ? IORING_OP_READ_FIXED :
+						IORING_OP_WRITE_FIXED;
+			sqe->buf_index = slice;
+		} else {
+			sqe->opcode = reading ? IORING_OP_READ : IORING_OP_WRITE;
+		}
+		if (use_fixed_files) {
+			sqe->fd = reading ? SOURCE_FILE : DESTINATION_FILE;
+			sqe->flags |= IOSQE_FIXED_FILE;
+		} else {
+			sqe->fd = reading ? source : destination;
+		}
+		const off_t base = reading ? source_offset : destination_offset;
+		if (reading) {
+			sqe->addr = (uint64_t)(uintptr_t)(slice_memory.data() +
+							  slice * slice_size());
+			sqe->len = std::min<uint64_t>(slice_size(),
+						      len - bytes_read);
+			sqe->off = base < 0 ? (uint64_t)-1 : base + bytes_read;
+		} else {
+			sqe->addr = (uint64_t)(uintptr_t)(slice_memory.data() +
+							  slice * slice_size() +
+							  written[slice]);
+			sqe->len = filled[slice] - written[slice];
+			sqe->off = base < 0 ? (uint64_t)-1 :
+					      base + position[slice] +
+						      written[slice];
+		}
+		sqe->user_data = (op << 8) | slice;
+		++in_flight;
+		if (!timed)
+			return;
+		sqe->flags |= IOSQE_IO_LINK;
+		io_uring_sqe *timeout_sqe = ring.get_sqe();
+		timeout_sqe->opcode = IORING_OP_LINK_TIMEOUT;
+		timeout_sqe->fd = -1;
+		timeout_sqe->addr = (uint64_t)(uintptr_t)&timeout;
+		timeout_sqe->len = 1;
+		timeout_sqe->user_data = STREAM_TIMEOUT << 8;
+		++in_flight;
+	};
+	// Keep a read and a write going while there is work for them.
+	auto advance = [&]() {
+		const bool writing = state[0] == SLICE_WRITING ||
+				     state[1] == SLICE_WRITING;
+		const bool reading = state[0] == SLICE_READING ||
+				     state[1] == SLICE_READING;
+		for (size_t slice = 0; slice < 2 && !writing; ++slice) {
+			if (state[slice] == SLICE_FULL) {
+				state[slice] = SLICE_WRITING;
+				queue(STREAM_WRITE, slice, write_timed,
+				      write_timeout);
+				break;
+			}
+		}
+		for (size_t slice = 0; slice < 2 && !reading && bytes_read < len;
+		     ++slice) {
+			if (state[slice] == SLICE_FREE) {
+				state[slice] = SLICE_READING;
+				queue(STREAM_READ, slice, read_timed,
+				      read_timeout);
+				break;
+			}
+		}
+	};
+	// Call off whatever is still in flight once the copy has failed.
+	auto cancel = [&]() {
+		for (size_t slice = 0; slice < 2; ++slice) {
+			if (state[slice] != SLICE_READING &&
+			    state[slice] != SLICE_WRITING)
+				continue;
+			const uint64_t op = state[slice] == SLICE_READING ?
+						    STREAM_READ :
+						    STREAM_WRITE;
+			io_uring_sqe *sqe = ring.get_sqe();
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->fd = -1;
+			sqe->addr = (op << 8) | slice;
+			sqe->user_data = STREAM_CANCEL << 8;
+			++in_flight;
+		}
+		cancelled = true;
+	};
+
+	advance();
+	while (in_flight > 0) {
+		if (failed && !cancelled)
+			cancel();
+		if (!ring.submit(1)) {
+			broken = true;
+			return false;
+		}
+		uint64_t user_data;
+		int32_t result;
+		while (ring.next_completion(user_data, result)) {
+			--in_flight;
+			const uint64_t op = user_data >> 8;
+			const size_t slice = user_data & 0xFF;
+			if (op == STREAM_TIMEOUT || op == STREAM_CANCEL) {
+				continue;
+			} else if (failed) {
+				// Nothing more gets queued.
+				state[slice] = SLICE_FREE;
+			} else if (result == -EINTR || result == -EAGAIN) {
+				queue((IoStreamOp)op, slice,
+				      op == STREAM_READ ? read_timed :
+							  write_timed,
+				      op == STREAM_READ ? read_timeout :
+							  write_timeout);
+			} else if (op == STREAM_READ) {
+				if (result <= 0) {
+					// -ECANCELED means the timeout fired.
+					if (source_offset >= 0)
+						std::cerr << "Error. Unable to "
+							     "read chunk.\n";
+					else if (result == 0)
+						std::cout << "Socket "
+							     "Disconnected.\n";
+					else
+						std::cout << "Unable to send or "
+							     "receive on "
+							     "socket.\n";
+					failed = true;
+					state[slice] = SLICE_FREE;
+					continue;
+				}
+				position[slice] = bytes_read;
+				filled[slice] = result;
+				written[slice] = 0;
+				bytes_read += result;
+				state[slice] = SLICE_FULL;
+			} else {
+				if (result <= 0) {
+					if (destination_offset >= 0)
+						std::cerr << "Error while "
+							     "writing chunk to "
+							     "file.\n";
+					else
+						std::cout << "Unable to send or "
+							     "receive on "
+							     "socket.\n";
+					failed = true;
+					state[slice] = SLICE_FREE;
+					continue;
+				}
+				written[slice] += result;
+				if (written[slice] < filled[slice]) {
+					// Write out the rest of it.
+					queue(STREAM_WRITE, slice, write_timed,
+					      write_timeout);
+					continue;
+				}
+				bytes_written += filled[slice];
+				state[slice] = SLICE_FREE;
+			}
+		}
+		if (!failed)
+			advance();
+	}
+	if (use_fixed_files && !ring.update_files(SOURCE_FILE, { -1, -1 })) {
+		// The ring would keep the descriptors' files open.
+		broken = true;
+	}
+	return !failed && bytes_written == len;
+}
+} // namespace ApplicationLayer
+#endif
@@ -0,0 +1,130 @@
+#pragma once
+// The io_uring backend is left out when the build asks for it to be, or the
+// kernel headers don't have it.
+#if !defined(P2P_NO_IO_URING) && !__has_include(<linux/io_uring.h>)
+#define P2P_NO_IO_URING
+#endif
+#ifndef P2P_NO_IO_URING
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <vector>
+extern "C" {
+#include <linux/io_uring.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+}
+namespace ApplicationLayer
+{
+// Entries in the submission queue of each IoStream's ring. A stream has at
+// most a read, a write, and a timeout for each of them in flight.
+static const unsigned constexpr IO_STREAM_RING_ENTRIES = 8;
+
+// An io_uring, set up with the raw system calls so there's nothing to link
+// against. Requests are queued with get_sqe() and go to the kernel together
+// on submit(), so a single system call can both hand over new work and wait
+// for the last.
+class IoUring {
+	int ring_fd;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned sq_entries;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	io_uring_cqe *cqes;
+	// Where get_sqe() has filled the submission queue up to. The kernel
+	// only sees it on submit().
+	unsigned sqe_tail;
+
+    public:
+	explicit IoUring(const unsigned entries);
+	~IoUring(void);
+	// This cannot be moved, deleted, or reassigned
+	IoUring(IoUring &&ring) = delete;
+	IoUring(IoUring &ring) = delete;
+	IoUring &operator=(IoUring &ring) = delete;
+	IoUring &operator=(IoUring &&ring) = delete;
+	// Whether the ring was set up. It isn't where the kernel lacks io_uring
+	// or it is turned off.
+	bool ready(void) const;
+	// Register buffers with the ring, so the kernel maps them once rather
+	// than on every request. Requests then name them by index.
+
+	// :return: false on failure
+	bool register_buffers(const std::vector<iovec> &buffers);
+	// Make room for count registered files, all empty to begin with.
+
+	// :return: false on failure
+	bool register_files(const unsigned count);
+	// Point registered files [first, first + fds.size()) at fds. -1 empties
+	// a slot, dropping the ring's hold on the file.
+
+	// :return: false on failure
+	bool update_files(const unsigned first, const std::vector<int> &fds);
+	// The next free submission queue entry, zeroed.
+
+	// :return: nullptr if the queue is full
+	io_uring_sqe *get_sqe(void);
+	// Hand every queued request to the kernel, and wait until at least
+	// wait_for requests have completed.
+
+	// :return: false on failure
+	bool submit(const unsigned wait_for);
+	// Take the next completion off the ring.
+
+	// :return: false if there is none
+	bool next_completion(uint64_t &out_user_data, int32_t &out_result);
+};
+
+// Moves a stream of bytes from one descriptor to another through an io_uring,
+// for example a chunk payload from its socket to its file. The bytes are staged
+// in two registered slices, so the next slice is read while the last one is
+// written out, and both descriptors are registered for the length of each
+// copy. Each thread gets its own stream, made on first use. The slices are the
+// stream's own, not borrowed from the BufferPool: they live as long as the
+// thread does, and would otherwise hold the pool's budget for that long.
+class IoStream {
+	// Both slices, one after the other
+	std::vector<uint8_t> slice_memory;
+	// After the slices, so it lets go of them before they are freed.
+	IoUring ring;
+	bool fixed_buffers;
+	bool fixed_files;
+	// Set when the ring failed under a copy, leaving it in an unknown state
+	bool broken;
+
+	explicit IoStream(const size_t slice_size);
+
+    public:
+	// This cannot be moved, deleted, or reassigned
+	IoStream(IoStream &&stream) = delete;
+	IoStream(IoStream &stream) = delete;
+	IoStream &operator=(IoStream &stream) = delete;
+	IoStream &operator=(IoStream &&stream) = delete;
+	// The calling thread's stream, with slices of slice_size.
+
+	// :return: nullptr if io_uring can't be used here
+	static IoStream *for_this_thread(const size_t slice_size);
+	// Size of each slice
+	size_t slice_size(void);
+	// Copy len bytes from source, starting at source_offset, to destination,
+	// starting at destination_offset. An offset of -1 reads or writes the
+	// descriptor in order, as a socket must be. A socket's SO_RCVTIMEO and
+	// SO_SNDTIMEO are honoured.
+
+	// :return: false on failure
+	bool copy(const int source, const off_t source_offset,
+		  const int destination, const off_t destination_offset,
+		  size_t len);
+};
+} // namespace ApplicationLayer
+#endif
@@ -1,13 +1,43 @@
 #include "Peer.hpp"
+#include "HashTree.hpp"
+#include "IoUring.hpp"
+#include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <cerrno>
 extern "C" {
 #include <netinet/in.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
 }
 namespace ApplicationLayer
 {
+std::atomic<size_t> Peer::receive_slice_size(DEFAULT_RECEIVE_SLICE_SIZE);
+std::atomic<int> Peer::io_backend(BLOCKING_IO);
+
+// Set how many bytes of a chunk payload may be held in memory per connection
+// while receiving it. Clamped to [MIN_RECEIVE_SLICE_SIZE, CHUNK_SIZE].
+void Peer::set_receive_slice_size(const size_t slice_size)
+{
+	receive_slice_size = std::max(MIN_RECEIVE_SLICE_SIZE,
+				      std::min(slice_size, CHUNK_SIZE));
+}
+
+// Move chunk payloads with backend from now on.
+
+// :return: false if this build has no such backend
+bool Peer::set_io_backend(const IoBackend backend)
+{
+#ifdef P2P_NO_IO_URING
+	if (backend == IO_URING)
+		return false;
+#endif
+	io_backend = backend;
+	return true;
+}
+
 // Function to insert a filename string into the PeerMessage Header
 
 // :return: false when the filename is too long
@@ -43,11 +73,14 @@ void Peer::pull_filename(std::string &out_filename, const PeerMessage &message)
 	}
 }
 
-// Function to read a chunk in from a file
+// Function to read length bytes of a file in, starting at offset. The buffer
+// has spare bytes of room after the chunk for the caller to work in, so that it
+// never has to wait on the pool for a second buffer while holding this one.
 
 // :return: (whether we were successful, the chunk, the size of the chunk)
-std::tuple<bool, std::vector<uint8_t>, uint32_t>
-Peer::read_chunk(const std::string &filename, const uint32_t chunk_idx)
+std::tuple<bool, PooledBuffer, uint32_t>
+Peer::read_chunk(const std::string &filename, const uint64_t offset,
+		 const uint32_t length, const size_t spare)
 {
 	// the file from disk, and send it in this message.
 	// Open the file to send a chunk of
@@ -55,29 +88,34 @@ Peer::read_chunk(const std::string &filename, const uint32_t chunk_idx)
 	// Make sure we were able to open the file
 	if (chunk_fid < 0) {
 		std::cerr << "Error. Unable to read from file being shared.\n";
-		return std::make_tuple(false, std::vector<uint8_t>(), 0);
+		return std::make_tuple(false, PooledBuffer(), 0);
 	}
 	// Seek to the beginning of the chunk to send
-	if (lseek(chunk_fid, chunk_idx * CHUNK_SIZE, SEEK_SET) == -1) {
+	if (lseek(chunk_fid, offset, SEEK_SET) == -1) {
 		std::cerr << "Error. chunk index out of range.\n";
 		close(chunk_fid);
-		return std::make_tuple(false, std::vector<uint8_t>(), 0);
+		return std::make_tuple(false, PooledBuffer(), 0);
+	}
+	// Chunk of the file to send to the other peer. Borrowed from the pool,
+	// so this waits if too much chunk memory is already in flight.
+	PooledBuffer chunk = BufferPool::instance().acquire(length + spare);
+	if (chunk.data() == nullptr) {
+		close(chunk_fid);
+		return std::make_tuple(false, PooledBuffer(), 0);
 	}
-	// Chunk of the file to send to the other peer.
-	std::vector<uint8_t> chunk(CHUNK_SIZE);
 	// If this chunk is the end chunk of the file, then it may be less than
-	// CHUNK_SIZE
-	uint32_t actual_chunk_size;
-	if ((actual_chunk_size = read(chunk_fid, chunk.data(), CHUNK_SIZE)) <
-	    1) {
+	// length
+	ssize_t actual_chunk_size = read(chunk_fid, chunk.data(), length);
+	if (actual_chunk_size < 1) {
 		std::cerr << "Unable to read chunk from send file.\n";
 		close(chunk_fid);
-		return std::make_tuple(false, std::vector<uint8_t>(), 0);
+		return std::make_tuple(false, PooledBuffer(), 0);
 	}
 	// Close the file. We are done reading.
 	close(chunk_fid);
 	// Return back our shiny new chunk.
-	return std::make_tuple(true, std::move(chunk), actual_chunk_size);
+	return std::make_tuple(true, std::move(chunk),
+			       (uint32_t)actual_chunk_size);
 }
 // Build a peer message to send to another peer. File name can be no longer than
 // 255 bytes. Do not add the extra null terminator. This function will take care
@@ -133,19 +171,422 @@ void Peer::deserialize_message_header(const PeerMessage &message,
 	out_current_chunk_size = ntohl(*((uint32_t *)&(message[272])));
 }
 
-template <typename T>
-bool Peer::send_or_recv_socket(int sock, T &container, size_t len,
+PeerHeader::PeerHeader(const uint8_t message_type, const uint8_t version)
+	: version(version), message_type(message_type), file_handle(0),
+	  max_version(0), num_chunks(0), chunk_request_begin_idx(0),
+	  chunk_request_end_idx(0), current_chunk_idx(0), current_chunk_size(0),
+	  chunk_size(0), block_offset(0), block_size(0), compression(0),
+	  compressed_size(0)
+{
+}
+
+// Fill in a PeerHeader from a v1 header, including the version handshake
+// fields.
+void Peer::decode_header_v1(const PeerMessage &message, PeerHeader &out_header)
+{
+	out_header.version = 1;
+	deserialize_message_header(message, out_header.message_type,
+				   out_header.file_name, out_header.num_chunks,
+				   out_header.chunk_request_begin_idx,
+				   out_header.chunk_request_end_idx,
+				   out_header.current_chunk_idx,
+				   out_header.current_chunk_size);
+	// A v1 peer leaves these fields zeroed, so only a peer that speaks a
+	// later version will have set the magic.
+	if ((out_header.message_type == PeerMessageType::FILE_REQUEST ||
+	     out_header.message_type == PeerMessageType::FILE_RESPONSE) &&
+	    out_header.chunk_request_begin_idx == VERSION_HANDSHAKE_MAGIC) {
+		out_header.max_version = std::min<uint32_t>(
+			out_header.chunk_request_end_idx, 0xFF);
+		if (out_header.message_type == PeerMessageType::FILE_RESPONSE) {
+			out_header.file_handle =
+				((uint64_t)out_header.current_chunk_idx << 32) |
+				out_header.current_chunk_size;
+		}
+	}
+}
+
+// Append value to out as a LEB128 varint.
+
+// :return: the number of bytes written
+size_t Peer::put_varint(uint64_t value, uint8_t *out)
+{
+	size_t len = 0;
+	while (value >= 0x80) {
+		out[len++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	out[len++] = (uint8_t)value;
+	return len;
+}
+
+// Pull a LEB128 varint from in, moving it past the varint.
+
+// :return: false if the varint runs past end or overflows 64 bits
+bool Peer::get_varint(const uint8_t *&in, const uint8_t *end,
+		      uint64_t &out_value)
+{
+	out_value = 0;
+	for (unsigned shift = 0; shift < 64; shift += 7) {
+		if (in == end)
+			return false;
+		uint8_t byte = *in++;
+		out_value |= (uint64_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+// Decode the next whole message from the front of buff, the way a seeder
+// receives it. Payloads are only allowed on messages other than CHUNK_RESPONSE,
+// and land in out_header.payload.
+
+// :return: the number of bytes used, 0 if more bytes are needed, or -1 if the
+// message is malformed
+ssize_t Peer::decode_message(const uint8_t *buff, const size_t len,
+			     PeerHeader &out_header)
+{
+	if (len == 0)
+		return 0;
+	out_header = PeerHeader();
+	if (buff[0] != V2_MARKER) {
+		PeerMessage m;
+		if (len < m.size())
+			return 0;
+		std::copy(buff, buff + m.size(), m.begin());
+		decode_header_v1(m, out_header);
+		return m.size();
+	}
+	uint64_t payload_length;
+	ssize_t header_length =
+		decode_header_v2(buff, len, out_header, payload_length);
+	if (header_length <= 0)
+		return header_length;
+	if (payload_length > MAX_CONTROL_PAYLOAD ||
+	    (payload_length > 0 &&
+	     out_header.message_type == PeerMessageType::CHUNK_RESPONSE)) {
+		return -1;
+	}
+	if (len - header_length < payload_length)
+		return 0;
+	out_header.payload.assign(buff + header_length,
+				  buff + header_length + payload_length);
+	if (out_header.message_type == PeerMessageType::FILE_REQUEST) {
+		out_header.file_name.assign(out_header.payload.begin(),
+					    out_header.payload.end());
+	}
+	return header_length + payload_length;
+}
+
+// Append the message in header.version to out, followed by header.payload. A
+// CHUNK_RESPONSE header instead says chunk_size bytes of chunk follow it, which
+// the caller sends on its own.
+
+// :return: false if the header can't be expressed in its version
+bool Peer::append_message(const PeerHeader &header, std::vector<uint8_t> &out,
+			  const uint32_t chunk_size)
+{
+	const bool chunk =
+		header.message_type == PeerMessageType::CHUNK_RESPONSE;
+	PeerMessage m;
+	size_t header_length;
+	if (!encode_header(header, chunk ? chunk_size : header.payload.size(),
+			   m, header_length)) {
+		return false;
+	}
+	out.insert(out.end(), m.begin(), m.begin() + header_length);
+	if (!chunk)
+		out.insert(out.end(), header.payload.begin(),
+			   header.payload.end());
+	return true;
+}
+
+// Append a varint length followed by the string's bytes to out.
+void Peer::append_string(const std::string &value, std::vector<uint8_t> &out)
+{
+	uint8_t length[10];
+	out.insert(out.end(), length, length + put_varint(value.size(), length));
+	out.insert(out.end(), value.begin(), value.end());
+}
+
+// Pull a string written by append_string from in, moving it past it.
+
+// :return: false if the string runs past end
+bool Peer::get_string(const uint8_t *&in, const uint8_t *end,
+		      std::string &out_value)
+{
+	uint64_t length;
+	if (!get_varint(in, end, length) || length > (uint64_t)(end - in))
+		return false;
+	out_value.assign(in, in + length);
+	in += length;
+	return true;
+}
+
+// Append one entry to the payload of an INVENTORY_RESPONSE or
+// FILE_BATCH_RESPONSE.
+void Peer::append_catalog_entry(const CatalogEntry &entry,
+				std::vector<uint8_t> &out_payload)
+{
+	append_string(entry.file_name, out_payload);
+	uint8_t fields[35];
+	uint8_t *field = fields;
+	field += put_varint(entry.file_size, field);
+	field += put_varint(entry.num_chunks, field);
+	field += put_varint(entry.file_handle, field);
+	field += put_varint(entry.chunk_size, field);
+	out_payload.insert(out_payload.end(), fields, field);
+	append_string(entry.root_hash, out_payload);
+}
+
+// Pull every catalog entry out of an INVENTORY_RESPONSE or FILE_BATCH_RESPONSE
+// payload.
+
+// :return: false if the payload is malformed
+bool Peer::decode_catalog(const std::vector<uint8_t> &payload,
+			  std::vector<CatalogEntry> &out_entries)
+{
+	out_entries.clear();
+	const uint8_t *in = payload.data();
+	const uint8_t *end = in + payload.size();
+	while (in != end) {
+		CatalogEntry entry;
+		uint64_t num_chunks;
+		uint64_t chunk_size;
+		if (!get_string(in, end, entry.file_name) ||
+		    !get_varint(in, end, entry.file_size) ||
+		    !get_varint(in, end, num_chunks) ||
+		    !get_varint(in, end, entry.file_handle) ||
+		    !get_varint(in, end, chunk_size) ||
+		    !get_string(in, end, entry.root_hash) ||
+		    num_chunks > 0xFFFFFFFF || chunk_size > MAX_CHUNK_SIZE ||
+		    (!entry.root_hash.empty() &&
+		     entry.root_hash.size() != HASH_SIZE)) {
+			return false;
+		}
+		entry.num_chunks = num_chunks;
+		entry.chunk_size = chunk_size;
+		out_entries.push_back(std::move(entry));
+	}
+	return true;
+}
+
+// Build the payload of a FILE_BATCH_REQUEST.
+void Peer::encode_names(const std::vector<std::string> &names,
+			std::vector<uint8_t> &out_payload)
+{
+	out_payload.clear();
+	for (auto &name : names) {
+		append_string(name, out_payload);
+	}
+}
+
+// Pull the filenames out of a FILE_BATCH_REQUEST payload.
+
+// :return: false if the payload is malformed
+bool Peer::decode_names(const std::vector<uint8_t> &payload,
+			std::vector<std::string> &out_names)
+{
+	out_names.clear();
+	const uint8_t *in = payload.data();
+	const uint8_t *end = in + payload.size();
+	while (in != end) {
+		std::string name;
+		if (!get_string(in, end, name))
+			return false;
+		out_names.push_back(std::move(name));
+	}
+	return true;
+}
+
+// Encode the header in its own wire version into out_message, with
+// payload_length bytes of payload to follow it. out_length is set to the
+// number of bytes used.
+
+// :return: false if the header can't be expressed in its version
+bool Peer::encode_header(const PeerHeader &header,
+			 const uint64_t payload_length, PeerMessage &out_message,
+			 size_t &out_length)
+{
+	if (header.version < 2) {
+		uint32_t begin_idx = header.chunk_request_begin_idx;
+		uint32_t end_idx = header.chunk_request_end_idx;
+		uint32_t chunk_idx = header.current_chunk_idx;
+		uint32_t chunk_size = header.current_chunk_size;
+		if (header.message_type == PeerMessageType::CHUNK_RESPONSE) {
+			chunk_size = payload_length;
+		} else if (payload_length > 0) {
+			// v1 messages have nowhere to say how long a payload is
+			return false;
+		}
+		// Nor any way to name another chunk size, part of a chunk, or
+		// compression
+		if (chunk_size_of(header) != CHUNK_SIZE ||
+		    header.block_offset != 0 || header.block_size != 0 ||
+		    header.compression != 0) {
+			return false;
+		}
+		// Offer or agree on a wire version through fields that v1 leaves
+		// unused in these messages.
+		if (header.max_version != 0 &&
+		    (header.message_type == PeerMessageType::FILE_REQUEST ||
+		     header.message_type == PeerMessageType::FILE_RESPONSE)) {
+			begin_idx = VERSION_HANDSHAKE_MAGIC;
+			end_idx = header.max_version;
+			if (header.message_type ==
+			    PeerMessageType::FILE_RESPONSE) {
+				chunk_idx = header.file_handle >> 32;
+				chunk_size = header.file_handle & 0xFFFFFFFF;
+			}
+		}
+		out_length = out_message.size();
+		return serialize_message_header(
+			out_message, header.message_type, header.file_name,
+			header.num_chunks, begin_idx, end_idx, chunk_idx,
+			chunk_size);
+	}
+	out_message[0] = V2_MARKER;
+	out_message[1] = header.message_type;
+	uint8_t *field = &out_message[V2_PREFIX_SIZE];
+	field += put_varint(header.file_handle, field);
+	field += put_varint(header.num_chunks, field);
+	field += put_varint(header.chunk_request_begin_idx, field);
+	field += put_varint(header.chunk_request_end_idx, field);
+	field += put_varint(header.current_chunk_idx, field);
+	field += put_varint(payload_length, field);
+	// The fields after the payload length are left off when they are 0. A
+	// compressed CHUNK_RESPONSE says how long its payload decompresses to.
+	const bool compressed =
+		header.message_type == PeerMessageType::CHUNK_RESPONSE &&
+		header.compression != 0;
+	const uint32_t extra_fields[] = {
+		header.chunk_size, header.block_offset, header.block_size,
+		header.compression, compressed ? header.current_chunk_size : 0
+	};
+	size_t num_extra_fields = 5;
+	while (num_extra_fields > 0 && extra_fields[num_extra_fields - 1] == 0)
+		--num_extra_fields;
+	for (size_t i = 0; i < num_extra_fields; ++i)
+		field += put_varint(extra_fields[i], field);
+	out_message[2] = field - &out_message[V2_PREFIX_SIZE];
+	out_length = field - out_message.data();
+	return true;
+}
+
+// The chunk size a header's chunk indices are counted in. Always CHUNK_SIZE for
+// v1.
+uint32_t Peer::chunk_size_of(const PeerHeader &header)
+{
+	return header.chunk_size != 0 ? header.chunk_size : CHUNK_SIZE;
+}
+
+// Work out which bytes of a file file_size long the CHUNK_RESPONSE for
+// chunk_idx of the request carries. The range is empty if block_offset is past
+// the end of the chunk.
+
+// :return: false if the chunk starts past the end of the file
+bool Peer::chunk_range(const PeerHeader &request, const uint32_t chunk_idx,
+		       const uint64_t file_size, uint64_t &out_offset,
+		       uint32_t &out_length)
+{
+	const uint32_t chunk_size = chunk_size_of(request);
+	const uint64_t chunk_start = (uint64_t)chunk_idx * chunk_size;
+	if (chunk_start >= file_size) {
+		return false;
+	}
+	// If this chunk is the end chunk of the file, then it may be less than
+	// chunk_size
+	const uint32_t chunk_length =
+		std::min<uint64_t>(chunk_size, file_size - chunk_start);
+	out_offset = chunk_start + std::min(request.block_offset, chunk_length);
+	out_length = request.block_offset >= chunk_length ?
+			     0 :
+			     chunk_length - request.block_offset;
+	if (request.block_size != 0)
+		out_length = std::min(out_length, request.block_size);
+	return true;
+}
+
+// Work out the handle a seeder hands out for a file. The same filename always
+// gets the same handle. Never 0.
+uint64_t Peer::make_file_handle(const std::string &filename)
+{
+	// 64 bit FNV-1a
+	uint64_t handle = 0xcbf29ce484222325ULL;
+	for (const char c : filename) {
+		handle ^= (uint8_t)c;
+		handle *= 0x100000001b3ULL;
+	}
+	return handle == 0 ? 1 : handle;
+}
+
+// Decode a v2 header from the front of buff.
+
+// :return: the number of header bytes used, 0 if more bytes are needed, or -1
+// if the header is malformed
+ssize_t Peer::decode_header_v2(const uint8_t *buff, const size_t len,
+			       PeerHeader &out_header,
+			       uint64_t &out_payload_length)
+{
+	if (len < V2_PREFIX_SIZE)
+		return 0;
+	if (buff[0] != V2_MARKER)
+		return -1;
+	const size_t header_length = V2_PREFIX_SIZE + buff[2];
+	if (len < header_length)
+		return 0;
+	uint64_t fields[11] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	const uint8_t *field = buff + V2_PREFIX_SIZE;
+	const uint8_t *end = buff + header_length;
+	for (size_t i = 0; i < 11 && field != end; ++i) {
+		if (!get_varint(field, end, fields[i]))
+			return -1;
+	}
+	// The 32 bit fields have to fit.
+	for (size_t i = 1; i < 11; ++i) {
+		if (i != 5 && fields[i] > 0xFFFFFFFF)
+			return -1;
+	}
+	if (fields[6] > MAX_CHUNK_SIZE)
+		return -1;
+	out_header.version = 2;
+	out_header.message_type = buff[1];
+	out_header.file_handle = fields[0];
+	out_header.num_chunks = fields[1];
+	out_header.chunk_request_begin_idx = fields[2];
+	out_header.chunk_request_end_idx = fields[3];
+	out_header.current_chunk_idx = fields[4];
+	out_payload_length = fields[5];
+	out_header.chunk_size = fields[6];
+	out_header.block_offset = fields[7];
+	out_header.block_size = fields[8];
+	out_header.compression = fields[9];
+	// A compressed payload is compressed_size long on the wire.
+	if (out_header.message_type == PeerMessageType::CHUNK_RESPONSE &&
+	    out_header.compression != 0) {
+		if (out_payload_length > 0xFFFFFFFF)
+			return -1;
+		out_header.compressed_size = out_payload_length;
+		out_header.current_chunk_size = fields[10];
+	}
+	return header_length;
+}
+
+bool Peer::send_or_recv_socket(int sock, uint8_t *buff, size_t len,
 			       ssize_t (*sock_func)(int sock, void *buff,
 						    size_t len))
 {
 	// A lot of pain was solved by reading this...
 	// https://stackoverflow.com/questions/14399691/send-not-deliver-all-bytes
-	uint32_t bytes_left = len;
-	uint8_t *read_ptr = container.data();
+	size_t bytes_left = len;
+	uint8_t *read_ptr = buff;
 	while (bytes_left > 0) {
 		// Try to read/write it all in at once (unlikely)
 		ssize_t bytes_done = sock_func(sock, read_ptr, bytes_left);
 		if (bytes_done < 0) {
+			if (errno == EINTR)
+				continue;
 			std::cout << "Unable to send or receive on socket.\n";
 			return false;
 		} else if (bytes_done == 0) {
@@ -160,6 +601,24 @@ bool Peer::send_or_recv_socket(int sock, T &container, size_t len,
 	return true;
 }
 
+template <typename T>
+bool Peer::send_or_recv_socket(int sock, T &container, size_t len,
+			       ssize_t (*sock_func)(int sock, void *buff,
+						    size_t len))
+{
+	return send_or_recv_socket(sock, container.data(), len, sock_func);
+}
+
+// Write all len bytes of buff to the socket.
+
+// :return: false on failure
+bool Peer::send_all(int sock, const uint8_t *buff, size_t len)
+{
+	return send_or_recv_socket(
+		sock, const_cast<uint8_t *>(buff), len,
+		(ssize_t(*)(int sock, void *buff, size_t len))write);
+}
+
 // Returns the pieces of the message extracted from the header, as well as
 // writes the chunk to the chunks folder passed if this is a CHUNK_RESPONSE
 // message. Where the filename is the chunk index number.p2p
@@ -171,52 +630,270 @@ bool Peer::read_message(const int socket, uint8_t &out_message_type,
 			uint32_t &out_chunk_request_end_idx,
 			uint32_t &out_current_chunk_idx,
 			uint32_t &out_current_chunk_size, const bool listener,
-			const std::string &temp_chunk_dir)
+			const std::string &temp_chunk_dir,
+			const int destination_fd)
 {
+	PeerHeader header;
+	if (!read_message(socket, header, listener, destination_fd,
+			  temp_chunk_dir)) {
+		return false;
+	}
+	out_message_type = header.message_type;
+	out_file_name = std::move(header.file_name);
+	out_num_chunks = header.num_chunks;
+	out_chunk_request_begin_idx = header.chunk_request_begin_idx;
+	out_chunk_request_end_idx = header.chunk_request_end_idx;
+	out_current_chunk_idx = header.current_chunk_idx;
+	out_current_chunk_size = header.current_chunk_size;
+	return true;
+}
+
+// Read the next message in whichever wire version it was sent with. A
+// CHUNK_RESPONSE payload is handled as in the other read_message, except that it
+// lands in destination_fd at chunk_idx * chunk_size + block_offset, any other v2
+// payload lands in out_header.payload.
+
+// :return: false on failure
+bool Peer::read_message(const int socket, PeerHeader &out_header,
+			const bool listener, const int destination_fd,
+			const std::string &temp_chunk_dir,
+			const uint32_t chunk_size)
+{
+	out_header = PeerHeader();
 	PeerMessage m;
-	// Read in the header
-	if (!send_or_recv_socket(socket, m, m.size(), read)) {
+	// The first byte tells us which wire version the message is framed with.
+	if (!send_or_recv_socket(socket, m, 1, read)) {
 		return false;
 	}
-	deserialize_message_header(m, out_message_type, out_file_name,
-				   out_num_chunks, out_chunk_request_begin_idx,
-				   out_chunk_request_end_idx,
-				   out_current_chunk_idx,
-				   out_current_chunk_size);
-	// Check if this is a Chunk response message and make sure we are not a
-	// seeder.
-	if (out_message_type == PeerMessageType::CHUNK_RESPONSE && !listener) {
-		// Chunk buffer
-		std::vector<uint8_t> chunk(CHUNK_SIZE);
-		// A lot of pain was solved by reading this...
-		// https://stackoverflow.com/questions/14399691/send-not-deliver-all-bytes
-		// read in the chunk
-		if (!send_or_recv_socket(socket, chunk, out_current_chunk_size,
+	uint64_t payload_length = 0;
+	if (m[0] == V2_MARKER) {
+		// Read the rest of the prefix, then the fields it says follow it.
+		if (!send_or_recv_socket(socket, &m[1], V2_PREFIX_SIZE - 1,
+					 read) ||
+		    !send_or_recv_socket(socket, &m[V2_PREFIX_SIZE], m[2],
 					 read)) {
 			return false;
 		}
-		// Build the chunk filename
-		std::stringstream filename;
-		filename << temp_chunk_dir << out_current_chunk_idx
-			 << FILE_EXTENSION;
-		// Open the temp file for the chunk
-		int chunk_fid = open(filename.str().c_str(),
-				     O_CREAT | O_WRONLY | O_TRUNC, 0644);
-		// Make sure we were able to open the file.
-		if (chunk_fid < 0) {
-			std::cerr
-				<< "Error. Unable to write chunk to temp chunk file.\n";
+		if (decode_header_v2(m.data(), V2_PREFIX_SIZE + m[2],
+				     out_header, payload_length) <= 0) {
+			std::cerr << "Error. Malformed v2 message header.\n";
 			return false;
 		}
-		// Write it to the temp file
-		if (write(chunk_fid, chunk.data(), out_current_chunk_size) <
-		    out_current_chunk_size) {
-			std::cerr
-				<< "Error while writing chunk to temp file.\n";
-			close(chunk_fid);
+		if (out_header.message_type == PeerMessageType::CHUNK_RESPONSE) {
+			if (payload_length > MAX_CHUNK_SIZE) {
+				std::cerr
+					<< "Error. Chunk is larger than MAX_CHUNK_SIZE.\n";
+				return false;
+			}
+			// A compressed payload has to be one we can take in.
+			if (out_header.compression != 0 &&
+			    (out_header.compression != LZ4_COMPRESSION ||
+			     out_header.current_chunk_size >
+				     MAX_COMPRESSED_BLOCK ||
+			     out_header.compressed_size >
+				     Compression::bound(
+					     out_header.current_chunk_size))) {
+				std::cerr << "Error. Unsupported compressed "
+					     "chunk.\n";
+				return false;
+			}
+			if (out_header.compression == 0)
+				out_header.current_chunk_size = payload_length;
+			payload_length = 0;
+		}
+	} else {
+		// Read in the rest of the v1 header
+		if (!send_or_recv_socket(socket, &m[1], m.size() - 1, read)) {
 			return false;
 		}
+		decode_header_v1(m, out_header);
+	}
+	// Pull in the payload of any other v2 message
+	if (payload_length > 0) {
+		if (payload_length > MAX_CONTROL_PAYLOAD) {
+			std::cerr << "Error. Message payload is too large.\n";
+			return false;
+		}
+		out_header.payload.resize(payload_length);
+		if (!send_or_recv_socket(socket, out_header.payload,
+					 payload_length, read)) {
+			return false;
+		}
+		if (out_header.message_type == PeerMessageType::FILE_REQUEST) {
+			out_header.file_name.assign(out_header.payload.begin(),
+						    out_header.payload.end());
+		}
+	}
+	if (out_header.message_type != PeerMessageType::CHUNK_RESPONSE) {
+		return true;
+	}
+	// A seeder never asks for chunks, so it has nowhere to put one. The
+	// payload of a v2 message would leave us mid stream.
+	if (listener) {
+		if (out_header.version >= 2 && out_header.current_chunk_size > 0) {
+			std::cerr << "Error. Unexpected chunk payload.\n";
+			return false;
+		}
+		return true;
+	}
+	// The payload has to fit in the chunk it says it is part of.
+	if ((uint64_t)out_header.block_offset + out_header.current_chunk_size >
+	    chunk_size) {
+		std::cerr << "Error. Chunk is larger than its chunk size.\n";
+		return false;
+	}
+	// Stream the chunk straight to where it belongs in the destination file
+	if (destination_fd >= 0) {
+		const off_t offset =
+			(off_t)out_header.current_chunk_idx * chunk_size +
+			out_header.block_offset;
+		if (out_header.compression != 0) {
+			return receive_compressed(socket, destination_fd, offset,
+						  out_header.compression,
+						  out_header.compressed_size,
+						  out_header.current_chunk_size);
+		}
+		return receive_to_file(socket, destination_fd, offset,
+				       out_header.current_chunk_size);
+	}
+	// Build the chunk filename
+	std::stringstream filename;
+	filename << temp_chunk_dir << out_header.current_chunk_idx
+		 << FILE_EXTENSION;
+	// Open the temp file for the chunk
+	int chunk_fid =
+		open(filename.str().c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+	// Make sure we were able to open the file.
+	if (chunk_fid < 0) {
+		std::cerr << "Error. Unable to write chunk to temp chunk file.\n";
+		return false;
+	}
+	// Stream it into the temp file
+	if (out_header.compression != 0 ?
+		    !receive_compressed(socket, chunk_fid, 0,
+					out_header.compression,
+					out_header.compressed_size,
+					out_header.current_chunk_size) :
+		    !receive_to_file(socket, chunk_fid, 0,
+				     out_header.current_chunk_size)) {
+		std::cerr << "Error while writing chunk to temp file.\n";
 		close(chunk_fid);
+		return false;
+	}
+	close(chunk_fid);
+	return true;
+}
+
+// Stream len bytes of payload from the socket into the file at offset, at most
+// one receive slice at a time, through the io_backend.
+
+// :return: false on failure
+bool Peer::receive_to_file(const int socket, const int file_fd, off_t offset,
+			   size_t len)
+{
+#ifndef P2P_NO_IO_URING
+	if (io_backend == IO_URING) {
+		IoStream *stream =
+			IoStream::for_this_thread(receive_slice_size.load());
+		if (stream != nullptr)
+			return stream->copy(socket, -1, file_fd, offset, len);
+	}
+#endif
+	// Slices are always the same size so that they recycle through the pool.
+	PooledBuffer slice =
+		BufferPool::instance().acquire(receive_slice_size.load());
+	if (slice.data() == nullptr)
+		return false;
+	while (len > 0) {
+		// Take whatever has arrived, up to a slice, and pass it on.
+		ssize_t bytes_read =
+			read(socket, slice.data(), std::min(len, slice.size()));
+		if (bytes_read < 0) {
+			if (errno == EINTR)
+				continue;
+			std::cout << "Unable to send or receive on socket.\n";
+			return false;
+		} else if (bytes_read == 0) {
+			std::cout << "Socket Disconnected.\n";
+			return false;
+		}
+		if (!write_at(file_fd, slice.data(), bytes_read, offset))
+			return false;
+		offset += bytes_read;
+		len -= bytes_read;
+	}
+	return true;
+}
+
+// Read a CHUNK_RESPONSE payload compressed with codec, compressed_size bytes
+// long, and write it into the file at offset decompressed, len bytes long.
+
+// :return: false on failure
+bool Peer::receive_compressed(const int socket, const int file_fd,
+			      const off_t offset, const uint32_t codec,
+			      const uint32_t compressed_size, const uint32_t len)
+{
+	// One buffer for the block, followed by room for the largest it could
+	// come in at compressed. Holding two buffers from the pool at once could
+	// wait forever on threads doing the same.
+	PooledBuffer buffer =
+		BufferPool::instance().acquire(len + Compression::bound(len));
+	if (buffer.data() == nullptr)
+		return false;
+	uint8_t *block = buffer.data();
+	uint8_t *compressed = buffer.data() + len;
+	if (!send_or_recv_socket(socket, compressed, compressed_size, read))
+		return false;
+	if (codec != LZ4_COMPRESSION ||
+	    !Compression::decompress(compressed, compressed_size, block, len)) {
+		std::cerr << "Error. Unable to decompress chunk.\n";
+		return false;
+	}
+	return write_at(file_fd, block, len, offset);
+}
+
+// Write len bytes of buff into the file at offset, without moving the file's
+// position, so several threads can fill the same file at once.
+
+// :return: false on failure
+bool Peer::write_at(const int file_fd, const uint8_t *buff, size_t len,
+		    off_t offset)
+{
+	while (len > 0) {
+		ssize_t bytes_written = pwrite(file_fd, buff, len, offset);
+		if (bytes_written < 0) {
+			if (errno == EINTR)
+				continue;
+			std::cerr << "Error while writing chunk to file.\n";
+			return false;
+		}
+		buff += bytes_written;
+		offset += bytes_written;
+		len -= bytes_written;
+	}
+	return true;
+}
+
+// Stream len bytes of the file starting at offset straight to the socket with
+// sendfile(2), so the payload never gets staged in userspace.
+
+// :return: false on failure
+bool Peer::send_file_range(const int socket, const int file_fd, off_t offset,
+			   size_t len)
+{
+	while (len > 0) {
+		ssize_t bytes_sent = sendfile(socket, file_fd, &offset, len);
+		if (bytes_sent < 0) {
+			if (errno == EINTR)
+				continue;
+			std::cout << "Unable to send file range on socket.\n";
+			return false;
+		} else if (bytes_sent == 0) {
+			// The file got shorter underneath us.
+			std::cout << "Unexpected end of file while sending chunk.\n";
+			return false;
+		}
+		len -= bytes_sent;
 	}
 	return true;
 }
@@ -232,58 +909,169 @@ bool Peer::write_message(const int socket, const uint8_t message_type,
 			 const uint32_t chunk_request_begin_idx,
 			 const uint32_t chunk_request_end_idx,
 			 const uint32_t current_chunk_idx,
-			 const std::string &filename_to_send)
+			 const std::string &filename_to_send,
+			 const bool zero_copy)
+{
+	PeerHeader header(message_type);
+	header.file_name = file_name;
+	header.num_chunks = num_chunks;
+	header.chunk_request_begin_idx = chunk_request_begin_idx;
+	header.chunk_request_end_idx = chunk_request_end_idx;
+	header.current_chunk_idx = current_chunk_idx;
+	return write_message(socket, header, filename_to_send, zero_copy);
+}
+
+// Write the message in header.version. A CHUNK_RESPONSE is sent with its chunk
+// of filename_to_send as in the other write_message. When its compression
+// offers a codec, the chunk goes out compressed with it if that saves enough.
+
+// :return: false on failure
+bool Peer::write_message(const int socket, const PeerHeader &header,
+			 const std::string &filename_to_send,
+			 const bool zero_copy)
 {
 	PeerMessage m;
-	if (message_type != PeerMessageType::CHUNK_RESPONSE) {
+	size_t header_length;
+	if (header.message_type != PeerMessageType::CHUNK_RESPONSE) {
+		// A v2 FILE_REQUEST names its file in the payload, which leaves
+		// the filename without a length limit.
+		const bool name_as_payload =
+			header.version >= 2 &&
+			header.message_type == PeerMessageType::FILE_REQUEST &&
+			header.payload.empty();
+		const uint8_t *payload =
+			name_as_payload ? (const uint8_t *)header.file_name.data() :
+					  header.payload.data();
+		const size_t payload_length = name_as_payload ?
+						      header.file_name.size() :
+						      header.payload.size();
 		// Build the header
-		if (!serialize_message_header(
-			    m, message_type, file_name, num_chunks,
-			    chunk_request_begin_idx, chunk_request_end_idx,
-			    current_chunk_idx)) {
+		if (!encode_header(header, payload_length, m, header_length)) {
 			std::cerr
 				<< "Error. Unable to serialize message header.\n";
 			return false;
 		}
-		// Send the header
-		if (!send_or_recv_socket(socket, m, m.size(),
-					 (ssize_t(*)(int sock, void *buff,
-						     size_t len))write)) {
+		// Send the header and its payload
+		return send_all(socket, m.data(), header_length) &&
+		       send_all(socket, payload, payload_length);
+	}
+	const bool may_compress = header.compression & LZ4_COMPRESSION;
+	if (zero_copy && !may_compress) {
+		// Open the file, and work out how much of this chunk exists in it.
+		// The payload is handed straight from the page cache to the socket.
+		int chunk_fid = open(filename_to_send.c_str(), O_RDONLY);
+		if (chunk_fid < 0) {
+			std::cerr << "Error. Unable to read from file being shared.\n";
 			return false;
 		}
-	} else {
-		// If the message_type is a CHUNK_RESPONSE we need to read a chunk of
-		// the file from disk, and send it in this message.
-		auto chunk_tuple =
-			read_chunk(filename_to_send, current_chunk_idx);
-		bool success = std::get<0>(chunk_tuple);
-		// We were unable to successfully read in the chunk of the file
-		if (!success)
+		struct stat file_info;
+		if (fstat(chunk_fid, &file_info) < 0) {
+			std::cerr << "Error. Unable to stat file being shared.\n";
+			close(chunk_fid);
 			return false;
-		std::vector<uint8_t> chunk(std::move(std::get<1>(chunk_tuple)));
-		uint32_t actual_chunk_size = std::get<2>(chunk_tuple);
+		}
+		uint64_t offset;
+		uint32_t actual_chunk_size;
+		if (!chunk_range(header, header.current_chunk_idx,
+				 file_info.st_size, offset, actual_chunk_size)) {
+			std::cerr << "Error. chunk index out of range.\n";
+			close(chunk_fid);
+			return false;
+		}
 		// Build the header
-		if (!serialize_message_header(
-			    m, message_type, file_name, num_chunks,
-			    chunk_request_begin_idx, chunk_request_end_idx,
-			    current_chunk_idx, actual_chunk_size)) {
+		if (!encode_header(header, actual_chunk_size, m,
+				   header_length)) {
 			std::cerr
 				<< "Error. Unable to serialize message header.\n";
+			close(chunk_fid);
 			return false;
 		}
-		// Send the header
-		if (!send_or_recv_socket(socket, m, m.size(),
-					 (ssize_t(*)(int sock, void *buff,
-						     size_t len))write)) {
+		// Send the header, then the chunk behind it.
+		bool success = send_all(socket, m.data(), header_length) &&
+			       send_file_range(socket, chunk_fid, offset,
+					       actual_chunk_size);
+		close(chunk_fid);
+		return success;
+	}
+	// If the message_type is a CHUNK_RESPONSE we need to read a chunk of
+	// the file from disk, and send it in this message.
+	struct stat file_info;
+	uint64_t offset;
+	uint32_t length;
+	if (stat(filename_to_send.c_str(), &file_info) < 0 ||
+	    !chunk_range(header, header.current_chunk_idx, file_info.st_size,
+			 offset, length)) {
+		std::cerr << "Error. chunk index out of range.\n";
+		return false;
+	}
+#ifndef P2P_NO_IO_URING
+	IoStream *stream =
+		io_backend == IO_URING && !may_compress ?
+			IoStream::for_this_thread(receive_slice_size.load()) :
+			nullptr;
+	if (stream != nullptr) {
+		if (!encode_header(header, length, m, header_length)) {
+			std::cerr
+				<< "Error. Unable to serialize message header.\n";
 			return false;
 		}
-		// Send the chunk to the peer
-		if (!send_or_recv_socket(socket, chunk, actual_chunk_size,
-					 (ssize_t(*)(int sock, void *buff,
-						     size_t len))write)) {
+		// The chunk is read and sent a slice at a time.
+		int chunk_fid = open(filename_to_send.c_str(), O_RDONLY);
+		if (chunk_fid < 0) {
+			std::cerr << "Error. Unable to read from file being shared.\n";
 			return false;
 		}
+		bool success = send_all(socket, m.data(), header_length) &&
+			       stream->copy(chunk_fid, offset, socket, -1, length);
+		close(chunk_fid);
+		return success;
 	}
-	return true;
+#endif
+	PooledBuffer chunk;
+	uint32_t actual_chunk_size = 0;
+	// A chunk that may go out compressed is read into a buffer with room to
+	// compress it into behind it.
+	const bool compressible = may_compress &&
+				  length >= MIN_COMPRESSED_BLOCK &&
+				  length <= MAX_COMPRESSED_BLOCK;
+	// A block past the end of the last chunk goes out empty.
+	if (length > 0) {
+		auto chunk_tuple = read_chunk(
+			filename_to_send, offset, length,
+			compressible ? Compression::worthwhile_size(length) : 0);
+		bool success = std::get<0>(chunk_tuple);
+		// We were unable to successfully read in the chunk of the file
+		if (!success)
+			return false;
+		chunk = std::move(std::get<1>(chunk_tuple));
+		actual_chunk_size = std::get<2>(chunk_tuple);
+	}
+	// Compress the chunk if it is worth it, otherwise it goes out as it is.
+	PeerHeader response = header;
+	response.compression = NO_COMPRESSION;
+	uint8_t *compressed = chunk.data() + length;
+	size_t compressed_size = 0;
+	if (compressible && actual_chunk_size >= MIN_COMPRESSED_BLOCK) {
+		compressed_size = Compression::compress(
+			chunk.data(), actual_chunk_size, compressed,
+			Compression::worthwhile_size(actual_chunk_size));
+		if (compressed_size != 0) {
+			response.compression = LZ4_COMPRESSION;
+			response.current_chunk_size = actual_chunk_size;
+		}
+	}
+	// Build the header
+	if (!encode_header(response,
+			   compressed_size != 0 ? compressed_size :
+						  actual_chunk_size,
+			   m, header_length)) {
+		std::cerr << "Error. Unable to serialize message header.\n";
+		return false;
+	}
+	// Send the header, then the chunk to the peer
+	return send_all(socket, m.data(), header_length) &&
+	       (compressed_size != 0 ?
+			send_all(socket, compressed, compressed_size) :
+			send_all(socket, chunk.data(), actual_chunk_size));
 }
 } // namespace ApplicationLayer
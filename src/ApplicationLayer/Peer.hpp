@@ -1,9 +1,15 @@
 #pragma once
+#include "BufferPool.hpp"
+#include "Compression.hpp"
 #include <string>
 #include <array>
 #include <vector>
 #include <tuple>
 #include <cstdint>
+#include <atomic>
+extern "C" {
+#include <sys/types.h>
+}
 namespace ApplicationLayer
 {
 // Message Definition
@@ -12,16 +18,130 @@ enum PeerMessageType {
 	FILE_REQUEST = 0,
 	FILE_RESPONSE,
 	CHUNK_REQUEST,
-	CHUNK_RESPONSE
+	CHUNK_RESPONSE,
+	// v2 only from here on
+	INVENTORY_REQUEST,
+	INVENTORY_RESPONSE,
+	FILE_BATCH_REQUEST,
+	FILE_BATCH_RESPONSE,
+	HASH_REQUEST,
+	HASH_RESPONSE
 };
 
-// Chunk Size
+// Chunk Size. Every v1 transfer uses it, a v2 seeder may advertise another one
+// for each file.
 static const size_t constexpr CHUNK_SIZE = 32 * 1000 * 1000;
+// Smallest and largest chunk size a file may be split into
+static const size_t constexpr MIN_CHUNK_SIZE = 64 * 1024;
+static const size_t constexpr MAX_CHUNK_SIZE = 256 * 1024 * 1024;
+// Default amount of a chunk payload held in memory at once while receiving it
+static const size_t constexpr DEFAULT_RECEIVE_SLICE_SIZE = 1024 * 1024;
+// Smallest receive slice we allow
+static const size_t constexpr MIN_RECEIVE_SLICE_SIZE = 4096;
 // File extension
 static const constexpr char FILE_EXTENSION[] = ".p2p";
 
+// How chunk payloads are moved between sockets and files
+enum IoBackend {
+	// A blocking system call for every read and write
+	BLOCKING_IO = 0,
+	// Reads and writes go through an io_uring per thread, with the next
+	// slice read while the last is written out. Falls back to BLOCKING_IO
+	// where io_uring can't be set up.
+	IO_URING
+};
+
+// Marks a v2 message. A v1 message starts with its message_type, which is
+// always below this.
+static const uint8_t constexpr V2_MARKER = 0xB2;
+// v2 prefix: the marker, the message_type, and the length of the varint
+// fields that follow it. The fields are, in order: file_handle, num_chunks,
+// chunk_request_begin_idx, chunk_request_end_idx, current_chunk_idx, the
+// payload length, chunk_size, block_offset, block_size, and from v3 on
+// compression and the length of a compressed payload once decompressed.
+// Missing trailing fields read as 0, unknown extra fields are skipped.
+static const size_t constexpr V2_PREFIX_SIZE = 3;
+// Placed in chunk_request_begin_idx of a v1 FILE_REQUEST or FILE_RESPONSE to
+// say that chunk_request_end_idx holds the highest wire version spoken.
+static const uint32_t constexpr VERSION_HANDSHAKE_MAGIC = 0x50325032;
+// Highest wire version this build speaks. v3 is framed as v2, and adds
+// compressed CHUNK_RESPONSE payloads.
+static const uint8_t constexpr PROTOCOL_VERSION = 3;
+// Largest payload accepted on anything other than a CHUNK_RESPONSE
+static const size_t constexpr MAX_CONTROL_PAYLOAD = 1024 * 1024;
+// An INVENTORY_RESPONSE page stops taking catalog entries once it is this long
+static const size_t constexpr INVENTORY_PAGE_SIZE = 64 * 1024;
+// Most filenames asked about in one FILE_BATCH_REQUEST
+static const size_t constexpr MAX_BATCH_FILES = 1024;
+// Most bytes of filenames in one FILE_BATCH_REQUEST, leaving the response room
+// to stay under MAX_CONTROL_PAYLOAD.
+static const size_t constexpr MAX_BATCH_NAME_BYTES = MAX_CONTROL_PAYLOAD / 2;
+
+// Every field a peer message can carry, in either wire version.
+struct PeerHeader {
+	// Wire version the message is framed with (1 or 2)
+	uint8_t version;
+	uint8_t message_type;
+	// Carried in the v1 header, or as the payload of a v2 FILE_REQUEST
+	std::string file_name;
+	// Handle a v2 seeder hands out for a file in its FILE_RESPONSE, used in
+	// place of the filename from then on.
+	uint64_t file_handle;
+	// Highest wire version offered (FILE_REQUEST) or agreed on
+	// (FILE_RESPONSE). 0 if the peer didn't take part in the handshake.
+	uint8_t max_version;
+	uint32_t num_chunks;
+	uint32_t chunk_request_begin_idx;
+	uint32_t chunk_request_end_idx;
+	uint32_t current_chunk_idx;
+	// Length of the chunk payload following a CHUNK_RESPONSE
+	uint32_t current_chunk_size;
+	// v2 only. The chunk size a file is split into (FILE_RESPONSE), or that
+	// the chunk indices are counted in (CHUNK_REQUEST). 0 means CHUNK_SIZE.
+	uint32_t chunk_size;
+	// v2 only. Where in each chunk a CHUNK_REQUEST wants to start, or where
+	// the payload of a CHUNK_RESPONSE starts.
+	uint32_t block_offset;
+	// v2 only. Most bytes of each chunk a CHUNK_REQUEST wants from
+	// block_offset on. 0 means the rest of the chunk.
+	uint32_t block_size;
+	// v3 only. The CompressionCodec bits a CHUNK_REQUEST will take the
+	// payload in, or the codec a CHUNK_RESPONSE payload is compressed with.
+	// 0 means raw.
+	uint32_t compression;
+	// Length of a compressed CHUNK_RESPONSE payload on the wire.
+	// current_chunk_size is its length once decompressed.
+	uint32_t compressed_size;
+	// Payload of a v2 message other than a CHUNK_RESPONSE
+	std::vector<uint8_t> payload;
+
+	explicit PeerHeader(const uint8_t message_type = FILE_REQUEST,
+			    const uint8_t version = 1);
+};
+
+// One file a peer shares, as listed in an INVENTORY_RESPONSE or a
+// FILE_BATCH_RESPONSE.
+struct CatalogEntry {
+	std::string file_name;
+	uint64_t file_size;
+	// 0 in a FILE_BATCH_RESPONSE for a file the peer doesn't have
+	uint32_t num_chunks;
+	// Handle to name the file by in CHUNK_REQUESTs
+	uint64_t file_handle;
+	// The chunk size num_chunks is counted in. 0 means CHUNK_SIZE.
+	uint32_t chunk_size;
+	// Root of the file's HashTree, empty if the peer has none
+	std::string root_hash;
+};
+
 class Peer {
 	friend class PeerTests;
+	// How many bytes of a chunk payload may be held in memory per connection
+	// while it is streamed from the socket to its file.
+	static std::atomic<size_t> receive_slice_size;
+	// The IoBackend chunk payloads are moved with
+	static std::atomic<int> io_backend;
+
 	// Function to insert a filename string into the PeerMessage Header
 
 	// :return: false when the filename is too long
@@ -32,11 +152,14 @@ class Peer {
 	static void pull_filename(std::string &out_filename,
 				  const PeerMessage &message);
 
-	// Function to read a chunk in from a file
+	// Function to read length bytes of a file in, starting at offset. The
+	// buffer has spare bytes of room after the chunk for the caller to work
+	// in.
 
 	// :return: (whether we were successful, the chunk, the size of the chunk)
-	static std::tuple<bool, std::vector<uint8_t>, uint32_t>
-	read_chunk(const std::string &filename, const uint32_t chunk_idx);
+	static std::tuple<bool, PooledBuffer, uint32_t>
+	read_chunk(const std::string &filename, const uint64_t offset,
+		   const uint32_t length, const size_t spare = 0);
 
 	// Build a peer message to send to another peer. File name can be no longer
 	// than 255 bytes. Do not add the extra null terminator. This function will
@@ -64,15 +187,194 @@ class Peer {
 		uint32_t &out_current_chunk_idx,
 		uint32_t &out_current_chunk_size);
 
+	// Fill in a PeerHeader from a v1 header, including the version
+	// handshake fields.
+	static void decode_header_v1(const PeerMessage &message,
+				     PeerHeader &out_header);
+
+	// Encode the header in its own wire version into out_message, with
+	// payload_length bytes of payload to follow it. out_length is set to the
+	// number of bytes used.
+
+	// :return: false if the header can't be expressed in its version
+	static bool encode_header(const PeerHeader &header,
+				  const uint64_t payload_length,
+				  PeerMessage &out_message, size_t &out_length);
+
+	// Append value to out as a LEB128 varint.
+
+	// :return: the number of bytes written
+	static size_t put_varint(uint64_t value, uint8_t *out);
+
+	// Pull a LEB128 varint from in, moving it past the varint.
+
+	// :return: false if the varint runs past end or overflows 64 bits
+	static bool get_varint(const uint8_t *&in, const uint8_t *end,
+			       uint64_t &out_value);
+
+	// Append a varint length followed by the string's bytes to out.
+	static void append_string(const std::string &value,
+				  std::vector<uint8_t> &out);
+
+	// Pull a string written by append_string from in, moving it past it.
+
+	// :return: false if the string runs past end
+	static bool get_string(const uint8_t *&in, const uint8_t *end,
+			       std::string &out_value);
+
+	// Write len bytes of buff into the file at offset, without moving the
+	// file's position, so several threads can fill the same file at once.
+
+	// :return: false on failure
+	static bool write_at(const int file_fd, const uint8_t *buff,
+			     size_t len, off_t offset);
+
+	// Stream len bytes of payload from the socket into the file at offset,
+	// at most one receive slice at a time, through the io_backend.
+
+	// :return: false on failure
+	static bool receive_to_file(const int socket, const int file_fd,
+				    off_t offset, size_t len);
+
+	// Read a CHUNK_RESPONSE payload compressed with codec, compressed_size
+	// bytes long, and write it into the file at offset decompressed, len
+	// bytes long.
+
+	// :return: false on failure
+	static bool receive_compressed(const int socket, const int file_fd,
+				       const off_t offset, const uint32_t codec,
+				       const uint32_t compressed_size,
+				       const uint32_t len);
+
+	// Stream len bytes of the file starting at offset straight to the socket
+	// with sendfile(2), so the payload never gets staged in userspace.
+
+	// :return: false on failure
+	static bool send_file_range(const int socket, const int file_fd,
+				    off_t offset, size_t len);
+
+	static bool send_or_recv_socket(int sock, uint8_t *buff, size_t len,
+					ssize_t (*sock_func)(int sock, void *buff,
+							 size_t len));
+
 	template <typename T>
 	static bool send_or_recv_socket(int sock, T &container, size_t len,
 					ssize_t (*sock_func)(int sock, void *buff,
 							 size_t len));
 
+	// Write all len bytes of buff to the socket.
+
+	// :return: false on failure
+	static bool send_all(int sock, const uint8_t *buff, size_t len);
+
     public:
+	// Set how many bytes of a chunk payload may be held in memory per
+	// connection while receiving it. Clamped to
+	// [MIN_RECEIVE_SLICE_SIZE, CHUNK_SIZE].
+	static void set_receive_slice_size(const size_t slice_size);
+
+	// Move chunk payloads with backend from now on.
+
+	// :return: false if this build has no such backend
+	static bool set_io_backend(const IoBackend backend);
+
+	// The chunk size a header's chunk indices are counted in. Always
+	// CHUNK_SIZE for v1.
+	static uint32_t chunk_size_of(const PeerHeader &header);
+
+	// Work out which bytes of a file file_size long the CHUNK_RESPONSE for
+	// chunk_idx of the request carries. The range is empty if block_offset
+	// is past the end of the chunk.
+
+	// :return: false if the chunk starts past the end of the file
+	static bool chunk_range(const PeerHeader &request,
+				const uint32_t chunk_idx,
+				const uint64_t file_size, uint64_t &out_offset,
+				uint32_t &out_length);
+
+	// Work out the handle a seeder hands out for a file. The same filename
+	// always gets the same handle. Never 0.
+	static uint64_t make_file_handle(const std::string &filename);
+
+	// Decode a v2 header from the front of buff.
+
+	// :return: the number of header bytes used, 0 if more bytes are needed,
+	// or -1 if the header is malformed
+	static ssize_t decode_header_v2(const uint8_t *buff, const size_t len,
+					PeerHeader &out_header,
+					uint64_t &out_payload_length);
+
+	// Decode the next whole message from the front of buff, the way a
+	// seeder receives it. Payloads are only allowed on messages other than
+	// CHUNK_RESPONSE, and land in out_header.payload.
+
+	// :return: the number of bytes used, 0 if more bytes are needed, or -1
+	// if the message is malformed
+	static ssize_t decode_message(const uint8_t *buff, const size_t len,
+				      PeerHeader &out_header);
+
+	// Append the message in header.version to out, followed by
+	// header.payload. A CHUNK_RESPONSE header instead says chunk_size bytes
+	// of chunk follow it, which the caller sends on its own.
+
+	// :return: false if the header can't be expressed in its version
+	static bool append_message(const PeerHeader &header,
+				   std::vector<uint8_t> &out,
+				   const uint32_t chunk_size = 0);
+
+	// Append one entry to the payload of an INVENTORY_RESPONSE or
+	// FILE_BATCH_RESPONSE.
+	static void append_catalog_entry(const CatalogEntry &entry,
+					 std::vector<uint8_t> &out_payload);
+
+	// Pull every catalog entry out of an INVENTORY_RESPONSE or
+	// FILE_BATCH_RESPONSE payload.
+
+	// :return: false if the payload is malformed
+	static bool decode_catalog(const std::vector<uint8_t> &payload,
+				   std::vector<CatalogEntry> &out_entries);
+
+	// Build the payload of a FILE_BATCH_REQUEST.
+	static void encode_names(const std::vector<std::string> &names,
+				 std::vector<uint8_t> &out_payload);
+
+	// Pull the filenames out of a FILE_BATCH_REQUEST payload.
+
+	// :return: false if the payload is malformed
+	static bool decode_names(const std::vector<uint8_t> &payload,
+				 std::vector<std::string> &out_names);
+
+	// Read the next message in whichever wire version it was sent with. A
+	// CHUNK_RESPONSE payload is handled as in the other read_message, except
+	// that it lands in destination_fd at
+	// chunk_idx * chunk_size + block_offset, any other v2 payload lands in
+	// out_header.payload.
+
+	// :return: false on failure
+	static bool read_message(const int socket, PeerHeader &out_header,
+				 const bool listener = false,
+				 const int destination_fd = -1,
+				 const std::string &temp_chunk_dir = "/tmp/",
+				 const uint32_t chunk_size = CHUNK_SIZE);
+
+	// Write the message in header.version. A CHUNK_RESPONSE is sent with its
+	// chunk of filename_to_send as in the other write_message, cut down to
+	// the block the header's chunk_size, block_offset and block_size name.
+
+	// :return: false on failure
+	static bool write_message(const int socket, const PeerHeader &header,
+				  const std::string &filename_to_send = "",
+				  const bool zero_copy = true);
+
 	// Returns the pieces of the message extracted from the header, as well as
 	// writes the chunk to the chunks folder passed if this is a CHUNK_RESPONSE
 	// message. Where the filename is the chunk index number.p2p
+	// If destination_fd is a valid descriptor the chunk is instead written
+	// straight into that file at chunk_idx * CHUNK_SIZE, and temp_chunk_dir
+	// is ignored.
+	// The chunk is streamed through a buffer of at most the receive slice
+	// size, never held in memory whole. The buffer comes from the process
+	// wide BufferPool.
 
 	// :return: false on failure
 	static bool read_message(const int socket, uint8_t &out_message_type,
@@ -83,11 +385,14 @@ class Peer {
 				 uint32_t &out_current_chunk_idx,
 				 uint32_t &out_current_chunk_size,
 				 const bool listener = false,
-				 const std::string &temp_chunk_dir = "/tmp/");
+				 const std::string &temp_chunk_dir = "/tmp/",
+				 const int destination_fd = -1);
 
 	// Write the message to the client socket passed. If this is a Chunk
 	// Response message then the corresponding chunk of the file will also be
-	// sent to the client as the message payload.
+	// sent to the client as the message payload. With zero_copy the payload is
+	// streamed from the file to the socket by the kernel, otherwise it is
+	// read into a buffer and written out from there.
 
 	// :return: false on failure
 	static bool write_message(const int socket, const uint8_t message_type,
@@ -96,6 +401,7 @@ class Peer {
 				  const uint32_t chunk_request_begin_idx = 0,
 				  const uint32_t chunk_request_end_idx = 0,
 				  const uint32_t current_chunk_idx = 0,
-				  const std::string &filename_to_send = "");
+				  const std::string &filename_to_send = "",
+				  const bool zero_copy = true);
 };
 } // namespace ApplicationLayer
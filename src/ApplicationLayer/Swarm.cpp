@@ -1,6 +1,9 @@
 #include "Swarm.hpp"
+#include <cerrno>
+#include <algorithm>
 extern "C" {
 #include <unistd.h>
+#include <arpa/inet.h>
 }
 
 namespace ApplicationLayer
@@ -21,6 +24,24 @@ void Swarm::build_message(const uint8_t mode, const uint32_t addr,
 	message[6] = ((uint8_t *)(&port))[1];
 }
 
+// Read exactly length bytes from socket into out, however many reads that
+// takes.
+// :return: false if the socket closed or failed first
+bool Swarm::read_exact(const int socket, uint8_t *out, const size_t length)
+{
+	size_t bytes_read = 0;
+	while (bytes_read < length) {
+		ssize_t result =
+			read(socket, out + bytes_read, length - bytes_read);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			return false;
+		bytes_read += result;
+	}
+	return true;
+}
+
 // Read in a message from the client, consisting of a mode, address, and port
 // from client_socket passed, and write it to each of the out parameters passed.
 bool Swarm::read_message(const int client_socket, uint8_t &out_mode,
@@ -28,8 +49,8 @@ bool Swarm::read_message(const int client_socket, uint8_t &out_mode,
 			 SwarmMessage &out_client_pair)
 {
 	// Read it in from the client
-	if (read(client_socket, out_client_pair.data(),
-		 out_client_pair.size()) < (ssize_t)(out_client_pair.size())) {
+	if (!read_exact(client_socket, out_client_pair.data(),
+			out_client_pair.size())) {
 		return false;
 	}
 	// Pull the mode from the message
@@ -50,4 +71,305 @@ bool Swarm::write_message(const int client_socket,
 	}
 	return true;
 }
+
+// Read the payload of a tracker message, whose header came back from
+// read_message with length in place of the address.
+// :return: Whether read was successful
+bool Swarm::read_payload(const int socket, const uint32_t length,
+			 std::vector<uint8_t> &out_payload)
+{
+	if (length > MAX_SWARM_PAYLOAD) {
+		return false;
+	}
+	out_payload.resize(length);
+	return read_exact(socket, out_payload.data(), length);
+}
+
+// Append a tracker message, its header followed by its payload, to out.
+// :return: false if the payload is too large
+bool Swarm::append_payload_message(const uint8_t mode, const uint16_t query_id,
+				   const std::vector<uint8_t> &payload,
+				   std::vector<uint8_t> &out)
+{
+	if (payload.size() > MAX_SWARM_PAYLOAD) {
+		return false;
+	}
+	SwarmMessage header;
+	build_message(mode, htonl(payload.size()), htons(query_id), header);
+	out.insert(out.end(), header.begin(), header.end());
+	out.insert(out.end(), payload.begin(), payload.end());
+	return true;
+}
+
+// Write a tracker message, its header followed by its payload.
+// :return: Whether write was successful
+bool Swarm::write_payload_message(const int socket, const uint8_t mode,
+				  const uint16_t query_id,
+				  const std::vector<uint8_t> &payload)
+{
+	// Send the header and payload together, so that they can't be split up
+	// by other writers of the same socket.
+	std::vector<uint8_t> message;
+	if (!append_payload_message(mode, query_id, payload, message)) {
+		return false;
+	}
+	size_t bytes_written = 0;
+	while (bytes_written < message.size()) {
+		ssize_t result = write(socket, message.data() + bytes_written,
+				       message.size() - bytes_written);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			return false;
+		bytes_written += result;
+	}
+	return true;
+}
+
+// Pull a 16, 32 or 64 bit network byte order field from in, moving it past the
+// field.
+
+// :return: false if the field runs past end
+template <typename T>
+bool Swarm::get_field(const uint8_t *&in, const uint8_t *end, T &out_value)
+{
+	if ((size_t)(end - in) < sizeof(T)) {
+		return false;
+	}
+	out_value = 0;
+	for (size_t i = 0; i < sizeof(T); ++i) {
+		out_value = (out_value << 8) | *in++;
+	}
+	return true;
+}
+
+// Append a network byte order field to out.
+template <typename T>
+void Swarm::put_field(const T value, std::vector<uint8_t> &out)
+{
+	for (size_t i = sizeof(T); i > 0; --i) {
+		out.push_back((uint8_t)(value >> (8 * (i - 1))));
+	}
+}
+
+// Build the payload of an ANNOUNCE_FILES message. Each file is its filename
+// length (2 bytes), the filename, and its number of chunks (4 bytes).
+void Swarm::encode_files(const std::vector<SwarmFile> &files,
+			 std::vector<uint8_t> &out_payload)
+{
+	out_payload.clear();
+	for (auto &file : files) {
+		// Filenames are never longer than 255 bytes on disk.
+		if (file.file_name.size() > 0xFFFF)
+			continue;
+		put_field<uint16_t>(file.file_name.size(), out_payload);
+		out_payload.insert(out_payload.end(), file.file_name.begin(),
+				   file.file_name.end());
+		put_field<uint32_t>(file.num_chunks, out_payload);
+	}
+}
+
+// Pull the files out of an ANNOUNCE_FILES payload.
+// :return: false if the payload is malformed
+bool Swarm::decode_files(const std::vector<uint8_t> &payload,
+			 std::vector<SwarmFile> &out_files)
+{
+	out_files.clear();
+	const uint8_t *in = payload.data();
+	const uint8_t *end = in + payload.size();
+	while (in != end) {
+		uint16_t name_length;
+		SwarmFile file;
+		if (!get_field(in, end, name_length) ||
+		    (size_t)(end - in) < name_length) {
+			return false;
+		}
+		file.file_name.assign(in, in + name_length);
+		in += name_length;
+		if (!get_field(in, end, file.num_chunks)) {
+			return false;
+		}
+		out_files.push_back(std::move(file));
+	}
+	return true;
+}
+
+// Build the payload of a HOLDERS message. Each holder is its address (4
+// bytes), port (2 bytes), and the number of chunks it has (4 bytes).
+void Swarm::encode_holders(const std::vector<SwarmHolder> &holders,
+			   std::vector<uint8_t> &out_payload)
+{
+	out_payload.clear();
+	for (auto &holder : holders) {
+		put_field<uint32_t>(ntohl(std::get<0>(holder)), out_payload);
+		put_field<uint16_t>(ntohs(std::get<1>(holder)), out_payload);
+		put_field<uint32_t>(std::get<2>(holder), out_payload);
+	}
+}
+
+// Pull the holders out of a HOLDERS payload.
+// :return: false if the payload is malformed
+bool Swarm::decode_holders(const std::vector<uint8_t> &payload,
+			   std::vector<SwarmHolder> &out_holders)
+{
+	out_holders.clear();
+	const uint8_t *in = payload.data();
+	const uint8_t *end = in + payload.size();
+	while (in != end) {
+		uint32_t address;
+		uint16_t port;
+		uint32_t num_chunks;
+		if (!get_field(in, end, address) || !get_field(in, end, port) ||
+		    !get_field(in, end, num_chunks)) {
+			return false;
+		}
+		out_holders.push_back(
+			std::make_tuple(htonl(address), htons(port), num_chunks));
+	}
+	return true;
+}
+
+// Append the SNAPSHOT frames listing members, followed by a SNAPSHOT_END
+// carrying view, to out. Each member is its address (4 bytes) and port (2
+// bytes).
+void Swarm::append_snapshot(const std::vector<SwarmMember> &members,
+			    const SwarmView &view, std::vector<uint8_t> &out)
+{
+	static const size_t constexpr MEMBER_SIZE = 4 + 2;
+	static const size_t constexpr MEMBERS_PER_FRAME =
+		MAX_SWARM_PAYLOAD / MEMBER_SIZE;
+	std::vector<uint8_t> payload;
+	size_t begin = 0;
+	// Always one frame, so that the peer knows a snapshot is coming even if
+	// the swarm is empty.
+	do {
+		const size_t end = std::min(members.size(),
+					    begin + MEMBERS_PER_FRAME);
+		payload.clear();
+		payload.reserve((end - begin) * MEMBER_SIZE);
+		for (size_t i = begin; i < end; ++i) {
+			put_field<uint32_t>(ntohl(std::get<0>(members[i])),
+					    payload);
+			put_field<uint16_t>(ntohs(std::get<1>(members[i])),
+					    payload);
+		}
+		append_payload_message(SwarmMessageType::SNAPSHOT, 0, payload,
+				       out);
+		begin = end;
+	} while (begin < members.size());
+	encode_view(view, payload);
+	append_payload_message(SwarmMessageType::SNAPSHOT_END, 0, payload, out);
+}
+
+// Pull the members out of a SNAPSHOT payload, appending them to out_members.
+// :return: false if the payload is malformed
+bool Swarm::decode_snapshot(const std::vector<uint8_t> &payload,
+			    std::vector<SwarmMember> &out_members)
+{
+	const uint8_t *in = payload.data();
+	const uint8_t *end = in + payload.size();
+	while (in != end) {
+		uint32_t address;
+		uint16_t port;
+		if (!get_field(in, end, address) || !get_field(in, end, port)) {
+			return false;
+		}
+		out_members.push_back(
+			std::make_tuple(htonl(address), htons(port)));
+	}
+	return true;
+}
+
+// Append the CHANGES frames numbered first_seq onwards to out. Each frame is
+// the epoch (4 bytes) and the seq of its first change (8 bytes), followed by
+// each change's mode (1 byte), address (4 bytes) and port (2 bytes).
+void Swarm::append_changes(const uint32_t epoch, const uint64_t first_seq,
+			   const std::vector<SwarmChange> &changes,
+			   std::vector<uint8_t> &out)
+{
+	static const size_t constexpr CHANGE_SIZE = 1 + 4 + 2;
+	static const size_t constexpr CHANGES_PER_FRAME =
+		(MAX_SWARM_PAYLOAD - 4 - 8) / CHANGE_SIZE;
+	std::vector<uint8_t> payload;
+	for (size_t begin = 0; begin < changes.size();
+	     begin += CHANGES_PER_FRAME) {
+		const size_t end = std::min(changes.size(),
+					    begin + CHANGES_PER_FRAME);
+		payload.clear();
+		payload.reserve(4 + 8 + (end - begin) * CHANGE_SIZE);
+		put_field<uint32_t>(epoch, payload);
+		put_field<uint64_t>(first_seq + begin, payload);
+		for (size_t i = begin; i < end; ++i) {
+			payload.push_back(changes[i].mode);
+			put_field<uint32_t>(ntohl(changes[i].address), payload);
+			put_field<uint16_t>(ntohs(changes[i].port), payload);
+		}
+		append_payload_message(SwarmMessageType::CHANGES, 0, payload,
+				       out);
+	}
+}
+
+// Pull the changes out of a CHANGES payload.
+// :return: false if the payload is malformed
+bool Swarm::decode_changes(const std::vector<uint8_t> &payload,
+			   uint32_t &out_epoch, uint64_t &out_first_seq,
+			   std::vector<SwarmChange> &out_changes)
+{
+	out_changes.clear();
+	const uint8_t *in = payload.data();
+	const uint8_t *end = in + payload.size();
+	if (!get_field(in, end, out_epoch) || !get_field(in, end, out_first_seq))
+		return false;
+	while (in != end) {
+		SwarmChange change;
+		change.mode = *in++;
+		if ((change.mode != SwarmMessageType::ADD &&
+		     change.mode != SwarmMessageType::REMOVE) ||
+		    !get_field(in, end, change.address) ||
+		    !get_field(in, end, change.port)) {
+			return false;
+		}
+		change.address = htonl(change.address);
+		change.port = htons(change.port);
+		out_changes.push_back(change);
+	}
+	return true;
+}
+
+// Build the payload of a SYNC, SNAPSHOT_END or DIGEST message: the epoch (4
+// bytes), seq (8 bytes), number of members (4 bytes), and digest (8 bytes).
+void Swarm::encode_view(const SwarmView &view,
+			std::vector<uint8_t> &out_payload)
+{
+	out_payload.clear();
+	put_field<uint32_t>(view.epoch, out_payload);
+	put_field<uint64_t>(view.seq, out_payload);
+	put_field<uint32_t>(view.num_members, out_payload);
+	put_field<uint64_t>(view.digest, out_payload);
+}
+
+// Pull the view out of a SYNC, SNAPSHOT_END or DIGEST payload.
+// :return: false if the payload is malformed
+bool Swarm::decode_view(const std::vector<uint8_t> &payload,
+			SwarmView &out_view)
+{
+	const uint8_t *in = payload.data();
+	const uint8_t *end = in + payload.size();
+	return get_field(in, end, out_view.epoch) &&
+	       get_field(in, end, out_view.seq) &&
+	       get_field(in, end, out_view.num_members) &&
+	       get_field(in, end, out_view.digest) && (in == end);
+}
+
+// What one peer adds to a SwarmView's digest. The address and port are mixed
+// (splitmix64) so that peers on neighbouring ports don't cancel each other out
+// under xor.
+uint64_t Swarm::member_digest(const uint32_t address, const uint16_t port)
+{
+	uint64_t x = ((uint64_t)ntohl(address) << 16) | ntohs(port);
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
 } // namespace ApplicationLayer
@@ -1,15 +1,101 @@
 #pragma once
 #include <cstdint>
 #include <array>
+#include <string>
+#include <tuple>
+#include <vector>
 namespace ApplicationLayer
 {
 // Message Definition
 using SwarmMessage = std::array<uint8_t, 1 + 4 + 2>;
-enum SwarmMessageType { REMOVE = 0, ADD = 1 };
+// Tracker messages (ANNOUNCE_FILES and up) use the address field for the
+// length of the payload that follows, and the port field for a query id. Both
+// are in network byte order.
+enum SwarmMessageType {
+	REMOVE = 0,
+	ADD = 1,
+	// Peer to server: every file the peer shares, replacing any earlier
+	// announcement.
+	ANNOUNCE_FILES = 2,
+	// Peer to server: the filename the peer wants the holders of
+	WHO_HAS = 3,
+	// Server to peer: the holders of the file asked about in WHO_HAS
+	HOLDERS = 4,
+	// Peer to server: join the swarm like ADD does, and be sent the peers
+	// already in it as SNAPSHOT frames instead of one ADD each. The address
+	// and port are those of the peer, as in ADD.
+	JOIN = 5,
+	// Server to peer: some of the peers in the swarm when we joined. A
+	// snapshot is always at least one frame, even for an empty swarm.
+	SNAPSHOT = 6,
+	// Server to peer: a SwarmView. Every peer in the swarm as of its seq has
+	// been sent, as a snapshot or as CHANGES since the seq we synced from.
+	SNAPSHOT_END = 7,
+	// Peer to server: a SwarmView, the epoch and seq our view is at. Sent
+	// before JOIN on a reconnect, or at any time to resync. The server
+	// answers with CHANGES since then, or a snapshot if it no longer has
+	// them, followed by SNAPSHOT_END.
+	SYNC = 8,
+	// Server to peer: peers joining and leaving, each numbered. Sent instead
+	// of ADD and REMOVE to peers that joined with JOIN.
+	CHANGES = 9,
+	// Server to peer: a SwarmView of the whole swarm, sent now and then so
+	// that peers can check their view hasn't drifted.
+	DIGEST = 10
+};
+
+// Largest tracker payload accepted
+static const size_t constexpr MAX_SWARM_PAYLOAD = 16 * 1024 * 1024;
+
+// A file a peer shares, as announced to the tracker
+struct SwarmFile {
+	std::string file_name;
+	uint32_t num_chunks;
+};
+// (address, port, num_chunks) of a peer that has a file. The address and port
+// are in network byte order.
+using SwarmHolder = std::tuple<uint32_t, uint16_t, uint32_t>;
+// (address, port) of a peer in the swarm, in network byte order
+using SwarmMember = std::tuple<uint32_t, uint16_t>;
+// A peer joining (ADD) or leaving (REMOVE) the swarm. The address and port
+// are in network byte order.
+struct SwarmChange {
+	uint8_t mode;
+	uint32_t address;
+	uint16_t port;
+};
+// Where the swarm's membership is at. Every change to it bumps seq, and epoch
+// is picked each time the server starts, so seqs from before a restart are
+// never mistaken for current ones. digest is the xor of member_digest over
+// every peer in the swarm.
+struct SwarmView {
+	uint32_t epoch;
+	uint64_t seq;
+	uint32_t num_members;
+	uint64_t digest;
+};
 
 class Swarm {
 	friend class SwarmTests;
 
+	// Read exactly length bytes from socket into out, however many reads
+	// that takes.
+	// :return: false if the socket closed or failed first
+	static bool read_exact(const int socket, uint8_t *out,
+			       const size_t length);
+
+	// Pull a 16, 32 or 64 bit network byte order field from in, moving it past
+	// the field.
+
+	// :return: false if the field runs past end
+	template <typename T>
+	static bool get_field(const uint8_t *&in, const uint8_t *end,
+			      T &out_value);
+
+	// Append a network byte order field to out.
+	template <typename T>
+	static void put_field(const T value, std::vector<uint8_t> &out);
+
     public:
 	// add the byte representation of the passed address and port (which already
 	// need to be in network byte order) to the passed SwarmMessage
@@ -17,7 +103,8 @@ class Swarm {
 				  const uint16_t port, SwarmMessage &message);
 
 	// Read in a Swarm Message, consisting of a mode, address, and port from
-	// socket passed, and write it to each of the out parameters passed.
+	// socket passed, and write it to each of the out parameters passed. Short
+	// reads are picked up where they left off.
 	// :return: Whether read was successful
 	static bool read_message(const int socket, uint8_t &out_mode,
 				 uint32_t &out_address, uint16_t &out_port,
@@ -26,5 +113,79 @@ class Swarm {
 	// Write message to passed client
 	static bool write_message(const int socket,
 				  const SwarmMessage &client_pair);
+
+	// Read the payload of a tracker message, whose header came back from
+	// read_message with length in place of the address.
+	// :return: Whether read was successful
+	static bool read_payload(const int socket, const uint32_t length,
+				 std::vector<uint8_t> &out_payload);
+
+	// Append a tracker message, its header followed by its payload, to out.
+	// :return: false if the payload is too large
+	static bool append_payload_message(const uint8_t mode,
+					   const uint16_t query_id,
+					   const std::vector<uint8_t> &payload,
+					   std::vector<uint8_t> &out);
+
+	// Write a tracker message, its header followed by its payload.
+	// :return: Whether write was successful
+	static bool write_payload_message(const int socket, const uint8_t mode,
+					  const uint16_t query_id,
+					  const std::vector<uint8_t> &payload);
+
+	// Build the payload of an ANNOUNCE_FILES message.
+	static void encode_files(const std::vector<SwarmFile> &files,
+				 std::vector<uint8_t> &out_payload);
+
+	// Pull the files out of an ANNOUNCE_FILES payload.
+	// :return: false if the payload is malformed
+	static bool decode_files(const std::vector<uint8_t> &payload,
+				 std::vector<SwarmFile> &out_files);
+
+	// Build the payload of a HOLDERS message.
+	static void encode_holders(const std::vector<SwarmHolder> &holders,
+				   std::vector<uint8_t> &out_payload);
+
+	// Pull the holders out of a HOLDERS payload.
+	// :return: false if the payload is malformed
+	static bool decode_holders(const std::vector<uint8_t> &payload,
+				   std::vector<SwarmHolder> &out_holders);
+
+	// Append the SNAPSHOT frames listing members, followed by a
+	// SNAPSHOT_END carrying view, to out. Large swarms are split over as many
+	// frames as it takes.
+	static void append_snapshot(const std::vector<SwarmMember> &members,
+				    const SwarmView &view,
+				    std::vector<uint8_t> &out);
+
+	// Pull the members out of a SNAPSHOT payload, appending them to
+	// out_members.
+	// :return: false if the payload is malformed
+	static bool decode_snapshot(const std::vector<uint8_t> &payload,
+				    std::vector<SwarmMember> &out_members);
+
+	// Append the CHANGES frames numbered first_seq onwards to out.
+	static void append_changes(const uint32_t epoch, const uint64_t first_seq,
+				   const std::vector<SwarmChange> &changes,
+				   std::vector<uint8_t> &out);
+
+	// Pull the changes out of a CHANGES payload.
+	// :return: false if the payload is malformed
+	static bool decode_changes(const std::vector<uint8_t> &payload,
+				   uint32_t &out_epoch, uint64_t &out_first_seq,
+				   std::vector<SwarmChange> &out_changes);
+
+	// Build the payload of a SYNC, SNAPSHOT_END or DIGEST message.
+	static void encode_view(const SwarmView &view,
+				std::vector<uint8_t> &out_payload);
+
+	// Pull the view out of a SYNC, SNAPSHOT_END or DIGEST payload.
+	// :return: false if the payload is malformed
+	static bool decode_view(const std::vector<uint8_t> &payload,
+				SwarmView &out_view);
+
+	// What one peer adds to a SwarmView's digest. Peers are added to and
+	// taken out of the digest by xor.
+	static uint64_t member_digest(const uint32_t address, const uint16_t port);
 };
 } // namespace ApplicationLayer
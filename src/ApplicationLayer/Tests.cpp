@@ -1,12 +1,30 @@
 #include "ApplicationLayer.hpp"
+#include "../Peer/Peers.hpp"
+#include "../Peer/ChunkScheduler.hpp"
+#include "../Peer/DownloadState.hpp"
+#include "../Peer/RateLimits.hpp"
+#include "../Peer/UploadSlots.hpp"
+#include "../Peer/PeerScores.hpp"
+#include "../Peer/ChunkCache.hpp"
+#include "../Peer/CompressedCache.hpp"
 #include <cassert>
 #include <iostream>
 #include <thread>
 #include <chrono>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <sstream>
 extern "C" {
 #include <sys/socket.h>
 #include <unistd.h>
 #include <sys/un.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
 }
 
 namespace ApplicationLayer
@@ -159,10 +177,626 @@ class PeerTests {
 		// Remove the unix socket file when done.
 		unlink(unix_socket_path.c_str());
 	}
+
+	// Make sure a v2 header survives a round trip, is far smaller than a v1
+	// header, and that a partial header asks for more bytes.
+	static void test_v2_header_serialization(void)
+	{
+		PeerHeader header(PeerMessageType::CHUNK_REQUEST, 2);
+		header.file_handle = Peer::make_file_handle("banana_soup.mp4");
+		header.chunk_request_begin_idx = 25;
+		header.chunk_request_end_idx = 65000;
+		PeerMessage m;
+		size_t length;
+		bool success = Peer::encode_header(header, 0, m, length);
+		assert(success && length < 32);
+		PeerHeader decoded;
+		uint64_t payload_length;
+		ssize_t used = Peer::decode_header_v2(m.data(), length - 1,
+						      decoded, payload_length);
+		assert(used == 0);
+		used = Peer::decode_header_v2(m.data(), length, decoded,
+					      payload_length);
+		assert((used == (ssize_t)length) && (decoded.version == 2) &&
+		       (decoded.message_type == PeerMessageType::CHUNK_REQUEST) &&
+		       (decoded.file_handle == header.file_handle) &&
+		       (decoded.chunk_request_begin_idx == 25) &&
+		       (decoded.chunk_request_end_idx == 65000) &&
+		       (payload_length == 0));
+	}
+
+	// Make sure the version handshake rides along in a v1 FILE_RESPONSE, and
+	// that a v2 chunk can then be sent by handle.
+	static void test_version_handshake(void)
+	{
+		int sockets[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1) {
+			std::cerr << "Error creating test socket pair.\n";
+			return;
+		}
+		PeerHeader response(PeerMessageType::FILE_RESPONSE);
+		response.num_chunks = 2;
+		response.max_version = PROTOCOL_VERSION;
+		response.file_handle = 0x123456789abcdef0ULL;
+		bool success = Peer::write_message(sockets[0], response);
+		assert(success);
+		PeerHeader received;
+		success = Peer::read_message(sockets[1], received, true);
+		assert(success && (received.version == 1) && (received.num_chunks == 2) &&
+		       (received.max_version == PROTOCOL_VERSION) &&
+		       (received.file_handle == response.file_handle));
+		// Now a v2 chunk response for the handle
+		static const std::string &destination_path = "v2_chunk";
+		int destination_fd = open(destination_path.c_str(),
+					  O_CREAT | O_RDWR | O_TRUNC, 0644);
+		assert(destination_fd >= 0);
+		PeerHeader chunk(PeerMessageType::CHUNK_RESPONSE, 2);
+		chunk.file_handle = received.file_handle;
+		chunk.current_chunk_idx = 1;
+		auto sender = std::thread([&] {
+			bool sent = Peer::write_message(sockets[0], chunk,
+							"../test_file");
+			assert(sent);
+		});
+		success = Peer::read_message(sockets[1], received, false,
+					     destination_fd);
+		sender.join();
+		assert(success);
+		struct stat file_info;
+		fstat(destination_fd, &file_info);
+		assert((received.version == 2) &&
+		       (received.file_handle == chunk.file_handle) &&
+		       (received.current_chunk_idx == 1) &&
+		       (received.current_chunk_size > 0) &&
+		       (file_info.st_size ==
+			(off_t)CHUNK_SIZE + received.current_chunk_size));
+		close(destination_fd);
+		unlink(destination_path.c_str());
+		close(sockets[0]);
+		close(sockets[1]);
+	}
+
+	// Make sure messages built into a buffer decode from one, in either
+	// version, and only once they have arrived whole.
+	static void test_buffered_messages(void)
+	{
+		std::vector<uint8_t> buff;
+		PeerHeader request(PeerMessageType::FILE_REQUEST);
+		request.file_name = "banana_soup.mp4";
+		request.max_version = PROTOCOL_VERSION;
+		bool success = Peer::append_message(request, buff);
+		assert(success && (buff.size() == PeerMessage().size()));
+		PeerHeader batch(PeerMessageType::FILE_BATCH_REQUEST, 2);
+		Peer::encode_names({ "a", "b" }, batch.payload);
+		success = Peer::append_message(batch, buff);
+		assert(success);
+		PeerHeader decoded;
+		ssize_t used = Peer::decode_message(buff.data(), buff.size(),
+						    decoded);
+		assert((used == (ssize_t)PeerMessage().size()) &&
+		       (decoded.file_name == request.file_name) &&
+		       (decoded.max_version == PROTOCOL_VERSION));
+		const uint8_t *rest = buff.data() + used;
+		const size_t rest_length = buff.size() - used;
+		used = Peer::decode_message(rest, rest_length - 1, decoded);
+		assert(used == 0);
+		used = Peer::decode_message(rest, rest_length, decoded);
+		assert((used == (ssize_t)rest_length) &&
+		       (decoded.message_type ==
+			PeerMessageType::FILE_BATCH_REQUEST) &&
+		       (decoded.payload == batch.payload));
+		// A seeder never takes a chunk payload
+		PeerHeader chunk(PeerMessageType::CHUNK_RESPONSE, 2);
+		buff.clear();
+		success = Peer::append_message(chunk, buff, 10);
+		assert(success);
+		used = Peer::decode_message(buff.data(), buff.size(), decoded);
+		assert(used == -1);
+	}
+
+	// Make sure catalog entries and filename batches survive a trip through
+	// a v2 message, and that a cut off payload is rejected.
+	static void test_catalog_payloads(void)
+	{
+		int sockets[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1) {
+			std::cerr << "Error creating test socket pair.\n";
+			return;
+		}
+		std::vector<CatalogEntry> entries = {
+			{ "banana_soup.mp4", 40000000, 2,
+			  Peer::make_file_handle("banana_soup.mp4"), 0,
+			  std::string(HASH_SIZE, 'r') },
+			{ "missing.txt", 0, 0, 0 }
+		};
+		PeerHeader response(PeerMessageType::INVENTORY_RESPONSE, 2);
+		response.num_chunks = entries.size();
+		response.chunk_request_end_idx = entries.size();
+		for (auto &entry : entries)
+			Peer::append_catalog_entry(entry, response.payload);
+		bool success = Peer::write_message(sockets[0], response);
+		assert(success);
+		PeerHeader received;
+		success = Peer::read_message(sockets[1], received, true);
+		assert(success && (received.version == 2) &&
+		       (received.message_type ==
+			PeerMessageType::INVENTORY_RESPONSE) &&
+		       (received.chunk_request_end_idx == 2));
+		std::vector<CatalogEntry> decoded;
+		success = Peer::decode_catalog(received.payload, decoded);
+		assert(success && (decoded.size() == 2));
+		for (size_t i = 0; i < decoded.size(); ++i) {
+			assert((decoded[i].file_name == entries[i].file_name) &&
+			       (decoded[i].file_size == entries[i].file_size) &&
+			       (decoded[i].num_chunks == entries[i].num_chunks) &&
+			       (decoded[i].file_handle == entries[i].file_handle) &&
+			       (decoded[i].root_hash == entries[i].root_hash));
+		}
+		received.payload.pop_back();
+		success = Peer::decode_catalog(received.payload, decoded);
+		assert(!success);
+		std::vector<std::string> names = { "a", "", "banana_soup.mp4" };
+		std::vector<uint8_t> payload;
+		Peer::encode_names(names, payload);
+		std::vector<std::string> decoded_names;
+		success = Peer::decode_names(payload, decoded_names);
+		assert(success && (decoded_names == names));
+		close(sockets[0]);
+		close(sockets[1]);
+	}
+
+	// Make sure a chunk streamed through a small receive slice lands in the
+	// destination file intact, with either I/O backend. Through io_uring
+	// the chunk is sent buffered too, so that both ends go through it.
+	static void test_streamed_chunk_receive(void)
+	{
+		const IoBackend backends[] = { BLOCKING_IO, IO_URING };
+		for (const IoBackend backend : backends) {
+			if (!Peer::set_io_backend(backend))
+				continue;
+			int sockets[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1) {
+				std::cerr << "Error creating test socket pair.\n";
+				return;
+			}
+			static const std::string &destination_path =
+				"streamed_chunk";
+			int destination_fd =
+				open(destination_path.c_str(),
+				     O_CREAT | O_RDWR | O_TRUNC, 0644);
+			assert(destination_fd >= 0);
+			Peer::set_receive_slice_size(0);
+			assert(Peer::receive_slice_size ==
+			       MIN_RECEIVE_SLICE_SIZE);
+			auto sender = std::thread([&] {
+				bool success = Peer::write_message(
+					sockets[0],
+					PeerMessageType::CHUNK_RESPONSE,
+					"test_file", 1, 0, 0, 0, "../test_file",
+					backend == BLOCKING_IO);
+				assert(success);
+			});
+			uint8_t message_type;
+			std::string filename;
+			uint32_t garbo;
+			uint32_t current_chunk_idx;
+			uint32_t current_chunk_size;
+			bool success = Peer::read_message(
+				sockets[1], message_type, filename, garbo,
+				garbo, garbo, current_chunk_idx,
+				current_chunk_size, false, "", destination_fd);
+			sender.join();
+			assert(success && (current_chunk_idx == 0) &&
+			       (current_chunk_size == CHUNK_SIZE));
+			// Compare what landed against the source file
+			int source_fd = open("../test_file", O_RDONLY);
+			assert(source_fd >= 0);
+			std::vector<uint8_t> expected(1024 * 1024);
+			std::vector<uint8_t> actual(1024 * 1024);
+			for (off_t offset = 0; offset < (off_t)CHUNK_SIZE;
+			     offset += expected.size()) {
+				ssize_t len = pread(
+					source_fd, expected.data(),
+					std::min<size_t>(expected.size(),
+							 CHUNK_SIZE - offset),
+					offset);
+				assert(len > 0);
+				assert(pread(destination_fd, actual.data(), len,
+					     offset) == len);
+				assert(memcmp(expected.data(), actual.data(),
+					      len) == 0);
+			}
+			Peer::set_receive_slice_size(DEFAULT_RECEIVE_SLICE_SIZE);
+			close(source_fd);
+			close(destination_fd);
+			unlink(destination_path.c_str());
+			close(sockets[0]);
+			close(sockets[1]);
+		}
+		Peer::set_io_backend(BLOCKING_IO);
+	}
+
+	// Make sure a block of a chunk in a file's own chunk size is worked out,
+	// survives the v2 header and lands where it belongs.
+	static void test_block_transfer(void)
+	{
+		PeerHeader request(PeerMessageType::CHUNK_REQUEST, 2);
+		request.chunk_size = 1024 * 1024;
+		request.block_offset = 256 * 1024;
+		request.block_size = 256 * 1024;
+		uint64_t offset;
+		uint32_t length;
+		// The last chunk of the file is only 300KB long
+		bool success = Peer::chunk_range(request, 2, 2348 * 1024,
+						 offset, length);
+		assert(success && (offset == 2304 * 1024) &&
+		       (length == 44 * 1024));
+		success = Peer::chunk_range(request, 3, 2348 * 1024, offset,
+					    length);
+		assert(!success);
+		request.block_offset = 512 * 1024;
+		success = Peer::chunk_range(request, 2, 2348 * 1024, offset,
+					    length);
+		assert(success && (length == 0));
+		// Only v2 can carry a block
+		PeerMessage m;
+		size_t header_length;
+		PeerHeader decoded;
+		uint64_t payload_length;
+		success = Peer::encode_header(request, 0, m, header_length);
+		assert(success && (Peer::decode_header_v2(
+					   m.data(), header_length, decoded,
+					   payload_length) == (ssize_t)header_length) &&
+		       (decoded.chunk_size == request.chunk_size) &&
+		       (decoded.block_offset == request.block_offset) &&
+		       (decoded.block_size == request.block_size));
+		request.version = 1;
+		success = Peer::encode_header(request, 0, m, header_length);
+		assert(!success);
+		// Now the second block of chunk 1 through a socket
+		int sockets[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1) {
+			std::cerr << "Error creating test socket pair.\n";
+			return;
+		}
+		static const std::string &destination_path = "block_chunk";
+		int destination_fd = open(destination_path.c_str(),
+					  O_CREAT | O_RDWR | O_TRUNC, 0644);
+		assert(destination_fd >= 0);
+		PeerHeader block(PeerMessageType::CHUNK_RESPONSE, 2);
+		block.current_chunk_idx = 1;
+		block.chunk_size = 1024 * 1024;
+		block.block_offset = 256 * 1024;
+		block.block_size = 256 * 1024;
+		auto sender = std::thread([&] {
+			bool sent = Peer::write_message(sockets[0], block,
+							"../test_file", false);
+			assert(sent);
+		});
+		PeerHeader received;
+		success = Peer::read_message(sockets[1], received, false,
+					     destination_fd, "", block.chunk_size);
+		sender.join();
+		assert(success && (received.current_chunk_idx == 1) &&
+		       (received.block_offset == block.block_offset) &&
+		       (received.current_chunk_size == block.block_size));
+		struct stat file_info;
+		fstat(destination_fd, &file_info);
+		assert(file_info.st_size == 1536 * 1024);
+		int source_fd = open("../test_file", O_RDONLY);
+		assert(source_fd >= 0);
+		std::vector<uint8_t> expected(block.block_size);
+		std::vector<uint8_t> actual(block.block_size);
+		assert(pread(source_fd, expected.data(), expected.size(),
+			     1280 * 1024) == (ssize_t)expected.size());
+		assert(pread(destination_fd, actual.data(), actual.size(),
+			     1280 * 1024) == (ssize_t)actual.size());
+		assert(expected == actual);
+		close(source_fd);
+		close(destination_fd);
+		unlink(destination_path.c_str());
+		close(sockets[0]);
+		close(sockets[1]);
+	}
+
+	// Make sure blocks survive compression, that bad ones are turned away
+	// and noise is left raw, and that a v3 block transfer arrives compressed
+	// while v1, with no way to say so, can't carry one.
+	static void test_compressed_blocks(void)
+	{
+		// A block of repeated records compresses, and comes back intact
+		std::string records;
+		for (int i = 0; records.size() < 64 * 1024; ++i) {
+			records += std::to_string(i % 977) + ",alpha,ok\n";
+		}
+		records.resize(64 * 1024);
+		const uint8_t *raw = (const uint8_t *)records.data();
+		std::vector<uint8_t> compressed(
+			Compression::worthwhile_size(records.size()));
+		size_t compressed_size = Compression::compress(
+			raw, records.size(), compressed.data(),
+			compressed.size());
+		assert(compressed_size > 0);
+		std::vector<uint8_t> restored(records.size());
+		assert(Compression::decompress(compressed.data(),
+					       compressed_size, restored.data(),
+					       restored.size()) &&
+		       std::equal(restored.begin(), restored.end(), raw));
+		// A cut off or wrongly sized block is turned away
+		assert(!Compression::decompress(compressed.data(),
+						compressed_size - 1,
+						restored.data(),
+						restored.size()));
+		assert(!Compression::decompress(compressed.data(),
+						compressed_size, restored.data(),
+						restored.size() - 1));
+		// Noise doesn't compress enough to be worth it
+		std::vector<uint8_t> noise(64 * 1024);
+		uint32_t seed = 12345;
+		for (auto &byte : noise) {
+			seed = seed * 1103515245 + 12345;
+			byte = seed >> 24;
+		}
+		assert(Compression::compress(noise.data(), noise.size(),
+					     compressed.data(),
+					     compressed.size()) == 0);
+		// A v3 request for the block gets it back compressed
+		static const std::string &source_path = "compressible_file";
+		static const std::string &destination_path = "decompressed_file";
+		int source_fd = open(source_path.c_str(),
+				     O_CREAT | O_RDWR | O_TRUNC, 0644);
+		assert(source_fd >= 0 &&
+		       write(source_fd, raw, records.size()) ==
+			       (ssize_t)records.size());
+		close(source_fd);
+		int destination_fd = open(destination_path.c_str(),
+					  O_CREAT | O_RDWR | O_TRUNC, 0644);
+		assert(destination_fd >= 0);
+		int sockets[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1) {
+			std::cerr << "Error creating test socket pair.\n";
+			return;
+		}
+		PeerHeader block(PeerMessageType::CHUNK_RESPONSE, 2);
+		block.chunk_size = records.size();
+		block.compression = LZ4_COMPRESSION;
+		auto sender = std::thread([&] {
+			bool sent = Peer::write_message(sockets[0], block,
+							source_path, true);
+			assert(sent);
+		});
+		PeerHeader received;
+		bool success = Peer::read_message(sockets[1], received, false,
+						  destination_fd, "",
+						  block.chunk_size);
+		sender.join();
+		assert(success && (received.compression == LZ4_COMPRESSION) &&
+		       (received.current_chunk_size == records.size()) &&
+		       (received.compressed_size < records.size()));
+		std::vector<uint8_t> actual(records.size());
+		assert(pread(destination_fd, actual.data(), actual.size(), 0) ==
+			       (ssize_t)actual.size() &&
+		       std::equal(actual.begin(), actual.end(), raw));
+		// v1 has no way to say a block is compressed
+		block.version = 1;
+		PeerMessage m;
+		size_t header_length;
+		assert(!Peer::encode_header(block, 0, m, header_length));
+		close(destination_fd);
+		unlink(source_path.c_str());
+		unlink(destination_path.c_str());
+		close(sockets[0]);
+		close(sockets[1]);
+	}
+};
+
+class BufferPoolTests {
+    public:
+	// Make sure buffers are recycled, and that the budget makes acquire wait
+	// rather than allocate past it.
+	static void test_recycling_and_budget(void)
+	{
+		BufferPool pool(2 * 4096);
+		{
+			PooledBuffer first = pool.acquire(4096);
+			assert(first.data() != nullptr && first.size() == 4096);
+		}
+		PooledBuffer second = pool.acquire(4096);
+		assert(pool.hits == 1 && pool.misses == 1);
+		PooledBuffer third = pool.acquire(4096);
+		assert(pool.in_flight == 2 * 4096);
+		// The budget is used up, so this one has to wait for a release.
+		std::atomic<bool> acquired(false);
+		auto waiter = std::thread([&] {
+			PooledBuffer fourth = pool.acquire(4096);
+			acquired = true;
+		});
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		assert(!acquired);
+		second = PooledBuffer();
+		waiter.join();
+		assert(acquired && pool.high_water == 2 * 4096 &&
+		       pool.allocated <= 2 * 4096);
+	}
+};
+
+class HashTreeTests {
+    public:
+	// Make sure a file hashes to the same leaves on any number of threads,
+	// that the root can't be reached from a level of nodes passed off as
+	// leaves, and that blocks are only accepted when they match.
+	static void test_hash_and_verify(void)
+	{
+		// Two and a half leaves
+		std::vector<uint8_t> data(2 * HASH_LEAF_SIZE + HASH_LEAF_SIZE / 2);
+		for (size_t i = 0; i < data.size(); ++i)
+			data[i] = (uint8_t)(i * 7 + i / 251);
+		char path[] = "/tmp/hash_tree_testXXXXXX";
+		int fd = mkstemp(path);
+		assert(fd >= 0);
+		unlink(path);
+		bool success = write(fd, data.data(), data.size()) ==
+			       (ssize_t)data.size();
+		assert(success);
+		std::vector<HashDigest> leaves;
+		success = HashTree::hash_file(fd, data.size(), leaves, 2);
+		assert(success && leaves.size() == 3 &&
+		       leaves[2] == HashTree::hash_leaf(
+					    &data[2 * HASH_LEAF_SIZE],
+					    HASH_LEAF_SIZE / 2));
+		std::vector<HashDigest> one_thread;
+		success = HashTree::hash_file(fd, data.size(), one_thread);
+		assert(success && one_thread == leaves);
+		close(fd);
+		const std::vector<HashDigest> nodes = {
+			HashTree::hash_pair(leaves[0], leaves[1]), leaves[2]
+		};
+		assert(HashTree::root(leaves) == HashTree::root(one_thread) &&
+		       HashTree::root(leaves) != HashTree::root(nodes));
+		// A file of 2 chunks of 3 leaves has 4 to 6 of them
+		assert(HashTree::num_leaves(2, 3 * HASH_LEAF_SIZE) == 6 &&
+		       HashTree::num_leaves(1, 3 * HASH_LEAF_SIZE) == 3);
+		// The whole file, and a block of it past the first leaf
+		assert(HashTree::verify(leaves, 0, data.data(), data.size(),
+					data.size()));
+		assert(HashTree::verify(leaves, HASH_LEAF_SIZE,
+					&data[HASH_LEAF_SIZE], HASH_LEAF_SIZE,
+					HASH_LEAF_SIZE));
+		// The last block may stop short where the file ends, nowhere else.
+		assert(HashTree::verify(leaves, 2 * HASH_LEAF_SIZE,
+					&data[2 * HASH_LEAF_SIZE],
+					HASH_LEAF_SIZE / 2, HASH_LEAF_SIZE));
+		assert(!HashTree::verify(leaves, 0, data.data(), HASH_LEAF_SIZE,
+					 2 * HASH_LEAF_SIZE));
+		assert(HashTree::verify(leaves, 3 * HASH_LEAF_SIZE, nullptr, 0,
+					HASH_LEAF_SIZE));
+		// Bad bytes, and blocks that don't start on a leaf
+		data[HASH_LEAF_SIZE + 5] ^= 1;
+		assert(!HashTree::verify(leaves, HASH_LEAF_SIZE,
+					 &data[HASH_LEAF_SIZE], HASH_LEAF_SIZE,
+					 HASH_LEAF_SIZE));
+		assert(!HashTree::verify(leaves, 1, &data[1], HASH_LEAF_SIZE,
+					 HASH_LEAF_SIZE));
+	}
+
+	// Make sure leaves survive a trip through a HASH_RESPONSE payload, and
+	// that a cut off one is rejected.
+	static void test_leaf_payloads(void)
+	{
+		std::vector<HashDigest> leaves = {
+			HashTree::hash_leaf((const uint8_t *)"banana", 6),
+			HashTree::hash_leaf((const uint8_t *)"soup", 4)
+		};
+		PeerHeader response(PeerMessageType::HASH_RESPONSE, 2);
+		HashTree::encode_leaves(leaves.data(), leaves.size(),
+					response.payload);
+		std::vector<HashDigest> decoded;
+		bool success = HashTree::decode_leaves(response.payload, decoded);
+		assert(success && decoded == leaves);
+		response.payload.pop_back();
+		decoded.clear();
+		success = HashTree::decode_leaves(response.payload, decoded);
+		assert(!success);
+	}
 };
 
 class SwarmTests {
     public:
+	// Make sure tracker payloads come back the way they went in, and that a
+	// cut off payload is rejected.
+	static void test_tracker_payloads(void)
+	{
+		std::vector<SwarmFile> files = { { "banana_soup.mp4", 2 },
+						 { "", 0 } };
+		std::vector<uint8_t> payload;
+		Swarm::encode_files(files, payload);
+		std::vector<SwarmFile> decoded_files;
+		bool success = Swarm::decode_files(payload, decoded_files);
+		assert(success && (decoded_files.size() == 2) &&
+		       (decoded_files[0].file_name == "banana_soup.mp4") &&
+		       (decoded_files[0].num_chunks == 2) &&
+		       (decoded_files[1].file_name.empty()));
+		payload.pop_back();
+		success = Swarm::decode_files(payload, decoded_files);
+		assert(!success);
+		std::vector<SwarmHolder> holders = {
+			std::make_tuple(htonl(0x7f000001), htons(6001), 3),
+			std::make_tuple(htonl(0x0a000002), htons(50001), 1)
+		};
+		Swarm::encode_holders(holders, payload);
+		assert(payload.size() == 20);
+		std::vector<SwarmHolder> decoded_holders;
+		success = Swarm::decode_holders(payload, decoded_holders);
+		assert(success && (decoded_holders == holders));
+	}
+
+	// Make sure a snapshot is one SNAPSHOT frame holding every member,
+	// followed by a SNAPSHOT_END carrying the view it is as of.
+	static void test_snapshot_frames(void)
+	{
+		std::vector<SwarmMember> members = {
+			std::make_tuple(htonl(0x7f000001), htons(6001)),
+			std::make_tuple(htonl(0x0a000002), htons(50001))
+		};
+		SwarmView view = { 7, 42, 2,
+				   Swarm::member_digest(htonl(0x7f000001),
+							htons(6001)) ^
+					   Swarm::member_digest(htonl(0x0a000002),
+								htons(50001)) };
+		std::vector<uint8_t> frames;
+		Swarm::append_snapshot(members, view, frames);
+		assert(frames.size() == 7 + 12 + 7 + 24);
+		assert((frames[0] == SwarmMessageType::SNAPSHOT) &&
+		       (frames[19] == SwarmMessageType::SNAPSHOT_END));
+		std::vector<uint8_t> payload(frames.begin() + 7,
+					     frames.begin() + 19);
+		std::vector<SwarmMember> decoded_members;
+		bool success = Swarm::decode_snapshot(payload, decoded_members);
+		assert(success && (decoded_members == members));
+		payload.pop_back();
+		success = Swarm::decode_snapshot(payload, decoded_members);
+		assert(!success);
+		payload.assign(frames.begin() + 26, frames.end());
+		SwarmView decoded_view;
+		success = Swarm::decode_view(payload, decoded_view);
+		assert(success && (decoded_view.epoch == 7) &&
+		       (decoded_view.seq == 42) &&
+		       (decoded_view.num_members == 2) &&
+		       (decoded_view.digest == view.digest));
+		// An empty swarm is still one (empty) SNAPSHOT frame
+		frames.clear();
+		Swarm::append_snapshot(std::vector<SwarmMember>(), view, frames);
+		assert((frames.size() == 7 + 7 + 24) &&
+		       (frames[0] == SwarmMessageType::SNAPSHOT));
+	}
+
+	// Make sure numbered changes come back the way they went in.
+	static void test_change_frames(void)
+	{
+		std::vector<SwarmChange> changes = {
+			{ SwarmMessageType::ADD, htonl(0x7f000001), htons(6001) },
+			{ SwarmMessageType::REMOVE, htonl(0x0a000002), htons(50001) }
+		};
+		std::vector<uint8_t> frames;
+		Swarm::append_changes(7, 1ULL << 40, changes, frames);
+		assert((frames.size() == 7 + 12 + 14) &&
+		       (frames[0] == SwarmMessageType::CHANGES));
+		std::vector<uint8_t> payload(frames.begin() + 7, frames.end());
+		uint32_t epoch;
+		uint64_t first_seq;
+		std::vector<SwarmChange> decoded;
+		bool success =
+			Swarm::decode_changes(payload, epoch, first_seq, decoded);
+		assert(success && (epoch == 7) && (first_seq == 1ULL << 40) &&
+		       (decoded.size() == 2) &&
+		       (decoded[1].mode == SwarmMessageType::REMOVE) &&
+		       (decoded[1].address == htonl(0x0a000002)) &&
+		       (decoded[1].port == htons(50001)));
+		payload.pop_back();
+		success = Swarm::decode_changes(payload, epoch, first_seq, decoded);
+		assert(!success);
+	}
+
 	static void test_swarm_message_writes()
 	{
 		static const std::string &unix_socket_path = "test_socket";
@@ -249,11 +883,577 @@ class SwarmTests {
 };
 } // namespace ApplicationLayer
 
+namespace Peer
+{
+class PeersTests {
+    public:
+	// Make sure a removed peer's place is taken by the last one, that the
+	// index follows it there, that a peer announced twice is kept once, and
+	// that a snapshot handed out never changes under its reader.
+	static void test_member_index(void)
+	{
+		Peers peers("127.0.0.1", 50001, "127.0.0.1", 6000);
+		const auto add = ApplicationLayer::SwarmMessageType::ADD;
+		const auto remove = ApplicationLayer::SwarmMessageType::REMOVE;
+		// Whether the peer at address is at idx, and indexed there
+		auto at = [&peers](const uint32_t address, const size_t idx) {
+			auto member = peers.member_index.find(
+				((uint64_t)address << 16) | 1);
+			return member != peers.member_index.end() &&
+			       member->second == idx &&
+			       std::get<0>(peers.peers[idx]) == address;
+		};
+		{
+			std::lock_guard<std::mutex> peers_guard(
+				peers.peers_lock);
+			for (uint32_t address = 1; address <= 4; ++address) {
+				peers.update_peers(add, address, 1);
+			}
+			peers.mark_stale();
+		}
+		PeersSnapshot before = peers.get_current_peers();
+		assert(before->size() == 4 &&
+		       peers.get_current_peers() == before);
+		{
+			std::lock_guard<std::mutex> peers_guard(
+				peers.peers_lock);
+			// The middle one, then the last one
+			peers.update_peers(remove, 2, 1);
+			assert(peers.peers.size() == 3 && at(1, 0) &&
+			       at(4, 1) && at(3, 2) &&
+			       peers.member_index.size() == 3);
+			peers.update_peers(remove, 3, 1);
+			assert(peers.peers.size() == 2 && at(1, 0) && at(4, 1));
+			// Once only, and peers we don't know can't be removed
+			peers.update_peers(add, 4, 1);
+			peers.update_peers(remove, 3, 1);
+			assert(peers.peers.size() == 2 &&
+			       peers.member_index.size() == 2);
+			peers.update_peers(add, 2, 1);
+			assert(peers.peers.size() == 3 && at(2, 2));
+			peers.mark_stale();
+		}
+		PeersSnapshot after = peers.get_current_peers();
+		assert(after->size() == 3 && before->size() == 4 &&
+		       std::get<0>((*before)[1]) == 2);
+	}
+};
+
+class ChunkSchedulerTests {
+    public:
+	// Make sure a chunk past its deadline goes to the next worker that asks,
+	// that a failed or rejected chunk goes back in the queue, that a worker
+	// sent us a bad chunk gets nothing more, and that a worker waiting on a
+	// chunk it already lists sleeps until the chunk is done.
+	static void test_deadline_reclaim_and_reject(void)
+	{
+		ChunkScheduler scheduler(1, std::chrono::milliseconds(20));
+		uint32_t chunk_idx = 1;
+		bool success = scheduler.take(0, false, chunk_idx);
+		assert(success && chunk_idx == 0);
+		success = scheduler.take(1, false, chunk_idx);
+		assert(!success);
+		std::this_thread::sleep_for(std::chrono::milliseconds(30));
+		success = scheduler.take(1, false, chunk_idx);
+		assert(success && chunk_idx == 0);
+		// Worker 0 was given up on, so its failure changes nothing.
+		scheduler.fail(0, 0);
+		success = scheduler.take(2, false, chunk_idx);
+		assert(!success);
+		scheduler.fail(1, 0);
+		success = scheduler.take(2, false, chunk_idx);
+		assert(success && chunk_idx == 0);
+		scheduler.reject(2, 0);
+		success = scheduler.take(2, false, chunk_idx);
+		assert(!success);
+		success = scheduler.take(3, false, chunk_idx);
+		assert(success && chunk_idx == 0);
+		// Once its deadline has passed, only the chunk being done can
+		// wake worker 3 up.
+		std::this_thread::sleep_for(std::chrono::milliseconds(30));
+		std::atomic<bool> returned(false);
+		auto waiter = std::thread([&] {
+			uint32_t waited_chunk_idx;
+			bool taken = scheduler.take(3, true, waited_chunk_idx);
+			assert(!taken);
+			returned = true;
+		});
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		assert(!returned);
+		scheduler.complete(0);
+		waiter.join();
+		assert(returned && scheduler.finished());
+	}
+
+	// Make sure that once every chunk is handed out, a worker with nothing
+	// left gets a copy of one in flight to fetch aside, that the first copy
+	// in cuts off the others, and that a beaten copy goes back in the queue
+	// if the winner turns out bad.
+	static void test_endgame_copies(void)
+	{
+		ChunkScheduler scheduler(2, std::chrono::milliseconds(10000));
+		uint32_t first_idx;
+		uint32_t second_idx;
+		uint32_t copy_idx = 2;
+		bool success = scheduler.take(0, false, first_idx) &&
+			       scheduler.take(1, false, second_idx);
+		assert(success && first_idx == 0 && second_idx == 1);
+		success = scheduler.take(2, false, copy_idx);
+		assert(!success);
+		success = scheduler.take(2, true, copy_idx);
+		assert(success && copy_idx < 2);
+		const size_t writer = copy_idx;
+		int writer_sockets[2];
+		int copy_sockets[2];
+		success =
+			socketpair(AF_UNIX, SOCK_STREAM, 0, writer_sockets) == 0 &&
+			socketpair(AF_UNIX, SOCK_STREAM, 0, copy_sockets) == 0;
+		assert(success);
+		bool in_place;
+		success = scheduler.watch(writer, writer_sockets[0], copy_idx,
+					  in_place);
+		assert(success && in_place);
+		success =
+			scheduler.watch(2, copy_sockets[0], copy_idx, in_place);
+		assert(success && !in_place);
+		// The copy fetched aside wins, and the writer is cut off.
+		scheduler.unwatch(2);
+		success = scheduler.arrive(2, copy_idx, 100);
+		assert(!success);
+		char byte;
+		assert(read(writer_sockets[0], &byte, 1) == 0);
+		success = scheduler.was_outrun(writer);
+		assert(success && !scheduler.was_outrun(writer));
+		scheduler.unwatch(writer);
+		scheduler.wait_for_writer(copy_idx);
+		// What the writer had read by then came in second.
+		success = scheduler.arrive(writer, copy_idx, 100);
+		assert(success);
+		std::ostringstream report;
+		scheduler.report(report, 200);
+		assert(report.str().find("1 duplicate requests, 1 transfers "
+					 "cut off, 100 redundant bytes") !=
+		       std::string::npos);
+		// The winner was bad, so the block is fetched again.
+		scheduler.reject(2, copy_idx);
+		uint32_t retry_idx;
+		success = scheduler.take(writer, false, retry_idx);
+		assert(success && retry_idx == copy_idx);
+		for (int fd : { writer_sockets[0], writer_sockets[1],
+				copy_sockets[0], copy_sockets[1] })
+			close(fd);
+	}
+};
+
+class DownloadStateTests {
+    public:
+	// Make sure the blocks marked done, and the length they reach, are
+	// picked up by the next run of the same download, that a download of
+	// something else starts over, and that finishing removes the state.
+	static void test_bitfield_and_resume(void)
+	{
+		char dir[] = "/tmp/download_state_testXXXXXX";
+		bool success = mkdtemp(dir) != nullptr;
+		assert(success);
+		const std::string destination = std::string(dir) + "/file.bin";
+		const std::string state_path =
+			destination + STATE_FILE_EXTENSION;
+		{
+			DownloadState state(destination);
+			success = state.open(10, 100, 400, "root");
+			assert(success && state.done_count() == 0);
+			state.mark(3, 400);
+			state.mark(9, 950);
+			state.mark(9, 950);
+			state.mark(12, 1300);
+			assert(state.done_count() == 2 && state.length() == 950);
+		}
+		{
+			DownloadState state(destination);
+			success = state.open(10, 100, 400, "root");
+			assert(success && state.done_count() == 2 &&
+			       state.done(3) && state.done(9) &&
+			       !state.done(4) && state.length() == 950);
+			state.unmark(3);
+			assert(state.done_count() == 1 && !state.done(3));
+		}
+		{
+			DownloadState state(destination);
+			success = state.open(10, 100, 400, "root");
+			assert(success && state.done_count() == 1 &&
+			       state.done(9));
+			success = state.reset();
+			assert(success && state.done_count() == 0 &&
+			       state.length() == 0);
+			state.mark(1, 200);
+		}
+		{
+			// Another file, or the same one in other blocks
+			DownloadState state(destination);
+			success = state.open(10, 100, 400, "other root");
+			assert(success && state.done_count() == 0);
+			state.mark(1, 200);
+		}
+		{
+			DownloadState state(destination);
+			success = state.open(10, 200, 400, "other root");
+			assert(success && state.done_count() == 0);
+			state.finish();
+			assert(access(state_path.c_str(), F_OK) < 0);
+		}
+		rmdir(dir);
+	}
+
+	// Make sure a state file that can't be written to part way through is
+	// removed, so that no later run resumes from it.
+	static void test_failed_writes(void)
+	{
+		char dir[] = "/tmp/download_state_testXXXXXX";
+		bool success = mkdtemp(dir) != nullptr;
+		assert(success);
+		const std::string destination = std::string(dir) + "/file.bin";
+		const std::string state_path =
+			destination + STATE_FILE_EXTENSION;
+		DownloadState state(destination);
+		success = state.open(10, 100, 400, "root");
+		assert(success);
+		state.mark(1, 200);
+		// Stand in a descriptor that can't be written for the file's.
+		close(state.fd);
+		state.fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+		assert(state.fd >= 0);
+		state.unmark(1);
+		assert(state.fd < 0 && !state.done(1) &&
+		       access(state_path.c_str(), F_OK) < 0);
+		// The download goes on without it.
+		state.mark(2, 300);
+		assert(state.done(2) && state.length() == 300);
+		rmdir(dir);
+	}
+};
+
+class RateLimitsTests {
+    public:
+	// Make sure a bucket lets a burst through at once and makes whatever
+	// comes after it wait at its rate, that no rate means no wait, and that
+	// the shared limit holds across connections and the per peer limit per
+	// connection.
+	static void test_token_buckets(void)
+	{
+		const auto ms = [](const std::chrono::nanoseconds wait) {
+			return std::chrono::duration_cast<
+				       std::chrono::milliseconds>(wait)
+				.count();
+		};
+		TokenBucket unlimited;
+		assert(unlimited.take(1 << 30).count() == 0);
+		TokenBucket bucket(1000);
+		assert(bucket.take(50).count() == 0);
+		// A second's worth of bytes past the burst
+		auto wait = bucket.take(1000);
+		assert(ms(wait) > 900 && ms(wait) <= 1000);
+		bucket.set_rate(0);
+		assert(bucket.take(1000).count() == 0 && bucket.get_rate() == 0);
+
+		RateLimits limits;
+		TokenBucket first;
+		TokenBucket second;
+		limits.configure(0, 0, 0, 0);
+		assert(!limits.upload_limited() &&
+		       limits.take_upload(first, 1 << 30).count() == 0);
+		// Two connections share the upload limit.
+		limits.configure(1000, 0, 0, 0);
+		assert(limits.upload_limited() &&
+		       limits.take_upload(first, 50).count() == 0);
+		wait = limits.take_upload(second, 1000);
+		assert(ms(wait) > 900 && ms(wait) <= 1000);
+		// Each connection is held to the per peer limit on its own.
+		limits.configure(0, 0, 0, 1000);
+		assert(!limits.upload_limited() &&
+		       limits.take_download(first, 50).count() == 0 &&
+		       limits.take_download(second, 50).count() == 0 &&
+		       first.get_rate() == 1000);
+		wait = limits.take_download(first, 500);
+		assert(ms(wait) > 400 && ms(wait) <= 500);
+	}
+};
+
+class UploadSlotsTests {
+    public:
+	// Make sure slots go to connections in the order they lined up, on the
+	// reactor serving them, and that a slot handed to a connection that
+	// went away before picking it up is passed on once released.
+	static void test_grant_order_and_cancel(void)
+	{
+		UploadSlots unlimited(0, 1);
+		const UploadSlots::Ticket any = { 0, 3, 0, 1 };
+		assert(unlimited.acquire(any) && unlimited.acquire(any));
+
+		UploadSlots slots(1, 2);
+		const UploadSlots::Ticket first = { 0, 10, 1, 1 };
+		const UploadSlots::Ticket second = { 1, 11, 2, 2 };
+		const UploadSlots::Ticket third = { 0, 12, 3, 3 };
+		bool success = slots.acquire(first);
+		assert(success);
+		success = slots.acquire(second) || slots.acquire(third);
+		assert(!success);
+		slots.release(first);
+		uint64_t count = 0;
+		success = read(slots.wake_fd(1), &count, sizeof(count)) ==
+			  (ssize_t)sizeof(count);
+		assert(success && count == 1);
+		assert(slots.take_granted(0).empty());
+		// The second connection goes away after it was handed the slot.
+		slots.cancel(second);
+		auto granted = slots.take_granted(1);
+		assert(granted.size() == 1 &&
+		       granted[0].connection_id == second.connection_id);
+		slots.release(granted[0]);
+		granted = slots.take_granted(0);
+		assert(granted.size() == 1 &&
+		       granted[0].connection_id == third.connection_id);
+		// A connection that gives up its place in line is skipped.
+		success = slots.acquire(first);
+		assert(!success);
+		slots.cancel(first);
+		slots.release(third);
+		success = slots.acquire(second);
+		assert(success && slots.take_granted(0).empty());
+	}
+
+	// Make sure a peer fetching over several connections gets no more turns
+	// than one fetching over one: a slot given up goes to the connection in
+	// line whose peer holds the fewest.
+	static void test_turns_by_peer(void)
+	{
+		UploadSlots slots(2, 1);
+		const uint32_t many_streams = 1;
+		const uint32_t one_stream = 2;
+		const UploadSlots::Ticket first = { 0, 10, 1, many_streams };
+		const UploadSlots::Ticket second = { 0, 11, 2, many_streams };
+		const UploadSlots::Ticket third = { 0, 12, 3, many_streams };
+		const UploadSlots::Ticket other = { 0, 13, 4, one_stream };
+		// With nobody else waiting, one peer may hold every slot.
+		bool success = slots.acquire(first) && slots.acquire(second);
+		assert(success);
+		success = slots.acquire(third) || slots.acquire(other);
+		assert(!success);
+		slots.release(first);
+		auto granted = slots.take_granted(0);
+		assert(granted.size() == 1 &&
+		       granted[0].connection_id == other.connection_id);
+		slots.release(second);
+		granted = slots.take_granted(0);
+		assert(granted.size() == 1 &&
+		       granted[0].connection_id == third.connection_id);
+	}
+};
+
+class PeerScoresTests {
+    public:
+	// Make sure a peer is only rated once it has sent blocks, that a faster
+	// peer rates higher and failures bring a rating down, and that scores
+	// carry over through the file they are kept in.
+	static void test_ratings_and_persistence(void)
+	{
+		char dir[] = "/tmp/peer_scores_testXXXXXX";
+		bool success = mkdtemp(dir) != nullptr;
+		assert(success);
+		const std::string path = std::string(dir) + "/scores";
+		const uint32_t fast = htonl(0x7F000001);
+		const uint32_t slow = htonl(0x7F000002);
+		const uint16_t port = htons(6001);
+		double fast_rating;
+		{
+			PeerScores scores(path);
+			assert(scores.rating(fast, port) < 0 &&
+			       scores.connect_rtt(fast, port) == 0);
+			scores.record_connect(fast, port,
+					      std::chrono::microseconds(200));
+			assert(scores.rating(fast, port) < 0 &&
+			       scores.connect_rtt(fast, port) == 200);
+			scores.record_block(fast, port, 1000000,
+					    std::chrono::microseconds(10000));
+			scores.record_block(slow, port, 1000000,
+					    std::chrono::microseconds(100000));
+			fast_rating = scores.rating(fast, port);
+			assert(fast_rating > scores.rating(slow, port) &&
+			       scores.rating(slow, port) > 0);
+			scores.record_failure(fast, port);
+			assert(scores.rating(fast, port) < fast_rating);
+			fast_rating = scores.rating(fast, port);
+			success = scores.save();
+			assert(success);
+		}
+		{
+			PeerScores scores(path);
+			const double loaded = scores.rating(fast, port);
+			assert(std::abs(loaded - fast_rating) <
+				       fast_rating * 1e-3 &&
+			       scores.connect_rtt(fast, port) == 200 &&
+			       scores.rating(fast, htons(6002)) < 0);
+		}
+		unlink(path.c_str());
+		rmdir(dir);
+	}
+};
+
+class ChunkCacheTests {
+    public:
+	// Make sure a chunk is read in off the caller's thread and hits once it
+	// is, that a chunk asked for again while it is read in is only read in
+	// once, that the chunk served least recently is let go once the cache
+	// is over budget, and that a chunk bigger than the budget isn't cached.
+	static void test_eviction_and_hit_rate(void)
+	{
+		char dir[] = "/tmp/chunk_cache_testXXXXXX";
+		bool success = mkdtemp(dir) != nullptr;
+		assert(success);
+		const std::string path = std::string(dir) + "/file.bin";
+		const int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+		assert(fd >= 0);
+		const size_t chunk = 4096;
+		std::vector<uint8_t> contents(3 * chunk, 7);
+		success = write(fd, contents.data(), contents.size()) ==
+			  (ssize_t)contents.size();
+		assert(success);
+		ChunkCache cache(2 * chunk);
+		auto loaded = [&cache] {
+			while (true) {
+				{
+					std::lock_guard<std::mutex> cache_guard(
+						cache.cache_lock);
+					if (cache.loading.empty())
+						return;
+				}
+				std::this_thread::sleep_for(
+					std::chrono::milliseconds(1));
+			}
+		};
+		auto cached = [&cache, fd](const off_t offset) {
+			std::lock_guard<std::mutex> cache_guard(
+				cache.cache_lock);
+			return cache.entries.count(std::make_pair(fd, offset)) >
+			       0;
+		};
+		assert(!cache.touch(fd, 0, chunk));
+		loaded();
+		assert(cache.touch(fd, 0, chunk));
+		assert(!cache.touch(fd, chunk, chunk));
+		{
+			std::lock_guard<std::mutex> cache_guard(
+				cache.cache_lock);
+			assert(cache.loading.size() <= 1);
+		}
+		assert(!cache.touch(fd, chunk, chunk));
+		loaded();
+		assert(cache.cached_bytes == 2 * chunk);
+		// 0 was served more recently than chunk now.
+		assert(cache.touch(fd, 0, chunk));
+		assert(!cache.touch(fd, 2 * chunk, chunk));
+		loaded();
+		assert(cache.cached_bytes == 2 * chunk && cached(0) &&
+		       !cached(chunk) && cached(2 * chunk));
+		assert(!cache.touch(fd, 0, 3 * chunk));
+		{
+			std::lock_guard<std::mutex> cache_guard(
+				cache.cache_lock);
+			assert(cache.loading.empty() && cache.hits == 2 &&
+			       cache.misses == 5);
+		}
+		close(fd);
+		unlink(path.c_str());
+		rmdir(dir);
+	}
+};
+
+class CompressedCacheTests {
+    public:
+	// Make sure a block is compressed once and hits after that, that a
+	// block that doesn't compress is remembered too, and that the block
+	// asked for least recently is let go once the cache is over budget.
+	static void test_eviction_and_hit_rate(void)
+	{
+		char dir[] = "/tmp/compressed_cache_testXXXXXX";
+		bool success = mkdtemp(dir) != nullptr;
+		assert(success);
+		const std::string path = std::string(dir) + "/file.bin";
+		const int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+		assert(fd >= 0);
+		const size_t block = 4096;
+		// Three blocks that compress, then one of noise
+		std::vector<uint8_t> contents(4 * block, 7);
+		uint32_t noise = 12345;
+		for (size_t i = 3 * block; i < contents.size(); ++i) {
+			noise = noise * 1103515245 + 12345;
+			contents[i] = noise >> 24;
+		}
+		success = write(fd, contents.data(), contents.size()) ==
+			  (ssize_t)contents.size();
+		assert(success);
+		size_t entry_size;
+		{
+			CompressedCache probe(1000000);
+			success = probe.get(fd, 0, block) != nullptr;
+			assert(success);
+			entry_size = probe.cached_bytes;
+		}
+		CompressedCache cache(2 * entry_size);
+		auto cached = [&cache, fd, block](const off_t offset) {
+			return cache.entries.count(std::make_tuple(
+				       fd, offset, block)) > 0;
+		};
+		auto first = cache.get(fd, 0, block);
+		assert(first && first->size() < block);
+		assert(cache.get(fd, 0, block) == first);
+		assert(cache.get(fd, block, block));
+		// 0 was asked for more recently than block now.
+		assert(cache.get(fd, 0, block) == first);
+		assert(cache.get(fd, 2 * block, block));
+		assert(cache.cached_bytes == 2 * entry_size && cached(0) &&
+		       !cached(block) && cached(2 * block));
+		assert(!cache.get(fd, 3 * block, block));
+		assert(cached(3 * block) && !cached(0) && cached(2 * block));
+		assert(!cache.get(fd, 3 * block, block));
+		assert(cache.hits == 3 && cache.misses == 4 &&
+		       cache.raw_bytes == 5 * block &&
+		       cache.compressed_bytes == 5 * first->size());
+		close(fd);
+		unlink(path.c_str());
+		rmdir(dir);
+	}
+};
+} // namespace Peer
+
 int main(void)
 {
 	ApplicationLayer::PeerTests::test_filename_functions();
 	ApplicationLayer::PeerTests::test_message_header_serialization();
 	ApplicationLayer::PeerTests::test_message_writes();
+	ApplicationLayer::PeerTests::test_v2_header_serialization();
+	ApplicationLayer::PeerTests::test_version_handshake();
+	ApplicationLayer::PeerTests::test_buffered_messages();
+	ApplicationLayer::PeerTests::test_catalog_payloads();
+	ApplicationLayer::PeerTests::test_streamed_chunk_receive();
+	ApplicationLayer::PeerTests::test_block_transfer();
+	ApplicationLayer::PeerTests::test_compressed_blocks();
+	ApplicationLayer::BufferPoolTests::test_recycling_and_budget();
+	ApplicationLayer::HashTreeTests::test_hash_and_verify();
+	ApplicationLayer::HashTreeTests::test_leaf_payloads();
 	ApplicationLayer::SwarmTests::test_swarm_message_writes();
+	ApplicationLayer::SwarmTests::test_tracker_payloads();
+	ApplicationLayer::SwarmTests::test_snapshot_frames();
+	ApplicationLayer::SwarmTests::test_change_frames();
+	Peer::PeersTests::test_member_index();
+	Peer::ChunkSchedulerTests::test_deadline_reclaim_and_reject();
+	Peer::ChunkSchedulerTests::test_endgame_copies();
+	Peer::DownloadStateTests::test_bitfield_and_resume();
+	Peer::DownloadStateTests::test_failed_writes();
+	Peer::RateLimitsTests::test_token_buckets();
+	Peer::UploadSlotsTests::test_grant_order_and_cancel();
+	Peer::UploadSlotsTests::test_turns_by_peer();
+	Peer::PeerScoresTests::test_ratings_and_persistence();
+	Peer::ChunkCacheTests::test_eviction_and_hit_rate();
+	Peer::CompressedCacheTests::test_eviction_and_hit_rate();
 	return 0;
 }
@@ -3,14 +3,23 @@ extern "C" {
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 }
 #include <string>
 #include <algorithm>
 #include <iostream>
-#include <thread>
-#include <mutex>
-#include <list>
+#include <array>
+#include <deque>
+#include <memory>
 #include <tuple>
+#include <unordered_map>
+#include <vector>
+#include <cerrno>
+#include <climits>
+#include <chrono>
+#include <random>
 
 // Application Layer for Swarm Messages
 #include "../ApplicationLayer/ApplicationLayer.hpp"
@@ -21,121 +30,578 @@ using SwarmMessage = ApplicationLayer::SwarmMessage;
 // IP Address and Port to bind to
 static const constexpr char BIND_ADDRESS[] = "0.0.0.0";
 static const constexpr uint16_t PORT = 50001;
+// Length of the queue of connections waiting to be accepted
+static const constexpr int LISTEN_BACKLOG = 1024;
+// Most bytes waiting to go out to one peer. A peer that falls this far behind
+// is disconnected, rather than holding up the rest of the swarm.
+static const constexpr size_t MAX_QUEUED_BYTES = 8 * 1024 * 1024;
+// Largest buffer small messages are gathered into on their way out
+static const constexpr size_t COALESCE_SIZE = 64 * 1024;
+// Most bytes read from a peer at once
+static const constexpr size_t READ_SIZE = 64 * 1024;
+// Most epoll events handled per wakeup
+static const constexpr size_t MAX_EVENTS = 256;
+// Most changes to the swarm kept around for peers catching up. Peers that
+// are further behind than this get a snapshot instead.
+static const constexpr size_t MAX_CHANGE_LOG = 64 * 1024;
+// How often peers that joined with JOIN are sent a DIGEST of the swarm
+static const constexpr std::chrono::seconds DIGEST_INTERVAL(30);
 
-// List of connected peers
-static std::mutex peers_lock;
-// (file descriptor, address, port)
-static std::list<std::tuple<int, uint32_t, uint16_t> > peers;
-
-static void register_peer(int client_socket, sockaddr client_addr)
-{
-	// Read in the first expected message from the client
-	uint8_t mode;
+// A connected peer, and where its conversation with us is at.
+struct Connection {
+	int fd;
+	// The address the peer connected to us from
+	uint32_t socket_address;
+	// Set once the peer has sent us its ADD or JOIN message
+	bool registered;
+	// Whether the peer joined with JOIN, and so is sent CHANGES instead of
+	// ADD and REMOVE
+	bool sequenced;
+	// The view the peer asked to catch up from, if it sent a SYNC before
+	// joining
+	bool has_sync;
+	ApplicationLayer::SwarmView sync;
+	// The address and port the peer listens on, from its ADD message
 	uint32_t address;
 	uint16_t port;
-	SwarmMessage client_pair;
-	if (!(SwarmLayer::read_message(client_socket, mode, address, port,
-				       client_pair))) {
-		std::cerr
-			<< "Unable to read Swarm message from Message Layer.\n";
-		close(client_socket);
+	// Bytes received but not yet handled
+	std::vector<uint8_t> input;
+	// Messages waiting to go out, and how much of the first one has
+	std::deque<std::vector<uint8_t> > output;
+	size_t output_offset;
+	size_t output_bytes;
+	// The events we asked epoll for
+	uint32_t events;
+	// Whether it has output to flush once this round of events is handled
+	bool dirty;
+	// Whether it is being disconnected
+	bool dropped;
+	// Files this peer announced to the tracker
+	std::vector<std::string> announced;
+};
+
+static int epoll_fd;
+// fd: connected peer
+static std::unordered_map<int, std::unique_ptr<Connection> > connections;
+// Connections with output to flush
+static std::vector<int> dirty;
+// Connections to disconnect
+static std::vector<int> dropped;
+// The swarm's epoch, seq, and the number and digest of its members
+static ApplicationLayer::SwarmView swarm_view;
+// The latest changes to the swarm, the last of them numbered swarm_view.seq
+static std::deque<ApplicationLayer::SwarmChange> change_log;
+// Tracker mode
+// filename: (address << 16 | port): (address, port, num_chunks)
+static std::unordered_map<
+	std::string,
+	std::unordered_map<uint64_t, ApplicationLayer::SwarmHolder> >
+	file_index;
+
+static uint64_t peer_key(const uint32_t address, const uint16_t port)
+{
+	return ((uint64_t)address << 16) | port;
+}
+
+// Mark the connection to be disconnected once this round of events is done.
+static void drop(Connection &connection)
+{
+	if (connection.dropped)
+		return;
+	connection.dropped = true;
+	dropped.push_back(connection.fd);
+}
+
+// Queue bytes to go out to the peer. A peer that has fallen too far behind is
+// disconnected instead.
+static void queue(Connection &connection, std::vector<uint8_t> &&bytes)
+{
+	if (connection.dropped)
 		return;
+	connection.output_bytes += bytes.size();
+	// Small messages, like a broadcast ADD, go on the end of the last
+	// buffer instead of one buffer each.
+	if (!connection.output.empty() &&
+	    connection.output.back().size() + bytes.size() <= COALESCE_SIZE) {
+		connection.output.back().insert(connection.output.back().end(),
+						bytes.begin(), bytes.end());
+	} else {
+		connection.output.push_back(std::move(bytes));
 	}
-	if (mode != SwarmType::ADD) {
-		std::cerr
-			<< "An unregistered peer cannot remove peers from the server.\n";
-		close(client_socket);
+	if (connection.output_bytes > MAX_QUEUED_BYTES) {
+		std::cerr << "A peer isn't keeping up with the swarm. Dropping "
+			     "the connection.\n";
+		drop(connection);
 		return;
 	}
+	if (!connection.dirty) {
+		connection.dirty = true;
+		dirty.push_back(connection.fd);
+	}
+}
+
+// Number the peer joining or leaving the swarm, and tell every other
+// registered peer: those that joined with JOIN as a CHANGES message, and the
+// rest as an ADD or REMOVE.
+static void record_change(const Connection &about, const uint8_t mode)
+{
+	ApplicationLayer::SwarmChange change = { mode, about.address,
+						 about.port };
+	++swarm_view.seq;
+	if (mode == SwarmType::ADD)
+		++swarm_view.num_members;
+	else
+		--swarm_view.num_members;
+	swarm_view.digest ^=
+		SwarmLayer::member_digest(about.address, about.port);
+	change_log.push_back(change);
+	if (change_log.size() > MAX_CHANGE_LOG)
+		change_log.pop_front();
+	SwarmMessage m;
+	SwarmLayer::build_message(mode, about.address, about.port, m);
+	std::vector<uint8_t> changes;
+	SwarmLayer::append_changes(
+		swarm_view.epoch, swarm_view.seq,
+		std::vector<ApplicationLayer::SwarmChange>(1, change), changes);
+	for (auto &peer : connections) {
+		Connection &connection = *peer.second;
+		if (!connection.registered || &connection == &about)
+			continue;
+		if (connection.sequenced)
+			queue(connection, std::vector<uint8_t>(changes));
+		else
+			queue(connection,
+			      std::vector<uint8_t>(m.begin(), m.end()));
+	}
+}
+
+// Queue what the peer needs to catch up from since to now: the changes since
+// then if we still have them, or a snapshot of every other peer if we don't,
+// followed by SNAPSHOT_END.
+static void catch_up(Connection &connection,
+		     const ApplicationLayer::SwarmView &since)
+{
+	std::vector<uint8_t> out;
+	const uint64_t first_logged = swarm_view.seq - change_log.size() + 1;
+	if (since.epoch == swarm_view.epoch && since.seq + 1 >= first_logged &&
+	    since.seq <= swarm_view.seq) {
+		std::vector<ApplicationLayer::SwarmChange> changes(
+			change_log.begin() + (since.seq + 1 - first_logged),
+			change_log.end());
+		SwarmLayer::append_changes(swarm_view.epoch, since.seq + 1,
+					   changes, out);
+		std::vector<uint8_t> payload;
+		SwarmLayer::encode_view(swarm_view, payload);
+		SwarmLayer::append_payload_message(SwarmType::SNAPSHOT_END, 0,
+						   payload, out);
+	} else {
+		std::vector<ApplicationLayer::SwarmMember> members;
+		members.reserve(connections.size());
+		for (auto &peer : connections) {
+			const Connection &other = *peer.second;
+			if (other.registered && &other != &connection)
+				members.push_back(std::make_tuple(
+					other.address, other.port));
+		}
+		SwarmLayer::append_snapshot(members, swarm_view, out);
+	}
+	queue(connection, std::move(out));
+}
+
+// Send every peer that joined with JOIN the current view of the swarm, so
+// that they can check theirs against it.
+static void broadcast_digest(void)
+{
+	std::vector<uint8_t> payload;
+	SwarmLayer::encode_view(swarm_view, payload);
+	std::vector<uint8_t> message;
+	SwarmLayer::append_payload_message(SwarmType::DIGEST, 0, payload,
+					   message);
+	for (auto &peer : connections) {
+		Connection &connection = *peer.second;
+		if (connection.registered && connection.sequenced)
+			queue(connection, std::vector<uint8_t>(message));
+	}
+}
+
+// Drop every file the peer announced from the index.
+static void unindex_files(Connection &connection)
+{
+	for (auto &filename : connection.announced) {
+		auto holders = file_index.find(filename);
+		if (holders == file_index.end())
+			continue;
+		holders->second.erase(
+			peer_key(connection.address, connection.port));
+		if (holders->second.empty())
+			file_index.erase(holders);
+	}
+	connection.announced.clear();
+}
+
+// Replace the files the peer announced before with the ones in payload.
+// :return: false if the payload is malformed
+static bool index_files(Connection &connection,
+			const std::vector<uint8_t> &payload)
+{
+	std::vector<ApplicationLayer::SwarmFile> files;
+	if (!SwarmLayer::decode_files(payload, files)) {
+		return false;
+	}
+	unindex_files(connection);
+	for (auto &file : files) {
+		file_index[file.file_name]
+			  [peer_key(connection.address, connection.port)] =
+				  std::make_tuple(connection.address,
+						  connection.port,
+						  file.num_chunks);
+		connection.announced.push_back(std::move(file.file_name));
+	}
+	return true;
+}
+
+// Answer a WHO_HAS with every peer but the one asking that has the file.
+// :return: false if the answer is too large to send
+static bool answer_who_has(Connection &connection, const uint16_t query_id,
+			   const std::vector<uint8_t> &payload)
+{
+	const std::string filename(payload.begin(), payload.end());
+	std::vector<ApplicationLayer::SwarmHolder> holders;
+	auto file = file_index.find(filename);
+	if (file != file_index.end()) {
+		holders.reserve(file->second.size());
+		for (auto &holder : file->second) {
+			if (holder.first !=
+			    peer_key(connection.address, connection.port))
+				holders.push_back(holder.second);
+		}
+	}
+	std::vector<uint8_t> response;
+	SwarmLayer::encode_holders(holders, response);
+	std::vector<uint8_t> message;
+	if (!SwarmLayer::append_payload_message(SwarmType::HOLDERS, query_id,
+						response, message)) {
+		return false;
+	}
+	queue(connection, std::move(message));
+	return true;
+}
+
+// Register the peer from its ADD or JOIN message, and tell the other peers it
+// has joined. A peer that sent ADD is sent one ADD per other peer. A peer that
+// sent JOIN is caught up from the SYNC it sent first, if any, or sent a
+// snapshot, ended with SNAPSHOT_END.
+// :return: false if the peer can't be registered
+static bool register_peer(Connection &connection, const uint8_t mode,
+			  const uint32_t address, const uint16_t port)
+{
 	// Make sure that the address this was sent from matches this address we
 	// received.
-	if (((sockaddr_in *)&client_addr)->sin_addr.s_addr != address) {
+	if (connection.socket_address != address) {
 		std::cerr
 			<< "The address the client sent doesn't match the one they "
 			   "connected to us with. Dropping the connection.\n";
-		close(client_socket);
+		return false;
+	}
+	connection.address = address;
+	connection.port = port;
+	if (mode == SwarmType::JOIN) {
+		// Our own ADD is part of what we catch up on, so that our seq
+		// lines up with the CHANGES that follow.
+		connection.registered = true;
+		connection.sequenced = true;
+		record_change(connection, SwarmType::ADD);
+		ApplicationLayer::SwarmView since = {};
+		if (connection.has_sync)
+			since = connection.sync;
+		catch_up(connection, since);
+		return true;
+	}
+	// Send ourselves the addresses, and ports of our peers, all in one go.
+	std::vector<uint8_t> peers_list;
+	for (auto &peer : connections) {
+		const Connection &other = *peer.second;
+		if (!other.registered)
+			continue;
+		SwarmMessage m;
+		// Add the mode, address and port, of the peer.
+		SwarmLayer::build_message(SwarmType::ADD, other.address,
+					  other.port, m);
+		peers_list.insert(peers_list.end(), m.begin(), m.end());
+	}
+	if (!peers_list.empty())
+		queue(connection, std::move(peers_list));
+	// Notify the other peers that we have joined.
+	record_change(connection, SwarmType::ADD);
+	connection.registered = true;
+	return true;
+}
+
+// Take the peer out of the swarm and the tracker's index, and tell the others
+// it has left.
+static void leave(Connection &connection)
+{
+	if (!connection.registered)
 		return;
+	connection.registered = false;
+	unindex_files(connection);
+	record_change(connection, SwarmType::REMOVE);
+}
+
+// Catch the peer up from the view in its SYNC. Before it has joined, the SYNC
+// is held onto until its JOIN.
+// :return: false if the payload is malformed
+static bool sync_peer(Connection &connection,
+		      const std::vector<uint8_t> &payload)
+{
+	ApplicationLayer::SwarmView since;
+	if (!SwarmLayer::decode_view(payload, since)) {
+		return false;
+	}
+	if (!connection.registered) {
+		connection.has_sync = true;
+		connection.sync = since;
+		return true;
 	}
-	// Lock context for the peers list (Scope based), Build the response message
-	// with all the other peers in it, then add ourselves to the list.
-	{
-		std::lock_guard<std::mutex> peers_guard(peers_lock);
-		// Send ourselves the addresses, and ports of our peers.
-		for (auto &peer : peers) {
-			SwarmMessage m;
-			uint32_t &peer_addr = std::get<1>(peer);
-			uint16_t &peer_port = std::get<2>(peer);
-			// Add the mode, address and port, of the peer.
-			SwarmLayer::build_message(1, peer_addr, peer_port, m);
-			// Send off the message
-			if (!(SwarmLayer::write_message(client_socket, m))) {
+	if (!connection.sequenced) {
+		return false;
+	}
+	catch_up(connection, since);
+	return true;
+}
+
+// Handle every whole message the peer has sent us.
+static void handle_input(Connection &connection)
+{
+	const size_t header_size = sizeof(SwarmMessage);
+	size_t used = 0;
+	while (!connection.dropped &&
+	       connection.input.size() - used >= header_size) {
+		const uint8_t *header = connection.input.data() + used;
+		// Pull the mode, address and port from the message
+		uint8_t mode = header[0];
+		uint32_t address = *((uint32_t *)(&header[1]));
+		uint16_t port = *((uint16_t *)(&header[5]));
+		if (!connection.registered && mode != SwarmType::SYNC) {
+			// The first message has to be the peer joining, or
+			// saying where to catch up from.
+			if (mode != SwarmType::ADD && mode != SwarmType::JOIN) {
 				std::cerr
-					<< "Error. Unable to write Swarm message to client.\n";
-				close(client_socket);
-				return;
+					<< "An unregistered peer cannot remove peers from the server.\n";
+				drop(connection);
+			} else if (!register_peer(connection, mode, address,
+						  port)) {
+				drop(connection);
 			}
+			used += header_size;
+			continue;
 		}
-		// Notify the other threads that we have joined.
-		for (auto &peer : peers) {
-			int peer_fd = std::get<0>(peer);
-			// Send off the message
-			if (!(SwarmLayer::write_message(peer_fd,
-							client_pair))) {
-				std::cerr
-					<< "Error. Unable to write Swarm message to client.\n";
-				close(client_socket);
-				return;
-			}
+		if (mode == SwarmType::REMOVE) {
+			// The peer is leaving. All done now.
+			leave(connection);
+			drop(connection);
+			used += header_size;
+			continue;
+		}
+		if (mode == SwarmType::ADD || mode == SwarmType::JOIN) {
+			std::cerr << "This peer should be sending a remove"
+				     " message but they sent add.\n";
+			drop(connection);
+			break;
+		}
+		// Everything else is a tracker message, carrying a payload.
+		const uint32_t length = ntohl(address);
+		if (length > ApplicationLayer::MAX_SWARM_PAYLOAD) {
+			std::cerr << "Tracker message from peer is too large.\n";
+			drop(connection);
+			break;
+		}
+		if (connection.input.size() - used - header_size < length) {
+			break;
+		}
+		const uint8_t *payload_begin = header + header_size;
+		std::vector<uint8_t> payload(payload_begin,
+					     payload_begin + length);
+		used += header_size + length;
+		bool success = false;
+		if (mode == SwarmType::SYNC) {
+			success = sync_peer(connection, payload);
+		} else if (mode == SwarmType::ANNOUNCE_FILES) {
+			success = index_files(connection, payload);
+		} else if (mode == SwarmType::WHO_HAS) {
+			success = answer_who_has(connection, ntohs(port),
+						 payload);
+		}
+		if (!success) {
+			std::cerr << "This peer should be sending a remove"
+				     " or tracker message but they sent "
+				  << (int)mode << ".\n";
+			drop(connection);
 		}
-		// Add ourselves to the peers list.
-		peers.push_back(std::make_tuple(client_socket, address, port));
 	}
-	// Wait for the client to send us the disconnect message to signify they are
-	// leaving (the data better be the same as the first time they sent it.)
-	// (We're not checking...)
-	if (!SwarmLayer::read_message(client_socket, mode, address, port,
-				      client_pair)) {
-		std::cerr
-			<< "Unable to read Swarm message from Message Layer.\n";
-		close(client_socket);
-		return;
+	connection.input.erase(connection.input.begin(),
+			       connection.input.begin() + used);
+}
+
+// Read whatever the peer has sent us without blocking, and handle it.
+static void receive(Connection &connection)
+{
+	std::array<uint8_t, READ_SIZE> buff;
+	const size_t input_limit =
+		sizeof(SwarmMessage) + ApplicationLayer::MAX_SWARM_PAYLOAD;
+	while (!connection.dropped) {
+		ssize_t bytes_read = read(connection.fd, buff.data(), buff.size());
+		if (bytes_read < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+		}
+		if (bytes_read <= 0) {
+			// The peer disconnected without saying goodbye.
+			leave(connection);
+			drop(connection);
+			break;
+		}
+		connection.input.insert(connection.input.end(), buff.begin(),
+					buff.begin() + bytes_read);
+		handle_input(connection);
+		if (connection.input.size() > input_limit) {
+			drop(connection);
+		}
 	}
-	if (mode != SwarmType::REMOVE) {
-		std::cerr << "This peer should be sending a remove"
-			     " message but they sent add.\n";
-		close(client_socket);
-		return;
+}
+
+// Send as much queued output as the socket takes without blocking, and only
+// ask epoll about writes while there is output left.
+static void flush(Connection &connection)
+{
+	while (!connection.output.empty()) {
+		// Gather up as many queued messages as one writev takes.
+		std::array<iovec, 64> parts;
+		size_t num_parts = 0;
+		size_t offset = connection.output_offset;
+		for (auto &message : connection.output) {
+			if (num_parts == parts.size())
+				break;
+			parts[num_parts].iov_base = message.data() + offset;
+			parts[num_parts].iov_len = message.size() - offset;
+			offset = 0;
+			++num_parts;
+		}
+		ssize_t sent = writev(connection.fd, parts.data(), num_parts);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			std::cerr << "Error. Unable to write Swarm message to client.\n";
+			leave(connection);
+			drop(connection);
+			return;
+		}
+		connection.output_bytes -= sent;
+		// Pop whatever went out whole
+		size_t left = sent + connection.output_offset;
+		while (!connection.output.empty() &&
+		       left >= connection.output.front().size()) {
+			left -= connection.output.front().size();
+			connection.output.pop_front();
+		}
+		connection.output_offset = left;
 	}
-	{
-		// Lock out the peers mutex
-		std::lock_guard<std::mutex> peers_guard(peers_lock);
-		// Remove ourselves from the peers list
-		peers.erase(std::find(peers.begin(), peers.end(),
-				      std::make_tuple(client_socket, address,
-						      port)));
-		// Notify the other threads that we are leaving, and that they need to
-		// remove us from their peer list.
-		for (auto &peer : peers) {
-			int peer_fd = std::get<0>(peer);
-			if (!(SwarmLayer::write_message(peer_fd,
-							client_pair))) {
+	uint32_t wanted = EPOLLIN | (connection.output.empty() ? 0 : EPOLLOUT);
+	if (wanted != connection.events) {
+		epoll_event event = {};
+		event.events = wanted;
+		event.data.fd = connection.fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection.fd, &event);
+		connection.events = wanted;
+	}
+}
+
+// Disconnect everyone dropped, and flush everyone with output, until neither
+// is left. Either can lead to more of the other.
+static void settle(void)
+{
+	while (!dropped.empty() || !dirty.empty()) {
+		while (!dropped.empty()) {
+			int fd = dropped.back();
+			dropped.pop_back();
+			auto item = connections.find(fd);
+			if (item == connections.end())
+				continue;
+			leave(*item->second);
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+			close(fd);
+			connections.erase(item);
+		}
+		std::vector<int> to_flush;
+		to_flush.swap(dirty);
+		for (int fd : to_flush) {
+			auto item = connections.find(fd);
+			if (item == connections.end())
+				continue;
+			item->second->dirty = false;
+			if (!item->second->dropped)
+				flush(*item->second);
+		}
+	}
+}
+
+// Accept every connection waiting on the listener.
+static void accept_peers(const int server_socket_fd)
+{
+	while (true) {
+		sockaddr_in client_addr;
+		socklen_t addr_len = sizeof(sockaddr_in);
+		int new_client_socket =
+			accept4(server_socket_fd, (sockaddr *)&client_addr,
+				&addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		// Make sure the client connection is valid
+		if (new_client_socket < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
 				std::cerr
-					<< "Error. Unable to write Swarm message to client.\n";
-				close(client_socket);
-				return;
+					<< "Error trying to accept connections on server socket.\n";
 			}
+			return;
 		}
+		std::unique_ptr<Connection> connection(new Connection());
+		connection->fd = new_client_socket;
+		connection->socket_address = client_addr.sin_addr.s_addr;
+		connection->registered = false;
+		connection->sequenced = false;
+		connection->has_sync = false;
+		connection->sync = {};
+		connection->address = 0;
+		connection->port = 0;
+		connection->output_offset = 0;
+		connection->output_bytes = 0;
+		connection->events = EPOLLIN;
+		connection->dirty = false;
+		connection->dropped = false;
+		epoll_event event = {};
+		event.events = EPOLLIN;
+		event.data.fd = new_client_socket;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_client_socket,
+			      &event) < 0) {
+			std::cerr << "Error. Unable to watch client connection.\n";
+			close(new_client_socket);
+			continue;
+		}
+		connections[new_client_socket] = std::move(connection);
 	}
-	// All done now.
-	close(client_socket);
 }
 
 int main(void)
 {
 	// Bind to our address
-	static int server_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+	static int server_socket_fd =
+		socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	// Make sure socket descriptor initialization was successful.
-	if (server_socket_fd == 0) {
+	if (server_socket_fd < 0) {
 		std::cerr << "Failed to Initialize server socket descriptor.\n";
 		exit(EXIT_FAILURE);
 	}
@@ -165,29 +631,71 @@ int main(void)
 		exit(EXIT_FAILURE);
 	}
 	// Set up listener for new connections
-	if (listen(server_socket_fd, 5) < 0) {
+	if (listen(server_socket_fd, LISTEN_BACKLOG) < 0) {
 		std::cerr
 			<< "Error trying to listen for connections on socket.\n";
 		exit(EXIT_FAILURE);
 	}
+	// Every peer is served from this one event loop. Nothing blocks in it,
+	// so one slow peer can't hold up the others.
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		std::cerr << "Error. Unable to create the server event loop.\n";
+		exit(EXIT_FAILURE);
+	}
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = server_socket_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket_fd, &event);
+	// A new epoch each time we start, so peers can tell our seqs from those
+	// of an earlier run. 0 is left for peers that have no view yet.
+	std::random_device random;
+	swarm_view.epoch = random();
+	if (swarm_view.epoch == 0)
+		swarm_view.epoch = 1;
+	auto next_digest = std::chrono::steady_clock::now() + DIGEST_INTERVAL;
 	// Accept and accommodate the incoming connections
-	socklen_t addr_len = sizeof(sockaddr_in);
+	std::array<epoll_event, MAX_EVENTS> events;
 	while (true) {
-		// Accept a client connection
-		sockaddr client_addr;
-		int new_client_socket = accept(
-			server_socket_fd, (sockaddr *)&client_addr, &addr_len);
-		// Make sure the client connection is valid
-		if (new_client_socket < 0) {
-			std::cerr
-				<< "Error trying to accept connections on server socket.\n";
-			exit(EXIT_FAILURE);
+		auto now = std::chrono::steady_clock::now();
+		if (now >= next_digest) {
+			broadcast_digest();
+			settle();
+			next_digest = now + DIGEST_INTERVAL;
+		}
+		int timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+				      next_digest - now)
+				      .count() +
+			      1;
+		int num_events = epoll_wait(epoll_fd, events.data(),
+					    events.size(), timeout);
+		if (num_events < 0) {
+			if (errno == EINTR)
+				continue;
+			std::cerr << "Error. The server event loop failed.\n";
+			break;
+		}
+		for (int i = 0; i < num_events; ++i) {
+			const int fd = events[i].data.fd;
+			if (fd == server_socket_fd) {
+				accept_peers(server_socket_fd);
+				continue;
+			}
+			auto item = connections.find(fd);
+			if (item == connections.end())
+				continue;
+			Connection &connection = *item->second;
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				receive(connection);
+			if ((events[i].events & EPOLLOUT) && !connection.dirty) {
+				connection.dirty = true;
+				dirty.push_back(fd);
+			}
 		}
-		// Set up the client thread for this connection.
-		std::thread(register_peer, new_client_socket, client_addr)
-			.detach();
+		settle();
 	}
 	// Close out the server socket.
+	close(epoll_fd);
 	close(server_socket_fd);
 	return 0;
 }
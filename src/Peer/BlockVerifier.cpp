@@ -0,0 +1,116 @@
+#include "BlockVerifier.hpp"
+#include <algorithm>
+#include <iostream>
+#include <cerrno>
+extern "C" {
+#include <unistd.h>
+}
+
+namespace Peer
+{
+BlockVerifier::BlockVerifier(
+	const int file_fd,
+	const std::vector<ApplicationLayer::HashDigest> &leaves,
+	ChunkScheduler &scheduler, DownloadState &state,
+	const size_t num_threads)
+	: file_fd(file_fd), leaves(leaves), scheduler(scheduler), state(state),
+	  finishing(false)
+{
+	size_t count = num_threads;
+	if (count == 0) {
+		count = std::max<size_t>(1, std::thread::hardware_concurrency());
+	}
+	for (size_t i = 0; i < count; ++i) {
+		threads.push_back(std::thread([this] { run(); }));
+	}
+}
+
+BlockVerifier::~BlockVerifier(void)
+{
+	finish();
+}
+
+// worker wrote length bytes of block_idx at offset in the file. Queue it to be
+// checked.
+void BlockVerifier::submit(const size_t worker, const uint32_t block_idx,
+			   const uint64_t offset, const uint32_t length,
+			   const uint32_t expected_length)
+{
+	{
+		std::lock_guard<std::mutex> verifier_guard(verifier_lock);
+		Block block = { worker, block_idx, offset, length,
+				expected_length };
+		blocks.push_back(block);
+	}
+	queued.notify_one();
+}
+
+// Check whatever blocks are left, and stop the threads.
+void BlockVerifier::finish(void)
+{
+	{
+		std::lock_guard<std::mutex> verifier_guard(verifier_lock);
+		finishing = true;
+	}
+	queued.notify_all();
+	for (auto &t : threads) {
+		if (t.joinable()) {
+			t.join();
+		}
+	}
+}
+
+// Read the block back from the file, and check it against the leaves.
+
+// :return: whether it matches
+bool BlockVerifier::check(const Block &block, std::vector<uint8_t> &buff) const
+{
+	buff.resize(block.length);
+	size_t done = 0;
+	while (done < block.length) {
+		ssize_t bytes_read = pread(file_fd, buff.data() + done,
+					   block.length - done,
+					   block.offset + done);
+		if (bytes_read < 0 && errno == EINTR)
+			continue;
+		if (bytes_read <= 0) {
+			std::cerr << "Error. Unable to read back block to check it.\n";
+			return false;
+		}
+		done += bytes_read;
+	}
+	return ApplicationLayer::HashTree::verify(leaves, block.offset,
+						  buff.data(), block.length,
+						  block.expected_length);
+}
+
+// Check blocks until we finish and there are none left.
+void BlockVerifier::run(void)
+{
+	std::vector<uint8_t> buff;
+	while (true) {
+		Block block;
+		{
+			std::unique_lock<std::mutex> verifier_guard(
+				verifier_lock);
+			queued.wait(verifier_guard, [this] {
+				return finishing || !blocks.empty();
+			});
+			if (blocks.empty())
+				return;
+			block = blocks.front();
+			blocks.pop_front();
+		}
+		if (check(block, buff)) {
+			state.mark(block.block_idx,
+				   block.offset + block.length);
+			scheduler.complete(block.block_idx);
+		} else {
+			std::cerr << "Error. Block " << block.block_idx
+				  << " doesn't match the file's hashes.\n";
+			state.unmark(block.block_idx);
+			scheduler.reject(block.worker, block.block_idx);
+		}
+	}
+}
+} // namespace Peer
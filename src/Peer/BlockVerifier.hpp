@@ -0,0 +1,69 @@
+#pragma once
+#include "ChunkScheduler.hpp"
+#include "DownloadState.hpp"
+#include "../ApplicationLayer/HashTree.hpp"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+namespace Peer
+{
+// Default number of threads checking blocks. 0 means one per core.
+static const size_t constexpr DEFAULT_VERIFY_THREADS = 0;
+
+// Checks the blocks of one download against the file's HashTree leaves on its
+// own threads, while the workers go on receiving. A block is only complete in
+// the scheduler, and marked in the download's state, once it matches. A block
+// that doesn't is fetched again, and the worker that sent it is given nothing
+// more.
+class BlockVerifier {
+	// A block that has landed in the destination file
+	struct Block {
+		size_t worker;
+		uint32_t block_idx;
+		uint64_t offset;
+		uint32_t length;
+		// How long the block would be if the file didn't end in it
+		uint32_t expected_length;
+	};
+	const int file_fd;
+	const std::vector<ApplicationLayer::HashDigest> &leaves;
+	ChunkScheduler &scheduler;
+	DownloadState &state;
+	std::mutex verifier_lock;
+	std::condition_variable queued;
+	// Blocks waiting to be checked, in the order they landed
+	std::deque<Block> blocks;
+	bool finishing;
+	std::vector<std::thread> threads;
+
+	// Check blocks until we finish and there are none left.
+	void run(void);
+
+	// Read the block back from the file, and check it against the leaves.
+
+	// :return: whether it matches
+	bool check(const Block &block, std::vector<uint8_t> &buff) const;
+
+    public:
+	BlockVerifier(const int file_fd,
+		      const std::vector<ApplicationLayer::HashDigest> &leaves,
+		      ChunkScheduler &scheduler, DownloadState &state,
+		      const size_t num_threads = DEFAULT_VERIFY_THREADS);
+	~BlockVerifier(void);
+	// This cannot be moved, deleted, or reassigned
+	BlockVerifier(BlockVerifier &&verifier) = delete;
+	BlockVerifier(BlockVerifier &verifier) = delete;
+	BlockVerifier &operator=(BlockVerifier &verifier) = delete;
+	BlockVerifier &operator=(BlockVerifier &&verifier) = delete;
+	// worker wrote length bytes of block_idx at offset in the file. Queue it
+	// to be checked.
+	void submit(const size_t worker, const uint32_t block_idx,
+		    const uint64_t offset, const uint32_t length,
+		    const uint32_t expected_length);
+	// Check whatever blocks are left, and stop the threads.
+	void finish(void);
+};
+} // namespace Peer
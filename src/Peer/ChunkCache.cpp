@@ -0,0 +1,148 @@
+#include "ChunkCache.hpp"
+extern "C" {
+#include <sys/mman.h>
+#include <unistd.h>
+}
+
+namespace Peer
+{
+ChunkCache::ChunkCache(const size_t budget)
+	: budget(budget), cached_bytes(0), hits(0), misses(0), stopping(false)
+{
+	if (budget > 0)
+		loader = std::thread([this] { load(); });
+}
+
+ChunkCache::~ChunkCache(void)
+{
+	{
+		std::lock_guard<std::mutex> cache_guard(cache_lock);
+		stopping = true;
+	}
+	load_wanted.notify_all();
+	if (loader.joinable())
+		loader.join();
+	for (auto &entry : entries) {
+		munmap(entry.second.mapping, entry.second.map_length);
+	}
+}
+
+// Map length bytes of the file from offset, reading them in, and lock them in
+// memory where we are allowed to. A mapping has to start on a page, so it
+// takes in the part of the page before offset too. This waits on the disk, so
+// only the loader does it.
+
+// :return: the entry, with a null mapping on failure
+ChunkCache::Entry ChunkCache::map_range(const int fd, const off_t offset,
+					const size_t length)
+{
+	static const off_t page_size = sysconf(_SC_PAGESIZE);
+	const off_t map_offset = offset - offset % page_size;
+	Entry entry = { nullptr, length + (size_t)(offset - map_offset),
+			length, std::list<Key>::iterator() };
+	void *mapping = mmap(nullptr, entry.map_length, PROT_READ,
+			     MAP_SHARED | MAP_POPULATE, fd, map_offset);
+	if (mapping == MAP_FAILED)
+		return entry;
+	// Without the right to lock memory, the mapping still keeps the pages
+	// in use, just not pinned.
+	mlock(mapping, entry.map_length);
+	entry.mapping = mapping;
+	return entry;
+}
+
+// Let go of the entries served least recently until we are within budget.
+// cache_lock must be held.
+void ChunkCache::evict(void)
+{
+	while (cached_bytes > budget && !recent.empty()) {
+		auto entry = entries.find(recent.back());
+		munmap(entry->second.mapping, entry->second.map_length);
+		cached_bytes -= entry->second.length;
+		entries.erase(entry);
+		recent.pop_back();
+	}
+}
+
+// Read in the ranges asked for until we stop.
+void ChunkCache::load(void)
+{
+	std::unique_lock<std::mutex> cache_guard(cache_lock);
+	while (true) {
+		load_wanted.wait(cache_guard, [this] {
+			return stopping || !to_load.empty();
+		});
+		if (stopping)
+			return;
+		const std::pair<Key, size_t> range = to_load.front();
+		to_load.pop_front();
+		// Reading it in may take a while, let the reactors at it.
+		cache_guard.unlock();
+		Entry mapped = map_range(range.first.first, range.first.second,
+					 range.second);
+		cache_guard.lock();
+		loading.erase(range.first);
+		if (mapped.mapping != nullptr)
+			insert(range.first, mapped);
+	}
+}
+
+// Cache the range mapped for key, unless it is cached already. cache_lock must
+// be held.
+void ChunkCache::insert(const Key &key, Entry &mapped)
+{
+	auto entry = entries.find(key);
+	if (entry != entries.end()) {
+		// It was read in before, or with less of it.
+		if (entry->second.length >= mapped.length) {
+			munmap(mapped.mapping, mapped.map_length);
+			return;
+		}
+		munmap(entry->second.mapping, entry->second.map_length);
+		cached_bytes -= entry->second.length;
+		recent.erase(entry->second.recent);
+		entries.erase(entry);
+	}
+	recent.push_front(key);
+	mapped.recent = recent.begin();
+	entries.insert(std::make_pair(key, mapped));
+	cached_bytes += mapped.length;
+	evict();
+}
+
+// length bytes of the open file from offset are about to be served. Keep them
+// in memory, and have them read in if they aren't already.
+
+// :return: whether they were already cached
+bool ChunkCache::touch(const int fd, const off_t offset, const size_t length)
+{
+	const Key key(fd, offset);
+	{
+		std::lock_guard<std::mutex> cache_guard(cache_lock);
+		auto entry = entries.find(key);
+		if (entry != entries.end() && entry->second.length >= length) {
+			recent.splice(recent.begin(), recent,
+				      entry->second.recent);
+			++hits;
+			return true;
+		}
+		++misses;
+		if (length > budget || !loading.insert(key).second)
+			return false;
+		to_load.push_back(std::make_pair(key, length));
+	}
+	load_wanted.notify_one();
+	return false;
+}
+
+// Print the hit rate and how much is cached.
+void ChunkCache::report(std::ostream &out)
+{
+	std::lock_guard<std::mutex> cache_guard(cache_lock);
+	uint64_t requests = hits + misses;
+	out << "Chunk cache: " << requests << " chunk responses, hit rate "
+	    << (requests == 0 ? 0.0 : 100.0 * hits / requests) << "%, "
+	    << cached_bytes << " bytes cached, budget " << budget
+	    << " bytes.\n";
+}
+} // namespace Peer
@@ -0,0 +1,86 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <thread>
+#include <utility>
+extern "C" {
+#include <sys/types.h>
+}
+namespace Peer
+{
+// Default memory kept for the chunks served most recently. 0 turns the cache
+// off.
+static const size_t constexpr DEFAULT_CHUNK_CACHE_SIZE = 256 * 1000 * 1000;
+
+// Keeps the chunks a seeder served most recently in memory, shared by every
+// reactor. A cached chunk is mapped and locked, so its pages stay in the page
+// cache and sendfile() sends them straight from memory, without a copy and
+// without going back to disk. A chunk that isn't cached yet is read in on the
+// cache's own thread, so a reactor never waits on the disk for it. Once the
+// cache is over its budget, the chunk served least recently is let go.
+class ChunkCache {
+	friend class ChunkCacheTests;
+	// (file descriptor, offset in the file)
+	using Key = std::pair<int, off_t>;
+	struct Entry {
+		void *mapping;
+		size_t map_length;
+		// Bytes of the file it holds, from the offset in its key
+		size_t length;
+		std::list<Key>::iterator recent;
+	};
+	const size_t budget;
+	std::mutex cache_lock;
+	// Most recently served first
+	std::list<Key> recent;
+	std::map<Key, Entry> entries;
+	size_t cached_bytes;
+	uint64_t hits;
+	uint64_t misses;
+	std::condition_variable load_wanted;
+	// Ranges waiting to be read in, oldest first
+	std::deque<std::pair<Key, size_t> > to_load;
+	// Keys waiting to be read in or being read in
+	std::set<Key> loading;
+	bool stopping;
+	std::thread loader;
+
+	// Read in the ranges asked for until we stop.
+	void load(void);
+	// Map length bytes of the file from offset, reading them in, and lock
+	// them in memory where we are allowed to.
+
+	// :return: the entry, with a null mapping on failure
+	static Entry map_range(const int fd, const off_t offset,
+			       const size_t length);
+	// Let go of the entries served least recently until we are within
+	// budget. cache_lock must be held.
+	void evict(void);
+	// Cache the range mapped for key, unless it is cached already.
+	// cache_lock must be held.
+	void insert(const Key &key, Entry &mapped);
+
+    public:
+	explicit ChunkCache(const size_t budget = DEFAULT_CHUNK_CACHE_SIZE);
+	~ChunkCache(void);
+	// This cannot be moved, deleted, or reassigned
+	ChunkCache(ChunkCache &&cache) = delete;
+	ChunkCache(ChunkCache &cache) = delete;
+	ChunkCache &operator=(ChunkCache &cache) = delete;
+	ChunkCache &operator=(ChunkCache &&cache) = delete;
+	// length bytes of the open file from offset are about to be served.
+	// Keep them in memory, and have them read in if they aren't already.
+
+	// :return: whether they were already cached
+	bool touch(const int fd, const off_t offset, const size_t length);
+	// Print the hit rate and how much is cached.
+	void report(std::ostream &out);
+};
+} // namespace Peer
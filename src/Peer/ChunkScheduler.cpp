@@ -0,0 +1,358 @@
+#include "ChunkScheduler.hpp"
+#include <algorithm>
+#include <limits>
+extern "C" {
+#include <sys/socket.h>
+}
+
+namespace Peer
+{
+// Stands in for a worker where there is none
+static const size_t constexpr NO_WORKER = std::numeric_limits<size_t>::max();
+
+ChunkScheduler::ChunkScheduler(const uint32_t num_chunks,
+			       const std::chrono::milliseconds chunk_timeout)
+	: num_chunks(num_chunks), chunk_timeout(chunk_timeout),
+	  done(num_chunks, false), num_done(0), arrived(num_chunks, false),
+	  num_hedged(0), redundant_bytes(0), num_cut_off(0)
+{
+	for (uint32_t chunk_idx = 0; chunk_idx < num_chunks; ++chunk_idx) {
+		pending.push_back(chunk_idx);
+	}
+}
+
+// Hand a chunk past its deadline to worker, if there is one it isn't already
+// fetching. scheduler_lock must be held.
+
+// :return: whether one was found
+bool ChunkScheduler::reclaim_expired(const size_t worker,
+				     uint32_t &out_chunk_idx)
+{
+	auto now = std::chrono::steady_clock::now();
+	for (auto &chunk : in_flight) {
+		auto &workers = chunk.second.workers;
+		if (chunk.second.deadline <= now &&
+		    std::find(workers.begin(), workers.end(), worker) ==
+			    workers.end()) {
+			// Whoever stalled on it is given up on.
+			cut_off(chunk.first, worker, false);
+			workers.assign(1, worker);
+			chunk.second.deadline = now + chunk_timeout;
+			out_chunk_idx = chunk.first;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Hand worker a copy of the chunk in flight with the fewest workers, the one
+// handed out first among them, as long as it has fewer than MAX_ENDGAME_COPIES
+// and worker isn't one of them. scheduler_lock must be held.
+
+// :return: whether one was found
+bool ChunkScheduler::hedge(const size_t worker, uint32_t &out_chunk_idx)
+{
+	auto best = in_flight.end();
+	for (auto chunk = in_flight.begin(); chunk != in_flight.end(); ++chunk) {
+		auto &workers = chunk->second.workers;
+		if (workers.size() >= MAX_ENDGAME_COPIES ||
+		    std::find(workers.begin(), workers.end(), worker) !=
+			    workers.end())
+			continue;
+		if (best == in_flight.end() ||
+		    workers.size() < best->second.workers.size() ||
+		    (workers.size() == best->second.workers.size() &&
+		     chunk->second.deadline < best->second.deadline))
+			best = chunk;
+	}
+	if (best == in_flight.end())
+		return false;
+	best->second.workers.push_back(worker);
+	out_chunk_idx = best->first;
+	++num_hedged;
+	return true;
+}
+
+// Take worker off the chunk. If nobody else is fetching it, and no copy of it
+// has come in, it goes back to the front of the queue. scheduler_lock must be
+// held.
+void ChunkScheduler::drop_worker(
+	const size_t worker,
+	std::unordered_map<uint32_t, Assignment>::iterator chunk)
+{
+	auto &workers = chunk->second.workers;
+	workers.erase(std::remove(workers.begin(), workers.end(), worker),
+		      workers.end());
+	if (workers.empty()) {
+		// Failed chunks go to the front, so the file fills in order.
+		if (!arrived[chunk->first])
+			pending.push_front(chunk->first);
+		in_flight.erase(chunk);
+	}
+}
+
+// Shut down the sockets waiting on the chunk, other than worker's. With beaten
+// set, it is because another copy came in first. scheduler_lock must be held.
+void ChunkScheduler::cut_off(const uint32_t chunk_idx, const size_t worker,
+			     const bool beaten)
+{
+	for (auto &watcher : watched) {
+		if (watcher.first != worker &&
+		    watcher.second.chunk_idx == chunk_idx) {
+			shutdown(watcher.second.socket_fd, SHUT_RDWR);
+			++num_cut_off;
+			if (beaten)
+				outrun.insert(watcher.first);
+		}
+	}
+}
+
+// Take the next chunk for worker to fetch. With wait set, worker has nothing in
+// flight, so in the endgame it gets a copy of a chunk in flight with others.
+// Failing that, wait until a chunk comes back, misses its deadline, or the
+// download is over.
+
+// :return: false if there is nothing for worker to fetch
+bool ChunkScheduler::take(const size_t worker, const bool wait,
+			  uint32_t &out_chunk_idx)
+{
+	std::unique_lock<std::mutex> scheduler_guard(scheduler_lock);
+	while (true) {
+		// A worker that sent us a bad chunk gets nothing more.
+		if (rejected.count(worker) > 0)
+			return false;
+		// Chunks that already landed by another worker are skipped.
+		while (!pending.empty() && done[pending.front()]) {
+			pending.pop_front();
+		}
+		if (!pending.empty()) {
+			out_chunk_idx = pending.front();
+			pending.pop_front();
+			Assignment assignment = {
+				std::vector<size_t>(1, worker),
+				std::chrono::steady_clock::now() + chunk_timeout,
+				worker
+			};
+			in_flight[out_chunk_idx] = assignment;
+			return true;
+		}
+		if (reclaim_expired(worker, out_chunk_idx)) {
+			return true;
+		}
+		if (!wait || in_flight.empty()) {
+			return false;
+		}
+		if (hedge(worker, out_chunk_idx)) {
+			return true;
+		}
+		// Wake up in time for the next deadline still to come. Those
+		// already missed are ones worker is fetching, so only a change
+		// can give it anything.
+		auto now = std::chrono::steady_clock::now();
+		bool any_ahead = false;
+		auto next_deadline = now;
+		for (auto &chunk : in_flight) {
+			if (chunk.second.deadline <= now)
+				continue;
+			if (!any_ahead || chunk.second.deadline < next_deadline)
+				next_deadline = chunk.second.deadline;
+			any_ahead = true;
+		}
+		if (any_ahead)
+			changed.wait_until(scheduler_guard, next_deadline);
+		else
+			changed.wait(scheduler_guard);
+	}
+}
+
+// worker's copy of the chunk, bytes long, has come in. The copies after the
+// first are what the endgame costs. If it is the first, the other copies still
+// coming in are cut off. If not, worker is taken off the chunk, so that should
+// the first turn out bad, the chunk goes back in the queue.
+
+// :return: whether another copy came in first
+bool ChunkScheduler::arrive(const size_t worker, const uint32_t chunk_idx,
+			    const uint32_t bytes)
+{
+	{
+		std::lock_guard<std::mutex> scheduler_guard(scheduler_lock);
+		if (chunk_idx >= num_chunks)
+			return false;
+		if (!arrived[chunk_idx]) {
+			arrived[chunk_idx] = true;
+			// The worker that fetched it has already stopped
+			// watching.
+			cut_off(chunk_idx, NO_WORKER, true);
+			return false;
+		}
+		redundant_bytes += bytes;
+		auto chunk = in_flight.find(chunk_idx);
+		if (chunk != in_flight.end())
+			drop_worker(worker, chunk);
+	}
+	changed.notify_all();
+	return true;
+}
+
+// Whether worker's socket was last shut down because another copy of its chunk
+// came in first, rather than for taking too long
+
+// :return: whether it was, once
+bool ChunkScheduler::was_outrun(const size_t worker)
+{
+	std::lock_guard<std::mutex> scheduler_guard(scheduler_lock);
+	return outrun.erase(worker) > 0;
+}
+
+// Wait until nobody is writing the chunk in place, so that a copy fetched aside
+// can be put there. Whoever is has been cut off, so it stops soon.
+void ChunkScheduler::wait_for_writer(const uint32_t chunk_idx)
+{
+	std::unique_lock<std::mutex> scheduler_guard(scheduler_lock);
+	changed.wait(scheduler_guard, [&] {
+		for (auto &watcher : watched) {
+			if (watcher.second.chunk_idx == chunk_idx &&
+			    watcher.second.in_place)
+				return false;
+		}
+		return true;
+	});
+}
+
+// The chunk has landed. Whoever else was fetching it can stop.
+void ChunkScheduler::complete(const uint32_t chunk_idx)
+{
+	{
+		std::lock_guard<std::mutex> scheduler_guard(scheduler_lock);
+		in_flight.erase(chunk_idx);
+		if (chunk_idx >= num_chunks || done[chunk_idx])
+			return;
+		done[chunk_idx] = true;
+		arrived[chunk_idx] = true;
+		++num_done;
+		// Cut off the copies still coming in.
+		if (num_done == num_chunks) {
+			for (auto &worker : watched) {
+				shutdown(worker.second.socket_fd, SHUT_RDWR);
+			}
+			num_cut_off += watched.size();
+		}
+	}
+	changed.notify_all();
+}
+
+// worker couldn't fetch the chunk, give it to someone else.
+void ChunkScheduler::fail(const size_t worker, const uint32_t chunk_idx)
+{
+	{
+		std::lock_guard<std::mutex> scheduler_guard(scheduler_lock);
+		auto chunk = in_flight.find(chunk_idx);
+		// It may have been handed to someone else since.
+		if (chunk == in_flight.end())
+			return;
+		auto &workers = chunk->second.workers;
+		if (std::find(workers.begin(), workers.end(), worker) ==
+		    workers.end())
+			return;
+		drop_worker(worker, chunk);
+	}
+	changed.notify_all();
+}
+
+// What worker sent for the chunk is bad. Fetch it again from someone else, and
+// give worker nothing more.
+void ChunkScheduler::reject(const size_t worker, const uint32_t chunk_idx)
+{
+	{
+		std::lock_guard<std::mutex> scheduler_guard(scheduler_lock);
+		rejected.insert(worker);
+		if (chunk_idx >= num_chunks)
+			return;
+		// The bad bytes may have landed on top of a good copy.
+		if (done[chunk_idx]) {
+			done[chunk_idx] = false;
+			--num_done;
+		}
+		arrived[chunk_idx] = false;
+		auto chunk = in_flight.find(chunk_idx);
+		if (chunk == in_flight.end()) {
+			pending.push_front(chunk_idx);
+		} else {
+			// Someone else fetching it will write over the bad
+			// bytes.
+			drop_worker(worker, chunk);
+		}
+	}
+	changed.notify_all();
+}
+
+// worker won't be taking any more chunks.
+void ChunkScheduler::leave(const size_t worker)
+{
+	{
+		std::lock_guard<std::mutex> scheduler_guard(scheduler_lock);
+		// Nobody is coming back for what the worker still had.
+		std::vector<uint32_t> chunks;
+		for (auto &chunk : in_flight) {
+			chunks.push_back(chunk.first);
+		}
+		for (uint32_t chunk_idx : chunks) {
+			drop_worker(worker, in_flight.find(chunk_idx));
+		}
+	}
+	changed.notify_all();
+}
+
+// worker is about to wait on the socket for the chunk. Once another copy of it
+// has landed, or every chunk has, the socket is shut down, so nobody waits on a
+// copy that isn't needed. Only the worker the chunk was first handed to writes
+// it in place, and only while no copy of it has come in. The worker mustn't
+// close the socket until it stops watching it.
+
+// :return: false if every chunk has already landed
+bool ChunkScheduler::watch(const size_t worker, const int socket_fd,
+			   const uint32_t chunk_idx, bool &out_in_place)
+{
+	std::lock_guard<std::mutex> scheduler_guard(scheduler_lock);
+	if (num_done == num_chunks)
+		return false;
+	auto chunk = in_flight.find(chunk_idx);
+	out_in_place = chunk != in_flight.end() &&
+		       chunk->second.writer == worker && !arrived[chunk_idx];
+	const Watch watch = { socket_fd, chunk_idx, out_in_place };
+	watched[worker] = watch;
+	outrun.erase(worker);
+	return true;
+}
+
+// worker is done waiting on its socket.
+void ChunkScheduler::unwatch(const size_t worker)
+{
+	{
+		std::lock_guard<std::mutex> scheduler_guard(scheduler_lock);
+		watched.erase(worker);
+	}
+	// Someone may be waiting for it to stop writing in place.
+	changed.notify_all();
+}
+
+// Whether every chunk has landed
+bool ChunkScheduler::finished(void)
+{
+	std::lock_guard<std::mutex> scheduler_guard(scheduler_lock);
+	return num_done == num_chunks;
+}
+
+// Print what the endgame cost, against a download of total_bytes.
+void ChunkScheduler::report(std::ostream &out, const uint64_t total_bytes)
+{
+	std::lock_guard<std::mutex> scheduler_guard(scheduler_lock);
+	if (num_hedged == 0)
+		return;
+	out << "Endgame: " << num_hedged << " duplicate requests, "
+	    << num_cut_off << " transfers cut off, " << redundant_bytes
+	    << " redundant bytes received in full ("
+	    << (total_bytes == 0 ? 0.0 : 100.0 * redundant_bytes / total_bytes)
+	    << "% of the download).\n";
+}
+} // namespace Peer
@@ -0,0 +1,145 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+namespace Peer
+{
+// Most workers fetching one chunk at once in the endgame
+static const size_t constexpr MAX_ENDGAME_COPIES = 3;
+
+// Hands out the chunks of one download to the workers fetching it, one peer
+// per worker. A chunk here is whatever unit the download is fetched in, which
+// may be a block of a chunk on the wire. Workers take a chunk whenever they
+// have room for one, so faster peers end up fetching more of the file. Each
+// chunk handed out has a deadline, and a chunk that misses it, or whose worker
+// fails, goes to the next worker that asks. Once every chunk has been handed
+// out, a worker with nothing left to fetch is handed a copy of a chunk still in
+// flight with others. This is the endgame: whichever copy lands first wins, and
+// the sockets still waiting on other copies of that chunk are shut down, so the
+// download doesn't wait on its slowest peer. Only the worker a chunk was first
+// handed to writes it in place. Every other copy is fetched aside, and only put
+// in place if it wins, once the worker writing in place has stopped, so a
+// losing copy never lands on top of the winner.
+class ChunkScheduler {
+	// Who is fetching a chunk, and until when the first of them has it
+	struct Assignment {
+		std::vector<size_t> workers;
+		std::chrono::steady_clock::time_point deadline;
+		// The worker that writes the chunk in place
+		size_t writer;
+	};
+	// The socket a worker is waiting on a chunk from
+	struct Watch {
+		int socket_fd;
+		uint32_t chunk_idx;
+		bool in_place;
+	};
+	const uint32_t num_chunks;
+	const std::chrono::milliseconds chunk_timeout;
+	std::mutex scheduler_lock;
+	std::condition_variable changed;
+	// Chunks waiting for a worker, in the order they should be fetched
+	std::deque<uint32_t> pending;
+	// chunk index: who is fetching it
+	std::unordered_map<uint32_t, Assignment> in_flight;
+	std::vector<bool> done;
+	uint32_t num_done;
+	// Chunks a copy of has come in, checked or not
+	std::vector<bool> arrived;
+	// Copies handed out in the endgame
+	uint64_t num_hedged;
+	// Bytes of copies that came in after another copy of the chunk
+	uint64_t redundant_bytes;
+	// Sockets shut down on copies still coming in once another copy landed
+	uint64_t num_cut_off;
+	// worker: the socket it is waiting on a chunk from
+	std::unordered_map<size_t, Watch> watched;
+	// Workers that sent us a bad chunk
+	std::unordered_set<size_t> rejected;
+	// Workers cut off because another copy of their chunk came in first
+	std::unordered_set<size_t> outrun;
+
+	// Hand a chunk past its deadline to worker, if there is one it isn't
+	// already fetching. scheduler_lock must be held.
+
+	// :return: whether one was found
+	bool reclaim_expired(const size_t worker, uint32_t &out_chunk_idx);
+	// Hand worker a copy of the chunk in flight with the fewest workers,
+	// the one handed out first among them, as long as it has fewer than
+	// MAX_ENDGAME_COPIES and worker isn't one of them. scheduler_lock must
+	// be held.
+
+	// :return: whether one was found
+	bool hedge(const size_t worker, uint32_t &out_chunk_idx);
+	// Take worker off the chunk. If nobody else is fetching it, and no copy
+	// of it has come in, it goes back to the front of the queue.
+	// scheduler_lock must be held.
+	void drop_worker(const size_t worker,
+			 std::unordered_map<uint32_t, Assignment>::iterator chunk);
+	// Shut down the sockets waiting on the chunk, other than worker's.
+	// With beaten set, it is because another copy came in first.
+	// scheduler_lock must be held.
+	void cut_off(const uint32_t chunk_idx, const size_t worker,
+		     const bool beaten);
+
+    public:
+	ChunkScheduler(const uint32_t num_chunks,
+		       const std::chrono::milliseconds chunk_timeout);
+	// This cannot be moved, deleted, or reassigned
+	ChunkScheduler(ChunkScheduler &&scheduler) = delete;
+	ChunkScheduler(ChunkScheduler &scheduler) = delete;
+	ChunkScheduler &operator=(ChunkScheduler &scheduler) = delete;
+	ChunkScheduler &operator=(ChunkScheduler &&scheduler) = delete;
+	// Take the next chunk for worker to fetch. With wait set, worker has
+	// nothing in flight, so in the endgame it gets a copy of a chunk in
+	// flight with others. Failing that, wait until a chunk comes back,
+	// misses its deadline, or the download is over.
+
+	// :return: false if there is nothing for worker to fetch
+	bool take(const size_t worker, const bool wait, uint32_t &out_chunk_idx);
+	// worker's copy of the chunk, bytes long, has come in. If it is the
+	// first, the other copies still coming in are cut off. If not, worker
+	// is taken off the chunk.
+
+	// :return: whether another copy came in first
+	bool arrive(const size_t worker, const uint32_t chunk_idx,
+		    const uint32_t bytes);
+	// Whether worker's socket was last shut down because another copy of
+	// its chunk came in first, rather than for taking too long
+
+	// :return: whether it was, once
+	bool was_outrun(const size_t worker);
+	// Wait until nobody is writing the chunk in place, so that a copy fetched
+	// aside can be put there.
+	void wait_for_writer(const uint32_t chunk_idx);
+	// The chunk has landed. Whoever else was fetching it can stop.
+	void complete(const uint32_t chunk_idx);
+	// worker couldn't fetch the chunk, give it to someone else.
+	void fail(const size_t worker, const uint32_t chunk_idx);
+	// What worker sent for the chunk is bad. Fetch it again from someone
+	// else, and give worker nothing more.
+	void reject(const size_t worker, const uint32_t chunk_idx);
+	// worker won't be taking any more chunks.
+	void leave(const size_t worker);
+	// worker is about to wait on the socket for the chunk. Once another copy
+	// of it has landed, the socket is shut down, so nobody waits on a copy
+	// that isn't needed. out_in_place says whether worker may write the
+	// chunk in place, or has to fetch it aside.
+
+	// :return: false if every chunk has already landed
+	bool watch(const size_t worker, const int socket_fd,
+		   const uint32_t chunk_idx, bool &out_in_place);
+	// worker is done waiting on its socket.
+	void unwatch(const size_t worker);
+	// Whether every chunk has landed
+	bool finished(void);
+	// Print what the endgame cost, against a download of total_bytes.
+	void report(std::ostream &out, const uint64_t total_bytes);
+};
+} // namespace Peer
@@ -0,0 +1,122 @@
+#include "CompressedCache.hpp"
+#include "../ApplicationLayer/Compression.hpp"
+#include <cerrno>
+extern "C" {
+#include <unistd.h>
+}
+
+namespace Peer
+{
+// What an entry costs on top of its compressed bytes, so the blocks that don't
+// compress stay within the budget too
+static const size_t constexpr ENTRY_COST = 128;
+
+CompressedCache::CompressedCache(const size_t budget)
+	: budget(budget), cached_bytes(0), hits(0), misses(0), raw_bytes(0),
+	  compressed_bytes(0)
+{
+}
+
+// Read length bytes of the file from offset, and compress them.
+
+// :return: nullptr if they couldn't be read or don't compress
+CompressedCache::Block CompressedCache::compress_range(const int fd,
+						       const off_t offset,
+						       const size_t length)
+{
+	std::vector<uint8_t> raw(length);
+	size_t done = 0;
+	while (done < length) {
+		ssize_t bytes_read =
+			pread(fd, raw.data() + done, length - done, offset + done);
+		if (bytes_read < 0 && errno == EINTR)
+			continue;
+		if (bytes_read <= 0)
+			return nullptr;
+		done += bytes_read;
+	}
+	std::shared_ptr<std::vector<uint8_t> > compressed(
+		new std::vector<uint8_t>(
+			ApplicationLayer::Compression::worthwhile_size(length)));
+	const size_t compressed_size = ApplicationLayer::Compression::compress(
+		raw.data(), length, compressed->data(), compressed->size());
+	if (compressed_size == 0)
+		return nullptr;
+	compressed->resize(compressed_size);
+	compressed->shrink_to_fit();
+	return compressed;
+}
+
+// Let go of the entries asked for least recently until we are within budget.
+// cache_lock must be held.
+void CompressedCache::evict(void)
+{
+	while (cached_bytes > budget && !recent.empty()) {
+		auto entry = entries.find(recent.back());
+		cached_bytes -= ENTRY_COST;
+		if (entry->second.compressed)
+			cached_bytes -= entry->second.compressed->size();
+		entries.erase(entry);
+		recent.pop_back();
+	}
+}
+
+// Count a block handed out. cache_lock must be held.
+void CompressedCache::count(const Block &compressed, const size_t length)
+{
+	if (compressed) {
+		raw_bytes += length;
+		compressed_bytes += compressed->size();
+	}
+}
+
+// length bytes of the open file from offset, compressed, compressing them if
+// they aren't already.
+
+// :return: nullptr if they don't compress well enough to be worth it
+CompressedCache::Block CompressedCache::get(const int fd, const off_t offset,
+					    const size_t length)
+{
+	const Key key(fd, offset, length);
+	{
+		std::lock_guard<std::mutex> cache_guard(cache_lock);
+		auto entry = entries.find(key);
+		if (entry != entries.end()) {
+			recent.splice(recent.begin(), recent,
+				      entry->second.recent);
+			++hits;
+			count(entry->second.compressed, length);
+			return entry->second.compressed;
+		}
+		++misses;
+	}
+	// Compress it without holding up the other reactors.
+	Block compressed = compress_range(fd, offset, length);
+	std::lock_guard<std::mutex> cache_guard(cache_lock);
+	count(compressed, length);
+	const size_t size =
+		ENTRY_COST + (compressed ? compressed->size() : 0);
+	// Someone else may have compressed it first.
+	if (budget == 0 || size > budget || entries.count(key) != 0)
+		return compressed;
+	recent.push_front(key);
+	Entry entry = { compressed, recent.begin() };
+	entries.insert(std::make_pair(key, entry));
+	cached_bytes += size;
+	evict();
+	return compressed;
+}
+
+// Print the hit rate, how many bytes compression kept off the wire, and how
+// much is cached.
+void CompressedCache::report(std::ostream &out)
+{
+	std::lock_guard<std::mutex> cache_guard(cache_lock);
+	uint64_t requests = hits + misses;
+	out << "Compressed cache: " << requests << " blocks, hit rate "
+	    << (requests == 0 ? 0.0 : 100.0 * hits / requests) << "%, "
+	    << raw_bytes - compressed_bytes << " bytes saved on the wire, "
+	    << cached_bytes << " bytes cached, budget " << budget
+	    << " bytes.\n";
+}
+} // namespace Peer
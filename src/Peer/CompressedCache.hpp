@@ -0,0 +1,75 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <tuple>
+#include <vector>
+extern "C" {
+#include <sys/types.h>
+}
+namespace Peer
+{
+// Default memory kept for blocks compressed most recently. 0 turns the cache
+// off, so every block is compressed again each time it is sent.
+static const size_t constexpr DEFAULT_COMPRESSED_CACHE_SIZE = 64 * 1000 * 1000;
+
+// Keeps the blocks a seeder compressed most recently, shared by every reactor,
+// so a popular block is only compressed once however many leechers ask for
+// it. Blocks that don't compress well enough are remembered too, so they
+// aren't tried again. Once the cache is over its budget, the block asked for
+// least recently is let go.
+class CompressedCache {
+	friend class CompressedCacheTests;
+	// (file descriptor, offset in the file, length)
+	using Key = std::tuple<int, off_t, size_t>;
+	using Block = std::shared_ptr<const std::vector<uint8_t> >;
+	struct Entry {
+		// nullptr when the block doesn't compress
+		Block compressed;
+		std::list<Key>::iterator recent;
+	};
+	const size_t budget;
+	std::mutex cache_lock;
+	// Most recently asked for first
+	std::list<Key> recent;
+	std::map<Key, Entry> entries;
+	size_t cached_bytes;
+	uint64_t hits;
+	uint64_t misses;
+	// Bytes the blocks handed out were, and are, compressed
+	uint64_t raw_bytes;
+	uint64_t compressed_bytes;
+
+	// Read length bytes of the file from offset, and compress them.
+
+	// :return: nullptr if they couldn't be read or don't compress
+	static Block compress_range(const int fd, const off_t offset,
+				    const size_t length);
+	// Let go of the entries asked for least recently until we are within
+	// budget. cache_lock must be held.
+	void evict(void);
+	// Count a block handed out. cache_lock must be held.
+	void count(const Block &compressed, const size_t length);
+
+    public:
+	explicit CompressedCache(
+		const size_t budget = DEFAULT_COMPRESSED_CACHE_SIZE);
+	// This cannot be moved, deleted, or reassigned
+	CompressedCache(CompressedCache &&cache) = delete;
+	CompressedCache(CompressedCache &cache) = delete;
+	CompressedCache &operator=(CompressedCache &cache) = delete;
+	CompressedCache &operator=(CompressedCache &&cache) = delete;
+	// length bytes of the open file from offset, compressed, compressing
+	// them if they aren't already.
+
+	// :return: nullptr if they don't compress well enough to be worth it
+	Block get(const int fd, const off_t offset, const size_t length);
+	// Print the hit rate, how many bytes compression kept off the wire, and
+	// how much is cached.
+	void report(std::ostream &out);
+};
+} // namespace Peer
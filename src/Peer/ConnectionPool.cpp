@@ -0,0 +1,120 @@
+#include "ConnectionPool.hpp"
+#include <iostream>
+extern "C" {
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+}
+
+namespace Peer
+{
+ConnectionPool::ConnectionPool(PeerScores &scores,
+			       const size_t max_idle_per_peer,
+			       const std::chrono::seconds max_idle_time)
+	: scores(scores), max_idle_per_peer(max_idle_per_peer),
+	  max_idle_time(max_idle_time)
+{
+}
+
+// Close every connection we are still holding on to
+ConnectionPool::~ConnectionPool(void)
+{
+	for (auto &peer : idle) {
+		for (auto &connection : peer.second) {
+			close(std::get<0>(connection));
+		}
+	}
+}
+
+uint64_t ConnectionPool::peer_key(const uint32_t addr, const uint16_t port)
+{
+	return ((uint64_t)addr << 16) | port;
+}
+
+// Open a new connection to the peer, and score how long it took. The
+// handshake is one round trip, so that is about the time it takes.
+
+// :return: the socket, or -1 on failure
+int ConnectionPool::connect_to(const uint32_t addr, const uint16_t port)
+{
+	// Bind to our address
+	int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+	// Make sure socket descriptor initialization was successful.
+	if (socket_fd < 0) {
+		std::cerr
+			<< "Failed to Initialize socket descriptor. in peer connect\n";
+		return -1;
+	}
+	// Build our address
+	in_addr address = { .s_addr = addr };
+	sockaddr_in sock_address = { .sin_family = AF_INET,
+				     .sin_port = port,
+				     .sin_addr = address };
+	// Connect to the peer
+	auto start = std::chrono::steady_clock::now();
+	if (connect(socket_fd, (sockaddr *)&sock_address,
+		    sizeof(sockaddr_in)) == -1) {
+		std::cerr << "Error. Unable to connect to peer.\n";
+		close(socket_fd);
+		scores.record_failure(addr, port);
+		return -1;
+	}
+	scores.record_connect(
+		addr, port,
+		std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start));
+	// Requests are small and pipelined, don't let Nagle hold them back.
+	int opt = 1; // (true)
+	setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(int));
+	return socket_fd;
+}
+
+// Take an idle connection to the peer (addr, port), or open a new one if there
+// isn't one.
+
+// :return: (socket or -1 on failure, whether it was reused)
+std::tuple<int, bool> ConnectionPool::acquire(const uint32_t addr,
+					      const uint16_t port)
+{
+	{
+		std::lock_guard<std::mutex> pool_guard(pool_lock);
+		auto peer = idle.find(peer_key(addr, port));
+		if (peer != idle.end()) {
+			auto now = std::chrono::steady_clock::now();
+			while (!peer->second.empty()) {
+				IdleConnection connection = peer->second.back();
+				peer->second.pop_back();
+				// Connections left idle too long have likely been
+				// dropped somewhere along the way.
+				if (now - std::get<1>(connection) > max_idle_time) {
+					close(std::get<0>(connection));
+					continue;
+				}
+				return std::make_tuple(std::get<0>(connection),
+						       true);
+			}
+		}
+	}
+	return std::make_tuple(connect_to(addr, port), false);
+}
+
+// Hand back a connection that is idle and in a clean state.
+void ConnectionPool::release(const uint32_t addr, const uint16_t port,
+			     const int fd)
+{
+	std::lock_guard<std::mutex> pool_guard(pool_lock);
+	auto &peer = idle[peer_key(addr, port)];
+	if (peer.size() >= max_idle_per_peer) {
+		close(fd);
+		return;
+	}
+	peer.push_back(std::make_tuple(fd, std::chrono::steady_clock::now()));
+}
+
+// Close a connection that failed, or was left mid message.
+void ConnectionPool::discard(const int fd)
+{
+	close(fd);
+}
+} // namespace Peer
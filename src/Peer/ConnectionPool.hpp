@@ -0,0 +1,54 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include "PeerScores.hpp"
+namespace Peer
+{
+// Keeps connections to other peers open between requests, so that the
+// FILE_REQUEST, the CHUNK_REQUESTs and later downloads from the same peer all
+// share one TCP connection instead of paying for a handshake each.
+class ConnectionPool {
+	// (file descriptor, when it was handed back)
+	using IdleConnection =
+		std::tuple<int, std::chrono::steady_clock::time_point>;
+	// Where the time each new connection takes to open is kept
+	PeerScores &scores;
+	const size_t max_idle_per_peer;
+	const std::chrono::seconds max_idle_time;
+	std::mutex pool_lock;
+	// (address << 16 | port): connections not in use right now
+	std::unordered_map<uint64_t, std::vector<IdleConnection> > idle;
+
+	static uint64_t peer_key(const uint32_t addr, const uint16_t port);
+	// Open a new connection to the peer, and score how long it took.
+
+	// :return: the socket, or -1 on failure
+	int connect_to(const uint32_t addr, const uint16_t port);
+
+    public:
+	explicit ConnectionPool(PeerScores &scores,
+				const size_t max_idle_per_peer = 4,
+				const std::chrono::seconds max_idle_time =
+					std::chrono::seconds(60));
+	~ConnectionPool(void);
+	// This cannot be moved, deleted, or reassigned
+	ConnectionPool(ConnectionPool &&pool) = delete;
+	ConnectionPool(ConnectionPool &pool) = delete;
+	ConnectionPool &operator=(ConnectionPool &pool) = delete;
+	ConnectionPool &operator=(ConnectionPool &&pool) = delete;
+	// Take an idle connection to the peer (addr, port), or open a new one if
+	// there isn't one. A reused connection may have been closed by the peer
+	// since, so a failure on it is worth one retry on a fresh connection.
+
+	// :return: (socket or -1 on failure, whether it was reused)
+	std::tuple<int, bool> acquire(const uint32_t addr, const uint16_t port);
+	// Hand back a connection that is idle and in a clean state.
+	void release(const uint32_t addr, const uint16_t port, const int fd);
+	// Close a connection that failed, or was left mid message.
+	void discard(const int fd);
+};
+} // namespace Peer
@@ -0,0 +1,191 @@
+#include "DownloadState.hpp"
+#include "../ApplicationLayer/HashTree.hpp"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+extern "C" {
+#include <unistd.h>
+#include <fcntl.h>
+}
+
+namespace Peer
+{
+static const constexpr char STATE_MAGIC[] = "P2PSTAT1";
+// Where file_length and the bitfield start in the state file
+static const size_t constexpr LENGTH_OFFSET =
+	8 + 3 * sizeof(uint32_t) + 1 + ApplicationLayer::HASH_SIZE;
+static const size_t constexpr BITFIELD_OFFSET =
+	LENGTH_OFFSET + sizeof(uint64_t);
+
+// Keep the state of the download to destination_path.
+DownloadState::DownloadState(const std::string &destination_path)
+	: path(destination_path + STATE_FILE_EXTENSION), fd(-1), num_blocks(0),
+	  num_done(0), file_length(0)
+{
+}
+
+DownloadState::~DownloadState(void)
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+// Write the whole state out, replacing whatever the file held.
+
+// :return: false on failure
+bool DownloadState::write_all(void)
+{
+	std::vector<uint8_t> state(header);
+	const uint8_t *length = (const uint8_t *)&file_length;
+	state.insert(state.end(), length, length + sizeof(file_length));
+	state.insert(state.end(), bitfield.begin(), bitfield.end());
+	if (ftruncate(fd, 0) < 0 ||
+	    pwrite(fd, state.data(), state.size(), 0) != (ssize_t)state.size()) {
+		std::cerr << "Error. Unable to write download state file.\n";
+		return false;
+	}
+	return true;
+}
+
+// Stop keeping the state after a write to the file failed, removing it so that
+// no later run resumes from what it holds. state_lock must be held.
+void DownloadState::abandon(void)
+{
+	std::cerr << "Error. Unable to write download state file, a later run "
+		     "will start over.\n";
+	close(fd);
+	fd = -1;
+	unlink(path.c_str());
+}
+
+// Open the state file for a download of num_blocks blocks, picking up the
+// blocks an earlier run finished if it was downloading the same file the same
+// way. root_hash is empty if we don't know it.
+
+// :return: false if the state file can't be written
+bool DownloadState::open(const uint32_t num_blocks, const uint32_t block_size,
+			 const uint32_t chunk_size, const std::string &root_hash)
+{
+	std::lock_guard<std::mutex> state_guard(state_lock);
+	header.assign(STATE_MAGIC, STATE_MAGIC + 8);
+	const uint32_t sizes[] = { num_blocks, block_size, chunk_size };
+	const uint8_t *sizes_bytes = (const uint8_t *)sizes;
+	header.insert(header.end(), sizes_bytes, sizes_bytes + sizeof(sizes));
+	header.push_back(
+		std::min(root_hash.size(), ApplicationLayer::HASH_SIZE));
+	uint8_t root[ApplicationLayer::HASH_SIZE] = { 0 };
+	std::copy(root_hash.begin(), root_hash.begin() + header.back(), root);
+	header.insert(header.end(), root, root + sizeof(root));
+	bitfield.assign((num_blocks + 7) / 8, 0);
+	this->num_blocks = num_blocks;
+	num_done = 0;
+	file_length = 0;
+	fd = ::open(path.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		std::cerr << "Error. Unable to open download state file.\n";
+		return false;
+	}
+	// Pick up what an earlier run of the same download left.
+	std::vector<uint8_t> state(BITFIELD_OFFSET + bitfield.size());
+	if (pread(fd, state.data(), state.size(), 0) == (ssize_t)state.size() &&
+	    std::equal(header.begin(), header.end(), state.begin())) {
+		std::memcpy(&file_length, &state[LENGTH_OFFSET],
+			    sizeof(file_length));
+		std::copy(state.begin() + BITFIELD_OFFSET, state.end(),
+			  bitfield.begin());
+		for (uint32_t block_idx = 0; block_idx < num_blocks;
+		     ++block_idx) {
+			if (bitfield[block_idx / 8] & (1 << (block_idx % 8)))
+				++num_done;
+		}
+		return true;
+	}
+	return write_all();
+}
+
+// Forget every block an earlier run finished.
+
+// :return: false if the state file can't be written
+bool DownloadState::reset(void)
+{
+	std::lock_guard<std::mutex> state_guard(state_lock);
+	std::fill(bitfield.begin(), bitfield.end(), 0);
+	num_done = 0;
+	file_length = 0;
+	return write_all();
+}
+
+// The number of blocks an earlier run, or this one, finished
+uint32_t DownloadState::done_count(void)
+{
+	std::lock_guard<std::mutex> state_guard(state_lock);
+	return num_done;
+}
+
+// Whether the block is done
+bool DownloadState::done(const uint32_t block_idx)
+{
+	std::lock_guard<std::mutex> state_guard(state_lock);
+	return block_idx < num_blocks &&
+	       (bitfield[block_idx / 8] & (1 << (block_idx % 8)));
+}
+
+// The block is done, and the file runs at least to block_end. The length goes
+// out before the bit, so a done block is never past the length on disk.
+void DownloadState::mark(const uint32_t block_idx, const uint64_t block_end)
+{
+	std::lock_guard<std::mutex> state_guard(state_lock);
+	if (block_idx >= num_blocks)
+		return;
+	if (block_end > file_length) {
+		file_length = block_end;
+		if (fd >= 0 &&
+		    pwrite(fd, &file_length, sizeof(file_length),
+			   LENGTH_OFFSET) != (ssize_t)sizeof(file_length))
+			abandon();
+	}
+	uint8_t &bits = bitfield[block_idx / 8];
+	if (bits & (1 << (block_idx % 8)))
+		return;
+	bits |= 1 << (block_idx % 8);
+	++num_done;
+	if (fd >= 0 &&
+	    pwrite(fd, &bits, 1, BITFIELD_OFFSET + block_idx / 8) != 1)
+		abandon();
+}
+
+// The block has to be fetched again.
+void DownloadState::unmark(const uint32_t block_idx)
+{
+	std::lock_guard<std::mutex> state_guard(state_lock);
+	if (block_idx >= num_blocks)
+		return;
+	uint8_t &bits = bitfield[block_idx / 8];
+	if (!(bits & (1 << (block_idx % 8))))
+		return;
+	bits &= ~(1 << (block_idx % 8));
+	--num_done;
+	// A block left marked on disk would be trusted by the next run.
+	if (fd >= 0 &&
+	    pwrite(fd, &bits, 1, BITFIELD_OFFSET + block_idx / 8) != 1)
+		abandon();
+}
+
+// The furthest byte of every done block
+uint64_t DownloadState::length(void)
+{
+	std::lock_guard<std::mutex> state_guard(state_lock);
+	return file_length;
+}
+
+// The download is complete, remove the state file.
+void DownloadState::finish(void)
+{
+	std::lock_guard<std::mutex> state_guard(state_lock);
+	if (fd >= 0) {
+		close(fd);
+		fd = -1;
+	}
+	unlink(path.c_str());
+}
+} // namespace Peer
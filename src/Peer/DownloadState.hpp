@@ -0,0 +1,78 @@
+#pragma once
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+namespace Peer
+{
+// Appended to the destination path to name the state file of its download
+static const constexpr char STATE_FILE_EXTENSION[] = ".p2pstate";
+
+// The blocks of one download that are done, kept in a state file next to the
+// destination so that a download cut short picks up where it left off. A block
+// is only marked once it is written, and checked if we have the file's hashes.
+// The file starts with what is being downloaded, so a state file left by a
+// download of something else is started over:
+//     magic: 8 ("P2PSTAT1")
+//     num_blocks: 4, block_size: 4, chunk_size: 4
+//     root_length: 1, root: 32 (zeroed past root_length)
+//     file_length: 8 // The furthest byte of a done block
+//     bitfield: a bit per block, lowest bit first
+// Numbers are in host byte order, since the file never leaves this machine.
+// If the file can't be written to part way through, it is removed, and the
+// download goes on without one.
+class DownloadState {
+	friend class DownloadStateTests;
+	const std::string path;
+	int fd;
+	std::mutex state_lock;
+	// What a state file for this download starts with
+	std::vector<uint8_t> header;
+	std::vector<uint8_t> bitfield;
+	uint32_t num_blocks;
+	uint32_t num_done;
+	uint64_t file_length;
+
+	// Write the whole state out, replacing whatever the file held.
+
+	// :return: false on failure
+	bool write_all(void);
+	// Stop keeping the state after a write to the file failed, removing it
+	// so that no later run resumes from what it holds. state_lock must be
+	// held.
+	void abandon(void);
+
+    public:
+	// Keep the state of the download to destination_path.
+	explicit DownloadState(const std::string &destination_path);
+	~DownloadState(void);
+	// This cannot be moved, deleted, or reassigned
+	DownloadState(DownloadState &&state) = delete;
+	DownloadState(DownloadState &state) = delete;
+	DownloadState &operator=(DownloadState &state) = delete;
+	DownloadState &operator=(DownloadState &&state) = delete;
+	// Open the state file for a download of num_blocks blocks, picking up
+	// the blocks an earlier run finished if it was downloading the same
+	// file the same way. root_hash is empty if we don't know it.
+
+	// :return: false if the state file can't be written
+	bool open(const uint32_t num_blocks, const uint32_t block_size,
+		  const uint32_t chunk_size, const std::string &root_hash);
+	// Forget every block an earlier run finished.
+
+	// :return: false if the state file can't be written
+	bool reset(void);
+	// The number of blocks an earlier run, or this one, finished
+	uint32_t done_count(void);
+	// Whether the block is done
+	bool done(const uint32_t block_idx);
+	// The block is done, and the file runs at least to block_end.
+	void mark(const uint32_t block_idx, const uint64_t block_end);
+	// The block has to be fetched again.
+	void unmark(const uint32_t block_idx);
+	// The furthest byte of every done block
+	uint64_t length(void);
+	// The download is complete, remove the state file.
+	void finish(void);
+};
+} // namespace Peer
@@ -1,292 +1,1060 @@
 #include "../ApplicationLayer/ApplicationLayer.hpp"
 #include "Leecher.hpp"
+#include "RateLimits.hpp"
 #include "src/ApplicationLayer/Peer.hpp"
 #include <algorithm>
 #include <iterator>
-#include <sstream>
 #include <tuple>
 #include <vector>
 #include <thread>
 #include <iostream>
-#include <cmath>
+#include <deque>
+#include <set>
+#include <limits>
+#include <cerrno>
 
 extern "C" {
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 }
 
 namespace Peer
 {
-Leecher::Leecher(std::shared_ptr<Peers> &live_peers) : live_peers(live_peers)
+Leecher::Leecher(std::shared_ptr<Peers> &live_peers,
+		 const size_t pipeline_depth,
+		 const std::chrono::milliseconds chunk_timeout,
+		 const size_t block_size, const size_t verify_threads,
+		 const std::string &scores_path,
+		 const size_t streams_per_peer, const uint32_t compression)
+	: live_peers(live_peers), pipeline_depth(std::max<size_t>(1, pipeline_depth)),
+	  chunk_timeout(chunk_timeout),
+	  block_size(std::max<size_t>(std::min(block_size,
+					       ApplicationLayer::MAX_CHUNK_SIZE) /
+					      ApplicationLayer::HASH_LEAF_SIZE,
+				      1) *
+		     ApplicationLayer::HASH_LEAF_SIZE),
+	  verify_threads(verify_threads), streams_per_peer(streams_per_peer),
+	  compression(compression & ApplicationLayer::SUPPORTED_COMPRESSION),
+	  scores(scores_path),
+	  connections(scores)
 {
 }
 
-// Connect to the specified peer, (addr, port) and ask them if they have the
-// passed filename.
-std::tuple<bool, uint32_t>
+// The FILE_RESPONSE a v2 peer would have sent us for a file in its catalog.
+static ApplicationLayer::PeerHeader
+catalog_file_response(const ApplicationLayer::CatalogEntry &entry,
+		      const uint8_t version)
+{
+	ApplicationLayer::PeerHeader response(
+		ApplicationLayer::PeerMessageType::FILE_RESPONSE, 2);
+	response.file_name = entry.file_name;
+	response.max_version = version;
+	response.num_chunks = entry.num_chunks;
+	response.file_handle = entry.file_handle;
+	response.chunk_size = entry.chunk_size;
+	response.payload.assign(entry.root_hash.begin(), entry.root_hash.end());
+	return response;
+}
+
+// Send the request to the peer (addr, port) over a pooled connection, and read
+// back its response.
+
+// :return: false on failure
+bool Leecher::exchange(const ApplicationLayer::PeerHeader &request,
+		       ApplicationLayer::PeerHeader &out_response,
+		       const uint32_t addr, const uint16_t port)
+{
+	// A pooled connection may have gone stale, give it one more go on a
+	// fresh one if so.
+	while (true) {
+		auto connection = connections.acquire(addr, port);
+		int socket_fd = std::get<0>(connection);
+		if (socket_fd < 0) {
+			return false;
+		}
+		// Send the request, and wait for the response
+		if (!ApplicationLayer::Peer::write_message(socket_fd, request) ||
+		    !ApplicationLayer::Peer::read_message(socket_fd, out_response,
+							  true)) {
+			connections.discard(socket_fd);
+			if (std::get<1>(connection))
+				continue;
+			return false;
+		}
+		connections.release(addr, port, socket_fd);
+		return true;
+	}
+}
+
+// The wire version the peer speaks, asking it if we haven't already.
+
+// :return: 0 if the peer couldn't be reached
+uint8_t Leecher::peer_version(const uint32_t addr, const uint16_t port)
+{
+	const uint64_t key = ((uint64_t)addr << 16) | port;
+	{
+		std::lock_guard<std::mutex> versions_guard(versions_lock);
+		auto version = peer_versions.find(key);
+		if (version != peer_versions.end())
+			return version->second;
+	}
+	// Ask for no file at all. A v2 peer agrees on a version anyway, and a v1
+	// peer just tells us it doesn't have it.
+	does_peer_have_file("", addr, port);
+	std::lock_guard<std::mutex> versions_guard(versions_lock);
+	auto version = peer_versions.find(key);
+	return version != peer_versions.end() ? version->second : 0;
+}
+
+// Ask the specified peer, (addr, port) if they have the passed filename, over a
+// pooled connection. Offers the peer our latest wire version while we're at it,
+// and remembers what they agreed to.
+
+// :return: (whether they have it, their FILE_RESPONSE)
+std::tuple<bool, ApplicationLayer::PeerHeader>
 Leecher::does_peer_have_file(const std::string &filename, const uint32_t addr,
 			     const uint16_t port)
 {
-	// Bind to our address
-	int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-	// Make sure socket descriptor initialization was successful.
-	if (socket_fd <= 0) {
-		std::cerr
-			<< "Failed to Initialize socket descriptor. in peer connect\n";
-	}
-	// Build our address
-	in_addr address = { .s_addr = addr };
-	sockaddr_in sock_address = { .sin_family = AF_INET,
-				     .sin_port = port,
-				     .sin_addr = address };
-	// Connect to the peer
-	if (connect(socket_fd, (sockaddr *)&sock_address,
-		    sizeof(sockaddr_in)) == -1) {
-		std::cerr << "Error. Unable to connect to peer.\n";
-		close(socket_fd);
-		return std::make_tuple(false, 0);
-	}
-	// Ask the peer if they have this file
-	if (!ApplicationLayer::Peer::write_message(
-		    socket_fd, ApplicationLayer::PeerMessageType::FILE_REQUEST,
-		    filename)) {
-		close(socket_fd);
-		return std::make_tuple(false, 0);
-	}
-	// Wait for the response
-	uint8_t message_type;
-	std::string filename_garbo;
-	uint32_t num_chunks;
-	uint32_t garbo;
-	if (!ApplicationLayer::Peer::read_message(
-		    socket_fd, message_type, filename_garbo, num_chunks, garbo,
-		    garbo, garbo, garbo, true)) {
-		close(socket_fd);
-		return std::make_tuple(false, 0);
+	// Ask the peer if they have this file. This goes out as v1 since we
+	// don't know what they speak yet.
+	ApplicationLayer::PeerHeader request(
+		ApplicationLayer::PeerMessageType::FILE_REQUEST);
+	request.file_name = filename;
+	request.max_version = ApplicationLayer::PROTOCOL_VERSION;
+	ApplicationLayer::PeerHeader response;
+	if (!exchange(request, response, addr, port) ||
+	    response.message_type !=
+		    ApplicationLayer::PeerMessageType::FILE_RESPONSE) {
+		return std::make_tuple(false, ApplicationLayer::PeerHeader());
+	}
+	{
+		std::lock_guard<std::mutex> versions_guard(versions_lock);
+		peer_versions[((uint64_t)addr << 16) | port] =
+			std::max<uint8_t>(1, response.max_version);
 	}
 	// This will be true if the peer has the file
-	if (message_type == ApplicationLayer::PeerMessageType::FILE_RESPONSE &&
-	    num_chunks > 0) {
-		close(socket_fd);
-		return std::make_tuple(true, num_chunks);
-	}
-	// Otherwise cleanup, and return false. They don't have it.
-	close(socket_fd);
-	return std::make_tuple(false, 0);
+	bool has = response.num_chunks > 0;
+	return std::make_tuple(has, std::move(response));
 }
 
-// Download a chunk set to the passed save_path.
-void Leecher::download_chunk_set(const std::string &filename,
-				 const uint32_t begin_idx,
-				 const uint32_t end_idx,
-				 const std::string &save_path,
-				 const uint32_t addr, const uint16_t port)
+// Ask the peer whether it has each of the filenames. A v2 peer is asked about
+// them in FILE_BATCH_REQUESTs, a v1 peer one file at a time.
+
+// :return: (whether they have it, their FILE_RESPONSE) for each filename
+std::vector<std::tuple<bool, ApplicationLayer::PeerHeader> >
+Leecher::query_files(const std::vector<std::string> &filenames,
+		     const uint32_t addr, const uint16_t port)
 {
-	// Bind to our address
-	int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-	// Make sure socket descriptor initialization was successful.
-	if (socket_fd <= 0) {
-		std::cerr
-			<< "Failed to Initialize socket descriptor. in peer connect\n";
-		return;
-	}
-	// Build our address
-	in_addr address = { .s_addr = addr };
-	sockaddr_in sock_address = { .sin_family = AF_INET,
-				     .sin_port = port,
-				     .sin_addr = address };
-	// Connect to the peer
-	if (connect(socket_fd, (sockaddr *)&sock_address,
-		    sizeof(sockaddr_in)) == -1) {
-		std::cerr << "Error. Unable to connect to peer.\n";
-		close(socket_fd);
-		return;
-	}
-	// Send off the chunk request
-	if (!ApplicationLayer::Peer::write_message(
-		    socket_fd, ApplicationLayer::PeerMessageType::CHUNK_REQUEST,
-		    filename, 0, begin_idx, end_idx)) {
-		std::cerr
-			<< "Error. Unable to send Chunk Request Message to peer.\n";
-		close(socket_fd);
-		return;
-	}
-	// Read in the chunks being sent back
-	// Wait for the response
-	uint8_t message_type;
-	std::string filename_garbo;
-	uint32_t current_chunk_idx;
-	uint32_t current_chunk_size;
-	uint32_t garbo;
-	// Save each chunk
-	for (size_t chunk_idx = begin_idx; chunk_idx <= end_idx; ++chunk_idx) {
-		if (!ApplicationLayer::Peer::read_message(
-			    socket_fd, message_type, filename_garbo, garbo,
-			    garbo, garbo, current_chunk_idx, current_chunk_size,
-			    false, save_path)) {
-			std::cerr << "Error. Unable to read in chunk: "
-				  << current_chunk_idx << "\n";
-			return;
+	std::vector<std::tuple<bool, ApplicationLayer::PeerHeader> > statuses;
+	statuses.reserve(filenames.size());
+	const uint8_t version = peer_version(addr, port);
+	// No point asking about each file if they can't be reached
+	if (version == 0) {
+		statuses.resize(filenames.size());
+		return statuses;
+	}
+	if (version < 2) {
+		for (auto &filename : filenames) {
+			statuses.push_back(
+				does_peer_have_file(filename, addr, port));
+		}
+		return statuses;
+	}
+	ApplicationLayer::PeerHeader request(
+		ApplicationLayer::PeerMessageType::FILE_BATCH_REQUEST, 2);
+	ApplicationLayer::PeerHeader response;
+	std::vector<std::string> batch;
+	std::vector<ApplicationLayer::CatalogEntry> entries;
+	size_t idx = 0;
+	while (idx < filenames.size()) {
+		// Fill the batch up as far as the limits allow, but always take
+		// at least one filename.
+		batch.clear();
+		size_t batch_bytes = 0;
+		while (idx < filenames.size() &&
+		       batch.size() < ApplicationLayer::MAX_BATCH_FILES &&
+		       (batch.empty() ||
+			batch_bytes + filenames[idx].size() <=
+				ApplicationLayer::MAX_BATCH_NAME_BYTES)) {
+			batch_bytes += filenames[idx].size();
+			batch.push_back(filenames[idx]);
+			++idx;
+		}
+		ApplicationLayer::Peer::encode_names(batch, request.payload);
+		if (!exchange(request, response, addr, port) ||
+		    response.message_type !=
+			    ApplicationLayer::PeerMessageType::FILE_BATCH_RESPONSE ||
+		    !ApplicationLayer::Peer::decode_catalog(response.payload,
+							    entries) ||
+		    entries.size() != batch.size()) {
+			std::cerr << "Error. Unable to ask peer about a batch of "
+				     "files.\n";
+			// Whatever we didn't hear back about, they don't have.
+			statuses.resize(filenames.size());
+			return statuses;
+		}
+		for (auto &entry : entries) {
+			statuses.push_back(std::make_tuple(
+				entry.num_chunks > 0,
+				catalog_file_response(entry, version)));
 		}
-		std::cout << "Downloading chunk: " << current_chunk_idx << "\n";
 	}
-	close(socket_fd);
+	return statuses;
 }
 
-// Ask the peers if they have this filename. If at least 1 peers has it.
-// Download the file to the path specified in save_path.
+// Fetch every page of the peer's catalog. Only v2 peers have one.
+
+// :return: (whether we were successful, the catalog)
+std::tuple<bool, std::vector<ApplicationLayer::CatalogEntry> >
+Leecher::fetch_inventory(const uint32_t addr, const uint16_t port)
+{
+	std::vector<ApplicationLayer::CatalogEntry> inventory;
+	if (peer_version(addr, port) < 2) {
+		return std::make_tuple(false, std::move(inventory));
+	}
+	ApplicationLayer::PeerHeader request(
+		ApplicationLayer::PeerMessageType::INVENTORY_REQUEST, 2);
+	ApplicationLayer::PeerHeader response;
+	std::vector<ApplicationLayer::CatalogEntry> page;
+	while (true) {
+		// Pick up where the last page left off
+		request.chunk_request_begin_idx = inventory.size();
+		if (!exchange(request, response, addr, port) ||
+		    response.message_type !=
+			    ApplicationLayer::PeerMessageType::INVENTORY_RESPONSE ||
+		    !ApplicationLayer::Peer::decode_catalog(response.payload,
+							    page) ||
+		    response.chunk_request_begin_idx != inventory.size() ||
+		    response.chunk_request_end_idx !=
+			    inventory.size() + page.size()) {
+			std::cerr << "Error. Unable to fetch inventory from peer.\n";
+			return std::make_tuple(false, std::move(inventory));
+		}
+		std::move(page.begin(), page.end(),
+			  std::back_inserter(inventory));
+		// An empty page means the catalog shrank under us, or ended.
+		if (page.empty() ||
+		    response.chunk_request_end_idx >= response.num_chunks) {
+			break;
+		}
+	}
+	return std::make_tuple(true, std::move(inventory));
+}
+
+// Fetch every page of the leaves of a file's HashTree from the peer. file_info
+// is the peer's FILE_RESPONSE. Only v2 peers have them. The file has num_chunks
+// chunks of chunk_size, so every chunk but the last is whole: anything more or
+// fewer leaves than that allows is turned away.
+
+// :return: (whether we were successful, the leaves)
+std::tuple<bool, std::vector<ApplicationLayer::HashDigest> >
+Leecher::fetch_hashes(const ApplicationLayer::PeerHeader &file_info,
+		      const uint32_t num_chunks, const uint32_t chunk_size,
+		      const uint32_t addr, const uint16_t port)
+{
+	std::vector<ApplicationLayer::HashDigest> leaves;
+	if (file_info.max_version < 2 || num_chunks == 0) {
+		return std::make_tuple(false, std::move(leaves));
+	}
+	const uint64_t most_leaves =
+		ApplicationLayer::HashTree::num_leaves(num_chunks, chunk_size);
+	const uint64_t fewest_leaves =
+		ApplicationLayer::HashTree::num_leaves(num_chunks - 1,
+						       chunk_size) +
+		1;
+	ApplicationLayer::PeerHeader request(
+		ApplicationLayer::PeerMessageType::HASH_REQUEST, 2);
+	request.file_handle = file_info.file_handle;
+	ApplicationLayer::PeerHeader response;
+	while (true) {
+		// Pick up where the last page left off
+		request.chunk_request_begin_idx = leaves.size();
+		const size_t page_begin = leaves.size();
+		if (!exchange(request, response, addr, port) ||
+		    response.message_type !=
+			    ApplicationLayer::PeerMessageType::HASH_RESPONSE ||
+		    response.chunk_request_begin_idx != page_begin ||
+		    !ApplicationLayer::HashTree::decode_leaves(response.payload,
+							       leaves) ||
+		    response.chunk_request_end_idx != leaves.size()) {
+			std::cerr << "Error. Unable to fetch hashes from peer.\n";
+			return std::make_tuple(false, std::move(leaves));
+		}
+		// An empty page means the peer has nothing more to give.
+		if (leaves.size() == page_begin ||
+		    leaves.size() >= response.num_chunks ||
+		    leaves.size() >= most_leaves) {
+			break;
+		}
+	}
+	if (leaves.size() < fewest_leaves || leaves.size() > most_leaves) {
+		std::cerr << "Error. Peer's hashes don't cover the file.\n";
+		return std::make_tuple(false, std::move(leaves));
+	}
+	return std::make_tuple(true, std::move(leaves));
+}
+
+// Fetch the leaves of a file of num_chunks chunks of chunk_size from the first
+// peer that has it whose leaves add up to the root it told us about. The
+// tracker doesn't tell us the root, so then the first peer's leaves are taken
+// as they are.
+
+// :return: false if no peer could give us the leaves
+bool Leecher::fetch_leaves(const FileHolders &peers_that_have,
+			   const uint32_t num_chunks, const uint32_t chunk_size,
+			   std::vector<ApplicationLayer::HashDigest> &out_leaves)
+{
+	for (auto &peer : peers_that_have) {
+		const ApplicationLayer::PeerHeader &file_info = std::get<2>(peer);
+		if (file_info.max_version < 2)
+			continue;
+		auto answer = fetch_hashes(file_info, num_chunks, chunk_size,
+					   std::get<0>(peer), std::get<1>(peer));
+		if (!std::get<0>(answer))
+			continue;
+		ApplicationLayer::HashDigest root =
+			ApplicationLayer::HashTree::root(std::get<1>(answer));
+		if (file_info.payload.size() == ApplicationLayer::HASH_SIZE &&
+		    !std::equal(root.begin(), root.end(),
+				file_info.payload.begin())) {
+			std::cerr << "Error. Peer's hashes don't match the "
+				     "file's root.\n";
+			continue;
+		}
+		out_leaves = std::move(std::get<1>(answer));
+		return true;
+	}
+	return false;
+}
+
+// Bound how long a read on the socket may wait for the peer. 0 waits forever.
+static void set_receive_timeout(const int socket_fd,
+				const std::chrono::milliseconds timeout)
+{
+	timeval tv = { (time_t)(timeout.count() / 1000),
+		       (suseconds_t)((timeout.count() % 1000) * 1000) };
+	setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(timeval));
+}
+
+// Copy len bytes from offset in one file to the same offset in another.
 
 // :return: false on failure
-bool Leecher::download_file(const std::string &filename,
-			    const std::string &save_path)
+static bool copy_block(const int from_fd, const int to_fd, const off_t offset,
+		       const size_t len)
+{
+	ApplicationLayer::PooledBuffer block =
+		ApplicationLayer::BufferPool::instance().acquire(len);
+	if (len > 0 && block.data() == nullptr)
+		return false;
+	for (size_t done = 0; done < len;) {
+		ssize_t bytes_read = pread(from_fd, block.data() + done,
+					   len - done, offset + done);
+		if (bytes_read < 0 && errno == EINTR)
+			continue;
+		if (bytes_read <= 0)
+			return false;
+		done += bytes_read;
+	}
+	for (size_t done = 0; done < len;) {
+		ssize_t bytes_written = pwrite(to_fd, block.data() + done,
+					       len - done, offset + done);
+		if (bytes_written < 0 && errno == EINTR)
+			continue;
+		if (bytes_written <= 0)
+			return false;
+		done += bytes_written;
+	}
+	return true;
+}
+
+// Fetch blocks from the peer, taking them from the scheduler as worker until
+// there are none left for it, and write each one straight into the destination
+// file. The file is split into chunks of chunk_size, and each chunk into blocks
+// of block_size. Every block that is done is marked in the download's state.
+// file_info is the peer's FILE_RESPONSE, which says which wire version to use.
+// Up to depth block requests are kept outstanding on the connection. A peer
+// that fails or stalls for longer than chunk_timeout gives its blocks back and
+// is dropped from the download. Blocks are handed to the verifier to be
+// checked, if there is one. The time each block takes to come in, and whether
+// the peer fails us, go into its score. This is one of the peer's streams,
+// which share its download limit and hear of every block fetched. A copy of a
+// block the scheduler doesn't let us write in place is fetched aside, and only
+// put in place if it beats the others.
+void Leecher::fetch_chunks(const std::string &filename,
+			   const ApplicationLayer::PeerHeader &file_info,
+			   const uint32_t chunk_size, const uint32_t block_size,
+			   ChunkScheduler &scheduler, BlockVerifier *verifier,
+			   const size_t worker, const size_t depth,
+			   const int destination_fd, DownloadState &state,
+			   PeerStreams &streams, const uint32_t addr,
+			   const uint16_t port)
+{
+	// If the peer agreed to v2 we name the file by the handle it gave us.
+	ApplicationLayer::PeerHeader request(
+		ApplicationLayer::PeerMessageType::CHUNK_REQUEST,
+		file_info.max_version >= 2 ? 2 : 1);
+	request.file_name = filename;
+	request.file_handle = file_info.file_handle;
+	// Only v2 can ask for another chunk size, or part of a chunk. A v1 peer
+	// is only ever in a download of whole chunks of CHUNK_SIZE.
+	const uint32_t blocks_per_chunk =
+		(chunk_size + block_size - 1) / block_size;
+	if (request.version >= 2) {
+		request.chunk_size = chunk_size;
+		request.block_size = blocks_per_chunk > 1 ? block_size : 0;
+	}
+	// From v3 on the peer may send the blocks compressed.
+	if (file_info.max_version >= 3)
+		request.compression = compression;
+	ApplicationLayer::PeerHeader response;
+	// Copies fetched aside land here, at the same offset as in the
+	// destination file. Made on first use.
+	int scratch_fd = -1;
+	while (true) {
+		auto connection = connections.acquire(addr, port);
+		int socket_fd = std::get<0>(connection);
+		if (socket_fd < 0) {
+			break;
+		}
+		// A peer that stops sending for this long has stalled.
+		set_receive_timeout(socket_fd, chunk_timeout);
+		// The blocks requested on this connection, in the order the
+		// peer answers them. Keep depth of them in flight so the peer
+		// always has the next one queued up, but only wait for more work
+		// when there is nothing left to read.
+		std::deque<uint32_t> requested;
+		bool failed = false;
+		// Whether the download finished while we still had requests
+		// out
+		bool cancelled = false;
+		// Whether another copy of the block we were reading won, so we
+		// were cut off
+		bool cut_off = false;
+		size_t received = 0;
+		while (true) {
+			uint32_t block_idx;
+			while (requested.size() < depth &&
+			       scheduler.take(worker, requested.empty(),
+					      block_idx)) {
+				const uint32_t chunk_idx =
+					block_idx / blocks_per_chunk;
+				request.chunk_request_begin_idx = chunk_idx;
+				request.chunk_request_end_idx = chunk_idx;
+				request.block_offset =
+					(block_idx % blocks_per_chunk) *
+					block_size;
+				requested.push_back(block_idx);
+				if (!ApplicationLayer::Peer::write_message(
+					    socket_fd, request)) {
+					std::cerr
+						<< "Error. Unable to send Chunk Request Message to peer.\n";
+					failed = true;
+					break;
+				}
+			}
+			if (failed || requested.empty())
+				break;
+			block_idx = requested.front();
+			const uint32_t chunk_idx = block_idx / blocks_per_chunk;
+			const uint32_t block_offset =
+				(block_idx % blocks_per_chunk) * block_size;
+			// Whatever is left to read isn't needed once every
+			// block is in, so the scheduler cuts it off.
+			bool in_place;
+			if (!scheduler.watch(worker, socket_fd, block_idx,
+					     in_place)) {
+				cancelled = true;
+				break;
+			}
+			if (!in_place && scratch_fd < 0) {
+				scratch_fd = memfd_create("p2p_block_copy",
+							  MFD_CLOEXEC);
+				if (scratch_fd < 0) {
+					std::cerr << "Error. Unable to make "
+						     "room for a block copy.\n";
+					scheduler.unwatch(worker);
+					failed = true;
+					break;
+				}
+			}
+			const auto read_start = std::chrono::steady_clock::now();
+			const bool read = ApplicationLayer::Peer::read_message(
+				socket_fd, response, false,
+				in_place ? destination_fd : scratch_fd, "/tmp/",
+				chunk_size);
+			scheduler.unwatch(worker);
+			if (!read && scheduler.finished()) {
+				cancelled = true;
+				break;
+			}
+			// Cut off because another copy of the block won isn't
+			// the peer's fault.
+			if (!read && scheduler.was_outrun(worker)) {
+				cut_off = true;
+				break;
+			}
+			if (!read ||
+			    response.message_type !=
+				    ApplicationLayer::PeerMessageType::
+					    CHUNK_RESPONSE ||
+			    response.current_chunk_idx != chunk_idx ||
+			    response.block_offset != block_offset) {
+				std::cerr << "Error. Unable to read in chunk: "
+					  << chunk_idx << "\n";
+				failed = true;
+				break;
+			}
+			requested.pop_front();
+			++received;
+			const uint64_t block_begin =
+				(uint64_t)chunk_idx * chunk_size + block_offset;
+			// In the endgame another peer's copy may have beaten
+			// this one, and is the one that counts.
+			const bool beaten = scheduler.arrive(
+				worker, block_idx, response.current_chunk_size);
+			if (!in_place) {
+				// A copy fetched aside that won goes in place,
+				// once whoever was writing there has stopped.
+				if (!beaten) {
+					scheduler.wait_for_writer(block_idx);
+					if (!copy_block(scratch_fd,
+							destination_fd,
+							block_begin,
+							response.current_chunk_size)) {
+						std::cerr << "Error. Unable to "
+							     "write chunk: "
+							  << chunk_idx << "\n";
+						scheduler.reject(worker,
+								 block_idx);
+						failed = true;
+						break;
+					}
+				}
+				if (ftruncate(scratch_fd, 0) < 0) {
+					failed = true;
+					break;
+				}
+			}
+			// With requests queued up behind it, the time spent
+			// reading the block is the time the peer took to send
+			// it.
+			scores.record_block(
+				addr, port, response.current_chunk_size,
+				std::chrono::duration_cast<
+					std::chrono::microseconds>(
+					std::chrono::steady_clock::now() -
+					read_start));
+			// A beaten copy leaves the block to the winner.
+			if (!beaten && verifier) {
+				// It is only complete once it has been
+				// checked.
+				verifier->submit(
+					worker, block_idx, block_begin,
+					response.current_chunk_size,
+					std::min(block_size,
+						 chunk_size - block_offset));
+			} else if (!beaten) {
+				// The state tracks the furthest byte written,
+				// so the file can be trimmed to its real length
+				// once every block is in. An empty block is
+				// past the end of the file.
+				uint64_t block_end = 0;
+				if (response.current_chunk_size > 0)
+					block_end = block_begin +
+						    response.current_chunk_size;
+				state.mark(block_idx, block_end);
+				scheduler.complete(block_idx);
+			}
+			// A short block is where the chunk ends, so there is
+			// nothing to fetch in the rest of it. Checked blocks
+			// only stop short at the end of the file, and aren't
+			// counted past it.
+			if (!verifier && !beaten &&
+			    response.current_chunk_size < block_size) {
+				for (uint32_t rest = block_idx + 1;
+				     rest % blocks_per_chunk != 0; ++rest) {
+					state.mark(rest, 0);
+					scheduler.complete(rest);
+				}
+			}
+			if (block_offset == 0)
+				std::cout << "Downloading chunk: " << chunk_idx
+					  << "\n";
+			streams.fetched(response.current_chunk_size);
+			// Hold off reading more until the download limits have
+			// caught up with this block, as it came over the wire.
+			// The peer backs off as the socket fills.
+			auto wait = RateLimits::instance().take_download(
+				streams.download_bucket,
+				response.compression != 0 ?
+					response.compressed_size :
+					response.current_chunk_size);
+			if (wait.count() > 0)
+				std::this_thread::sleep_for(wait);
+		}
+		if (!failed && !cancelled && !cut_off) {
+			set_receive_timeout(socket_fd, std::chrono::milliseconds(0));
+			connections.release(addr, port, socket_fd);
+			break;
+		}
+		connections.discard(socket_fd);
+		// Someone else can have what we didn't get to.
+		for (auto block_idx : requested) {
+			scheduler.fail(worker, block_idx);
+		}
+		// Being cut off from copies nobody needs is no fault of the
+		// peer's.
+		if (cancelled)
+			break;
+		if (cut_off)
+			continue;
+		// Only a reused connection that died before giving us anything is
+		// worth another try.
+		if (!std::get<1>(connection) || received != 0) {
+			scores.record_failure(addr, port);
+			break;
+		}
+	}
+	if (scratch_fd >= 0)
+		close(scratch_fd);
+	scheduler.leave(worker);
+}
+
+// List every file shared by the live peers that speak v2, sorted and without
+// duplicates.
+std::vector<std::string> Leecher::list_files(void)
+{
+	auto peers_list = live_peers->get_current_peers();
+	std::vector<std::thread> peer_threads;
+	peer_threads.reserve(peers_list->size());
+	// (success, catalog) of each peer
+	std::vector<std::tuple<bool, std::vector<ApplicationLayer::CatalogEntry> > >
+		inventories(peers_list->size());
+	size_t idx = 0;
+	for (auto &peer : *peers_list) {
+		peer_threads.push_back(std::thread([&, idx] {
+			inventories[idx] = fetch_inventory(std::get<0>(peer),
+							   std::get<1>(peer));
+		}));
+		++idx;
+	}
+	std::set<std::string> filenames;
+	for (size_t i = 0; i < peer_threads.size(); ++i) {
+		peer_threads[i].join();
+		for (auto &entry : std::get<1>(inventories[i])) {
+			if (entry.num_chunks > 0)
+				filenames.insert(std::move(entry.file_name));
+		}
+	}
+	return std::vector<std::string>(filenames.begin(), filenames.end());
+}
+
+// Ask every peer which of these files they have, in one exchange per peer
+// where the peer allows it.
+
+// :return: the peers that have each file, its number of chunks and its chunk
+// size
+std::vector<FilePlan>
+Leecher::locate_from_peers(const std::vector<std::string> &filenames)
 {
 	// Get the list of peers from live_peers
 	auto peers_list = live_peers->get_current_peers();
-	// Now I need to ask each of the peers whether they have the filename
-	// passed.
+	// Now I need to ask each of the peers which of the filenames passed they
+	// have.
 	std::vector<std::thread> peer_threads;
-	peer_threads.reserve(peers_list.size());
-	// vec of each of the peers that has the file
-	// (has, num_chunks)
-	std::vector<std::tuple<bool, uint32_t> > file_statuses(
-		peers_list.size());
+	peer_threads.reserve(peers_list->size());
+	// For each peer, (has, FILE_RESPONSE) of each file
+	std::vector<std::vector<std::tuple<bool, ApplicationLayer::PeerHeader> > >
+		file_statuses(peers_list->size());
 	size_t idx = 0;
-	for (auto &peer : peers_list) {
+	for (auto &peer : *peers_list) {
 		peer_threads.push_back(std::thread([&, idx] {
 			// Check this peer
-			file_statuses[idx] = does_peer_have_file(
-				filename, std::get<0>(peer), std::get<1>(peer));
+			file_statuses[idx] = query_files(
+				filenames, std::get<0>(peer), std::get<1>(peer));
 		}));
 		++idx;
 	}
-	// Parse the information the threads found
-	// This vec holds the address and port of the peers that have the file we
-	// are looking for.
-	std::vector<std::tuple<uint32_t, uint16_t> > peers_that_have;
-	// The number of chunks we are going to download
-	uint32_t num_chunks = 0;
-	size_t status_idx = 0;
-	auto peers_it = peers_list.begin();
 	for (auto &t : peer_threads) {
 		// Join back the thread
 		t.join();
-		// If the peer has it, add them to the peers that have
-		bool has = std::get<0>(file_statuses[status_idx]);
-		// Pull the number of chunks the peer reported the file to have
-		uint32_t temp_num_chunks =
-			std::get<1>(file_statuses[status_idx]);
-		// If they have the file, update the peers_that_have list
-		if (has) {
-			peers_that_have.push_back(std::move(*peers_it));
-			// Take the largest number of chunks
-			if (temp_num_chunks > num_chunks)
-				num_chunks = temp_num_chunks;
+	}
+	std::vector<FilePlan> plans(filenames.size());
+	for (size_t file_idx = 0; file_idx < filenames.size(); ++file_idx) {
+		// Parse the information the threads found
+		// This vec holds the address and port of the peers that have the
+		// file we are looking for, and what they told us about it.
+		FileHolders &peers_that_have = std::get<0>(plans[file_idx]);
+		// The number of chunks we are going to download
+		uint32_t &num_chunks = std::get<1>(plans[file_idx]);
+		// The first peer that has the file picks its chunk size, and
+		// the first that knows its root picks that.
+		uint32_t &chunk_size = std::get<2>(plans[file_idx]);
+		std::vector<uint8_t> root_hash;
+		size_t status_idx = 0;
+		for (auto &peer : *peers_list) {
+			auto &status = file_statuses[status_idx][file_idx];
+			const uint32_t peer_chunk_size =
+				ApplicationLayer::Peer::chunk_size_of(
+					std::get<1>(status));
+			const std::vector<uint8_t> &peer_root_hash =
+				std::get<1>(status).payload;
+			if (std::get<0>(status) && chunk_size == 0) {
+				chunk_size = peer_chunk_size;
+			}
+			// A peer with another root has another file by the
+			// same name.
+			const bool same_root = root_hash.empty() ||
+					       peer_root_hash.empty() ||
+					       peer_root_hash == root_hash;
+			// If they have the file in the same chunks, update the
+			// peers_that_have list
+			if (std::get<0>(status) && peer_chunk_size == chunk_size &&
+			    same_root) {
+				if (root_hash.empty())
+					root_hash = peer_root_hash;
+				// Take the largest number of chunks
+				num_chunks = std::max(num_chunks,
+						      std::get<1>(status).num_chunks);
+				peers_that_have.push_back(std::make_tuple(
+					std::get<0>(peer), std::get<1>(peer),
+					std::move(std::get<1>(status))));
+			}
+			++status_idx;
+		}
+	}
+	return plans;
+}
+
+// Ask the tracker which peers have each of these files. Only the holders are
+// contacted, to find out which wire version they speak if we don't know yet.
+
+// :return: (whether the tracker answered for every file, the peers that have
+// each file, its number of chunks and its chunk size)
+std::tuple<bool, std::vector<FilePlan> >
+Leecher::locate_from_tracker(const std::vector<std::string> &filenames)
+{
+	std::vector<FilePlan> plans(filenames.size());
+	for (size_t file_idx = 0; file_idx < filenames.size(); ++file_idx) {
+		// The tracker counts every file in chunks of CHUNK_SIZE.
+		std::get<2>(plans[file_idx]) = ApplicationLayer::CHUNK_SIZE;
+		auto answer = live_peers->who_has(filenames[file_idx]);
+		if (!std::get<0>(answer)) {
+			return std::make_tuple(false, std::move(plans));
 		}
-		// Counters
-		peers_it = std::next(peers_it);
-		++status_idx;
-	} // peers_list is invalid now from the moves. DO NOT ACCESS
-	std::cout << "Num Chunks: " << num_chunks << "\n";
-	// For fun, print how many peers have the file
-	std::cout << peers_that_have.size() << " peers have the file.\n";
-	// Find out how many peers said that they have the file, and split the
-	// chunks up evenly among them.
-	peer_threads.clear();
-	peer_threads.reserve(peers_that_have.size());
-	const uint32_t stepping_factor =
-		ceil(num_chunks / (double)peers_that_have.size());
-	// The number of chunks we have requested from peers
-	uint32_t processed_chunks = 0;
-	// The beginning of the request address
-	uint32_t begin_idx = 0;
-	// The end of the request address, hence the -1
-	uint32_t end_idx = stepping_factor - 1;
-	size_t peers_idx = 0;
-	while (processed_chunks < num_chunks) {
-		auto &current_peer = peers_that_have[peers_idx];
-		// For the last iteration, there may be less chunks than stepping_factor
-		// remaining.
-		uint32_t chunks_left = num_chunks - processed_chunks;
-		if (chunks_left < stepping_factor) {
-			// Set to the last valid chunk index.
-			end_idx = num_chunks - 1;
+		FileHolders &peers_that_have = std::get<0>(plans[file_idx]);
+		uint32_t &num_chunks = std::get<1>(plans[file_idx]);
+		for (auto &holder : std::get<1>(answer)) {
+			const uint32_t addr = std::get<0>(holder);
+			const uint16_t port = std::get<1>(holder);
+			const uint8_t version = peer_version(addr, port);
+			// Skip holders we can't reach
+			if (version == 0 || std::get<2>(holder) == 0)
+				continue;
+			// Stand in for the FILE_RESPONSE we didn't ask for. The
+			// handle is worked out from the filename on both ends.
+			ApplicationLayer::PeerHeader file_info(
+				ApplicationLayer::PeerMessageType::FILE_RESPONSE);
+			file_info.file_name = filenames[file_idx];
+			file_info.num_chunks = std::get<2>(holder);
+			if (version >= 2) {
+				file_info.max_version = version;
+				file_info.file_handle =
+					ApplicationLayer::Peer::make_file_handle(
+						filenames[file_idx]);
+			}
+			num_chunks = std::max(num_chunks, file_info.num_chunks);
+			peers_that_have.push_back(
+				std::make_tuple(addr, port, std::move(file_info)));
 		}
-		// Begin a thread and download each of the chunks to the save_path
-		peer_threads.push_back(std::thread([&, begin_idx, end_idx] {
-			download_chunk_set(filename, begin_idx, end_idx,
-					   save_path, std::get<0>(current_peer),
-					   std::get<1>(current_peer));
-		}));
-		// Increment counters
-		processed_chunks += stepping_factor;
-		begin_idx += stepping_factor;
-		end_idx += stepping_factor;
-		++peers_idx;
 	}
-	// Join back our download threads
-	for (auto &t : peer_threads) {
-		t.join();
+	return std::make_tuple(true, std::move(plans));
+}
+
+// Find the peers that have each of these files, through the tracker if we use
+// one and by asking every peer otherwise. Then download each file that at
+// least 1 peer has to the path specified in save_path.
+
+// :return: false if any of the files could not be downloaded
+bool Leecher::download_files(const std::vector<std::string> &filenames,
+			     const std::string &save_path)
+{
+	std::vector<FilePlan> plans;
+	bool located = false;
+	if (live_peers->tracker_enabled()) {
+		auto answer = locate_from_tracker(filenames);
+		located = std::get<0>(answer);
+		plans = std::move(std::get<1>(answer));
+		if (!located) {
+			std::cerr << "Falling back to asking every peer.\n";
+		}
 	}
-	// Merge the downloaded chunks into a single file.
-	return merge_downloaded_chunks(save_path, filename, num_chunks);
+	if (!located) {
+		plans = locate_from_peers(filenames);
+	}
+	bool success = true;
+	for (size_t file_idx = 0; file_idx < filenames.size(); ++file_idx) {
+		const FileHolders &peers_that_have = std::get<0>(plans[file_idx]);
+		const uint32_t num_chunks = std::get<1>(plans[file_idx]);
+		const uint32_t chunk_size = std::get<2>(plans[file_idx]);
+		std::cout << filenames[file_idx] << " Num Chunks: " << num_chunks
+			  << "\n";
+		// For fun, print how many peers have the file
+		std::cout << peers_that_have.size() << " peers have the file.\n";
+		if (peers_that_have.empty()) {
+			std::cerr << "Error. No peers have " << filenames[file_idx]
+				  << ".\n";
+			success = false;
+			continue;
+		}
+		success = download_from_peers(filenames[file_idx],
+					      peers_that_have, num_chunks,
+					      chunk_size, save_path) &&
+			  success;
+	}
+	return success;
 }
 
-// Merge the downloaded chunks into a single file
+// Ask the peers if they have this filename. If at least 1 peers has it.
+// Download the file to the path specified in save_path.
 
 // :return: false on failure
-bool Leecher::merge_downloaded_chunks(const std::string &save_path,
-				      const std::string &filename,
-				      const size_t num_chunks)
+bool Leecher::download_file(const std::string &filename,
+			    const std::string &save_path)
 {
-	// Create file to write each chunk to
-	int merged_file_fd = open((save_path + filename).c_str(),
-				  O_CREAT | O_WRONLY | O_TRUNC, 0644);
-	// Make sure we were able to open our merged file for writing.
-	if (merged_file_fd < 0) {
-		std::cerr << "Error. Unable to open merged file for writing.\n";
-		return false;
+	return download_files(std::vector<std::string>(1, filename), save_path);
+}
+
+// Order the peers that have a file best first: the ones rated highest in
+// earlier downloads, then the ones we haven't downloaded from yet, the nearest
+// first.
+
+// :return: the peers in order
+FileHolders Leecher::rank_peers(const FileHolders &peers_that_have)
+{
+	// (rating, connect round trip, index in peers_that_have) of each peer.
+	// A round trip we haven't measured sorts last.
+	std::vector<std::tuple<double, double, size_t> > ratings;
+	ratings.reserve(peers_that_have.size());
+	for (size_t i = 0; i < peers_that_have.size(); ++i) {
+		const uint32_t addr = std::get<0>(peers_that_have[i]);
+		const uint16_t port = std::get<1>(peers_that_have[i]);
+		double rtt = scores.connect_rtt(addr, port);
+		ratings.push_back(std::make_tuple(
+			scores.rating(addr, port),
+			rtt > 0 ? rtt : std::numeric_limits<double>::max(), i));
 	}
-	// memory to store each chunk
-	std::unique_ptr<uint8_t[]> chunk(
-		new uint8_t[ApplicationLayer::CHUNK_SIZE]);
-	// filename to build each time we download a chunk
-	std::stringstream chunk_filename;
-	// Read in each chunk, and append it to the merged file.
-	for (size_t i = 0; i < num_chunks; ++i) {
-		// build chunk filename string from passed vars.
-		chunk_filename << save_path << i << ".p2p";
-		std::string full_chunk_filename = chunk_filename.str();
-		// Open up the current chunk for reading
-		int chunk_fd = open(full_chunk_filename.c_str(), O_RDONLY);
-		if (chunk_fd < 0) {
-			std::cerr << "Error. Unable to open chunk"
-				  << full_chunk_filename << " for reading.\n";
-			return false;
-		}
-		// Read the chunk into the buffer
-		ssize_t bytes_read = read(chunk_fd, chunk.get(),
-					  ApplicationLayer::CHUNK_SIZE);
-		if (bytes_read < 0) {
-			std::cerr
-				<< "Unable to read in any bytes from the chunk.\n";
-			return false;
+	std::stable_sort(ratings.begin(), ratings.end(),
+			 [](const std::tuple<double, double, size_t> &a,
+			    const std::tuple<double, double, size_t> &b) {
+				 if (std::get<0>(a) != std::get<0>(b))
+					 return std::get<0>(a) > std::get<0>(b);
+				 return std::get<1>(a) < std::get<1>(b);
+			 });
+	FileHolders ranked;
+	ranked.reserve(peers_that_have.size());
+	for (auto &rating : ratings) {
+		ranked.push_back(peers_that_have[std::get<2>(rating)]);
+	}
+	return ranked;
+}
+
+// How many block requests to keep in flight with each of the ranked peers. A
+// peer gets a share of pipeline_depth in proportion to its rating against the
+// best peer's, and at least 1. A peer we haven't rated yet gets all of it, so
+// that it can show what it can do.
+
+// :return: the depth for each peer
+std::vector<size_t> Leecher::pipeline_depths(const FileHolders &ranked)
+{
+	std::vector<size_t> depths;
+	depths.reserve(ranked.size());
+	double best = 0;
+	for (auto &peer : ranked) {
+		best = std::max(best, scores.rating(std::get<0>(peer),
+						    std::get<1>(peer)));
+	}
+	for (auto &peer : ranked) {
+		double rating = scores.rating(std::get<0>(peer),
+					      std::get<1>(peer));
+		if (rating < 0 || best <= 0) {
+			depths.push_back(pipeline_depth);
+		} else {
+			depths.push_back(std::max<size_t>(
+				1, (size_t)(pipeline_depth * rating / best +
+					    0.5)));
 		}
-		// Were done with the chunk, we can close it's file now.
-		close(chunk_fd);
-		// Delete the chunk
-		unlink(full_chunk_filename.c_str());
-		// Write the chunk into the merged file.
-		if (write(merged_file_fd, chunk.get(), bytes_read) < 0) {
-			std::cerr << "Error writing chunk to merged file.\n";
+	}
+	return depths;
+}
+
+// Download the file from the peers that have it, to the path specified in
+// save_path. Each peer fetches blocks from a shared queue for as long as there
+// are any left, so faster peers fetch more of them, and peers rated higher keep
+// more of them in flight. Each peer's blocks are striped across
+// streams_per_peer connections to it.
+
+// :return: false on failure
+bool Leecher::download_from_peers(const std::string &filename,
+				  const FileHolders &peers_that_have,
+				  const uint32_t num_chunks,
+				  const uint32_t chunk_size,
+				  const std::string &save_path)
+{
+	// The best peers go first: they hand us the leaves, and get the most
+	// blocks in flight.
+	const FileHolders ranked = rank_peers(peers_that_have);
+	const std::vector<size_t> depths = pipeline_depths(ranked);
+	// v1 peers can only send whole chunks, so with one of them in the
+	// download every block is a whole chunk.
+	uint32_t download_block_size = std::min(block_size, chunk_size);
+	for (auto &peer : peers_that_have) {
+		if (std::get<2>(peer).max_version < 2)
+			download_block_size = chunk_size;
+	}
+	if ((uint64_t)num_chunks *
+		    ((chunk_size + download_block_size - 1) /
+		     download_block_size) >
+	    0xFFFFFFFF) {
+		download_block_size = chunk_size;
+	}
+	const uint32_t blocks_per_chunk =
+		(chunk_size + download_block_size - 1) / download_block_size;
+	uint64_t file_chunks = num_chunks;
+	uint64_t num_blocks = (uint64_t)num_chunks * blocks_per_chunk;
+	// Fetch the file's leaves, so each block can be checked as it lands.
+	// They also say exactly how many blocks the file has.
+	std::vector<ApplicationLayer::HashDigest> leaves;
+	const bool verifying =
+		chunk_size % ApplicationLayer::HASH_LEAF_SIZE == 0 &&
+		fetch_leaves(ranked, num_chunks, chunk_size, leaves);
+	if (verifying) {
+		const uint64_t hashed_length =
+			leaves.size() * ApplicationLayer::HASH_LEAF_SIZE;
+		file_chunks = (hashed_length + chunk_size - 1) / chunk_size;
+		num_blocks = (file_chunks - 1) * blocks_per_chunk +
+			     (hashed_length - (file_chunks - 1) * chunk_size +
+			      download_block_size - 1) /
+				     download_block_size;
+	} else {
+		std::cerr << "No peer has the hashes of " << filename
+			  << ", so it won't be checked.\n";
+	}
+	if (num_blocks > 0xFFFFFFFF) {
+		std::cerr << "Error. " << filename << " has too many blocks.\n";
+		return false;
+	}
+	// Pick up the blocks an earlier run of the same download finished, as
+	// long as what it wrote is still there.
+	const std::string destination_path = save_path + filename;
+	DownloadState state(destination_path);
+	std::string root_hash;
+	if (verifying) {
+		ApplicationLayer::HashDigest root =
+			ApplicationLayer::HashTree::root(leaves);
+		root_hash.assign(root.begin(), root.end());
+	}
+	if (!state.open(num_blocks, download_block_size, chunk_size,
+			root_hash)) {
+		return false;
+	}
+	int destination_fd = -1;
+	if (state.done_count() > 0) {
+		destination_fd = open(destination_path.c_str(), O_RDWR);
+		if (destination_fd >= 0) {
+			std::cout << "Resuming " << filename << ", "
+				  << state.done_count() << " of " << num_blocks
+				  << " blocks are already downloaded.\n";
+		} else if (!state.reset()) {
 			return false;
 		}
-		// Clear the string stream for the next iteration.
-		chunk_filename.str(std::string());
 	}
-	close(merged_file_fd);
-	return true;
+	// Open the destination file, and reserve room for every chunk up front
+	// so that each one can be written straight into its place. Blocks are
+	// read back from it to be checked.
+	if (destination_fd < 0) {
+		destination_fd = open(destination_path.c_str(),
+				      O_CREAT | O_RDWR | O_TRUNC, 0644);
+	}
+	if (destination_fd < 0) {
+		std::cerr << "Error. Unable to open destination file for writing.\n";
+		return false;
+	}
+	const off_t reserved_length = (off_t)file_chunks * chunk_size;
+	// Not every filesystem supports fallocate, a sparse file works too.
+	if (fallocate(destination_fd, 0, 0, reserved_length) < 0 &&
+	    ftruncate(destination_fd, reserved_length) < 0) {
+		std::cerr << "Error. Unable to reserve space for the download.\n";
+		close(destination_fd);
+		return false;
+	}
+	// Every peer that has the file fetches from one queue of the blocks we
+	// don't have yet.
+	ChunkScheduler scheduler(num_blocks, chunk_timeout);
+	for (uint32_t block_idx = 0; block_idx < num_blocks; ++block_idx) {
+		if (state.done(block_idx))
+			scheduler.complete(block_idx);
+	}
+	std::unique_ptr<BlockVerifier> verifier;
+	if (verifying) {
+		verifier.reset(new BlockVerifier(destination_fd, leaves,
+						 scheduler, state,
+						 verify_threads));
+	}
+	// Every stream is a worker of its own to the scheduler, numbered from
+	// the peer's index times MAX_STREAMS_PER_PEER.
+	std::vector<std::unique_ptr<PeerStreams> > peer_streams;
+	for (size_t peer_idx = 0;
+	     peer_idx < ranked.size() && peer_idx < num_blocks; ++peer_idx) {
+		peer_streams.emplace_back(new PeerStreams(
+			streams_per_peer, peer_idx * MAX_STREAMS_PER_PEER));
+		PeerStreams *streams = peer_streams.back().get();
+		streams->start([&, peer_idx, streams](const size_t worker) {
+			return std::thread([&, peer_idx, streams, worker] {
+				auto &current_peer = ranked[peer_idx];
+				fetch_chunks(filename, std::get<2>(current_peer),
+					     chunk_size, download_block_size,
+					     scheduler, verifier.get(), worker,
+					     depths[peer_idx], destination_fd,
+					     state, *streams,
+					     std::get<0>(current_peer),
+					     std::get<1>(current_peer));
+			});
+		});
+	}
+	// Join back our download threads
+	for (auto &streams : peer_streams) {
+		const size_t num_streams = streams->join();
+		if (num_streams > 1)
+			std::cout << "Fetched over " << num_streams
+				  << " streams from one peer.\n";
+	}
+	if (verifier) {
+		verifier->finish();
+	}
+	scheduler.report(std::cout, state.length());
+	bool success = scheduler.finished();
+	// The download is complete once the last chunk has landed. Trim the
+	// reservation down to the real length of the file.
+	if (success && ftruncate(destination_fd, state.length()) < 0) {
+		std::cerr << "Error. Unable to set the length of the download.\n";
+		success = false;
+	}
+	close(destination_fd);
+	// Keep what we learned about the peers for the next download.
+	scores.save();
+	// Only a complete download lets go of its state. Otherwise the next
+	// attempt carries on from it.
+	if (success) {
+		state.finish();
+	} else {
+		std::cerr << "Error. Not every chunk of " << filename
+			  << " could be downloaded.\n";
+	}
+	return success;
 }
 
 } // namespace Peer
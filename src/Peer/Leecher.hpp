@@ -1,37 +1,194 @@
 #include "Peers.hpp"
+#include "ConnectionPool.hpp"
+#include "ChunkScheduler.hpp"
+#include "BlockVerifier.hpp"
+#include "DownloadState.hpp"
+#include "PeerScores.hpp"
+#include "PeerStreams.hpp"
+#include "../ApplicationLayer/Peer.hpp"
 #include <memory>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace Peer
 {
+// Default number of chunk requests kept outstanding on each connection
+static const size_t constexpr DEFAULT_PIPELINE_DEPTH = 4;
+// Default time a peer gets to make progress on a chunk before it is handed to
+// another peer
+static const constexpr std::chrono::seconds DEFAULT_CHUNK_TIMEOUT(30);
+// Default size of the blocks v2 peers are asked for inside each chunk. Blocks
+// are a whole number of hash tree leaves, so each can be checked on its own.
+static const size_t constexpr DEFAULT_BLOCK_SIZE =
+	ApplicationLayer::HASH_LEAF_SIZE;
+
+// (address, port, FILE_RESPONSE) of each peer that has a file
+using FileHolders = std::vector<
+	std::tuple<uint32_t, uint16_t, ApplicationLayer::PeerHeader> >;
+// (the peers that have a file, its number of chunks, its chunk size)
+using FilePlan = std::tuple<FileHolders, uint32_t, uint32_t>;
+
 class Leecher {
 	const std::shared_ptr<Peers> live_peers;
+	const size_t pipeline_depth;
+	const std::chrono::milliseconds chunk_timeout;
+	const uint32_t block_size;
+	const size_t verify_threads;
+	// TCP streams opened to each peer in a download, 0 to adapt
+	const size_t streams_per_peer;
+	// Codecs we offer v3 peers to compress blocks with, 0 for none
+	const uint32_t compression;
+	// How well each peer has done, across downloads and runs
+	PeerScores scores;
+	// Connections to other peers, kept open across requests and downloads
+	ConnectionPool connections;
+	std::mutex versions_lock;
+	// (address << 16 | port): the wire version the peer agreed on
+	std::unordered_map<uint64_t, uint8_t> peer_versions;
+
+	// Send the request to the peer (addr, port) over a pooled connection, and
+	// read back its response.
+
+	// :return: false on failure
+	bool exchange(const ApplicationLayer::PeerHeader &request,
+		      ApplicationLayer::PeerHeader &out_response,
+		      const uint32_t addr, const uint16_t port);
+	// The wire version the peer speaks, asking it if we haven't already.
+
+	// :return: 0 if the peer couldn't be reached
+	uint8_t peer_version(const uint32_t addr, const uint16_t port);
 
-	// Connect to the specified peer, (addr, port) and ask them if they have the
-	// passed filename.
-	static std::tuple<bool, uint32_t>
+	// Ask the specified peer, (addr, port) if they have the passed filename,
+	// over a pooled connection. Offers the peer our latest wire version while
+	// we're at it.
+
+	// :return: (whether they have it, their FILE_RESPONSE)
+	std::tuple<bool, ApplicationLayer::PeerHeader>
 	does_peer_have_file(const std::string &filename, const uint32_t addr,
 			    const uint16_t port);
-	// Download a chunk set to the passed save_path.
-	static void download_chunk_set(const std::string &filename,
-				       const uint32_t begin_idx,
-				       const uint32_t end_idx,
-				       const std::string &save_path,
-				       const uint32_t address,
-				       const uint16_t port);
-	// Merge the downloaded chunks into a single file
+	// Ask the peer whether it has each of the filenames. A v2 peer is asked
+	// about them in FILE_BATCH_REQUESTs, a v1 peer one file at a time.
+
+	// :return: (whether they have it, their FILE_RESPONSE) for each filename
+	std::vector<std::tuple<bool, ApplicationLayer::PeerHeader> >
+	query_files(const std::vector<std::string> &filenames,
+		    const uint32_t addr, const uint16_t port);
+	// Fetch every page of the peer's catalog. Only v2 peers have one.
+
+	// :return: (whether we were successful, the catalog)
+	std::tuple<bool, std::vector<ApplicationLayer::CatalogEntry> >
+	fetch_inventory(const uint32_t addr, const uint16_t port);
+	// Fetch every page of the leaves of a file's HashTree from the peer.
+	// file_info is the peer's FILE_RESPONSE. Only v2 peers have them. The
+	// file has num_chunks chunks of chunk_size, which bounds how many leaves
+	// it can have.
+
+	// :return: (whether we were successful, the leaves)
+	std::tuple<bool, std::vector<ApplicationLayer::HashDigest> >
+	fetch_hashes(const ApplicationLayer::PeerHeader &file_info,
+		     const uint32_t num_chunks, const uint32_t chunk_size,
+		     const uint32_t addr, const uint16_t port);
+	// Fetch the leaves of a file of num_chunks chunks of chunk_size from the
+	// first peer that has it whose leaves add up to the root it told us
+	// about.
+
+	// :return: false if no peer could give us the leaves
+	bool fetch_leaves(const FileHolders &peers_that_have,
+			  const uint32_t num_chunks, const uint32_t chunk_size,
+			  std::vector<ApplicationLayer::HashDigest> &out_leaves);
+	// Fetch blocks from the peer, taking them from the scheduler as worker
+	// until there are none left for it, and write each one straight into
+	// the destination file. The file is split into chunks of chunk_size,
+	// and each chunk into blocks of block_size. Every block that is done is
+	// marked in the download's state. file_info is the peer's
+	// FILE_RESPONSE, which says which wire version to use. Up to depth
+	// block requests are kept outstanding on the connection. How long each
+	// block takes is scored. A peer that fails or stalls for longer than
+	// chunk_timeout gives its blocks back and is dropped from the download.
+	// Blocks are handed to the verifier to be checked, if there is one.
+	// This is one of the peer's streams, which share its download limit and
+	// hear of every block fetched.
+	void fetch_chunks(const std::string &filename,
+			  const ApplicationLayer::PeerHeader &file_info,
+			  const uint32_t chunk_size, const uint32_t block_size,
+			  ChunkScheduler &scheduler, BlockVerifier *verifier,
+			  const size_t worker, const size_t depth,
+			  const int destination_fd, DownloadState &state,
+			  PeerStreams &streams, const uint32_t addr,
+			  const uint16_t port);
+	// Order the peers that have a file best first: the ones rated highest
+	// in earlier downloads, then the ones we haven't downloaded from yet,
+	// the nearest first.
+
+	// :return: the peers in order
+	FileHolders rank_peers(const FileHolders &peers_that_have);
+	// How many block requests to keep in flight with each of the ranked
+	// peers. A peer gets a share of pipeline_depth in proportion to its
+	// rating against the best peer's, and at least 1. A peer we haven't
+	// rated yet gets all of it, so that it can show what it can do.
+
+	// :return: the depth for each peer
+	std::vector<size_t> pipeline_depths(const FileHolders &ranked);
+	// Ask every peer which of these files they have, in one exchange per
+	// peer where the peer allows it.
+
+	// :return: the peers that have each file, its number of chunks and its
+	// chunk size
+	std::vector<FilePlan>
+	locate_from_peers(const std::vector<std::string> &filenames);
+	// Ask the tracker which peers have each of these files. Only the holders
+	// are contacted, to find out which wire version they speak if we don't
+	// know yet.
+
+	// :return: (whether the tracker answered for every file, the peers that
+	// have each file, its number of chunks and its chunk size)
+	std::tuple<bool, std::vector<FilePlan> >
+	locate_from_tracker(const std::vector<std::string> &filenames);
+	// Download the file from the peers that have it, to the path specified
+	// in save_path. Each peer fetches blocks from a shared queue for as long
+	// as there are any left, so faster peers fetch more of them, and peers
+	// rated higher keep more of them in flight. Each peer's blocks are
+	// striped across streams_per_peer connections to it. Each block
+	// is checked against the file's HashTree while the next ones arrive.
+	// A download cut short picks up from the blocks its state file says
+	// are done.
 
 	// :return: false on failure
-	bool merge_downloaded_chunks(const std::string &save_path,
-				     const std::string &filename,
-				     const size_t num_chunks);
+	bool download_from_peers(const std::string &filename,
+				 const FileHolders &peers_that_have,
+				 const uint32_t num_chunks,
+				 const uint32_t chunk_size,
+				 const std::string &save_path);
 
     public:
-	Leecher(std::shared_ptr<Peers> &live_peers);
+	Leecher(std::shared_ptr<Peers> &live_peers,
+		const size_t pipeline_depth = DEFAULT_PIPELINE_DEPTH,
+		const std::chrono::milliseconds chunk_timeout =
+			DEFAULT_CHUNK_TIMEOUT,
+		const size_t block_size = DEFAULT_BLOCK_SIZE,
+		const size_t verify_threads = DEFAULT_VERIFY_THREADS,
+		const std::string &scores_path = DEFAULT_PEER_SCORES_PATH,
+		const size_t streams_per_peer = DEFAULT_STREAMS_PER_PEER,
+		const uint32_t compression =
+			ApplicationLayer::SUPPORTED_COMPRESSION);
 	// This cannot be moved, deleted, or reassigned
 	Leecher(Leecher &&leecher) = delete;
 	Leecher(Leecher &leecher) = delete;
 	Leecher &operator=(Leecher &leecher) = delete;
 	Leecher &operator=(Leecher &&leecher) = delete;
+	// List every file shared by the live peers that speak v2, sorted and
+	// without duplicates.
+	std::vector<std::string> list_files(void);
+	// Find the peers that have each of these files, through the tracker if
+	// we use one and by asking every peer otherwise. Then download each file
+	// that at least 1 peer has to the path specified in save_path.
+
+	// :return: false if any of the files could not be downloaded
+	bool download_files(const std::vector<std::string> &filenames,
+			    const std::string &save_path);
 	// Ask the peers if they have this filename. If at least 1 peers has it.
 	// Download the file to the path specified in save_path.
 
@@ -2,22 +2,36 @@
 #include "Peers.hpp"
 #include "Seeder.hpp"
 #include "Leecher.hpp"
+#include "RateLimits.hpp"
 #include <iterator>
 extern "C" {
 #include <netinet/in.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 }
 #include <csignal>
+#include <cerrno>
 #include <iostream>
-#include <cmath>
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <thread>
+#include <unordered_map>
 
 // IP Address and Port of the Swarm Server
 static const constexpr char SERVER_ADDRESS[] = "127.0.0.1";
 static const constexpr uint16_t PORT = 50001;
+// How often the rate limits file is checked for changes
+static const constexpr std::chrono::seconds LIMITS_POLL_INTERVAL(1);
 static std::weak_ptr<Peer::Peers> peers_instance;
 static std::unique_ptr<Peer::Seeder> seeder = nullptr;
+// The SIGINT handler hands the signal on through this, so that the cleanup
+// runs outside of it
+static int interrupt_pipe[2] = { -1, -1 };
 // On exit, this function is called to close the server_socket_fd
 // and destroy the rwlock.
 void cleanup_on_exit(int signum)
@@ -30,11 +44,101 @@ void cleanup_on_exit(int signum)
 	}
 	// Close the seeder server
 	if (seeder != nullptr) {
+		seeder->report(std::cout);
 		seeder->stop();
 	}
+	ApplicationLayer::BufferPool::instance().report(std::cout);
 	exit(signum);
 }
 
+// Hand SIGINT on to handle_interrupts. Hardly anything else is safe to call
+// from a signal handler.
+static void on_interrupt(int signum)
+{
+	const uint8_t signal_number = signum;
+	if (write(interrupt_pipe[1], &signal_number, 1) < 0) {
+		_exit(signum);
+	}
+}
+
+// Wait for the SIGINT handler to hand a signal on, then clean up and exit
+// with it.
+static void handle_interrupts(void)
+{
+	uint8_t signal_number;
+	while (read(interrupt_pipe[0], &signal_number, 1) < 0 &&
+	       errno == EINTR) {
+	}
+	cleanup_on_exit(signal_number);
+}
+
+// Read a size setting from the environment, falling back to default_value
+// when it isn't set or isn't a valid number.
+static size_t size_setting(const char *name, const size_t default_value)
+{
+	const char *value = getenv(name);
+	if (value == nullptr) {
+		return default_value;
+	}
+	try {
+		return std::stoull(value);
+	} catch (std::logic_error &err) {
+		std::cerr << "Error. " << name
+			  << " is not a valid size. Using the default.\n";
+		return default_value;
+	}
+}
+
+// Set the upload and download limits, in bytes per second, from the values
+// passed or else the environment. Unset limits are off.
+static void
+configure_rate_limits(const std::unordered_map<std::string, size_t> &values)
+{
+	auto rate = [&values](const char *name) {
+		auto value = values.find(name);
+		return value != values.end() ? value->second :
+					       size_setting(name, 0);
+	};
+	Peer::RateLimits::instance().configure(
+		rate("P2P_UPLOAD_RATE"), rate("P2P_DOWNLOAD_RATE"),
+		rate("P2P_UPLOAD_RATE_PER_PEER"),
+		rate("P2P_DOWNLOAD_RATE_PER_PEER"));
+}
+
+// Watch the limits file, and whenever it changes apply the limits it sets, one
+// NAME=VALUE per line with the same names as the environment. Runs for as
+// long as we do.
+static void watch_rate_limits(const std::string path)
+{
+	timespec last_change = {};
+	while (true) {
+		struct stat file_stat;
+		if (stat(path.c_str(), &file_stat) == 0 &&
+		    (file_stat.st_mtim.tv_sec != last_change.tv_sec ||
+		     file_stat.st_mtim.tv_nsec != last_change.tv_nsec)) {
+			last_change = file_stat.st_mtim;
+			std::ifstream file(path);
+			std::unordered_map<std::string, size_t> values;
+			std::string line;
+			while (std::getline(file, line)) {
+				size_t equals = line.find('=');
+				if (equals == std::string::npos)
+					continue;
+				try {
+					values[line.substr(0, equals)] =
+						std::stoull(line.substr(equals + 1));
+				} catch (std::logic_error &err) {
+					std::cerr << "Error. Ignoring invalid rate limit: "
+						  << line << "\n";
+				}
+			}
+			configure_rate_limits(values);
+			std::cout << "Rate limits updated from " << path << ".\n";
+		}
+		std::this_thread::sleep_for(LIMITS_POLL_INTERVAL);
+	}
+}
+
 // Retrieve out listen address and port from the user
 static int get_listen_address_port(std::string &out_address, uint16_t &out_port)
 {
@@ -75,11 +179,18 @@ static int get_listen_address_port(std::string &out_address, uint16_t &out_port)
 }
 
 // Ask the user for filenames to share (name and path)[for simplicity].
-static std::unordered_map<std::string, std::tuple<std::string, uint32_t> >
-get_files_to_share(void)
+static Peer::SharedFiles get_files_to_share(void)
 {
-	std::unordered_map<std::string, std::tuple<std::string, uint32_t> >
-		shared_files;
+	Peer::SharedFiles shared_files;
+	// The chunk size v2 peers are told to split our files into. It is a
+	// whole number of hash tree leaves, so each chunk can be checked.
+	const uint32_t chunk_size =
+		std::max<uint32_t>(std::min(size_setting("P2P_CHUNK_SIZE",
+							 ApplicationLayer::CHUNK_SIZE),
+					    ApplicationLayer::MAX_CHUNK_SIZE) /
+					   ApplicationLayer::HASH_LEAF_SIZE,
+				   1) *
+		ApplicationLayer::HASH_LEAF_SIZE;
 	std::cout << "Please enter the files you wish to share: "
 		     "(Just hit enter for none.).\n";
 	while (true) {
@@ -113,22 +224,73 @@ get_files_to_share(void)
 		}
 		// Calculate the number of chunks in the file
 		size_t file_length = file_info.st_size;
-		size_t num_chunks = ceil(file_length /
-					 (double)ApplicationLayer::CHUNK_SIZE);
-		// Insert the key (filename) and data (path, and num chunks)
-		shared_files.insert(std::make_pair(
-			std::move(filename),
-			std::make_pair(file_complete_path, num_chunks)));
+		size_t num_chunks = (file_length + chunk_size - 1) / chunk_size;
+		// Insert the key (filename) and data (path, num chunks, size and
+		// chunk size)
+		Peer::SharedFile shared_file = { file_complete_path,
+						 (uint32_t)num_chunks,
+						 (uint64_t)file_length, chunk_size };
+		// Hash the file on every core, so leechers can check what we
+		// send them.
+		std::cout << "Hashing " << filename << "\n";
+		int file_fd = open(file_complete_path.c_str(),
+				   O_RDONLY | O_CLOEXEC);
+		if (file_fd < 0) {
+			std::cerr << "Error. Unable to open file to share.\n";
+			cleanup_on_exit(EXIT_FAILURE);
+		}
+		bool hashed = ApplicationLayer::HashTree::hash_file(
+			file_fd, file_length, shared_file.leaves,
+			std::thread::hardware_concurrency());
+		close(file_fd);
+		if (!hashed) {
+			cleanup_on_exit(EXIT_FAILURE);
+		}
+		ApplicationLayer::HashDigest root =
+			ApplicationLayer::HashTree::root(shared_file.leaves);
+		shared_file.root_hash.assign(root.begin(), root.end());
+		shared_files.insert(
+			std::make_pair(std::move(filename), shared_file));
 	}
 	return shared_files;
 }
 
 int main(void)
 {
-	// Attach our cleanup handler to SIGINT
-	signal(SIGINT, cleanup_on_exit);
+	// Attach our cleanup handler to SIGINT. It runs on a thread of its own,
+	// since the seeder and buffer pool take locks and print their reports.
+	if (pipe2(interrupt_pipe, O_CLOEXEC) < 0) {
+		std::cerr << "Error. Unable to set up the SIGINT handler.\n";
+		return EXIT_FAILURE;
+	}
+	std::thread(handle_interrupts).detach();
+	signal(SIGINT, on_interrupt);
 	// ignore sigpipe (kills valgrind)
 	signal(SIGPIPE, SIG_IGN);
+	// Bound how much of each incoming chunk is held in memory at once
+	ApplicationLayer::Peer::set_receive_slice_size(
+		size_setting("P2P_RECEIVE_SLICE_SIZE",
+			     ApplicationLayer::DEFAULT_RECEIVE_SLICE_SIZE));
+	// Cap the chunk memory in flight across every seeder and leecher thread
+	ApplicationLayer::BufferPool::instance().configure(
+		size_setting("P2P_BUFFER_BUDGET",
+			     ApplicationLayer::DEFAULT_BUFFER_BUDGET),
+		size_setting("P2P_HUGE_PAGES", 0) != 0);
+	// Move chunk payloads with blocking calls, or through io_uring
+	const char *io_backend = getenv("P2P_IO_BACKEND");
+	if (io_backend != nullptr && std::string(io_backend) == "uring" &&
+	    !ApplicationLayer::Peer::set_io_backend(
+		    ApplicationLayer::IO_URING)) {
+		std::cerr << "Warning. This build has no io_uring backend, "
+			     "using blocking I/O.\n";
+	}
+	// Shape our upload and download, and keep following the limits file if
+	// there is one
+	configure_rate_limits({});
+	const char *limits_file = getenv("P2P_LIMITS_FILE");
+	if (limits_file != nullptr) {
+		std::thread(watch_rate_limits, std::string(limits_file)).detach();
+	}
 	std::string address;
 	uint16_t port;
 	// Retrieve out listen address and port from the user
@@ -136,43 +298,114 @@ int main(void)
 		return EXIT_FAILURE;
 	}
 	// Connect to swarm server and acquire peer ip addresses.
+	// In tracker mode the swarm server also tracks who has which file.
 	std::shared_ptr<Peer::Peers> peers(
-		new Peer::Peers(SERVER_ADDRESS, PORT, address, port));
+		new Peer::Peers(SERVER_ADDRESS, PORT, address, port,
+				size_setting("P2P_TRACKER", 0) != 0));
 	peers_instance = peers;
 	peers->start();
-	// Wait for the peer messages to come in...
-	std::this_thread::sleep_for(std::chrono::milliseconds(250));
+	// Wait for the server to tell us who is in the swarm
+	if (!peers->wait_for_snapshot(Peer::SNAPSHOT_TIMEOUT)) {
+		std::cerr << "The swarm server hasn't sent us the peers in the "
+			     "swarm. Carrying on with the ones we know of.\n";
+	}
 	// Pull the list of peer messages
-	Peer::PeersList live_peers = peers->get_current_peers();
+	Peer::PeersSnapshot live_peers = peers->get_current_peers();
 	// Check if we are the only peer currently in the swarm
-	if (live_peers.size() == 0) {
+	if (live_peers->size() == 0) {
 		std::cout << "We are currently the only peer in the swarm.\n";
 	}
 	// Ask the user for filenames to share (name and path)[for simplicity].
 	auto files = get_files_to_share();
 	// If files length is 0, and we are the only peer, might as well shutdown.
 	// We have nothing to do.
-	if (files.size() == 0 && live_peers.size() == 0) {
+	if (files.size() == 0 && live_peers->size() == 0) {
 		std::cout
 			<< "Shutting down, we have no files to share, and there are "
 			   "no peers in the swarm.\n";
 		cleanup_on_exit(EXIT_SUCCESS);
 	}
+	// What we share, as the tracker wants to hear it. The tracker has no
+	// room for a chunk size, so it hears chunks of CHUNK_SIZE.
+	std::vector<ApplicationLayer::SwarmFile> announcement;
+	announcement.reserve(files.size());
+	for (auto &file : files) {
+		ApplicationLayer::SwarmFile shared_file = {
+			file.first,
+			(uint32_t)((file.second.size + ApplicationLayer::CHUNK_SIZE -
+				    1) /
+				   ApplicationLayer::CHUNK_SIZE)
+		};
+		announcement.push_back(std::move(shared_file));
+	}
 	// Start the file request listener with the list of shared files
 	if (files.size() > 0) {
-		seeder.reset(new Peer::Seeder(address, port, std::move(files)));
+		seeder.reset(new Peer::Seeder(
+			address, port, std::move(files),
+			size_setting("P2P_SEEDER_THREADS",
+				     Peer::DEFAULT_SEEDER_THREADS),
+			size_setting("P2P_LISTEN_BACKLOG",
+				     Peer::DEFAULT_LISTEN_BACKLOG),
+			size_setting("P2P_CHUNK_CACHE",
+				     Peer::DEFAULT_CHUNK_CACHE_SIZE),
+			size_setting("P2P_UPLOAD_SLOTS",
+				     Peer::DEFAULT_UPLOAD_SLOTS),
+			size_setting("P2P_COMPRESSED_CACHE",
+				     Peer::DEFAULT_COMPRESSED_CACHE_SIZE)));
 		seeder->start();
 	}
-	// Ask the user if they want to download a file and ask for the filename.
-	std::cout << "If you would like to download a file, "
-		     "please enter the filename: ";
-	std::string filename_to_download;
-	if (!std::getline(std::cin, filename_to_download)) {
-		std::cerr << "Error. Unable to read in line from stdin.\n";
-		cleanup_on_exit(EXIT_FAILURE);
-	}
-	// The user specified a file to download:
-	if (!(filename_to_download.empty())) {
+	// Tell the tracker what we share, so leechers can find us without
+	// asking every peer.
+	peers->announce_files(std::move(announcement));
+	// Start the Leecher system. It holds on to its connections to other
+	// peers between downloads.
+	Peer::Leecher leecher(
+		peers,
+		size_setting("P2P_PIPELINE_DEPTH", Peer::DEFAULT_PIPELINE_DEPTH),
+		std::chrono::seconds(size_setting(
+			"P2P_CHUNK_TIMEOUT", Peer::DEFAULT_CHUNK_TIMEOUT.count())),
+		size_setting("P2P_BLOCK_SIZE", Peer::DEFAULT_BLOCK_SIZE),
+		size_setting("P2P_VERIFY_THREADS", Peer::DEFAULT_VERIFY_THREADS),
+		getenv("P2P_PEER_SCORES") != nullptr ?
+			getenv("P2P_PEER_SCORES") :
+			Peer::DEFAULT_PEER_SCORES_PATH,
+		size_setting("P2P_STREAMS_PER_PEER",
+			     Peer::DEFAULT_STREAMS_PER_PEER),
+		size_setting("P2P_COMPRESSION",
+			     ApplicationLayer::SUPPORTED_COMPRESSION));
+	while (true) {
+		// Ask the user if they want to download files and ask for the
+		// filenames. Filenames can't hold a '/', so it separates them.
+		std::cout << "If you would like to download files, please enter "
+			     "the filenames separated by '/', or * for every "
+			     "file in the swarm: ";
+		std::string filenames_to_download;
+		if (!std::getline(std::cin, filenames_to_download)) {
+			std::cerr
+				<< "Error. Unable to read in line from stdin.\n";
+			cleanup_on_exit(EXIT_FAILURE);
+		}
+		// The user is done downloading
+		if (filenames_to_download.empty()) {
+			break;
+		}
+		std::vector<std::string> filenames;
+		if (filenames_to_download == "*") {
+			// Ask the peers what they share
+			filenames = leecher.list_files();
+			std::cout << filenames.size()
+				  << " files are shared in the swarm.\n";
+		} else {
+			std::stringstream names(filenames_to_download);
+			std::string filename;
+			while (std::getline(names, filename, '/')) {
+				if (!filename.empty())
+					filenames.push_back(std::move(filename));
+			}
+		}
+		if (filenames.empty()) {
+			continue;
+		}
 		std::cout << "Please enter a directory to save the file in: ";
 		std::string save_path;
 		if (!std::getline(std::cin, save_path)) {
@@ -181,16 +414,14 @@ int main(void)
 			cleanup_on_exit(EXIT_FAILURE);
 		}
 		// if the save_path doesn't have a trailing /, then add one.
-		if (*std::prev(save_path.end()) != '/') {
+		if (save_path.empty() || *std::prev(save_path.end()) != '/') {
 			save_path.push_back('/');
 		}
-		// Start the Leecher system
-		Peer::Leecher leecher(peers);
-		leecher.download_file(filename_to_download, save_path);
+		leecher.download_files(filenames, save_path);
+		ApplicationLayer::BufferPool::instance().report(std::cout);
 	}
-	// If a filename was specified, download that file to the current directory.
-	// If not, be a seeder to the pool for the files specified. If no files
-	// specified then just seed.
+	// Once the user is done downloading, be a seeder to the pool for the
+	// files specified. If no files specified then just seed.
 	std::cout << "Entering seed mode. Hit enter to exit.\n";
 	std::getline(std::cin, address);
 	cleanup_on_exit(EXIT_SUCCESS);
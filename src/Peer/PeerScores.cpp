@@ -0,0 +1,149 @@
+#include "PeerScores.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+extern "C" {
+#include <arpa/inet.h>
+}
+
+namespace Peer
+{
+// How much each new measurement moves a score's averages
+static const double constexpr RTT_WEIGHT = 0.3;
+static const double constexpr THROUGHPUT_WEIGHT = 0.2;
+static const double constexpr FAILURE_WEIGHT = 0.1;
+
+// Keep the scores in the file at path, loading what it already has.
+PeerScores::PeerScores(const std::string &path) : path(path)
+{
+	if (path.empty())
+		return;
+	std::ifstream file(path);
+	std::string line;
+	while (std::getline(file, line)) {
+		std::istringstream fields(line);
+		std::string address;
+		uint32_t port;
+		Score score;
+		in_addr addr;
+		if (!(fields >> address >> port >> score.connect_rtt_us >>
+		      score.bytes_per_second >> score.failure_rate) ||
+		    inet_pton(AF_INET, address.c_str(), &addr) <= 0 ||
+		    port > 0xFFFF) {
+			std::cerr << "Warning. Skipping a malformed line in "
+				  << path << ".\n";
+			continue;
+		}
+		scores[peer_key(addr.s_addr, htons(port))] = score;
+	}
+}
+
+uint64_t PeerScores::peer_key(const uint32_t addr, const uint16_t port)
+{
+	return ((uint64_t)addr << 16) | port;
+}
+
+// Write the scores out to the file, replacing what it held. They are written
+// to a new file that is then renamed over the old one, so a crash leaves one
+// or the other whole.
+
+// :return: false on failure
+bool PeerScores::save(void)
+{
+	if (path.empty())
+		return true;
+	std::lock_guard<std::mutex> scores_guard(scores_lock);
+	const std::string new_path = path + ".new";
+	{
+		std::ofstream file(new_path, std::ios::trunc);
+		for (auto &item : scores) {
+			in_addr addr = { .s_addr = (uint32_t)(item.first >> 16) };
+			char address[INET_ADDRSTRLEN];
+			inet_ntop(AF_INET, &addr, address, sizeof(address));
+			file << address << ' ' << ntohs(item.first & 0xFFFF)
+			     << ' ' << item.second.connect_rtt_us << ' '
+			     << item.second.bytes_per_second << ' '
+			     << item.second.failure_rate << '\n';
+		}
+		if (!file.flush()) {
+			std::cerr << "Error. Unable to write the peer scores.\n";
+			return false;
+		}
+	}
+	if (std::rename(new_path.c_str(), path.c_str()) != 0) {
+		std::cerr << "Error. Unable to replace the peer scores.\n";
+		return false;
+	}
+	return true;
+}
+
+// Opening a connection to the peer took rtt.
+void PeerScores::record_connect(const uint32_t addr, const uint16_t port,
+				const std::chrono::microseconds rtt)
+{
+	std::lock_guard<std::mutex> scores_guard(scores_lock);
+	Score &score = scores[peer_key(addr, port)];
+	score.connect_rtt_us =
+		score.connect_rtt_us == 0 ?
+			rtt.count() :
+			score.connect_rtt_us +
+				RTT_WEIGHT * (rtt.count() - score.connect_rtt_us);
+}
+
+// The peer sent a block of bytes in elapsed. That counts as an attempt that
+// didn't fail.
+void PeerScores::record_block(const uint32_t addr, const uint16_t port,
+			      const size_t bytes,
+			      const std::chrono::microseconds elapsed)
+{
+	if (bytes == 0)
+		return;
+	// Less than a microsecond rounds up, rather than dividing by 0.
+	const double rate =
+		bytes * 1e6 / std::max<int64_t>(1, elapsed.count());
+	std::lock_guard<std::mutex> scores_guard(scores_lock);
+	Score &score = scores[peer_key(addr, port)];
+	score.bytes_per_second =
+		score.bytes_per_second == 0 ?
+			rate :
+			score.bytes_per_second +
+				THROUGHPUT_WEIGHT *
+					(rate - score.bytes_per_second);
+	score.failure_rate -= FAILURE_WEIGHT * score.failure_rate;
+}
+
+// The peer couldn't be reached, stalled, or broke off.
+void PeerScores::record_failure(const uint32_t addr, const uint16_t port)
+{
+	std::lock_guard<std::mutex> scores_guard(scores_lock);
+	Score &score = scores[peer_key(addr, port)];
+	score.failure_rate += FAILURE_WEIGHT * (1 - score.failure_rate);
+}
+
+// How much work the peer has earned: its throughput, less the share of
+// attempts it fails.
+
+// :return: the rating, or a negative number if it hasn't sent us any blocks
+// yet
+double PeerScores::rating(const uint32_t addr, const uint16_t port)
+{
+	std::lock_guard<std::mutex> scores_guard(scores_lock);
+	auto item = scores.find(peer_key(addr, port));
+	if (item == scores.end() || item->second.bytes_per_second == 0)
+		return -1;
+	return item->second.bytes_per_second *
+	       (1 - item->second.failure_rate);
+}
+
+// How long it takes to connect to the peer.
+
+// :return: the round trip in microseconds, 0 if we haven't measured it
+double PeerScores::connect_rtt(const uint32_t addr, const uint16_t port)
+{
+	std::lock_guard<std::mutex> scores_guard(scores_lock);
+	auto item = scores.find(peer_key(addr, port));
+	return item == scores.end() ? 0 : item->second.connect_rtt_us;
+}
+} // namespace Peer
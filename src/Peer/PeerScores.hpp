@@ -0,0 +1,68 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+namespace Peer
+{
+// Default file the peer scores are kept in between runs. Empty keeps them in
+// memory only.
+static const constexpr char DEFAULT_PEER_SCORES_PATH[] = ".p2p_peer_scores";
+
+// How well each peer we have downloaded from has done: how long it takes to
+// connect to, how fast it sends blocks, and how often it fails us. Each is a
+// moving average, so a peer that gets better or worse is soon scored as such.
+// The scores are kept in a file, so they carry over between downloads and
+// runs, one peer per line:
+//     address port connect_rtt_us bytes_per_second failure_rate
+class PeerScores {
+	struct Score {
+		// 0 until measured
+		double connect_rtt_us;
+		// 0 until measured
+		double bytes_per_second;
+		// Share of recent attempts that failed
+		double failure_rate;
+	};
+	const std::string path;
+	std::mutex scores_lock;
+	// (address << 16 | port): its score
+	std::unordered_map<uint64_t, Score> scores;
+
+	static uint64_t peer_key(const uint32_t addr, const uint16_t port);
+
+    public:
+	// Keep the scores in the file at path, loading what it already has.
+	explicit PeerScores(const std::string &path = DEFAULT_PEER_SCORES_PATH);
+	// This cannot be moved, deleted, or reassigned
+	PeerScores(PeerScores &&scores) = delete;
+	PeerScores(PeerScores &scores) = delete;
+	PeerScores &operator=(PeerScores &scores) = delete;
+	PeerScores &operator=(PeerScores &&scores) = delete;
+	// Write the scores out to the file, replacing what it held.
+
+	// :return: false on failure
+	bool save(void);
+	// Opening a connection to the peer took rtt.
+	void record_connect(const uint32_t addr, const uint16_t port,
+			    const std::chrono::microseconds rtt);
+	// The peer sent a block of bytes in elapsed.
+	void record_block(const uint32_t addr, const uint16_t port,
+			  const size_t bytes,
+			  const std::chrono::microseconds elapsed);
+	// The peer couldn't be reached, stalled, or broke off.
+	void record_failure(const uint32_t addr, const uint16_t port);
+	// How much work the peer has earned: its throughput, less the share of
+	// attempts it fails.
+
+	// :return: the rating, or a negative number if it hasn't sent us any
+	// blocks yet
+	double rating(const uint32_t addr, const uint16_t port);
+	// How long it takes to connect to the peer.
+
+	// :return: the round trip in microseconds, 0 if we haven't measured it
+	double connect_rtt(const uint32_t addr, const uint16_t port);
+};
+} // namespace Peer
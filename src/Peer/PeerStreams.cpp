@@ -0,0 +1,81 @@
+#include "PeerStreams.hpp"
+#include <algorithm>
+
+namespace Peer
+{
+// How long each stream count is measured for before trying one more
+static const constexpr std::chrono::milliseconds STREAM_PROBE_INTERVAL(250);
+// Share by which the last stream has to raise the throughput to be worth
+// trying another
+static const double constexpr STREAM_GAIN = 0.1;
+
+PeerStreams::PeerStreams(const size_t fixed_count, const size_t first_worker)
+	: fixed_count(std::min(fixed_count, MAX_STREAMS_PER_PEER)),
+	  first_worker(first_worker), bytes(0), growing(fixed_count == 0),
+	  probe_bytes(0), last_rate(0)
+{
+}
+
+// Open another stream. streams_lock must be held.
+void PeerStreams::open(void)
+{
+	threads.push_back(start_stream(first_worker + threads.size()));
+	probe_start = std::chrono::steady_clock::now();
+	probe_bytes = bytes;
+}
+
+// Open the first streams, each started by start_stream with its worker id.
+void PeerStreams::start(std::function<std::thread(size_t)> start_stream)
+{
+	std::lock_guard<std::mutex> streams_guard(streams_lock);
+	this->start_stream = std::move(start_stream);
+	do {
+		open();
+	} while (threads.size() < fixed_count);
+}
+
+// A stream fetched a block of bytes. This is where another stream may be
+// opened.
+void PeerStreams::fetched(const size_t block_bytes)
+{
+	std::lock_guard<std::mutex> streams_guard(streams_lock);
+	bytes += block_bytes;
+	if (!growing)
+		return;
+	const auto elapsed = std::chrono::steady_clock::now() - probe_start;
+	if (elapsed < STREAM_PROBE_INTERVAL)
+		return;
+	const double rate =
+		(bytes - probe_bytes) /
+		std::chrono::duration<double>(elapsed).count();
+	// The last stream didn't pay for itself, so stop there.
+	if ((threads.size() > 1 && rate < last_rate * (1 + STREAM_GAIN)) ||
+	    threads.size() >= MAX_STREAMS_PER_PEER) {
+		growing = false;
+		return;
+	}
+	last_rate = rate;
+	open();
+}
+
+// Wait for every stream to finish, those opened meanwhile included.
+
+// :return: how many streams were opened
+size_t PeerStreams::join(void)
+{
+	size_t joined = 0;
+	while (true) {
+		std::thread stream;
+		{
+			std::lock_guard<std::mutex> streams_guard(streams_lock);
+			if (joined == threads.size()) {
+				growing = false;
+				return joined;
+			}
+			stream = std::move(threads[joined]);
+		}
+		stream.join();
+		++joined;
+	}
+}
+} // namespace Peer
@@ -0,0 +1,67 @@
+#pragma once
+#include "RateLimits.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+namespace Peer
+{
+// Default number of TCP streams a download opens to each peer. 0 adapts it to
+// the throughput each extra stream adds.
+static const size_t constexpr DEFAULT_STREAMS_PER_PEER = 1;
+// Most streams a download opens to one peer
+static const size_t constexpr MAX_STREAMS_PER_PEER = 8;
+
+// The TCP streams a download has open to one peer. On a link with a large
+// bandwidth-delay product a single stream can't keep enough bytes in flight
+// to fill it, so blocks are fetched over several streams at once. Each pulls
+// the next block from the scheduler, which stripes the blocks across them.
+// With a fixed count, every stream is opened up front. Otherwise there is one
+// to begin with, and another is opened each probe interval for as long as the
+// last one raised the peer's throughput enough to pay for itself.
+class PeerStreams {
+	// 0 adapts
+	const size_t fixed_count;
+	// Worker id of the first stream, the rest follow it
+	const size_t first_worker;
+	// Starts a stream's thread, given its worker id
+	std::function<std::thread(size_t)> start_stream;
+	std::mutex streams_lock;
+	std::vector<std::thread> threads;
+	// Bytes fetched over every stream
+	uint64_t bytes;
+	// Whether we're still trying more streams
+	bool growing;
+	// When the last stream was opened, and the bytes fetched by then
+	std::chrono::steady_clock::time_point probe_start;
+	uint64_t probe_bytes;
+	// Throughput before the last stream was opened
+	double last_rate;
+
+	// Open another stream. streams_lock must be held.
+	void open(void);
+
+    public:
+	PeerStreams(const size_t fixed_count, const size_t first_worker);
+	// This cannot be moved, deleted, or reassigned
+	PeerStreams(PeerStreams &&streams) = delete;
+	PeerStreams(PeerStreams &streams) = delete;
+	PeerStreams &operator=(PeerStreams &streams) = delete;
+	PeerStreams &operator=(PeerStreams &&streams) = delete;
+	// The peer's download limit, shared by its streams
+	TokenBucket download_bucket;
+	// Open the first streams, each started by start_stream with its worker
+	// id.
+	void start(std::function<std::thread(size_t)> start_stream);
+	// A stream fetched a block of bytes. This is where another stream may
+	// be opened.
+	void fetched(const size_t block_bytes);
+	// Wait for every stream to finish, those opened meanwhile included.
+
+	// :return: how many streams were opened
+	size_t join(void);
+};
+} // namespace Peer
@@ -1,6 +1,5 @@
 #include "src/ApplicationLayer/Swarm.hpp"
 #include <iostream>
-#include <algorithm>
 
 #include "Peers.hpp"
 #include <tuple>
@@ -15,9 +14,15 @@ namespace Peer
 // Takes the address and port of the Swarm server to connect
 // to.
 Peers::Peers(const std::string &server_address, const uint16_t server_port,
-	     const std::string &our_address, const uint16_t our_port)
+	     const std::string &our_address, const uint16_t our_port,
+	     const bool tracker)
 	: server_address(server_address), server_port(server_port),
-	  our_address(our_address), our_port(our_port)
+	  our_address(our_address), our_port(our_port), tracker(tracker),
+	  server_fd(-1), member_address(0), member_port(0), stopping(false),
+	  published(std::make_shared<const PeersList>()), stale(false),
+	  has_snapshot(false),
+	  view(), resyncing(false),
+	  receiving_snapshot(false), connected(false), next_query_id(0)
 {
 }
 
@@ -28,86 +33,170 @@ Peers::~Peers(void)
 		peers_thread.join();
 }
 
+// Connect to the swarm server.
+// :return: the socket, or -1 on failure
+int Peers::connect_to_server(void)
+{
+	// Bind to our address
+	int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+	// Make sure socket descriptor initialization was successful.
+	if (socket_fd < 0) {
+		std::cerr << "Failed to Initialize server socket descriptor.\n";
+		return -1;
+	}
+	// Build our address
+	sockaddr_in address = { .sin_family = AF_INET,
+				.sin_port = htons(server_port) };
+	// Convert our ip address string to the required binary format.
+	if (inet_pton(AF_INET, server_address.c_str(), &(address.sin_addr)) <=
+	    0) {
+		std::cerr << "Error building IPV4 Address.\n";
+		close(socket_fd);
+		return -1;
+	}
+	// Connect to the server
+	if (connect(socket_fd, (sockaddr *)&address, sizeof(sockaddr_in)) ==
+	    -1) {
+		std::cerr << "Error. Unable to connect to Swarm server.\n";
+		close(socket_fd);
+		return -1;
+	}
+	return socket_fd;
+}
+
+// Join the swarm, catching up from our view if we have one, and tell the
+// tracker what we share.
+// :return: Whether the messages were sent
+bool Peers::join_swarm(void)
+{
+	ApplicationLayer::SwarmView since;
+	{
+		std::lock_guard<std::mutex> peers_guard(peers_lock);
+		since = view;
+	}
+	std::vector<uint8_t> message;
+	if (since.epoch != 0) {
+		std::vector<uint8_t> payload;
+		ApplicationLayer::Swarm::encode_view(since, payload);
+		ApplicationLayer::Swarm::append_payload_message(
+			ApplicationLayer::SwarmMessageType::SYNC, 0, payload,
+			message);
+	}
+	// Build our Swarm join message
+	ApplicationLayer::SwarmMessage m;
+	ApplicationLayer::Swarm::build_message(
+		ApplicationLayer::SwarmMessageType::JOIN, member_address,
+		member_port, m);
+	message.insert(message.end(), m.begin(), m.end());
+	receiving_snapshot = false;
+	next_peers.clear();
+	resyncing = true;
+	// Send off the message to the server, and anything we were asked to
+	// announce before we got here.
+	std::lock_guard<std::mutex> write_guard(write_lock);
+	if (write(server_fd, message.data(), message.size()) !=
+		    (ssize_t)message.size() ||
+	    !send_announcement()) {
+		std::cerr
+			<< "Error. Unable to send Swarm announce message to the server\n";
+		return false;
+	}
+	connected = true;
+	return true;
+}
+
+// Connect back to the swarm server after losing it, and catch up.
+// :return: false if we couldn't, or are stopping
+bool Peers::reconnect(void)
+{
+	{
+		std::lock_guard<std::mutex> write_guard(write_lock);
+		connected = false;
+		close(server_fd);
+		server_fd = -1;
+	}
+	for (size_t attempt = 0; attempt < RECONNECT_ATTEMPTS; ++attempt) {
+		std::this_thread::sleep_for(RECONNECT_DELAY);
+		if (stopping)
+			return false;
+		int socket_fd = connect_to_server();
+		if (socket_fd < 0)
+			continue;
+		{
+			std::lock_guard<std::mutex> write_guard(write_lock);
+			server_fd = socket_fd;
+		}
+		if (join_swarm()) {
+			std::cerr << "Reconnected to the Swarm server.\n";
+			return true;
+		}
+		std::lock_guard<std::mutex> write_guard(write_lock);
+		close(server_fd);
+		server_fd = -1;
+	}
+	return false;
+}
+
 // Start the loop of listening for data from the swarm server.
 void Peers::start(void)
 {
 	peers_thread = std::thread([&] {
-		// Bind to our address
-		server_fd = socket(AF_INET, SOCK_STREAM, 0);
-		// Make sure socket descriptor initialization was successful.
-		if (server_fd == 0) {
-			std::cerr
-				<< "Failed to Initialize server socket descriptor.\n";
-			exit(EXIT_FAILURE);
-		}
-		// Build our address
-		sockaddr_in address = { .sin_family = AF_INET,
-					.sin_port = htons(server_port) };
-		// Convert our ip address string to the required binary format.
-		if (inet_pton(AF_INET, server_address.c_str(),
-			      &(address.sin_addr)) <= 0) {
-			std::cerr << "Error building IPV4 Address.\n";
-			exit(EXIT_FAILURE);
-		}
-		// Connect to the server
-		if (connect(server_fd, (sockaddr *)&address,
-			    sizeof(sockaddr_in)) == -1) {
-			std::cerr
-				<< "Error. Unable to connect to Swarm server.\n";
-			close(server_fd);
-			exit(EXIT_FAILURE);
-		}
-		// Build our Swarm announce message
-		ApplicationLayer::SwarmMessage m;
-		uint32_t converted_address;
-		if (inet_pton(AF_INET, our_address.c_str(),
-			      &converted_address) <= 0) {
+		if (inet_pton(AF_INET, our_address.c_str(), &member_address) <=
+		    0) {
 			std::cerr
 				<< "Error. User didn't enter a valid IPV4 address to listen on.\n";
-			close(server_fd);
 			exit(EXIT_FAILURE);
 		}
-		ApplicationLayer::Swarm::build_message(
-			ApplicationLayer::SwarmMessageType::ADD,
-			converted_address, htons(our_port), m);
-		// Send off the message to the server
-		if (!ApplicationLayer::Swarm::write_message(server_fd, m)) {
-			std::cerr
-				<< "Error. Unable to send Swarm announce message to the server\n";
-			close(server_fd);
+		member_port = htons(our_port);
+		server_fd = connect_to_server();
+		if (server_fd < 0 || !join_swarm()) {
 			exit(EXIT_FAILURE);
 		}
-		// Expect to receive messages from the server now. Add or remove these
-		// from the PeersList
-		uint8_t mode_to_add;
-		uint32_t address_to_add;
-		uint16_t port_to_add;
+		// Expect to receive messages from the server now. The peers in
+		// the swarm come first, followed by peers joining and leaving.
+		ApplicationLayer::SwarmMessage m;
+		uint8_t mode;
+		uint32_t peer_address;
+		uint16_t peer_port;
+		std::vector<uint8_t> payload;
 		while (true) {
-			// Read in a new swarm message (blocks here)
-			if (!ApplicationLayer::Swarm::read_message(
-				    server_fd, mode_to_add, address_to_add,
-				    port_to_add, m)) {
+			// Read in a new swarm message (blocks here), and its
+			// payload if it carries one.
+			bool success = ApplicationLayer::Swarm::read_message(
+				server_fd, mode, peer_address, peer_port, m);
+			if (success &&
+			    mode != ApplicationLayer::SwarmMessageType::ADD &&
+			    mode != ApplicationLayer::SwarmMessageType::REMOVE) {
+				success = ApplicationLayer::Swarm::read_payload(
+					server_fd, ntohl(peer_address), payload);
+			}
+			if (!success) {
+				if (stopping) {
+					// All done now.
+					close(server_fd);
+					return;
+				}
 				std::cerr
-					<< "Unable to read Swarm message. May be shutting down.\n";
-				close(server_fd);
-				exit(EXIT_FAILURE);
+					<< "Unable to read Swarm message. Reconnecting.\n";
+				if (!reconnect()) {
+					if (stopping)
+						return;
+					std::cerr
+						<< "Error. Unable to reconnect to the Swarm server.\n";
+					exit(EXIT_FAILURE);
+				}
+				continue;
 			}
-			// Process the swarm message
-			{
+			if (mode == ApplicationLayer::SwarmMessageType::ADD ||
+			    mode == ApplicationLayer::SwarmMessageType::REMOVE) {
 				std::lock_guard<std::mutex> peers_guard(
 					peers_lock);
-				if (mode_to_add == 1) {
-					// Add a new peer
-					peers.push_back(std::make_tuple(
-						address_to_add, port_to_add));
-				} else {
-					// remove a peer
-					peers.erase(std::find(
-						peers.begin(), peers.end(),
-						std::make_tuple(address_to_add,
-								port_to_add)));
-					;
-				}
+				update_peers(mode, peer_address, peer_port);
+				mark_stale();
+			} else if (!handle_payload(mode, ntohs(peer_port),
+						   payload)) {
+				std::cerr
+					<< "Error. Malformed Swarm message from the server.\n";
 			}
 		}
 	});
@@ -116,6 +205,7 @@ void Peers::start(void)
 // Disconnect from the swarm server
 void Peers::stop(void)
 {
+	stopping = true;
 	// Build our Swarm disconnect message
 	ApplicationLayer::SwarmMessage m;
 	uint32_t converted_address;
@@ -124,24 +214,317 @@ void Peers::stop(void)
 		ApplicationLayer::SwarmMessageType::REMOVE, converted_address,
 		htons(our_port), m);
 	// Send off the message to the server
-	if (!ApplicationLayer::Swarm::write_message(server_fd, m)) {
+	std::lock_guard<std::mutex> write_guard(write_lock);
+	if (connected && !ApplicationLayer::Swarm::write_message(server_fd, m)) {
 		std::cerr
 			<< "Error. Unable to send Swarm shutdown message to the server\n";
-		close(server_fd);
-		return;
 	}
-	// Disconnect from the swarm server
-	close(server_fd);
-	return;
+	// Disconnect from the swarm server. The peers thread closes the socket
+	// once it sees it shut.
+	connected = false;
+	if (server_fd >= 0)
+		shutdown(server_fd, SHUT_RDWR);
 }
 
 // Retrieve the current list of peers (to iterate through) and check whether
-// they have the file we are looking for
-PeersList Peers::get_current_peers(void)
+// they have the file we are looking for. Only copies the list the first time
+// it is asked for after a change, so that however often peers join and leave,
+// each change costs the same.
+PeersSnapshot Peers::get_current_peers(void)
 {
-	std::lock_guard<std::mutex> peers_guard(peers_lock);
-	auto cpy = peers;
-	return cpy;
+	if (stale) {
+		std::lock_guard<std::mutex> peers_guard(peers_lock);
+		if (stale) {
+			std::atomic_store(&published,
+					  PeersSnapshot(std::make_shared<
+							const PeersList>(peers)));
+			stale = false;
+		}
+	}
+	return std::atomic_load(&published);
+}
+
+// peers has changed, so the next reader takes a new snapshot of it. peers_lock
+// must be held.
+void Peers::mark_stale(void)
+{
+	stale = true;
+}
+
+// Wait for the swarm server to send us every peer in the swarm.
+// :return: false if it didn't within timeout
+bool Peers::wait_for_snapshot(const std::chrono::milliseconds timeout)
+{
+	std::unique_lock<std::mutex> peers_guard(peers_lock);
+	return snapshot_ready.wait_for(peers_guard, timeout,
+				       [this] { return has_snapshot; });
 }
 
+// Add or remove a peer, from an ADD or REMOVE message. peers_lock must be
+// held.
+void Peers::update_peers(const uint8_t mode, const uint32_t address,
+			 const uint16_t port)
+{
+	// We're never one of our own peers
+	if (address == member_address && port == member_port)
+		return;
+	const uint64_t key = ((uint64_t)address << 16) | port;
+	if (mode == ApplicationLayer::SwarmMessageType::ADD) {
+		// Add a new peer, once
+		if (member_index.emplace(key, peers.size()).second)
+			peers.push_back(std::make_tuple(address, port));
+		return;
+	}
+	// remove a peer, moving the last one into its place
+	auto member = member_index.find(key);
+	if (member == member_index.end())
+		return;
+	const size_t idx = member->second;
+	member_index.erase(member);
+	if (idx != peers.size() - 1) {
+		peers[idx] = peers.back();
+		member_index[((uint64_t)std::get<0>(peers[idx]) << 16) |
+			     std::get<1>(peers[idx])] = idx;
+	}
+	peers.pop_back();
+}
+
+// Handle a message from the server that carries a payload.
+// :return: false if the payload is malformed
+bool Peers::handle_payload(const uint8_t mode, const uint16_t query_id,
+			   const std::vector<uint8_t> &payload)
+{
+	switch (mode) {
+	case ApplicationLayer::SwarmMessageType::HOLDERS:
+		// The tracker answering one of our queries
+		answer_query(query_id, payload);
+		return true;
+	case ApplicationLayer::SwarmMessageType::SNAPSHOT:
+		if (!receiving_snapshot) {
+			receiving_snapshot = true;
+			next_peers.clear();
+		}
+		return ApplicationLayer::Swarm::decode_snapshot(payload,
+								next_peers);
+	case ApplicationLayer::SwarmMessageType::SNAPSHOT_END:
+		return end_snapshot(payload);
+	case ApplicationLayer::SwarmMessageType::CHANGES:
+		return apply_changes(payload);
+	case ApplicationLayer::SwarmMessageType::DIGEST:
+		return check_digest(payload);
+	default:
+		return false;
+	}
+}
+
+// Ask the server to catch us up from since.
+void Peers::request_sync(const ApplicationLayer::SwarmView &since)
+{
+	resyncing = true;
+	std::vector<uint8_t> payload;
+	ApplicationLayer::Swarm::encode_view(since, payload);
+	std::lock_guard<std::mutex> write_guard(write_lock);
+	// If this fails the read side fails too, and we reconnect.
+	if (!connected ||
+	    !ApplicationLayer::Swarm::write_payload_message(
+		    server_fd, ApplicationLayer::SwarmMessageType::SYNC, 0,
+		    payload)) {
+		std::cerr << "Error. Unable to ask the Swarm server to resync.\n";
+	}
+}
+
+// Apply the changes in a CHANGES payload that follow on from our view. Asks for
+// a resync if some were missed.
+// :return: false if the payload is malformed
+bool Peers::apply_changes(const std::vector<uint8_t> &payload)
+{
+	uint32_t epoch;
+	uint64_t seq;
+	std::vector<ApplicationLayer::SwarmChange> changes;
+	if (!ApplicationLayer::Swarm::decode_changes(payload, epoch, seq,
+						     changes)) {
+		return false;
+	}
+	ApplicationLayer::SwarmView since;
+	{
+		std::lock_guard<std::mutex> peers_guard(peers_lock);
+		// Changes before our snapshot is in are already part of it.
+		if (receiving_snapshot || view.epoch == 0)
+			return true;
+		bool missed = false;
+		bool changed = false;
+		for (auto &change : changes) {
+			if (epoch != view.epoch || seq > view.seq + 1) {
+				missed = true;
+				break;
+			}
+			// Changes we've already applied are skipped.
+			if (seq == view.seq + 1) {
+				update_peers(change.mode, change.address,
+					     change.port);
+				view.seq = seq;
+				changed = true;
+			}
+			++seq;
+		}
+		if (changed)
+			mark_stale();
+		if (!missed || resyncing)
+			return true;
+		since = view;
+	}
+	// We missed some. Ask the server to fill us in.
+	std::cerr << "Missed changes to the swarm. Resyncing.\n";
+	request_sync(since);
+	return true;
+}
+
+// Take the view in a SNAPSHOT_END payload, and the snapshot before it if there
+// was one.
+// :return: false if the payload is malformed
+bool Peers::end_snapshot(const std::vector<uint8_t> &payload)
+{
+	ApplicationLayer::SwarmView end_view;
+	if (!ApplicationLayer::Swarm::decode_view(payload, end_view)) {
+		return false;
+	}
+	{
+		std::lock_guard<std::mutex> peers_guard(peers_lock);
+		if (receiving_snapshot) {
+			peers.clear();
+			member_index.clear();
+			for (auto &member : next_peers) {
+				update_peers(ApplicationLayer::SwarmMessageType::ADD,
+					     std::get<0>(member),
+					     std::get<1>(member));
+			}
+			next_peers.clear();
+			receiving_snapshot = false;
+			mark_stale();
+		}
+		view = end_view;
+		resyncing = false;
+		has_snapshot = true;
+	}
+	snapshot_ready.notify_all();
+	return true;
+}
+
+// Check our view against the DIGEST in payload, and resync from scratch if it
+// has drifted.
+// :return: false if the payload is malformed
+bool Peers::check_digest(const std::vector<uint8_t> &payload)
+{
+	ApplicationLayer::SwarmView digest;
+	if (!ApplicationLayer::Swarm::decode_view(payload, digest)) {
+		return false;
+	}
+	{
+		std::lock_guard<std::mutex> peers_guard(peers_lock);
+		// Only comparable once we're caught up to the same point.
+		if (resyncing || receiving_snapshot ||
+		    digest.epoch != view.epoch || digest.seq != view.seq)
+			return true;
+		// The server's digest counts us too.
+		uint64_t ours = ApplicationLayer::Swarm::member_digest(
+			member_address, member_port);
+		for (auto &peer : peers) {
+			ours ^= ApplicationLayer::Swarm::member_digest(
+				std::get<0>(peer), std::get<1>(peer));
+		}
+		if (ours == digest.digest &&
+		    peers.size() + 1 == digest.num_members)
+			return true;
+	}
+	std::cerr << "Our view of the swarm has drifted. Resyncing.\n";
+	request_sync(ApplicationLayer::SwarmView());
+	return true;
+}
+
+// Whether the swarm server is used as a tracker
+bool Peers::tracker_enabled(void) const
+{
+	return tracker;
+}
+
+// Send shared_files to the tracker. write_lock must be held.
+bool Peers::send_announcement(void)
+{
+	if (!tracker || shared_files.empty())
+		return true;
+	std::vector<uint8_t> payload;
+	ApplicationLayer::Swarm::encode_files(shared_files, payload);
+	return ApplicationLayer::Swarm::write_payload_message(
+		server_fd, ApplicationLayer::SwarmMessageType::ANNOUNCE_FILES, 0,
+		payload);
+}
+
+// Tell the tracker which files we share, now or once we're connected. Does
+// nothing outside of tracker mode.
+void Peers::announce_files(std::vector<ApplicationLayer::SwarmFile> &&files)
+{
+	if (!tracker)
+		return;
+	std::lock_guard<std::mutex> write_guard(write_lock);
+	shared_files = std::move(files);
+	if (connected && !send_announcement()) {
+		std::cerr
+			<< "Error. Unable to announce our files to the tracker.\n";
+	}
+}
+
+// Hand the HOLDERS payload to whoever is waiting on its query.
+void Peers::answer_query(const uint16_t query_id,
+			 const std::vector<uint8_t> &payload)
+{
+	std::vector<ApplicationLayer::SwarmHolder> holders;
+	if (!ApplicationLayer::Swarm::decode_holders(payload, holders)) {
+		std::cerr << "Error. Malformed holders message from tracker.\n";
+		// Whoever asked will time out.
+		return;
+	}
+	std::lock_guard<std::mutex> queries_guard(queries_lock);
+	auto query = pending_queries.find(query_id);
+	// They may have given up waiting already
+	if (query == pending_queries.end())
+		return;
+	query->second.set_value(std::move(holders));
+	pending_queries.erase(query);
+}
+
+// Ask the tracker which peers have the file.
+// :return: (whether the tracker answered, the holders other than us)
+std::tuple<bool, std::vector<ApplicationLayer::SwarmHolder> >
+Peers::who_has(const std::string &filename)
+{
+	std::vector<ApplicationLayer::SwarmHolder> holders;
+	if (!tracker)
+		return std::make_tuple(false, std::move(holders));
+	std::future<std::vector<ApplicationLayer::SwarmHolder> > answer;
+	uint16_t query_id;
+	{
+		std::lock_guard<std::mutex> queries_guard(queries_lock);
+		query_id = next_query_id++;
+		answer = pending_queries[query_id].get_future();
+	}
+	bool sent = false;
+	{
+		std::lock_guard<std::mutex> write_guard(write_lock);
+		sent = connected &&
+		       ApplicationLayer::Swarm::write_payload_message(
+			       server_fd, ApplicationLayer::SwarmMessageType::WHO_HAS,
+			       query_id,
+			       std::vector<uint8_t>(filename.begin(),
+						    filename.end()));
+	}
+	if (sent && answer.wait_for(TRACKER_QUERY_TIMEOUT) ==
+			    std::future_status::ready) {
+		return std::make_tuple(true, answer.get());
+	}
+	std::cerr << "Error. The tracker didn't answer who has " << filename
+		  << ".\n";
+	std::lock_guard<std::mutex> queries_guard(queries_lock);
+	pending_queries.erase(query_id);
+	return std::make_tuple(false, std::move(holders));
+}
 } // namespace Peer
@@ -1,27 +1,132 @@
 #pragma once
-#include <list>
+#include "../ApplicationLayer/Swarm.hpp"
+#include <memory>
 #include <mutex>
 #include <thread>
 #include <tuple>
+#include <string>
+#include <vector>
+#include <future>
+#include <condition_variable>
+#include <atomic>
+#include <unordered_map>
+#include <chrono>
 namespace Peer
 {
-using PeersList = std::list<std::tuple<uint32_t, uint16_t> >;
+using PeersList = std::vector<std::tuple<uint32_t, uint16_t> >;
+// A view of the peers in the swarm, as of when it was taken. It is never
+// changed, so it can be read without holding any lock.
+using PeersSnapshot = std::shared_ptr<const PeersList>;
+
+// How long to wait for the swarm server to answer a WHO_HAS
+static const constexpr std::chrono::seconds TRACKER_QUERY_TIMEOUT(5);
+// How long to wait for the swarm server to send us the peers in the swarm
+static const constexpr std::chrono::seconds SNAPSHOT_TIMEOUT(5);
+// How many times, and how far apart, to try getting back to the swarm server
+// after losing it
+static const constexpr size_t RECONNECT_ATTEMPTS = 5;
+static const constexpr std::chrono::seconds RECONNECT_DELAY(1);
 
 class Peers {
+	friend class PeersTests;
 	const std::string server_address;
 	const uint16_t server_port;
 	const std::string our_address;
 	const uint16_t our_port;
+	// Whether to use the swarm server as a tracker
+	const bool tracker;
 	int server_fd;
+	// Our address and port, in network byte order, once started
+	uint32_t member_address;
+	uint16_t member_port;
+	std::atomic<bool> stopping;
 	std::thread peers_thread;
+	// Guards peers, member_index, and the fields below
 	std::mutex peers_lock;
+	// Every peer in the swarm, in no particular order
 	PeersList peers;
+	// (address << 16 | port): where that peer is in peers
+	std::unordered_map<uint64_t, size_t> member_index;
+	// The latest snapshot of peers handed to readers. Swapped atomically,
+	// not under peers_lock.
+	PeersSnapshot published;
+	// Whether peers has changed since published was taken. Set under
+	// peers_lock, so that joins and leaves don't copy the whole list.
+	std::atomic<bool> stale;
+	// Whether every peer in the swarm when we joined is in peers. Guarded by
+	// peers_lock.
+	bool has_snapshot;
+	std::condition_variable snapshot_ready;
+	// The epoch and seq of the last change applied to peers. An epoch of 0
+	// means we have no view yet. Guarded by peers_lock.
+	ApplicationLayer::SwarmView view;
+	// Only used by the peers thread:
+	// Whether we've asked the server to catch us up, and are waiting on its
+	// SNAPSHOT_END
+	bool resyncing;
+	// The snapshot being received, which replaces peers once it ends
+	bool receiving_snapshot;
+	std::vector<ApplicationLayer::SwarmMember> next_peers;
+	// Guards writes to server_fd, and the fields below
+	std::mutex write_lock;
+	bool connected;
+	// Files to announce to the tracker once connected
+	std::vector<ApplicationLayer::SwarmFile> shared_files;
+	std::mutex queries_lock;
+	uint16_t next_query_id;
+	// query id: where the answer to that WHO_HAS goes
+	std::unordered_map<uint16_t,
+			   std::promise<std::vector<ApplicationLayer::SwarmHolder> > >
+		pending_queries;
+
+	// Connect to the swarm server.
+	// :return: the socket, or -1 on failure
+	int connect_to_server(void);
+	// Join the swarm, catching up from our view if we have one, and tell the
+	// tracker what we share.
+	// :return: Whether the messages were sent
+	bool join_swarm(void);
+	// Connect back to the swarm server after losing it, and catch up.
+	// :return: false if we couldn't, or are stopping
+	bool reconnect(void);
+	// Ask the server to catch us up from since.
+	void request_sync(const ApplicationLayer::SwarmView &since);
+	// Send shared_files to the tracker. write_lock must be held.
+	bool send_announcement(void);
+	// Add or remove a peer, from an ADD or REMOVE message. peers_lock must be
+	// held.
+	void update_peers(const uint8_t mode, const uint32_t address,
+			  const uint16_t port);
+	// peers has changed, so the next reader takes a new snapshot of it.
+	// peers_lock must be held.
+	void mark_stale(void);
+	// Handle a message from the server that carries a payload.
+	// :return: false if the payload is malformed
+	bool handle_payload(const uint8_t mode, const uint16_t query_id,
+			    const std::vector<uint8_t> &payload);
+	// Apply the changes in a CHANGES payload that follow on from our view.
+	// Asks for a resync if some were missed.
+	// :return: false if the payload is malformed
+	bool apply_changes(const std::vector<uint8_t> &payload);
+	// Take the view in a SNAPSHOT_END payload, and the snapshot before it
+	// if there was one.
+	// :return: false if the payload is malformed
+	bool end_snapshot(const std::vector<uint8_t> &payload);
+	// Check our view against the DIGEST in payload, and resync from scratch
+	// if it has drifted.
+	// :return: false if the payload is malformed
+	bool check_digest(const std::vector<uint8_t> &payload);
+	// Hand the HOLDERS payload to whoever is waiting on its query.
+	void answer_query(const uint16_t query_id,
+			  const std::vector<uint8_t> &payload);
 
     public:
 	// Takes the address and port of the Swarm server to connect
-	// to.
+	// to. With tracker set, the server is told which files we share and
+	// asked who has a file, instead of asking every peer.
 	Peers(const std::string &server_address, const uint16_t server_port,
-	      const std::string &our_address, const uint16_t our_port);
+	      const std::string &our_address, const uint16_t our_port,
+	      const bool tracker = false);
 	// This cannot be moved, deleted, or reassigned
 	Peers(Peers &&peer) = delete;
 	Peers(Peers &peer) = delete;
@@ -33,7 +138,20 @@ class Peers {
 	// Disconnect from the swarm server
 	void stop(void);
 	// Retrieve the current list of peers (iterate through) and check whether
-	// they have the file we are looking for
-	PeersList get_current_peers(void);
+	// they have the file we are looking for. Only copies the list the first
+	// time it is asked for after a change.
+	PeersSnapshot get_current_peers(void);
+	// Wait for the swarm server to send us every peer in the swarm.
+	// :return: false if it didn't within timeout
+	bool wait_for_snapshot(const std::chrono::milliseconds timeout);
+	// Whether the swarm server is used as a tracker
+	bool tracker_enabled(void) const;
+	// Tell the tracker which files we share, now or once we're connected.
+	// Does nothing outside of tracker mode.
+	void announce_files(std::vector<ApplicationLayer::SwarmFile> &&files);
+	// Ask the tracker which peers have the file.
+	// :return: (whether the tracker answered, the holders other than us)
+	std::tuple<bool, std::vector<ApplicationLayer::SwarmHolder> >
+	who_has(const std::string &filename);
 };
 } // namespace Peer
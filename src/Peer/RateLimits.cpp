@@ -0,0 +1,117 @@
+#include "RateLimits.hpp"
+#include <algorithm>
+
+namespace Peer
+{
+// Nanoseconds on the steady clock
+static int64_t now_ns(void)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		       std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+TokenBucket::TokenBucket(const uint64_t rate) : rate(rate), paid_until(0)
+{
+}
+
+// Change the rate. Bytes already taken stay paid for at the old one.
+void TokenBucket::set_rate(const uint64_t rate)
+{
+	this->rate.store(rate, std::memory_order_relaxed);
+}
+
+uint64_t TokenBucket::get_rate(void) const
+{
+	return rate.load(std::memory_order_relaxed);
+}
+
+// Take len bytes. They are ours either way, but may only go once the wait is
+// over. A bucket left idle doesn't save up more than its burst.
+
+// :return: how long to wait before moving them, 0 if they can go now
+std::chrono::nanoseconds TokenBucket::take(const size_t len)
+{
+	const uint64_t bytes_per_second = rate.load(std::memory_order_relaxed);
+	if (bytes_per_second == 0)
+		return std::chrono::nanoseconds(0);
+	const int64_t now = now_ns();
+	const int64_t cost = (int64_t)((double)len * 1e9 / bytes_per_second);
+	int64_t paid = paid_until.load(std::memory_order_relaxed);
+	int64_t next;
+	do {
+		next = std::max(paid, now) + cost;
+	} while (!paid_until.compare_exchange_weak(paid, next,
+						   std::memory_order_relaxed));
+	const int64_t burst =
+		std::chrono::duration_cast<std::chrono::nanoseconds>(
+			DEFAULT_BURST)
+			.count();
+	return std::chrono::nanoseconds(std::max<int64_t>(0, next - now - burst));
+}
+
+RateLimits::RateLimits(void) : upload_per_peer(0), download_per_peer(0)
+{
+}
+
+// The limits every transfer in the process is held to
+RateLimits &RateLimits::instance(void)
+{
+	static RateLimits limits;
+	return limits;
+}
+
+// Change every limit, in bytes per second.
+void RateLimits::configure(const uint64_t upload_rate,
+			   const uint64_t download_rate,
+			   const uint64_t upload_rate_per_peer,
+			   const uint64_t download_rate_per_peer)
+{
+	upload.set_rate(upload_rate);
+	download.set_rate(download_rate);
+	upload_per_peer.store(upload_rate_per_peer, std::memory_order_relaxed);
+	download_per_peer.store(download_rate_per_peer,
+				std::memory_order_relaxed);
+}
+
+// Whether uploads are limited at all
+bool RateLimits::upload_limited(void) const
+{
+	return upload.get_rate() != 0 ||
+	       upload_per_peer.load(std::memory_order_relaxed) != 0;
+}
+
+// Take len bytes from the shared bucket and the connection's, after bringing
+// the connection's rate up to date.
+
+// :return: how long to wait before moving them
+std::chrono::nanoseconds RateLimits::take_both(TokenBucket &shared,
+					       TokenBucket &connection,
+					       const uint64_t connection_rate,
+					       const size_t len)
+{
+	connection.set_rate(connection_rate);
+	return std::max(shared.take(len), connection.take(len));
+}
+
+// Take len bytes of upload for the connection.
+
+// :return: how long to wait before sending them
+std::chrono::nanoseconds RateLimits::take_upload(TokenBucket &connection,
+						 const size_t len)
+{
+	return take_both(upload, connection,
+			 upload_per_peer.load(std::memory_order_relaxed), len);
+}
+
+// Take len bytes of download for the connection.
+
+// :return: how long to wait before receiving more
+std::chrono::nanoseconds RateLimits::take_download(TokenBucket &connection,
+						   const size_t len)
+{
+	return take_both(download, connection,
+			 download_per_peer.load(std::memory_order_relaxed),
+			 len);
+}
+} // namespace Peer
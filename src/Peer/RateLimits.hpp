@@ -0,0 +1,84 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+namespace Peer
+{
+// How far ahead of its rate a bucket may run before anyone has to wait, so
+// that short bursts go out at once
+static const constexpr std::chrono::milliseconds DEFAULT_BURST(50);
+
+// Hands out bandwidth at a fixed rate of bytes per second to any number of
+// threads. Instead of counting tokens it keeps the time by which every byte
+// taken so far is paid for, and moves it on with one compare and swap per
+// take, so no lock is taken on the way to a send or receive.
+class TokenBucket {
+	// Bytes per second, 0 for no limit
+	std::atomic<uint64_t> rate;
+	// When every byte taken so far is paid for, in nanoseconds on the
+	// steady clock
+	std::atomic<int64_t> paid_until;
+
+    public:
+	explicit TokenBucket(const uint64_t rate = 0);
+	// This cannot be moved, deleted, or reassigned
+	TokenBucket(TokenBucket &&bucket) = delete;
+	TokenBucket(TokenBucket &bucket) = delete;
+	TokenBucket &operator=(TokenBucket &bucket) = delete;
+	TokenBucket &operator=(TokenBucket &&bucket) = delete;
+	// Change the rate. Bytes already taken stay paid for at the old one.
+	void set_rate(const uint64_t rate);
+	uint64_t get_rate(void) const;
+	// Take len bytes. They are ours either way, but may only go once the
+	// wait is over.
+
+	// :return: how long to wait before moving them, 0 if they can go now
+	std::chrono::nanoseconds take(const size_t len);
+};
+
+// The upload and download limits of the whole process. Each direction has a
+// bucket shared by every thread, and a rate each connection is held to on a
+// bucket of its own. 0 means no limit. Every limit can be changed while
+// transfers are running.
+class RateLimits {
+	TokenBucket upload;
+	TokenBucket download;
+	std::atomic<uint64_t> upload_per_peer;
+	std::atomic<uint64_t> download_per_peer;
+
+	// Take len bytes from the shared bucket and the connection's, after
+	// bringing the connection's rate up to date.
+
+	// :return: how long to wait before moving them
+	static std::chrono::nanoseconds
+	take_both(TokenBucket &shared, TokenBucket &connection,
+		  const uint64_t connection_rate, const size_t len);
+
+    public:
+	RateLimits(void);
+	// This cannot be moved, deleted, or reassigned
+	RateLimits(RateLimits &&limits) = delete;
+	RateLimits(RateLimits &limits) = delete;
+	RateLimits &operator=(RateLimits &limits) = delete;
+	RateLimits &operator=(RateLimits &&limits) = delete;
+	// The limits every transfer in the process is held to
+	static RateLimits &instance(void);
+	// Change every limit, in bytes per second.
+	void configure(const uint64_t upload_rate, const uint64_t download_rate,
+		       const uint64_t upload_rate_per_peer,
+		       const uint64_t download_rate_per_peer);
+	// Whether uploads are limited at all
+	bool upload_limited(void) const;
+	// Take len bytes of upload for the connection.
+
+	// :return: how long to wait before sending them
+	std::chrono::nanoseconds take_upload(TokenBucket &connection,
+					     const size_t len);
+	// Take len bytes of download for the connection.
+
+	// :return: how long to wait before receiving more
+	std::chrono::nanoseconds take_download(TokenBucket &connection,
+					       const size_t len);
+};
+} // namespace Peer
@@ -4,187 +4,934 @@
 
 extern "C" {
 #include <unistd.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 }
 
 #include <iostream>
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <map>
 
 namespace Peer
 {
-Seeder::Seeder(
-	const std::string &bind_address, const uint16_t bind_port,
-	std::unordered_map<std::string, std::tuple<std::string, uint32_t> >
-		&&files_list)
+// Most bytes read from a connection at once
+static const size_t constexpr READ_SIZE = 64 * 1024;
+// Stop reading from a connection once this much of its input is undecoded.
+// Always room for one whole message.
+static const size_t constexpr INPUT_LIMIT =
+	ApplicationLayer::MAX_CONTROL_PAYLOAD + READ_SIZE;
+// Stop answering a connection's requests once this many bytes of responses are
+// waiting to go out to it.
+static const size_t constexpr OUTPUT_LIMIT =
+	ApplicationLayer::MAX_CONTROL_PAYLOAD;
+// Most bytes sent at once while uploads are limited, so that the limits are
+// paid for a slice at a time
+static const size_t constexpr SHAPED_SEND_SIZE = 64 * 1024;
+// Most epoll events handled per wakeup
+static const size_t constexpr MAX_EVENTS = 256;
+
+Seeder::OpenFile::OpenFile(const int fd, const off_t size)
+	: fd(fd), size(size)
+{
+}
+
+Seeder::OpenFile::~OpenFile(void)
+{
+	close(fd);
+}
+
+Seeder::Connection::Connection(const int fd, const size_t reactor,
+			       const uint64_t id, const uint32_t peer_address)
+	: fd(fd), reactor(reactor), id(id), peer_address(peer_address),
+	  output_bytes(0),
+	  sending_chunks(false), chunk_file_size(0), next_chunk_idx(0),
+	  end_chunk_idx(0), events(0), allowance(0), slot(NO_SLOT),
+	  sent_on_slot(false)
+{
+}
+
+Seeder::Seeder(const std::string &bind_address, const uint16_t bind_port,
+	       SharedFiles &&files_list, const size_t num_reactors,
+	       const int backlog, const size_t cache_size,
+	       const size_t num_slots, const size_t compressed_cache_size)
 	: bind_address(bind_address), bind_port(bind_port),
-	  files_list(std::move(files_list))
+	  files_list(std::move(files_list)),
+	  file_handles(build_file_handles(this->files_list)),
+	  catalog(build_catalog(this->files_list)),
+	  open_files(open_shared_files(this->files_list)),
+	  chunk_cache(cache_size), compressed_cache(compressed_cache_size),
+	  num_reactors(num_reactors != 0 ?
+				     num_reactors :
+				     std::max(1u, std::thread::hardware_concurrency())),
+	  backlog(backlog), upload_slots(num_slots, this->num_reactors),
+	  next_connection_id(0), stop_event(eventfd(0, EFD_CLOEXEC)),
+	  stopping(false)
+{
+}
+
+// Hand out a handle for each of the files we share
+std::unordered_map<uint64_t, std::string>
+Seeder::build_file_handles(const SharedFiles &files_list)
+{
+	std::unordered_map<uint64_t, std::string> file_handles;
+	for (auto &file : files_list) {
+		uint64_t handle =
+			ApplicationLayer::Peer::make_file_handle(file.first);
+		if (!file_handles.insert(std::make_pair(handle, file.first))
+			     .second) {
+			std::cerr << "Warning. " << file.first
+				  << " shares a handle with another file. v2 "
+				     "peers will only see one of them.\n";
+		}
+	}
+	return file_handles;
+}
+
+// Open each of the files we share. A file we can't open is left out, and
+// requests for its chunks are turned away.
+std::unordered_map<std::string, std::shared_ptr<Seeder::OpenFile> >
+Seeder::open_shared_files(const SharedFiles &files_list)
+{
+	std::unordered_map<std::string, std::shared_ptr<OpenFile> > open_files;
+	for (auto &file : files_list) {
+		int file_fd = open(file.second.path.c_str(),
+				   O_RDONLY | O_CLOEXEC);
+		if (file_fd < 0) {
+			std::cerr << "Error. Unable to open " << file.first
+				  << " to share it.\n";
+			continue;
+		}
+		struct stat file_info;
+		if (fstat(file_fd, &file_info) < 0) {
+			std::cerr << "Error. Unable to stat " << file.first
+				  << ".\n";
+			close(file_fd);
+			continue;
+		}
+		open_files.insert(std::make_pair(
+			file.first, std::shared_ptr<OpenFile>(new OpenFile(
+					    file_fd, file_info.st_size))));
+	}
+	return open_files;
+}
+
+// List the files we share, sorted by filename
+std::vector<ApplicationLayer::CatalogEntry>
+Seeder::build_catalog(const SharedFiles &files_list)
+{
+	std::vector<ApplicationLayer::CatalogEntry> catalog;
+	catalog.reserve(files_list.size());
+	for (auto &file : files_list) {
+		ApplicationLayer::CatalogEntry entry = {
+			file.first, file.second.size, file.second.num_chunks,
+			ApplicationLayer::Peer::make_file_handle(file.first),
+			file.second.chunk_size, file.second.root_hash
+		};
+		catalog.push_back(std::move(entry));
+	}
+	std::sort(catalog.begin(), catalog.end(),
+		  [](const ApplicationLayer::CatalogEntry &a,
+		     const ApplicationLayer::CatalogEntry &b) {
+			  return a.file_name < b.file_name;
+		  });
+	return catalog;
+}
+
+// Find the shared file a request names, by handle for v2 requests and by
+// filename otherwise.
+SharedFiles::const_iterator
+Seeder::find_file(const ApplicationLayer::PeerHeader &request) const
+{
+	if (request.version < 2 ||
+	    request.message_type == ApplicationLayer::PeerMessageType::FILE_REQUEST) {
+		return files_list.find(request.file_name);
+	}
+	auto handle = file_handles.find(request.file_handle);
+	if (handle == file_handles.end()) {
+		return files_list.end();
+	}
+	return files_list.find(handle->second);
+}
+
+// Answer a FILE_REQUEST. num_chunks stays 0 if we don't have the file. A v2
+// response carries the root of the file's HashTree as its payload. A v1 framed
+// response can't name a chunk size, so it counts chunks of CHUNK_SIZE.
+ApplicationLayer::PeerHeader
+Seeder::build_file_response(const ApplicationLayer::PeerHeader &request) const
 {
+	auto item = find_file(request);
+	ApplicationLayer::PeerHeader response(
+		ApplicationLayer::PeerMessageType::FILE_RESPONSE,
+		request.version);
+	// If they offered a later wire version, agree on the highest we both
+	// speak, even when we don't have the file, so that a leecher can find
+	// out what we speak by asking for no file at all.
+	if (request.max_version >= 2) {
+		response.max_version = std::min(
+			request.max_version, ApplicationLayer::PROTOCOL_VERSION);
+	}
+	if (item != files_list.end()) {
+		if (response.version >= 2) {
+			response.num_chunks = item->second.num_chunks;
+			response.chunk_size = item->second.chunk_size;
+			response.payload.assign(item->second.root_hash.begin(),
+						item->second.root_hash.end());
+		} else {
+			response.num_chunks =
+				(item->second.size + ApplicationLayer::CHUNK_SIZE -
+				 1) /
+				ApplicationLayer::CHUNK_SIZE;
+		}
+		// Hand them the file's handle to use from now on.
+		if (response.max_version >= 2) {
+			response.file_handle =
+				ApplicationLayer::Peer::make_file_handle(
+					item->first);
+		}
+	}
+	return response;
 }
 
-// Join back the threads on exit
+// Answer an INVENTORY_REQUEST with the page of the catalog starting at its
+// chunk_request_begin_idx. The response says where the page starts in
+// chunk_request_begin_idx, where the next one starts in chunk_request_end_idx,
+// and how many files we share in num_chunks.
+ApplicationLayer::PeerHeader
+Seeder::build_inventory_page(const ApplicationLayer::PeerHeader &request) const
+{
+	ApplicationLayer::PeerHeader response(
+		ApplicationLayer::PeerMessageType::INVENTORY_RESPONSE, 2);
+	size_t idx = std::min<size_t>(request.chunk_request_begin_idx,
+				      catalog.size());
+	response.num_chunks = catalog.size();
+	response.chunk_request_begin_idx = idx;
+	// Always take at least one entry, so that the leecher makes progress.
+	while (idx < catalog.size() &&
+	       response.payload.size() < ApplicationLayer::INVENTORY_PAGE_SIZE) {
+		ApplicationLayer::Peer::append_catalog_entry(catalog[idx],
+							     response.payload);
+		++idx;
+	}
+	response.chunk_request_end_idx = idx;
+	return response;
+}
+
+// Answer a FILE_BATCH_REQUEST with an entry for each filename asked about, in
+// the order they were asked. Files we don't have get an entry with 0 chunks.
+
+// :return: false if the request is malformed
+bool Seeder::build_file_batch(const ApplicationLayer::PeerHeader &request,
+			      ApplicationLayer::PeerHeader &out_response) const
+{
+	std::vector<std::string> names;
+	if (!ApplicationLayer::Peer::decode_names(request.payload, names) ||
+	    names.size() > ApplicationLayer::MAX_BATCH_FILES) {
+		std::cerr << "Error. Malformed file batch request.\n";
+		return false;
+	}
+	out_response = ApplicationLayer::PeerHeader(
+		ApplicationLayer::PeerMessageType::FILE_BATCH_RESPONSE, 2);
+	out_response.num_chunks = names.size();
+	for (auto &name : names) {
+		ApplicationLayer::CatalogEntry entry = { name, 0, 0, 0, 0, "" };
+		auto item = files_list.find(name);
+		if (item != files_list.end()) {
+			entry.file_size = item->second.size;
+			entry.num_chunks = item->second.num_chunks;
+			entry.chunk_size = item->second.chunk_size;
+			entry.root_hash = item->second.root_hash;
+			entry.file_handle =
+				ApplicationLayer::Peer::make_file_handle(name);
+		}
+		ApplicationLayer::Peer::append_catalog_entry(
+			entry, out_response.payload);
+	}
+	return true;
+}
+
+// Answer a HASH_REQUEST with the page of the file's leaves starting at its
+// chunk_request_begin_idx. The response counts every leaf in num_chunks, and
+// says which ones it holds in chunk_request_begin_idx and chunk_request_end_idx.
+// num_chunks stays 0 if we don't have the file.
+ApplicationLayer::PeerHeader
+Seeder::build_hash_page(const ApplicationLayer::PeerHeader &request) const
+{
+	ApplicationLayer::PeerHeader response(
+		ApplicationLayer::PeerMessageType::HASH_RESPONSE, 2);
+	response.file_handle = request.file_handle;
+	auto item = find_file(request);
+	if (item == files_list.end()) {
+		return response;
+	}
+	const std::vector<ApplicationLayer::HashDigest> &leaves =
+		item->second.leaves;
+	size_t idx = std::min<size_t>(request.chunk_request_begin_idx,
+				      leaves.size());
+	size_t end = std::min(idx + ApplicationLayer::MAX_HASHES_PER_RESPONSE,
+			      leaves.size());
+	response.num_chunks = leaves.size();
+	response.chunk_request_begin_idx = idx;
+	response.chunk_request_end_idx = end;
+	ApplicationLayer::HashTree::encode_leaves(leaves.data() + idx, end - idx,
+						  response.payload);
+	return response;
+}
+
+// Stop every reactor, and join them back on exit
 Seeder::~Seeder(void)
 {
-	if (t.joinable()) {
-		t.join();
-	}
-}
-
-// Connection handler for each connected peer
-void Seeder::client_handler(int client_fd)
-{
-	uint8_t message_type;
-	std::string filename;
-	uint32_t num_chunks;
-	uint32_t chunk_request_begin_idx;
-	uint32_t chunk_request_end_idx;
-	uint32_t current_chunk_idx;
-	uint32_t current_chunk_size;
-	while (true) {
-		if (!ApplicationLayer::Peer::read_message(
-			    client_fd, message_type, filename, num_chunks,
-			    chunk_request_begin_idx, chunk_request_end_idx,
-			    current_chunk_idx, current_chunk_size, true)) {
-			std::cerr
-				<< "Unable to read message from client_handler. "
-				   "Or peer disconnected."
-				<< std::endl;
-			close(client_fd);
-			return;
+	stop();
+	for (auto &reactor : reactors) {
+		if (reactor.joinable()) {
+			reactor.join();
 		}
-		switch (message_type) {
-		case ApplicationLayer::PeerMessageType::CHUNK_REQUEST: {
-			// See if we have the filename they are looking for
-			auto item = files_list.find(filename);
-			if (item == files_list.end()) {
-				// This should never happen, since we should only receive a
-				// chunk request after a solicitation has occurred with
-				// FILE_REQUESTS
-				continue;
-			}
-			// Send them each of the chunks they requested.
-			for (size_t it = chunk_request_begin_idx;
-			     it <= chunk_request_end_idx; ++it) {
-				if (!ApplicationLayer::Peer::write_message(
-					    client_fd,
-					    ApplicationLayer::PeerMessageType::
-						    CHUNK_RESPONSE,
-					    "", 0, 0, 0, it,
-					    std::get<0>(item->second))) {
-					close(client_fd);
-					return;
-				}
-				std::cout << "Sending chunk: " << it << "\n";
-			}
-			break;
+	}
+	for (int listener : listeners) {
+		close(listener);
+	}
+	close(stop_event);
+}
+
+// Whether the connection has enough output queued that we should stop looking
+// at its requests for now.
+bool Seeder::backed_up(const Connection &connection)
+{
+	return connection.sending_chunks ||
+	       connection.output_bytes >= OUTPUT_LIMIT;
+}
+
+// Queue a message, followed by chunk_size bytes of chunk if it is a
+// CHUNK_RESPONSE.
+
+// :return: false if the message can't be expressed in its version
+bool Seeder::queue_message(Connection &connection,
+			   const ApplicationLayer::PeerHeader &message,
+			   const uint32_t chunk_size)
+{
+	OutputSegment segment;
+	if (!ApplicationLayer::Peer::append_message(message, segment.bytes,
+						     chunk_size)) {
+		std::cerr << "Error. Unable to serialize message header.\n";
+		return false;
+	}
+	segment.offset = 0;
+	segment.remaining = segment.bytes.size();
+	connection.output_bytes += segment.remaining;
+	connection.output.push_back(std::move(segment));
+	return true;
+}
+
+// Who the connection's upload slot is for
+UploadSlots::Ticket Seeder::ticket(const Connection &connection)
+{
+	const UploadSlots::Ticket ticket = { connection.reactor, connection.fd,
+					     connection.id,
+					     connection.peer_address };
+	return ticket;
+}
+
+// Get the connection an upload slot for its next block, giving up the one it
+// sent its last block on first, so that anyone waiting goes before it.
+
+// :return: whether it holds a slot for its next block
+bool Seeder::take_turn(Connection &connection)
+{
+	if (connection.slot == HOLDING_SLOT) {
+		if (!connection.sent_on_slot)
+			return true;
+		upload_slots.release(ticket(connection));
+		connection.slot = NO_SLOT;
+	}
+	if (connection.slot == WAITING_FOR_SLOT)
+		return false;
+	if (!upload_slots.acquire(ticket(connection))) {
+		connection.slot = WAITING_FOR_SLOT;
+		return false;
+	}
+	connection.slot = HOLDING_SLOT;
+	connection.sent_on_slot = false;
+	return true;
+}
+
+// Give up the connection's upload slot once its last block has gone out, or
+// for good if it is going away.
+void Seeder::end_turn(Connection &connection, const bool closing)
+{
+	if (connection.slot == WAITING_FOR_SLOT && closing) {
+		upload_slots.cancel(ticket(connection));
+		connection.slot = NO_SLOT;
+	} else if (connection.slot == HOLDING_SLOT &&
+		   (closing || (connection.sent_on_slot &&
+				!connection.sending_chunks &&
+				connection.output.empty()))) {
+		upload_slots.release(ticket(connection));
+		connection.slot = NO_SLOT;
+	}
+}
+
+// Queue the next chunk of the CHUNK_REQUEST being answered, or the block of it
+// that was asked for. The chunk itself goes out straight from the page cache,
+// and is kept there by the chunk cache while it is popular. If the request
+// offers a codec and the chunk compresses well enough, it goes out compressed
+// from the compressed cache instead.
+
+// :return: false if the connection should be closed
+bool Seeder::queue_next_chunk(Connection &connection)
+{
+	uint64_t offset;
+	uint32_t chunk_size;
+	if (!ApplicationLayer::Peer::chunk_range(
+		    connection.chunk_request, connection.next_chunk_idx,
+		    connection.chunk_file_size, offset, chunk_size)) {
+		std::cerr << "Error. chunk index out of range.\n";
+		return false;
+	}
+	connection.chunk_response.current_chunk_idx = connection.next_chunk_idx;
+	std::shared_ptr<const std::vector<uint8_t> > compressed;
+	if ((connection.chunk_request.compression &
+	     ApplicationLayer::LZ4_COMPRESSION) &&
+	    chunk_size >= ApplicationLayer::MIN_COMPRESSED_BLOCK &&
+	    chunk_size <= ApplicationLayer::MAX_COMPRESSED_BLOCK) {
+		compressed = compressed_cache.get(connection.chunk_file->fd,
+						  offset, chunk_size);
+	}
+	if (compressed) {
+		// The compressed chunk goes out behind its header.
+		connection.chunk_response.compression =
+			ApplicationLayer::LZ4_COMPRESSION;
+		connection.chunk_response.current_chunk_size = chunk_size;
+		const bool queued = queue_message(
+			connection, connection.chunk_response,
+			compressed->size());
+		connection.chunk_response.compression =
+			ApplicationLayer::NO_COMPRESSION;
+		if (!queued)
+			return false;
+		OutputSegment &segment = connection.output.back();
+		segment.bytes.insert(segment.bytes.end(), compressed->begin(),
+				     compressed->end());
+		segment.remaining += compressed->size();
+		connection.output_bytes += compressed->size();
+	} else if (!queue_message(connection, connection.chunk_response,
+				  chunk_size)) {
+		return false;
+	} else if (chunk_size > 0) {
+		// A block past the end of the last chunk goes out empty.
+		chunk_cache.touch(connection.chunk_file->fd, offset, chunk_size);
+		OutputSegment range;
+		range.file = connection.chunk_file;
+		range.offset = offset;
+		range.remaining = chunk_size;
+		connection.output.push_back(std::move(range));
+	}
+	if (connection.chunk_request.block_offset == 0)
+		std::cout << "Sending chunk: " << connection.next_chunk_idx << "\n";
+	if (++connection.next_chunk_idx > connection.end_chunk_idx) {
+		connection.sending_chunks = false;
+		connection.chunk_file.reset();
+	}
+	return true;
+}
+
+// Queue the response to one request. Always answer in the wire version we
+// were asked in.
+
+// :return: false if the connection should be closed
+bool Seeder::handle_request(Connection &connection,
+			    const ApplicationLayer::PeerHeader &request)
+{
+	switch (request.message_type) {
+	case ApplicationLayer::PeerMessageType::CHUNK_REQUEST: {
+		// See if we have the file they are looking for
+		auto item = find_file(request);
+		if (item == files_list.end()) {
+			// This should never happen, since we should only receive a
+			// chunk request after a solicitation has occurred with
+			// FILE_REQUESTS
+			return true;
+		}
+		if (request.chunk_request_begin_idx >
+		    request.chunk_request_end_idx) {
+			return true;
+		}
+		// Tiny chunks would only cost us a header each.
+		if (request.chunk_size != 0 &&
+		    request.chunk_size < ApplicationLayer::MIN_CHUNK_SIZE) {
+			std::cerr << "Error. Requested chunk size is too small.\n";
+			return false;
+		}
+		auto file = open_files.find(item->first);
+		if (file == open_files.end()) {
+			std::cerr << "Error. Unable to read from file being shared.\n";
+			return false;
 		}
-		// We shouldn't receive these. We send these to the client as responses.
-		case ApplicationLayer::PeerMessageType::CHUNK_RESPONSE: {
+		// Send them each of the chunks they requested, one at a time.
+		connection.chunk_response = ApplicationLayer::PeerHeader(
+			ApplicationLayer::PeerMessageType::CHUNK_RESPONSE,
+			request.version);
+		connection.chunk_response.file_handle = request.file_handle;
+		connection.chunk_response.block_offset = request.block_offset;
+		connection.chunk_request = request;
+		connection.chunk_file = file->second;
+		connection.chunk_file_size = file->second->size;
+		connection.next_chunk_idx = request.chunk_request_begin_idx;
+		connection.end_chunk_idx = request.chunk_request_end_idx;
+		connection.sending_chunks = true;
+		return true;
+	}
+	case ApplicationLayer::PeerMessageType::FILE_REQUEST: {
+		return queue_message(connection, build_file_response(request));
+	}
+	// These only exist in v2, and they carry a payload we have to answer in
+	// kind.
+	case ApplicationLayer::PeerMessageType::INVENTORY_REQUEST: {
+		if (request.version < 2)
+			return true;
+		return queue_message(connection, build_inventory_page(request));
+	}
+	case ApplicationLayer::PeerMessageType::FILE_BATCH_REQUEST: {
+		if (request.version < 2)
+			return true;
+		ApplicationLayer::PeerHeader response;
+		return build_file_batch(request, response) &&
+		       queue_message(connection, response);
+	}
+	case ApplicationLayer::PeerMessageType::HASH_REQUEST: {
+		if (request.version < 2)
+			return true;
+		return queue_message(connection, build_hash_page(request));
+	}
+	// We shouldn't receive anything else. We send these to the client as
+	// responses.
+	default:
+		return true;
+	}
+}
+
+// Decode and answer whatever whole requests the connection has sent, as long
+// as its output isn't backed up.
+
+// :return: false if the connection should be closed
+bool Seeder::handle_requests(Connection &connection)
+{
+	ApplicationLayer::PeerHeader request;
+	size_t decoded = 0;
+	bool success = true;
+	while (success) {
+		// Finish the chunk request first, so that responses go out in
+		// the order they were asked for.
+		if (connection.sending_chunks) {
+			if (!connection.output.empty())
+				break;
+			// Each block waits its turn at an upload slot.
+			if (!take_turn(connection))
+				break;
+			success = queue_next_chunk(connection);
+			connection.sent_on_slot = true;
 			continue;
+		}
+		if (backed_up(connection))
 			break;
+		ssize_t used = ApplicationLayer::Peer::decode_message(
+			connection.input.data() + decoded,
+			connection.input.size() - decoded, request);
+		if (used < 0) {
+			std::cerr << "Error. Malformed message from peer.\n";
+			success = false;
+		} else if (used == 0) {
+			break;
+		} else {
+			decoded += used;
+			success = handle_request(connection, request);
 		}
-		case ApplicationLayer::PeerMessageType::FILE_REQUEST: {
-			// See if we have the filename they are looking for
-			auto item = files_list.find(filename);
-			if (item == files_list.end()) {
-				// We don't have it.
-				if (!ApplicationLayer::Peer::write_message(
-					    client_fd,
-					    ApplicationLayer::PeerMessageType::
-						    FILE_RESPONSE,
-					    "", 0)) {
-					close(client_fd);
-					return;
-				}
-			} else {
-				// We have the file...
-				if (!ApplicationLayer::Peer::write_message(
-					    client_fd,
-					    ApplicationLayer::PeerMessageType::
-						    FILE_RESPONSE,
-					    "", std::get<1>(item->second))) {
-					close(client_fd);
-					return;
+	}
+	connection.input.erase(connection.input.begin(),
+			       connection.input.begin() + decoded);
+	return success;
+}
+
+// Send as much queued output as the socket takes without blocking, and the
+// upload limits allow. Once they ask us to wait, the connection is throttled
+// until the wait is over.
+
+// :return: false if the connection should be closed
+bool Seeder::flush(Connection &connection)
+{
+	RateLimits &limits = RateLimits::instance();
+	if (throttled(connection))
+		return true;
+	while (!connection.output.empty()) {
+		OutputSegment &segment = connection.output.front();
+		size_t len = segment.remaining;
+		if (limits.upload_limited()) {
+			// Pay for the next slice up front. It goes out once
+			// the limits have caught up with it.
+			if (connection.allowance == 0) {
+				connection.allowance =
+					std::min(len, SHAPED_SEND_SIZE);
+				auto wait = limits.take_upload(
+					connection.upload_bucket,
+					connection.allowance);
+				if (wait.count() > 0) {
+					connection.throttled_until =
+						std::chrono::steady_clock::now() +
+						wait;
+					return true;
 				}
 			}
-			break;
+			len = std::min(len, connection.allowance);
 		}
-		// We shouldn't receive these. We send these to the client as responses.
-		case ApplicationLayer::PeerMessageType::FILE_RESPONSE: {
-			continue;
-			break;
+		ssize_t sent;
+		if (segment.file) {
+			sent = sendfile(connection.fd, segment.file->fd,
+					&segment.offset, len);
+		} else {
+			// Hold a header back until the chunk behind it can go in
+			// the same packet.
+			sent = send(connection.fd,
+				    segment.bytes.data() + segment.bytes.size() -
+					    segment.remaining,
+				    len,
+				    MSG_NOSIGNAL |
+					    (connection.output.size() > 1 ?
+						     MSG_MORE :
+						     0));
+		}
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+			std::cout << "Unable to send or receive on socket.\n";
+			return false;
+		} else if (sent == 0) {
+			// The file got shorter underneath us.
+			std::cout << "Unexpected end of file while sending chunk.\n";
+			return false;
 		}
-		} // End switch.
+		segment.remaining -= sent;
+		connection.allowance -=
+			std::min<size_t>(sent, connection.allowance);
+		if (!segment.file)
+			connection.output_bytes -= sent;
+		if (segment.remaining == 0)
+			connection.output.pop_front();
 	}
-	close(client_fd);
+	return true;
 }
 
-void Seeder::start(void)
+// Whether the upload limits hold the connection back for now
+bool Seeder::throttled(const Connection &connection)
 {
-	t = std::thread([&] {
-		// Bind to our address
-		sock_desc = socket(AF_INET, SOCK_STREAM, 0);
-		// Make sure socket descriptor initialization was successful.
-		if (sock_desc == 0) {
-			std::cerr
-				<< "Failed to Initialize server socket descriptor.\n";
-			exit(EXIT_FAILURE);
+	return connection.throttled_until > std::chrono::steady_clock::now();
+}
+
+// Open a listener on our address and port that other reactors can share.
+
+// :return: the socket, or -1 on failure
+int Seeder::open_listener(void) const
+{
+	int listener =
+		socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	// Make sure socket descriptor initialization was successful.
+	if (listener < 0) {
+		std::cerr << "Failed to Initialize server socket descriptor.\n";
+		return -1;
+	}
+	// Build our address
+	sockaddr_in address = { .sin_family = AF_INET,
+				.sin_port = htons(bind_port) };
+	// Convert our ip address string to the required binary format.
+	if (inet_pton(AF_INET, bind_address.c_str(), &(address.sin_addr)) <= 0) {
+		std::cerr << "Error building IPV4 Address.\n";
+		close(listener);
+		return -1;
+	}
+	// Set the socket options to allow bind to succeed even if there are
+	// still connections open on this address and port. (Important on
+	// restarts of the server daemon) Explained in depth here:
+	// https://stackoverflow.com/questions/3229860/what-is-the-meaning-of-so-reuseaddr-setsockopt-option-linux
+	// SO_REUSEPORT lets every reactor bind its own listener to the same
+	// port, and the kernel spreads new connections between them.
+	int opt = 1; // (true)
+	if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt,
+		       sizeof(int)) ||
+	    setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &opt,
+		       sizeof(int))) {
+		std::cerr
+			<< "Failed to modify the socket options of the server socket.\n";
+		close(listener);
+		return -1;
+	}
+	// Attach our socket to our address
+	if (bind(listener, (sockaddr *)&address, sizeof(sockaddr_in)) < 0) {
+		std::cerr << "Error binding to address.\n";
+		close(listener);
+		return -1;
+	}
+	// Set up listener for new connections
+	if (listen(listener, backlog) < 0) {
+		std::cerr
+			<< "Error trying to listen for connections on socket.\n";
+		close(listener);
+		return -1;
+	}
+	return listener;
+}
+
+// Run one reactor until we stop, serving every connection accepted on its
+// listener. Each connection is a state machine driven by epoll events, so a
+// reactor serves any number of them on its one thread. A connection held back
+// by the upload limits stops asking to write, and is woken up by the epoll
+// timeout once it may send again.
+void Seeder::reactor(const int listener, const size_t reactor_idx)
+{
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		std::cerr << "Error. Unable to create seeder event loop.\n";
+		return;
+	}
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = listener;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener, &event);
+	event.data.fd = stop_event;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_event, &event);
+	const int slot_event = upload_slots.wake_fd(reactor_idx);
+	event.data.fd = slot_event;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, slot_event, &event);
+	// fd: its connection
+	std::unordered_map<int, std::unique_ptr<Connection> > connections;
+	std::array<epoll_event, MAX_EVENTS> events;
+	std::array<uint8_t, READ_SIZE> read_buffer;
+	// When each throttled connection may send again: its fd
+	std::multimap<std::chrono::steady_clock::time_point, int> throttled_fds;
+	// Take in, answer, and send what we can for the connection, given the
+	// epoll events it is ready for.
+	auto serve = [&](decltype(connections)::iterator item,
+			 const uint32_t ready) {
+		const int fd = item->first;
+		Connection &connection = *item->second;
+		bool open = !(ready & EPOLLERR);
+		// Take in whatever has arrived, up to the input limit
+		if (open && (ready & (EPOLLIN | EPOLLHUP))) {
+			while (connection.input.size() < INPUT_LIMIT) {
+				ssize_t bytes_read = read(fd, read_buffer.data(),
+							  read_buffer.size());
+				if (bytes_read < 0 && errno == EINTR)
+					continue;
+				if (bytes_read < 0 &&
+				    (errno == EAGAIN || errno == EWOULDBLOCK))
+					break;
+				if (bytes_read <= 0) {
+					// Peer disconnected.
+					open = false;
+					break;
+				}
+				connection.input.insert(
+					connection.input.end(),
+					read_buffer.begin(),
+					read_buffer.begin() + bytes_read);
+			}
 		}
-		// Build our address
-		sockaddr_in address = { .sin_family = AF_INET,
-					.sin_port = htons(bind_port) };
-		// Convert our ip address string to the required binary format.
-		if (inet_pton(AF_INET, bind_address.c_str(),
-			      &(address.sin_addr)) <= 0) {
-			std::cerr << "Error building IPV4 Address.\n";
-			exit(EXIT_FAILURE);
+		// Answer and send until the socket is full, the limits hold us
+		// back, we are waiting for an upload slot, or there is nothing
+		// left to do.
+		while (open) {
+			open = handle_requests(connection);
+			const bool was_backed_up = backed_up(connection);
+			open = open && flush(connection);
+			if (!was_backed_up || !connection.output.empty() ||
+			    connection.slot == WAITING_FOR_SLOT)
+				break;
 		}
-		// Set the socket options to allow bind to succeed even if there are
-		// still connections open on this address and port. (Important on
-		// restarts of the server daemon) Explained in depth here:
-		// https://stackoverflow.com/questions/3229860/what-is-the-meaning-of-so-reuseaddr-setsockopt-option-linux
-		int opt = 1; // (true)
-		if (setsockopt(sock_desc, SOL_SOCKET,
-			       SO_REUSEADDR | SO_REUSEPORT, &opt,
-			       sizeof(int))) {
-			std::cerr
-				<< "Failed to modify the socket options of the server socket.\n";
-			exit(EXIT_FAILURE);
+		end_turn(connection, !open);
+		if (!open) {
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+			close(fd);
+			connections.erase(item);
+			return;
 		}
-		// Attach our socket to our address
-		if (bind(sock_desc, (sockaddr *)&address, sizeof(sockaddr_in)) <
-		    0) {
-			std::cerr << "Error binding to address.\n";
-			exit(EXIT_FAILURE);
+		// Only read more once the output has drained, and only ask to
+		// write while there is output the limits let us send.
+		const bool waiting = throttled(connection);
+		if (waiting) {
+			throttled_fds.insert(
+				std::make_pair(connection.throttled_until, fd));
 		}
-		// Set up listener for new connections
-		if (listen(sock_desc, 5) < 0) {
-			std::cerr
-				<< "Error trying to listen for connections on socket.\n";
-			exit(EXIT_FAILURE);
+		uint32_t wanted =
+			(backed_up(connection) ? 0 : EPOLLIN) |
+			(connection.output.empty() || waiting ? 0 : EPOLLOUT);
+		if (wanted != connection.events) {
+			epoll_event change = {};
+			change.events = wanted;
+			change.data.fd = fd;
+			epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &change);
+			connection.events = wanted;
+		}
+	};
+	while (!stopping) {
+		// Sleep no longer than the first throttled connection has to
+		// wait, rounded up to whole milliseconds.
+		int timeout = -1;
+		if (!throttled_fds.empty()) {
+			auto wait = throttled_fds.begin()->first -
+				    std::chrono::steady_clock::now();
+			int64_t wait_ms =
+				(std::chrono::duration_cast<
+					 std::chrono::microseconds>(wait)
+					 .count() +
+				 999) /
+				1000;
+			timeout = (int)std::max<int64_t>(0, wait_ms);
+		}
+		int num_events = epoll_wait(epoll_fd, events.data(),
+					    events.size(), timeout);
+		if (num_events < 0) {
+			if (errno == EINTR)
+				continue;
+			std::cerr << "Error. Seeder event loop failed.\n";
+			break;
 		}
-		// Accept and accommodate the incoming connections
-		socklen_t addr_len = sizeof(sockaddr_in);
-		while (true) {
-			// Accept a client connection
-			sockaddr client_addr;
-			int new_client_socket = accept(
-				sock_desc, (sockaddr *)&client_addr, &addr_len);
-			// Make sure the client connection is valid
-			if (new_client_socket < 0) {
-				std::cerr
-					<< "Error trying to accept connections on server socket.\n";
-				exit(EXIT_FAILURE);
+		for (int i = 0; i < num_events; ++i) {
+			const int fd = events[i].data.fd;
+			if (fd == stop_event) {
+				continue;
 			}
-			// Set up the client thread for this connection.
-			std::thread(&Seeder::client_handler, this,
-				    new_client_socket)
-				.detach();
+			if (fd == slot_event) {
+				// Serve the connections handed an upload slot.
+				// One that has gone passes its slot on.
+				for (auto &ticket :
+				     upload_slots.take_granted(reactor_idx)) {
+					auto item = connections.find(ticket.fd);
+					if (item == connections.end() ||
+					    item->second->id !=
+						    ticket.connection_id ||
+					    item->second->slot !=
+						    WAITING_FOR_SLOT) {
+						upload_slots.release(ticket);
+						continue;
+					}
+					item->second->slot = HOLDING_SLOT;
+					item->second->sent_on_slot = false;
+					serve(item, 0);
+				}
+				continue;
+			}
+			if (fd == listener) {
+				// Accept every connection that is waiting
+				while (true) {
+					sockaddr_in peer = {};
+					socklen_t peer_length = sizeof(peer);
+					int client_fd = accept4(
+						listener, (sockaddr *)&peer,
+						&peer_length,
+						SOCK_NONBLOCK | SOCK_CLOEXEC);
+					if (client_fd < 0) {
+						if (errno == EINTR ||
+						    errno == ECONNABORTED)
+							continue;
+						if (errno != EAGAIN &&
+						    errno != EWOULDBLOCK) {
+							std::cerr
+								<< "Error trying to accept connections on server socket.\n";
+						}
+						break;
+					}
+					// Headers are small, don't let Nagle hold
+					// them back.
+					int opt = 1; // (true)
+					setsockopt(client_fd, IPPROTO_TCP,
+						   TCP_NODELAY, &opt, sizeof(int));
+					std::unique_ptr<Connection> connection(
+						new Connection(
+							client_fd, reactor_idx,
+							next_connection_id++,
+							peer.sin_addr.s_addr));
+					connection->events = EPOLLIN;
+					event.events = EPOLLIN;
+					event.data.fd = client_fd;
+					epoll_ctl(epoll_fd, EPOLL_CTL_ADD,
+						  client_fd, &event);
+					connections[client_fd] =
+						std::move(connection);
+				}
+				continue;
+			}
+			auto item = connections.find(fd);
+			if (item == connections.end()) {
+				continue;
+			}
+			serve(item, events[i].events);
 		}
-	});
+		// Wake up the connections the upload limits now let send. A
+		// closed connection's fd may have been reused since, which
+		// costs the new one no more than a look at its output.
+		const auto now = std::chrono::steady_clock::now();
+		while (!throttled_fds.empty() &&
+		       throttled_fds.begin()->first <= now) {
+			const int fd = throttled_fds.begin()->second;
+			throttled_fds.erase(throttled_fds.begin());
+			auto item = connections.find(fd);
+			if (item != connections.end() &&
+			    !throttled(*item->second)) {
+				serve(item, 0);
+			}
+		}
+	}
+	for (auto &connection : connections) {
+		close(connection.first);
+	}
+	close(epoll_fd);
 }
 
+// Bind to the passed address and port, and listen for file requests, and chunk
+// requests, on each of the reactor threads.
+void Seeder::start(void)
+{
+	if (stop_event < 0) {
+		std::cerr << "Error. Unable to create seeder stop event.\n";
+		exit(EXIT_FAILURE);
+	}
+	// Open every listener first, so a failure leaves nothing half running.
+	for (size_t i = 0; i < num_reactors; ++i) {
+		int listener = open_listener();
+		if (listener < 0) {
+			exit(EXIT_FAILURE);
+		}
+		listeners.push_back(listener);
+	}
+	for (size_t i = 0; i < listeners.size(); ++i) {
+		reactors.push_back(
+			std::thread(&Seeder::reactor, this, listeners[i], i));
+	}
+}
+
+// Print how well the chunk cache and the compressed cache are doing.
+void Seeder::report(std::ostream &out)
+{
+	chunk_cache.report(out);
+	compressed_cache.report(out);
+}
+
+// Stop listening and shutdown. Every reactor wakes up on the stop event.
 void Seeder::stop(void)
 {
-	close(sock_desc);
+	if (stopping.exchange(true) || stop_event < 0) {
+		return;
+	}
+	uint64_t wake = 1;
+	if (write(stop_event, &wake, sizeof(wake)) < 0) {
+		std::cerr << "Error. Unable to stop the seeder.\n";
+	}
 }
 } // namespace Peer
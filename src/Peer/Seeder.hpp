@@ -1,25 +1,234 @@
 #pragma once
+#include "../ApplicationLayer/Peer.hpp"
+#include "../ApplicationLayer/HashTree.hpp"
+#include "ChunkCache.hpp"
+#include "CompressedCache.hpp"
+#include "RateLimits.hpp"
+#include "UploadSlots.hpp"
 #include <string>
 #include <unordered_map>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
 #include <thread>
+#include <ostream>
+#include <chrono>
 namespace Peer
 {
+// Default length of the queue of connections waiting to be accepted
+static const int constexpr DEFAULT_LISTEN_BACKLOG = 1024;
+// Default number of reactor threads. 0 means one per core.
+static const size_t constexpr DEFAULT_SEEDER_THREADS = 0;
+
+// A file we share with the swarm
+struct SharedFile {
+	std::string path;
+	// Counted in chunk_size chunks
+	uint32_t num_chunks;
+	uint64_t size;
+	// The chunk size v2 peers are told to split the file into. v1 peers
+	// always use CHUNK_SIZE.
+	uint32_t chunk_size;
+	// The leaves of the file's HashTree, and its root
+	std::vector<ApplicationLayer::HashDigest> leaves;
+	std::string root_hash;
+};
+// filename: SharedFile
+using SharedFiles = std::unordered_map<std::string, SharedFile>;
+
 class Seeder {
+	// A shared file, opened once for as long as we share it. Closed once
+	// the seeder and the last chunk sent from it are gone.
+	struct OpenFile {
+		const int fd;
+		const off_t size;
+		OpenFile(const int fd, const off_t size);
+		~OpenFile(void);
+	};
+	// Part of a connection's output: bytes, or a range of an open file that
+	// is handed straight to the socket.
+	struct OutputSegment {
+		std::vector<uint8_t> bytes;
+		std::shared_ptr<OpenFile> file;
+		off_t offset;
+		size_t remaining;
+	};
+	// Where a connection stands with the upload slots
+	enum SlotState { NO_SLOT, WAITING_FOR_SLOT, HOLDING_SLOT };
+	// Where a connection is at, between epoll events
+	struct Connection {
+		const int fd;
+		// The reactor serving it, and an id no other connection has,
+		// for the upload slots to find it by
+		const size_t reactor;
+		const uint64_t id;
+		// The peer's address, which its upload turns go by
+		const uint32_t peer_address;
+		// Bytes received but not yet decoded into a message
+		std::vector<uint8_t> input;
+		std::deque<OutputSegment> output;
+		// Bytes (not file ranges) waiting in output
+		size_t output_bytes;
+		// The CHUNK_REQUEST being answered. Its chunks are queued one at a
+		// time, and no later request is looked at until it is done.
+		bool sending_chunks;
+		ApplicationLayer::PeerHeader chunk_request;
+		ApplicationLayer::PeerHeader chunk_response;
+		std::shared_ptr<OpenFile> chunk_file;
+		off_t chunk_file_size;
+		uint64_t next_chunk_idx;
+		uint64_t end_chunk_idx;
+		// The events we asked epoll for
+		uint32_t events;
+		// Bytes of upload taken from the rate limits but not sent yet
+		size_t allowance;
+		// While uploads are limited, when the connection may send again
+		std::chrono::steady_clock::time_point throttled_until;
+		// The connection's own upload limit
+		TokenBucket upload_bucket;
+		SlotState slot;
+		// Whether a block has been queued on the slot it holds
+		bool sent_on_slot;
+		Connection(const int fd, const size_t reactor,
+			   const uint64_t id, const uint32_t peer_address);
+	};
+
 	const std::string bind_address;
 	const uint16_t bind_port;
-	// filename: (file_path, num_chunks)
-	const std::unordered_map<std::string, std::tuple<std::string, uint32_t> >
-		files_list;
-	int sock_desc;
-	std::thread t;
+	const SharedFiles files_list;
+	// file_handle: filename, for v2 peers that ask by handle
+	const std::unordered_map<uint64_t, std::string> file_handles;
+	// Every file we share sorted by filename, so that INVENTORY_RESPONSE pages
+	// pick up where the last one left off.
+	const std::vector<ApplicationLayer::CatalogEntry> catalog;
+	// filename: the open file, for every file we could open
+	const std::unordered_map<std::string, std::shared_ptr<OpenFile> >
+		open_files;
+	// The chunks served most recently, shared by every reactor
+	ChunkCache chunk_cache;
+	// The blocks compressed most recently, shared by every reactor
+	CompressedCache compressed_cache;
+	const size_t num_reactors;
+	const int backlog;
+	// The connections we upload to at once, shared by every reactor
+	UploadSlots upload_slots;
+	std::atomic<uint64_t> next_connection_id;
+	// One listener per reactor, all bound to the same address and port
+	std::vector<int> listeners;
+	std::vector<std::thread> reactors;
+	// Wakes every reactor up when we stop
+	int stop_event;
+	std::atomic<bool> stopping;
+
+	// Hand out a handle for each of the files we share
+	static std::unordered_map<uint64_t, std::string>
+	build_file_handles(const SharedFiles &files_list);
+
+	// Open each of the files we share.
+	static std::unordered_map<std::string, std::shared_ptr<OpenFile> >
+	open_shared_files(const SharedFiles &files_list);
+
+	// List the files we share, sorted by filename
+	static std::vector<ApplicationLayer::CatalogEntry>
+	build_catalog(const SharedFiles &files_list);
+
+	// Find the shared file a request names, by handle for v2 requests and by
+	// filename otherwise.
+	SharedFiles::const_iterator
+	find_file(const ApplicationLayer::PeerHeader &request) const;
+
+	// Answer a FILE_REQUEST.
+	ApplicationLayer::PeerHeader
+	build_file_response(const ApplicationLayer::PeerHeader &request) const;
+
+	// Answer an INVENTORY_REQUEST with the page of the catalog starting at
+	// its chunk_request_begin_idx.
+	ApplicationLayer::PeerHeader
+	build_inventory_page(const ApplicationLayer::PeerHeader &request) const;
+
+	// Answer a FILE_BATCH_REQUEST with an entry for each filename asked
+	// about, in the order they were asked.
+
+	// :return: false if the request is malformed
+	bool build_file_batch(const ApplicationLayer::PeerHeader &request,
+			      ApplicationLayer::PeerHeader &out_response) const;
+
+	// Answer a HASH_REQUEST with the page of the file's leaves starting at
+	// its chunk_request_begin_idx.
+	ApplicationLayer::PeerHeader
+	build_hash_page(const ApplicationLayer::PeerHeader &request) const;
+
+	// Open a listener on our address and port that other reactors can share.
+
+	// :return: the socket, or -1 on failure
+	int open_listener(void) const;
+
+	// Run one reactor until we stop, serving every connection accepted on
+	// its listener.
+	void reactor(const int listener, const size_t reactor_idx);
+
+	// Decode and answer whatever whole requests the connection has sent, as
+	// long as its output isn't backed up.
+
+	// :return: false if the connection should be closed
+	bool handle_requests(Connection &connection);
+
+	// Queue the response to one request.
+
+	// :return: false if the connection should be closed
+	bool handle_request(Connection &connection,
+			    const ApplicationLayer::PeerHeader &request);
+
+	// Queue a message, followed by chunk_size bytes of chunk if it is a
+	// CHUNK_RESPONSE.
+
+	// :return: false if the message can't be expressed in its version
+	static bool queue_message(Connection &connection,
+				  const ApplicationLayer::PeerHeader &message,
+				  const uint32_t chunk_size = 0);
+
+	// Who the connection's upload slot is for
+	static UploadSlots::Ticket ticket(const Connection &connection);
+
+	// Get the connection an upload slot for its next block, giving up the
+	// one it sent its last block on first, so that anyone waiting goes
+	// before it.
+
+	// :return: whether it holds a slot for its next block
+	bool take_turn(Connection &connection);
+
+	// Give up the connection's upload slot once its last block has gone
+	// out, or for good if it is going away.
+	void end_turn(Connection &connection, const bool closing = false);
+
+	// Queue the next chunk of the CHUNK_REQUEST being answered.
+
+	// :return: false if the connection should be closed
+	bool queue_next_chunk(Connection &connection);
+
+	// Send as much queued output as the socket takes without blocking,
+	// and the upload limits allow.
+
+	// :return: false if the connection should be closed
+	static bool flush(Connection &connection);
+
+	// Whether the upload limits hold the connection back for now
+	static bool throttled(const Connection &connection);
 
-	// Connection handler for each connected peer
-	void client_handler(int client_fd);
+	// Whether the connection has enough output queued that we should stop
+	// looking at its requests for now.
+	static bool backed_up(const Connection &connection);
 
     public:
 	Seeder(const std::string &bind_address, const uint16_t bind_port,
-	       std::unordered_map<std::string, std::tuple<std::string, uint32_t> >
-		       &&files_list);
+	       SharedFiles &&files_list,
+	       const size_t num_reactors = DEFAULT_SEEDER_THREADS,
+	       const int backlog = DEFAULT_LISTEN_BACKLOG,
+	       const size_t cache_size = DEFAULT_CHUNK_CACHE_SIZE,
+	       const size_t num_slots = DEFAULT_UPLOAD_SLOTS,
+	       const size_t compressed_cache_size =
+		       DEFAULT_COMPRESSED_CACHE_SIZE);
 	~Seeder(void);
 	// This cannot be moved, deleted, or reassigned
 	Seeder(Seeder &&seeder) = delete;
@@ -27,9 +236,11 @@ class Seeder {
 	Seeder &operator=(Seeder &seeder) = delete;
 	Seeder &operator=(Seeder &&seeder) = delete;
 	// Bind to the passed address and port, and listen for file requests,
-	// and chunk requests.
+	// and chunk requests, on each of the reactor threads.
 	void start(void);
 	// Stop listening and shutdown.
 	void stop(void);
+	// Print how well the chunk cache and the compressed cache are doing.
+	void report(std::ostream &out);
 };
 } // namespace Peer
@@ -0,0 +1,114 @@
+#include "UploadSlots.hpp"
+#include <algorithm>
+#include <iostream>
+#include <limits>
+extern "C" {
+#include <sys/eventfd.h>
+#include <unistd.h>
+}
+
+namespace Peer
+{
+UploadSlots::UploadSlots(const size_t max_slots, const size_t num_reactors)
+	: max_slots(max_slots), active(0), granted(num_reactors)
+{
+	for (size_t i = 0; i < num_reactors; ++i) {
+		wake_fds.push_back(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+	}
+}
+
+UploadSlots::~UploadSlots(void)
+{
+	for (int fd : wake_fds) {
+		if (fd >= 0)
+			close(fd);
+	}
+}
+
+// The event the reactor waits on for the slots handed to it
+int UploadSlots::wake_fd(const size_t reactor) const
+{
+	return wake_fds[reactor];
+}
+
+// Ask for a slot. Without one, the connection waits in line.
+
+// :return: whether it holds a slot now
+bool UploadSlots::acquire(const Ticket &ticket)
+{
+	if (max_slots == 0)
+		return true;
+	std::lock_guard<std::mutex> slots_guard(slots_lock);
+	if (active < max_slots && waiting.empty()) {
+		++active;
+		++held[ticket.peer_address];
+		return true;
+	}
+	waiting.push_back(ticket);
+	return false;
+}
+
+// Give up the slot held for ticket, handing it to the first connection in line
+// whose peer holds the fewest slots.
+void UploadSlots::release(const Ticket &ticket)
+{
+	if (max_slots == 0)
+		return;
+	std::lock_guard<std::mutex> slots_guard(slots_lock);
+	auto holder = held.find(ticket.peer_address);
+	if (holder != held.end() && --holder->second == 0)
+		held.erase(holder);
+	if (waiting.empty()) {
+		--active;
+		return;
+	}
+	auto choice = waiting.begin();
+	size_t next_held = std::numeric_limits<size_t>::max();
+	for (auto item = waiting.begin(); item != waiting.end(); ++item) {
+		auto peer = held.find(item->peer_address);
+		const size_t peer_held = peer == held.end() ? 0 : peer->second;
+		if (peer_held < next_held) {
+			choice = item;
+			next_held = peer_held;
+			if (next_held == 0)
+				break;
+		}
+	}
+	const Ticket next = *choice;
+	waiting.erase(choice);
+	++held[next.peer_address];
+	granted[next.reactor].push_back(next);
+	uint64_t wake = 1;
+	if (write(wake_fds[next.reactor], &wake, sizeof(wake)) < 0) {
+		std::cerr << "Error. Unable to hand on an upload slot.\n";
+	}
+}
+
+// Take a connection that is going away out of the line.
+void UploadSlots::cancel(const Ticket &ticket)
+{
+	if (max_slots == 0)
+		return;
+	std::lock_guard<std::mutex> slots_guard(slots_lock);
+	auto item = std::find_if(waiting.begin(), waiting.end(),
+				 [&ticket](const Ticket &other) {
+					 return other.connection_id ==
+						ticket.connection_id;
+				 });
+	if (item != waiting.end())
+		waiting.erase(item);
+}
+
+// Pick up the slots handed to the reactor's connections. A ticket whose
+// connection has gone must be released.
+std::vector<UploadSlots::Ticket> UploadSlots::take_granted(const size_t reactor)
+{
+	uint64_t count;
+	while (read(wake_fds[reactor], &count, sizeof(count)) > 0) {
+	}
+	std::vector<Ticket> tickets;
+	std::lock_guard<std::mutex> slots_guard(slots_lock);
+	tickets.swap(granted[reactor]);
+	return tickets;
+}
+} // namespace Peer
@@ -0,0 +1,70 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+namespace Peer
+{
+// Default number of connections a seeder uploads to at once. 0 means no
+// limit.
+static const size_t constexpr DEFAULT_UPLOAD_SLOTS = 8;
+
+// Hands out the seeder's upload slots to the connections of every reactor. A
+// connection holds a slot for one block at a time, then goes to the back of
+// the line if anyone is waiting, so that everyone waiting gets a turn in
+// between and a leecher asking for many chunks doesn't starve the rest. Turns
+// go by peer rather than by connection: a slot given up goes to the first
+// connection in line whose peer holds the fewest slots, so a leecher fetching
+// over many streams doesn't get a turn for each. A connection that can't get a
+// slot is choked until one is handed to it, and its reactor is woken up to
+// pick it up.
+class UploadSlots {
+    public:
+	// Who a slot is for
+	struct Ticket {
+		size_t reactor;
+		int fd;
+		uint64_t connection_id;
+		// The address of the peer, which all of its connections share
+		uint32_t peer_address;
+	};
+
+    private:
+	const size_t max_slots;
+	std::mutex slots_lock;
+	size_t active;
+	// peer address: the slots its connections hold
+	std::unordered_map<uint32_t, size_t> held;
+	// Choked connections, first in line first
+	std::deque<Ticket> waiting;
+	// Wakes each reactor up when one of its connections is handed a slot
+	std::vector<int> wake_fds;
+	// The slots handed to each reactor's connections, not yet picked up
+	std::vector<std::vector<Ticket> > granted;
+
+    public:
+	UploadSlots(const size_t max_slots, const size_t num_reactors);
+	~UploadSlots(void);
+	// This cannot be moved, deleted, or reassigned
+	UploadSlots(UploadSlots &&slots) = delete;
+	UploadSlots(UploadSlots &slots) = delete;
+	UploadSlots &operator=(UploadSlots &slots) = delete;
+	UploadSlots &operator=(UploadSlots &&slots) = delete;
+	// The event the reactor waits on for the slots handed to it
+	int wake_fd(const size_t reactor) const;
+	// Ask for a slot. Without one, the connection waits in line.
+
+	// :return: whether it holds a slot now
+	bool acquire(const Ticket &ticket);
+	// Give up the slot held for ticket, handing it to the first connection
+	// in line whose peer holds the fewest slots.
+	void release(const Ticket &ticket);
+	// Take a connection that is going away out of the line.
+	void cancel(const Ticket &ticket);
+	// Pick up the slots handed to the reactor's connections. A ticket whose
+	// connection has gone must be released.
+	std::vector<Ticket> take_granted(const size_t reactor);
+};
+} // namespace Peer